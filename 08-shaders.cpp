@@ -46,6 +46,49 @@
 //------------------------------------------------------------------------------
 #include <GLFW/glfw3.h>
 //------------------------------------------------------------------------------
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <sys/stat.h>
+//------------------------------------------------------------------------------
+#if defined(USE_OSMESA)
+#include <GL/osmesa.h>
+// glewInit() resolves entry points through GLX unless GLEW itself is built
+// (and included) with GLEW_OSMESA, so stock GLEW fails on an OSMesa context
+#if defined(GLEW_VERSION) && !defined(GLEW_OSMESA)
+#error "USE_OSMESA requires GLEW built with GLEW_OSMESA defined"
+#endif
+#endif
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+//------------------------------------------------------------------------------
 using namespace chai3d;
 using namespace std;
 //------------------------------------------------------------------------------
@@ -111,12 +154,6 @@ cSpotLight *light;
 // a haptic device handler
 cHapticDeviceHandler* handler;
 
-// a pointer to the current haptic device
-cGenericHapticDevicePtr hapticDevice;
-
-// a virtual tool representing the haptic device in the scene
-cToolCursor* tool;
-
 // a line representing the velocity vector of the haptic device
 cShapeLine* velocity;
 
@@ -142,19 +179,11 @@ cLabel* labelRatesPos;
 
 
 // a flag that indicates if the haptic simulation is currently running
-bool simulationRunning = false;
-
-// a flag that indicates if the haptic simulation has terminated
-bool simulationFinished = true;
+atomic<bool> simulationRunning(false);
 
 // a frequency counter to measure the simulation graphic rate
 cFrequencyCounter freqCounterGraphics;
 
-// a frequency counter to measure the simulation haptic rate
-cFrequencyCounter freqCounterHaptics;
-
-// haptic thread
-cThread* hapticsThread;
 
 // a handle to window display context
 GLFWwindow* window = NULL;
@@ -168,6 +197,16 @@ int height = 0;
 // swap interval for the display context (vertical synchronization)
 int swapInterval = 1;
 
+// if true, render offscreen without a window for a fixed number of frames
+bool headless = false;
+
+// number of frames rendered in headless mode
+int headlessFrames = 500;
+
+// size of the offscreen buffer in headless mode
+const int HEADLESS_WIDTH  = 1280;
+const int HEADLESS_HEIGHT = 640;
+
 
 // mouse position
 double mouseX, mouseY;
@@ -176,1164 +215,11036 @@ double mouseX, mouseY;
 MouseState mouseState = MOUSE_IDLE;
 
 //------------------------------------------------------------------------------
-// RELIEF MAPPING
+// FRAME PACING
 //------------------------------------------------------------------------------
 
-//Scale Relief
-float heightScale;
-
-
-
-//------------------------------------------------------------------------------
-//------------------------------------------------------------------------------
-// DECLARED MACROS
-//------------------------------------------------------------------------------
-// convert to resource path
-#define RESOURCE_PATH(p)    (char*)((resourceRoot+string(p)).c_str())
+// number of frames the GPU may lag behind the CPU before updateGraphics() waits
+const int MAX_FRAMES_IN_FLIGHT = 2;
 
+// GPU stages timed by timer queries
+enum GpuStage
+{
+    GPU_STAGE_VIEW1,
+    GPU_STAGE_VIEW2,
+    GPU_STAGE_COMPOSITE,
+    GPU_STAGE_COUNT
+};
 
-//------------------------------------------------------------------------------
-// DECLARED FUNCTIONS
-//------------------------------------------------------------------------------
+// names of GPU stages
+const char* GPU_STAGE_NAMES[GPU_STAGE_COUNT] = { "view 1", "view 2", "composite" };
 
-// callback when the window display is resized
-void windowSizeCallback(GLFWwindow* a_window, int a_width, int a_height);
+// fence inserted at the end of each frame in flight
+GLsync frameFences[MAX_FRAMES_IN_FLIGHT];
 
-// callback when an error GLFW occurs
-void errorCallback(int error, const char* a_description);
+// timer queries of each frame in flight
+GLuint frameQueries[MAX_FRAMES_IN_FLIGHT][GPU_STAGE_COUNT];
 
-// callback when a key is pressed
-void keyCallback(GLFWwindow* a_window, int a_key, int a_scancode, int a_action, int a_mods);
+// true when the timer queries of a frame in flight have been issued
+bool frameQueriesIssued[MAX_FRAMES_IN_FLIGHT];
 
-// callback to handle mouse click
-void mouseButtonCallback(GLFWwindow* a_window, int a_button, int a_action, int a_mods);
+// frame in flight currently recorded
+int frameSlot = 0;
 
-// callback to handle mouse motion
-void mouseMotionCallback(GLFWwindow* a_window, double a_posX, double a_posY);
+// true if fences and timer queries are supported by the context
+bool useFrameFences = false;
+bool useTimerQueries = false;
 
-// this function renders the scene
-void updateGraphics(void);
+// smoothed GPU time of each stage [ms]
+double gpuStageTimeMs[GPU_STAGE_COUNT];
 
-// this function contains the main haptics simulation loop
-void updateHaptics(void);
+//------------------------------------------------------------------------------
+// TRACING
+//------------------------------------------------------------------------------
 
-// this function closes the application
-void close(void);
+// trace zones are compiled in unless NO_TRACING is defined
+#if !defined(NO_TRACING)
+#define USE_TRACING
+#endif
 
+// thread local storage of plain values (thread_local is missing before VS2015)
+#if defined(_MSC_VER) && (_MSC_VER < 1900)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL thread_local
+#endif
 
-bool moveW = false;
+// events kept per thread, later ones are dropped and counted in the trace
+const int TRACE_BUFFER_EVENTS = 1 << 20;
 
-//==============================================================================
-/*
-    DEMO:   08-shaders.cpp
+// a completed zone, times in nanoseconds since the start of the trace
+struct TraceEvent
+{
+    const char* m_name;
+    long long m_start;
+    long long m_duration;
+};
 
-    This example illustrates how to build a small mesh cube.
-    The applications also presents the use of texture properties by defining 
-    a texture image and associated texture coordinates for each of the vertices.
-    A bump map is also used in combination with a shader to create a more
-    realistic rendering of the surface.
-*/
-//==============================================================================
+// events of one thread. Only that thread writes them, an event is visible to
+// others once m_numEvents includes it.
+struct TraceBuffer
+{
+    int m_threadId;
+    string m_threadName;
+    vector<TraceEvent> m_events;
+    atomic<int> m_numEvents;
+    atomic<int> m_numDropped;
+};
 
-int main(int argc, char* argv[])
+// collects the zones of all threads and writes them in the Chrome trace
+// event format (chrome://tracing, ui.perfetto.dev)
+class Tracer
 {
-    //--------------------------------------------------------------------------
-    // INITIALIZATION
-    //--------------------------------------------------------------------------
+public:
+    Tracer();
+    ~Tracer();
 
-    cout << endl;
-    cout << "-----------------------------------" << endl;
-    cout << "Final Project" << endl;
-    cout << "-----------------------------------" << endl << endl << endl;
-    cout << "Keyboard Options:" << endl << endl;
-    cout << "[f] - Enable/Disable full screen mode" << endl;
-    cout << "[m] - Enable/Disable vertical mirroring" << endl;
-    cout << "[q] - Exit application" << endl;
-    cout << endl << endl;
+    // zones are only recorded while enabled
+    void setEnabled(bool a_enabled) { m_enabled.store(a_enabled, memory_order_relaxed); }
+    bool getEnabled() const { return (m_enabled.load(memory_order_relaxed)); }
 
-    // parse first arg to try and locate resources
-    string resourceRoot = string(argv[0]).substr(0,string(argv[0]).find_last_of("/\\")+1);
+    // name of the calling thread on the timeline. Called before the loop of
+    // the thread, it also allocates its events while tracing is enabled.
+    void setThreadName(const string& a_name);
 
+    // append a zone of the calling thread
+    void record(const char* a_name, long long a_start, long long a_end);
 
-    //--------------------------------------------------------------------------
-    // OPEN GL - WINDOW DISPLAY
-    //--------------------------------------------------------------------------
+    // write all recorded zones as Chrome trace JSON
+    bool write(const string& a_filename) const;
 
-    // initialize GLFW library
-    if (!glfwInit())
-    {
-        cout << "failed initialization" << endl;
-        cSleepMs(1000);
-        return 1;
-    }
+    // monotonic time [ns]
+    static long long now();
 
-    // set error callback
-    glfwSetErrorCallback(errorCallback);
+private:
+    // buffer of the calling thread, created at its first use with its events
+    // if tracing is enabled
+    TraceBuffer* getBuffer();
 
-    // compute desired size of window
-    const GLFWvidmode* mode = glfwGetVideoMode(glfwGetPrimaryMonitor());
-    int w = 0.8 * mode->height;
-    int h = 0.5 * mode->height;
-    int x = 0.5 * (mode->width - w);
-    int y = 0.5 * (mode->height - h);
+    atomic<bool> m_enabled;
+    long long m_origin;
+    mutable mutex m_mutex;
+    vector<TraceBuffer*> m_buffers;
+};
 
-    // set OpenGL version
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
+// zones of the application
+Tracer tracer;
 
-    // set active stereo mode
-    if (stereoMode == C_STEREO_ACTIVE)
-    {
-        glfwWindowHint(GLFW_STEREO, GL_TRUE);
-    }
-    else
-    {
-        glfwWindowHint(GLFW_STEREO, GL_FALSE);
-    }
+// file written at exit when tracing is enabled
+string traceFilename;
 
-    // create display context
-    window = glfwCreateWindow(w, h, "Final Project", NULL, NULL);
-    if (!window)
+// records the lifetime of a scope as a zone of the calling thread
+class TraceZone
+{
+public:
+    explicit TraceZone(const char* a_name) : m_name(a_name), m_start(tracer.getEnabled() ? Tracer::now() : -1) {}
+    ~TraceZone()
     {
-        cout << "failed to create window" << endl;
-        cSleepMs(1000);
-        glfwTerminate();
-        return 1;
+        if (m_start >= 0)
+        {
+            tracer.record(m_name, m_start, Tracer::now());
+        }
     }
 
-    // get width and height of window
-    glfwGetWindowSize(window, &width, &height);
+private:
+    const char* m_name;
+    long long m_start;
+};
 
-    // set position of window
-    glfwSetWindowPos(window, x, y);
+//------------------------------------------------------------------------------
+// RELIEF MAPPING
+//------------------------------------------------------------------------------
 
-    // set key callback
-    glfwSetKeyCallback(window, keyCallback);
+//Scale Relief
+float heightScale;
 
-    // set resize callback
-    glfwSetWindowSizeCallback(window, windowSizeCallback);
+// size of the textured plane (cCreatePlane), one texture coordinate unit
+const double PLANE_SIZE = 0.9;
 
-    // set mouse position callback
-    glfwSetCursorPosCallback(window, mouseMotionCallback);
+// if true, the displacement image stores depth (white = deepest) as
+// sampled by the parallax/relief shaders, otherwise it stores height
+const bool DISPLACEMENT_IS_DEPTH = true;
 
-    // set mouse button callback
-    glfwSetMouseButtonCallback(window, mouseButtonCallback);
+//------------------------------------------------------------------------------
+// HAPTIC HEIGHT FIELD
+//------------------------------------------------------------------------------
 
-    // set current display context
-    glfwMakeContextCurrent(window);
+// min-max pyramid of the displacement map. Level 0 holds one depth value
+// per texel in [0,1], each coarser level holds the min/max depth of the
+// (up to) 2x2 nodes it covers, down to a single root node.
+struct HeightPyramid
+{
+    int m_numLevels;
+    vector<int> m_width;
+    vector<int> m_height;
+    vector<vector<float> > m_min;
+    vector<vector<float> > m_max;
+};
 
-    // sets the swap interval for the current display context
-    glfwSwapInterval(swapInterval);
+// result of a sphere query against the height field (plane local frame)
+struct HeightFieldContact
+{
+    // true if the sphere penetrates the surface
+    bool m_inContact;
 
-#ifdef GLEW_VERSION
-    // initialize GLEW library
-    if (glewInit() != GLEW_OK)
-    {
-        cout << "failed to initialize GLEW library" << endl;
-        glfwTerminate();
-        return 1;
-    }
-#endif
+    // vertical distance required to lift the sphere out of the surface
+    double m_lift;
 
+    // surface point touched by the sphere once lifted
+    cVector3d m_point;
 
-    //--------------------------------------------------------------------------
-    // WORLD
-    //--------------------------------------------------------------------------
-    // create a new world.
-    world = new cWorld();
+    // surface normal at contact, pointing towards the sphere center
+    cVector3d m_normal;
 
-    // set the background color of the environment
-    // the color is defined by its (R,G,B) components.
-    world->m_backgroundColor.setWhite();
+    // number of pyramid nodes visited by the query
+    int m_numNodes;
+};
 
-    //--------------------------------------------------------------------------
-    // CAMERA
-    //--------------------------------------------------------------------------
+// displacement map pyramid sampled by the haptic thread
+HeightPyramid heightPyramid;
 
-    // create a camera and insert it into the virtual world
-    //camera = new cCamera(world);
-    camera = new cCamera(NULL);
+// if true, forces on the plane are rendered from the displacement map
+// instead of the flat mesh offset by object->heighC
+bool useHeightFieldHaptics = true;
 
-    cameraView1 = new cCamera(world);
+// haptic surface offset of the flat plane, applied by the haptic thread
+double heighC;
 
-    world->addChild(cameraView1);
+//------------------------------------------------------------------------------
+// MULTI-POINT TOOL
+//------------------------------------------------------------------------------
 
-    // position and orient the camera
-    cameraView1->set(cVector3d(1.43, 0.4, 0.860),    // camera position (eye)
-                    cVector3d(-0.732, -0.252, -0.63),    // lookat position (target)
-                    cVector3d(-0.602, -0.180, 0.773));   // direction of the "up" vector
+// per triangle values precomputed for the narrow phase: first vertex, edges
+// e0 = b - a and e1 = c - a, unit normal, vectors g0 and g1 whose dot products
+// with p - a give the barycentric coordinates of the projection of p, and the
+// inverse squared lengths of the three edges
+enum TriangleField
+{
+    TRI_AX, TRI_AY, TRI_AZ,
+    TRI_E0X, TRI_E0Y, TRI_E0Z,
+    TRI_E1X, TRI_E1Y, TRI_E1Z,
+    TRI_NX, TRI_NY, TRI_NZ,
+    TRI_G0X, TRI_G0Y, TRI_G0Z,
+    TRI_G1X, TRI_G1Y, TRI_G1Z,
+    TRI_INV_E0, TRI_INV_E1, TRI_INV_E2,
+    TRI_FIELD_COUNT
+};
 
-// set the near and far clipping planes of the camera
-// anything in front or behind these clipping planes will not be rendered
-    cameraView1->setClippingPlanes(0.01, 10.0);
+// bounding volume hierarchy over the triangles of a mesh (mesh local frame).
+// The triangles are stored as structure of arrays in leaf order, so that each
+// leaf covers a contiguous range of them. Degenerate triangles are left out.
+struct TriangleBVH
+{
+    struct Node
+    {
+        float m_min[3];
+        float m_max[3];
 
-    // set stereo mode
-    cameraView1->setStereoMode(stereoMode);
+        // first child, the second one follows it (-1 for leaves)
+        int m_left;
 
-    // set stereo eye separation and focal length (applies only if stereo is enabled)
-    cameraView1->setStereoEyeSeparation(0.03);
-    cameraView1->setStereoFocalLength(3.0);
+        // triangles of a leaf
+        int m_first;
+        int m_count;
+    };
 
-    // set vertical mirrored display mode
-    cameraView1->setMirrorVertical(mirroredDisplay);
+    vector<Node> m_nodes;
+    vector<float> m_triangles[TRI_FIELD_COUNT];
+    int m_numTriangles;
+    int m_maxDepth;
 
-    // set camera field of view 
-    cameraView1->setFieldViewAngleDeg(45);
+    // mesh triangle index of each stored triangle
+    vector<int> m_indices;
+};
 
-    //create camera 2
+// sphere queries of all the points of a tool, stored as structure of arrays
+struct ContactBatch
+{
+    int m_numPoints;
 
-    cameraView2 = new cCamera(world);
+    // sphere centers (mesh local frame)
+    vector<float> m_x, m_y, m_z;
 
-    world->addChild(cameraView2);
+    // penetration depth (<= 0 without contact) and contact normal per point
+    vector<float> m_depth;
+    vector<float> m_nx, m_ny, m_nz;
 
-    // position and orient the camera
-    cameraView2->set(cVector3d(1.5, 0.0, -0.27),    // camera position (eye)
-                    cVector3d(0.0, 0.0, 0.0),    // lookat position (target)
-                    cVector3d(0.0, 0.0, 1.0));   // direction of the "up" vector
+    // (point, triangle) candidates of the broad phase and their narrow phase result
+    vector<int> m_pairPoint;
+    vector<int> m_pairTriangle;
+    vector<float> m_pairDepth;
+    vector<float> m_pairNx, m_pairNy, m_pairNz;
 
-// set the near and far clipping planes of the camera
-// anything in front or behind these clipping planes will not be rendered
-    cameraView2->setClippingPlanes(0.01, 10.0);
+    // point index lists of the traversal
+    vector<int> m_work;
 
-    // set stereo mode
-    cameraView2->setStereoMode(stereoMode);
+    // number of tree nodes visited by the last query
+    int m_numNodes;
+};
 
-    // set stereo eye separation and focal length (applies only if stereo is enabled)
-    cameraView2->setStereoEyeSeparation(0.03);
-    cameraView2->setStereoFocalLength(3.0);
+// number of contact points along each side of the square probe
+const int PROBE_POINTS_PER_SIDE = 8;
 
-    // set vertical mirrored display mode
-    cameraView2->setMirrorVertical(mirroredDisplay);
+// size of the probe and radius of its contact points
+const double PROBE_SIZE = 0.04;
+const double PROBE_POINT_RADIUS = 0.004;
 
-    // set camera field of view 
-    cameraView2->setFieldViewAngleDeg(45);
+// maximum number of triangles in a leaf of a TriangleBVH
+const int BVH_LEAF_SIZE = 4;
 
+// (point, triangle) candidates reserved per point of a batch
+const int CONTACT_BATCH_PAIRS_PER_POINT = 32;
 
-    //--------------------------------------------------------------------------
-    // LIGHT SOURCES
-    //--------------------------------------------------------------------------
+// triangles of the plane mesh queried by the multi-point tool
+TriangleBVH objectBVH;
 
-    // create a light source
-    light = new cSpotLight(world);
+// if true, the tool touches the plane mesh through a probe of
+// PROBE_POINTS_PER_SIDE^2 points instead of the single cursor sphere
+bool useMultiPointTool = false;
 
-    // add light to world
-    world->addChild(light);
+//------------------------------------------------------------------------------
+// WIDE BVH
+//------------------------------------------------------------------------------
 
-    // enable light source
-    light->setEnabled(true);
+// 4-wide bounding volume hierarchy collapsed from a TriangleBVH. The bounds
+// of the children of a node are stored as structure of arrays so that they
+// are tested against a sphere or a segment at once with SSE, and every leaf
+// is a packet of up to 4 triangles tested together against a sphere.
+struct WideBVH
+{
+    struct Node
+    {
+        float m_minX[4], m_minY[4], m_minZ[4];
+        float m_maxX[4], m_maxY[4], m_maxZ[4];
 
-    // position the light source
-    light->setLocalPos(3.5, 2.0, 8.0);
+        // inner child: node index, leaf child: first triangle of its packet,
+        // empty child: -1 (with inverted bounds)
+        int m_child[4];
 
-    // define the direction of the light beam
-    light->setDir(-3.5, -2.0, -8.0);
+        // number of triangles of a leaf child, 0 otherwise
+        int m_count[4];
 
-    // set light cone half angle
-    light->setCutOffAngleDeg(20);
+        // bit i set if child i is not empty. Inverted bounds keep empty
+        // children out of sphere tests, but a slab test swaps them back.
+        int m_laneMask;
+    };
 
+    vector<Node> m_nodes;
 
-    //--------------------------------------------------------------------------
-    // HAPTIC DEVICES / TOOLS
-    //--------------------------------------------------------------------------
+    // triangle fields (see TriangleField), 4 entries per packet
+    vector<float> m_triangles[TRI_FIELD_COUNT];
 
-    // create a haptic device handler
-    handler = new cHapticDeviceHandler();
+    // mesh triangle index of each packet entry, -1 for padding
+    vector<int> m_indices;
+};
 
-    // get access to the first available haptic device
-    handler->getDevice(hapticDevice, 0);
+// collision trees available for a mesh
+enum CollisionTree
+{
+    COLLISION_TREE_AABB,    // CHAI3D binary AABB tree
+    COLLISION_TREE_WIDE,    // 4-wide SSE tree
+    COLLISION_TREE_SDF      // signed distance field, static meshes only
+};
 
-    // retrieve information about the current haptic device
-    cHapticDeviceInfo hapticDeviceInfo = hapticDevice->getSpecifications();
+// collision detector traversing a WideBVH. It answers the same segment
+// queries as cCollisionAABB and tests the triangles it reaches with the
+// mesh's own triangle test, so that contacts are identical.
+class WideBVHCollision : public cGenericCollision
+{
+public:
+    WideBVHCollision(cMesh* a_mesh);
+    virtual ~WideBVHCollision() {}
+
+    virtual bool computeCollision(cGenericObject* a_object,
+                                  cVector3d& a_segmentPointA,
+                                  cVector3d& a_segmentPointB,
+                                  cCollisionRecorder& a_recorder,
+                                  cCollisionSettings& a_settings);
+
+    // tree traversed by the detector
+    const WideBVH& getTree() const { return (m_tree); }
+
+private:
+    cMesh* m_mesh;
+    WideBVH m_tree;
+};
 
-    // if the device has a gripper, enable the gripper to simulate a user switch
-    hapticDevice->setEnableGripperUserSwitch(true);
+// collision tree of the plane mesh (--collision aabb|wide|sdf)
+CollisionTree objectCollisionTree = COLLISION_TREE_AABB;
 
-    // create a 3D tool and add it to the world
-    tool = new cToolCursor(world);
-    world->addChild(tool);
+// detector of the plane mesh when it uses the wide tree, NULL otherwise
+WideBVHCollision* objectWideCollision = NULL;
 
-    // connect the haptic device to the tool
-    tool->setHapticDevice(hapticDevice);
+//------------------------------------------------------------------------------
+// SIGNED DISTANCE FIELD
+//------------------------------------------------------------------------------
 
-    // define the radius of the tool (sphere)
-    double toolRadius = SPHERE_RADIUS;
+// cells along each side of a brick, bricks hold (SDF_BRICK_SIZE + 1)^3 samples
+// so that any cell is interpolated from a single brick
+const int SDF_BRICK_SIZE = 8;
+const int SDF_BRICK_SAMPLES = (SDF_BRICK_SIZE + 1) * (SDF_BRICK_SIZE + 1) * (SDF_BRICK_SIZE + 1);
 
-    // define a radius for the tool
-    tool->setRadius(toolRadius);
+// cell size of the field baked for the plane
+const double SDF_CELL_SIZE = PLANE_SIZE / 128.0;
 
-    // set color of proxy sphere
-    tool->m_hapticPoint->m_sphereProxy->m_material->setGreenLimeGreen();
+// largest grid baked for the plane displaced by the height map, finer
+// triangles than half a cell do not change the field
+const int SDF_DISPLACED_GRID_SIZE = 256;
 
-    // show proxy and device position of finger-proxy algorithm
-    tool->setShowContactPoints(true, true, cColorf(0.0, 0.0, 0.0));
+// signed distance to a triangle surface, positive on the side the triangle
+// normals point to. Only the bricks within a band of the surface are stored;
+// elsewhere the field reads as +band. Each sample keeps its distance, the
+// gradient of the distance and the triangle nearest to it.
+class SignedDistanceField
+{
+public:
+    SignedDistanceField() : m_cellSize(1.0), m_band(0.0) { m_numBricks[0] = m_numBricks[1] = m_numBricks[2] = 0; }
+
+    // bake the field of an indexed triangle list, on all cores
+    void bake(const vector<cVector3d>& a_vertices,
+              const vector<unsigned int>& a_indices,
+              double a_cellSize,
+              double a_band,
+              int a_numThreads = 0);
+
+    // trilinear distance and gradient at a point
+    double sample(const cVector3d& a_point, cVector3d& a_gradient) const;
+
+    // triangle nearest to the sample closest to a point, -1 outside the band
+    int getNearestTriangle(const cVector3d& a_point) const;
+
+    double getCellSize() const { return (m_cellSize); }
+    double getBand() const { return (m_band); }
+    int getNumBricks() const { return ((int)(m_triangles.size() / SDF_BRICK_SAMPLES)); }
+    size_t getMemorySize() const;
+
+private:
+    // brick slot of a brick coordinate, -1 outside the grid
+    int getSlot(int a_x, int a_y, int a_z) const;
+
+    // fill the samples of the bricks taken from a_nextBrick
+    void bakeBricks(const vector<cVector3d>* a_vertices,
+                    const vector<unsigned int>* a_indices,
+                    const vector<cVector3d>* a_normals,
+                    const vector<vector<int> >* a_candidates,
+                    const vector<int>* a_slots,
+                    atomic<int>* a_nextBrick);
+
+    cVector3d m_origin;
+    double m_cellSize;
+    double m_band;
+    int m_numBricks[3];
+
+    // brick of each slot of the grid, -1 if empty
+    vector<int> m_brickIndex;
+
+    // distance and gradient (4 floats), and nearest triangle of each sample
+    vector<float> m_samples;
+    vector<int> m_triangles;
+};
 
-    // enable if objects in the scene are going to rotate of translate
-    // or possibly collide against the tool. If the environment
-    // is entirely static, you can set this parameter to "false"
-    tool->enableDynamicObjects(false);
+// collision detector answering proxy segment queries by sphere tracing a
+// signed distance field. Contacts report the triangle nearest to the contact,
+// of the mesh itself or of the displaced surface baked from the height map.
+class SignedDistanceCollision : public cGenericCollision
+{
+public:
+    // bake the field of a mesh, or of the plane displaced by a_pyramid if given
+    SignedDistanceCollision(cMesh* a_mesh,
+                            double a_radius,
+                            const HeightPyramid* a_pyramid = NULL,
+                            double a_depthScale = 0.0);
+    virtual ~SignedDistanceCollision();
+
+    virtual bool computeCollision(cGenericObject* a_object,
+                                  cVector3d& a_segmentPointA,
+                                  cVector3d& a_segmentPointB,
+                                  cCollisionRecorder& a_recorder,
+                                  cCollisionSettings& a_settings);
+
+    const SignedDistanceField& getField() const { return (m_field); }
+
+private:
+    // triangles reported by the contacts, owned if baked from the height map
+    cMesh* m_surface;
+    bool m_ownsSurface;
+    SignedDistanceField m_field;
+};
 
-    // map the physical workspace of the haptic device to a larger virtual workspace.
-    tool->setWorkspaceRadius(0.9);
+//------------------------------------------------------------------------------
+// THREAD HANDOFF
+//------------------------------------------------------------------------------
 
-    // start the haptic tool
-    tool->start();
+// wait-free single producer / single consumer channel. The producer fills
+// its private buffer and swaps it with the shared one, the consumer swaps
+// its own buffer with the shared one when a new value has been published.
+// Neither side ever blocks or sees a partially written value.
+template <class T> class TripleBuffer
+{
+public:
+    TripleBuffer() : m_shared(1), m_write(0), m_read(2) {}
 
-    // create small line to illustrate the velocity of the haptic device
-    velocity = new cShapeLine(cVector3d(0, 0, 0),
-        cVector3d(0, 0, 0));
+    // buffer owned by the producer, all fields must be written before publish()
+    T& getWriteBuffer() { return m_buffers[m_write]; }
 
-    // insert line inside world
-    world->addChild(velocity);
+    // make the producer buffer the latest value
+    void publish()
+    {
+        m_write = m_shared.exchange(m_write | FRESH, memory_order_acq_rel) & INDEX;
+    }
 
-    //--------------------------------------------------------------------------
-    // CREATE OBJECT
-    //--------------------------------------------------------------------------
+    // copy the latest value if one was published since the last call
+    bool consume(T& a_value)
+    {
+        if ((m_shared.load(memory_order_relaxed) & FRESH) == 0)
+        {
+            return (false);
+        }
+        m_read = m_shared.exchange(m_read, memory_order_acq_rel) & INDEX;
+        a_value = m_buffers[m_read];
+        return (true);
+    }
 
-    // read the scale factor between the physical workspace of the haptic
-    // device and the virtual workspace defined for the tool
-    double workspaceScaleFactor = tool->getWorkspaceScaleFactor();
+private:
+    enum { INDEX = 3, FRESH = 4 };
+    T m_buffers[3];
+    atomic<int> m_shared;
+    int m_write;
+    int m_read;
+};
 
-    // stiffness properties
-    double maxStiffness = hapticDeviceInfo.m_maxLinearStiffness / workspaceScaleFactor;
+//------------------------------------------------------------------------------
+// HAPTIC TIMING
+//------------------------------------------------------------------------------
 
-    // create a virtual mesh
-    object = new cMesh();
+// wait-free single producer / single consumer queue of fixed capacity N
+// (a power of two). push() fails instead of blocking when the queue is full.
+template <class T, unsigned int N> class RingBuffer
+{
+public:
+    RingBuffer() : m_head(0), m_tail(0) {}
 
-    // add object to world
-    world->addChild(object);
-
-    // set the position of the object at the center of the world
-    //object->setLocalPos(0.0, 0.0, -0.75);
-    object->setLocalPos(0.0, 0.0, -0.3);
-
-    // create cube
-    //cCreateBox(object, 0.8, 0.8, 0.8);
-    
-    // create plane
-    cCreatePlane(object, 0.9, 0.9);
-
-    // create a texture
-    cTexture2dPtr texture = cTexture2d::create();
-       
-    bool fileload = texture->loadFromFile(RESOURCE_PATH("../resources/images/wood.png"));
-    if (!fileload)
-    {
-        #if defined(_MSVC)
-        fileload = texture->loadFromFile("../../../bin/resources/images/wood.png");
-        #endif
-    }
-    if (!fileload)
+    // append an item (producer thread)
+    bool push(const T& a_item)
     {
-        cout << "Error - Texture image failed to load correctly." << endl;
-       // close();
-       // return (-1);
+        unsigned int head = m_head.load(memory_order_relaxed);
+        if (head - m_tail.load(memory_order_acquire) >= N)
+        {
+            return (false);
+        }
+        m_items[head & (N - 1)] = a_item;
+        m_head.store(head + 1, memory_order_release);
+        return (true);
     }
 
-    cTexture2dPtr texture2 = cTexture2d::create();
-    texture2->setTextureUnit(GL_TEXTURE4);
-    fileload = texture2->loadFromFile(RESOURCE_PATH("../../../resources/images/toy_box_disp.png"));
-    if (!fileload)
-    {
-#if defined(_MSVC)
-        fileload = texture2->loadFromFile("../../../bin/resources/images/toy_box_disp.png");
-#endif
-    }
-    if (!fileload)
+    // remove the oldest item (consumer thread)
+    bool pop(T& a_item)
     {
-        cout << "Error - Texture2 image failed to load correctly." << endl;
-        // close();
-        // return (-1);
+        unsigned int tail = m_tail.load(memory_order_relaxed);
+        if (tail == m_head.load(memory_order_acquire))
+        {
+            return (false);
+        }
+        a_item = m_items[tail & (N - 1)];
+        m_tail.store(tail + 1, memory_order_release);
+        return (true);
     }
 
+private:
+    T m_items[N];
+    atomic<unsigned int> m_head;
+    atomic<unsigned int> m_tail;
+};
 
-    // apply texture to object
-    object->setTexture(texture);
-    object->setTexture2(texture2);
-    // enable texture rendering 
-    object->setUseTexture(true);
+// histogram of durations with logarithmic buckets subdivided linearly, so that
+// every recorded value is known to better than 1% over a nanosecond to hours
+// range (as in HdrHistogram)
+class LatencyHistogram
+{
+public:
+    LatencyHistogram() { reset(); }
 
-    // Since we don't need to see our polygons from both sides, we enable culling.
-    object->setUseCulling(true);
+    // clear all recorded values
+    void reset();
 
-    // set material properties to light gray
-    object->m_material->setWhite();
+    // record a duration in seconds
+    void record(double a_seconds);
 
-    // set material shininess
-    object->m_material->setShininess(80);
+    // value in seconds below which a fraction a_quantile of the samples lie
+    double getQuantile(double a_quantile) const;
 
-    // compute collision detection algorithm
-    object->createAABBCollisionDetector(toolRadius);
+    // statistics of recorded values
+    unsigned long long getCount() const { return (m_count); }
+    double getMean() const { return ((m_count > 0) ? 1e-9 * (double)m_sum / (double)m_count : 0.0); }
+    double getMax() const { return (1e-9 * (double)m_max); }
+    double getMin() const { return ((m_count > 0) ? 1e-9 * (double)m_min : 0.0); }
 
-    // define a default stiffness for the object
-    //object->m_material->setStiffness(0.5 * maxStiffness);
-    object->m_material->setStiffness(0.5 * maxStiffness);
+    // write the non-empty buckets as CSV rows (name, lower, upper [us], count)
+    void writeBuckets(ostream& a_stream, const string& a_name) const;
 
-    // define some static friction
-    object->m_material->setStaticFriction(0.0); //0.2
+private:
+    enum { SUB_BITS = 7, SUB_COUNT = 1 << SUB_BITS, HALF_COUNT = SUB_COUNT / 2 };
+    enum { NUM_BUCKETS = SUB_COUNT + (64 - SUB_BITS) * HALF_COUNT };
 
-    // define some dynamic friction
-    object->m_material->setDynamicFriction(0.0); //0.2
+    static int getBucket(unsigned long long a_value);
+    static unsigned long long getBucketLowerBound(int a_bucket);
 
-    // define some texture rendering
-    object->m_material->setTextureLevel(1.0);
+    unsigned long long m_counts[NUM_BUCKETS];
+    unsigned long long m_count;
+    unsigned long long m_sum;
+    unsigned long long m_min;
+    unsigned long long m_max;
+};
 
-    // render triangles haptically on front side only
-    object->m_material->setHapticTriangleSides(true, false);
+// timed quantities of the haptic loop
+enum HapticMetric
+{
+    HAPTIC_PERIOD,
+    HAPTIC_JITTER,
+    HAPTIC_DEVICE_READ,
+    HAPTIC_FORCES,
+    HAPTIC_DEVICE_WRITE,
+    HAPTIC_TICK,
+    HAPTIC_METRIC_COUNT
+};
 
-    // create a normal texture
-    cNormalMapPtr normalMap = cNormalMap::create();
+// names of haptic loop metrics
+const char* HAPTIC_METRIC_NAMES[HAPTIC_METRIC_COUNT] =
+{
+    "period",               // time between two ticks
+    "jitter",               // change of period between two ticks
+    "updateFromDevice",
+    "computeInteractionForces",
+    "applyToDevice",
+    "tick"                  // time spent computing a tick
+};
 
-    // load normal map from file
-    fileload = normalMap->loadFromFile(RESOURCE_PATH("../resources/images/toy_box_normal.png"));
-    if (!fileload)
-    {
-#if defined(_MSVC)
-        fileload = normalMap->loadFromFile("../../../bin/resources/images/toy_box_normal.pngq");
-#endif
-    }
-    if (!fileload)
-    {
-        cout << "Error - Texture image failed to load correctly." << endl;
-        close();
-        return (-1);
-    }
+// rate the haptic loops are expected to reach outside real-time mode [Hz]
+const double HAPTIC_NOMINAL_RATE = 1000.0;
 
-    // assign normal map to object
-    object->m_normalMap = normalMap;
+// fraction of a period by which a tick may be late before it counts as a
+// deadline miss
+const double HAPTIC_DEADLINE_TOLERANCE = 0.1;
 
-    // compute tangent vectors
-    object->computeBTN();   
-    
+// timings of one haptic tick [s]
+struct HapticTimingSample
+{
+    double m_values[HAPTIC_METRIC_COUNT];
+};
 
-    //--------------------------------------------------------------------------
-    // CREATE SHADERS
-    //--------------------------------------------------------------------------
+// timings sent by the haptic thread, drained by the graphics thread
+RingBuffer<HapticTimingSample, 8192> hapticTimingQueue;
 
-    // create vertex shader
-    cShaderPtr vertexShader = cShader::create(C_VERTEX_SHADER);
-    
-    string modeMappingV, modeMappingF;
-    int modeM = 1;
+// number of samples lost because the queue was full
+atomic<unsigned int> hapticTimingDropped(0);
 
-    switch (modeM)
-    {
-    case 0:
-       modeMappingV = RESOURCE_PATH("../resources/shaders/bump.vert");
-        modeMappingF = RESOURCE_PATH("../resources/shaders/bump.frag");
-#if defined(_MSVC)
-        modeMappingV = "../../../bin/resources/shaders/bump.vert";
-        modeMappingF = "../../../bin/resources/shaders/bump.frag";
-#endif
-        break;
-    case 1:
-        modeMappingV = RESOURCE_PATH("../resources/shaders/parallaxmapping.vert");
-        modeMappingF = RESOURCE_PATH("../resources/shaders/parallaxmapping.frag");
-#if defined(_MSVC)
-        modeMappingV = "../../../bin/resources/shaders/parallaxmapping.vert";
-        modeMappingF = "../../../bin/resources/shaders/parallaxmapping.frag";
-#endif
-        break;
-    case 2:
-        modeMappingV = RESOURCE_PATH("../resources/shaders/ReliefMapping.vert");
-        modeMappingF = RESOURCE_PATH("../resources/shaders/ReliefMapping.frag");
-#if defined(_MSVC)
-        modeMappingV = "../../../bin/resources/shaders/ReliefMapping.vert";
-        modeMappingF = "../../../bin/resources/shaders/ReliefMapping.frag";
-#endif
-        break;
-    default:
-        break;
-    }
+// histograms of haptic loop metrics
+LatencyHistogram hapticHistograms[HAPTIC_METRIC_COUNT];
 
-    // load vertex shader from file
-    fileload = vertexShader->loadSourceFile(modeMappingV);
-    /*if (!fileload)
-    {
-#if defined(_MSVC)
-        fileload = vertexShader->loadSourceFile("../../../bin/resources/shaders/parallaxmapping.vert");
-#endif
-    }*/
+// number of ticks whose period exceeded the deadline
+unsigned long long hapticDeadlineMisses = 0;
 
-    // create fragment shader
-    cShaderPtr fragmentShader = cShader::create(C_FRAGMENT_SHADER);
-    
-    // load fragment shader from file
-    fileload = fragmentShader->loadSourceFile(modeMappingF);
-    /*if (!fileload)
-    {
-#if defined(_MSVC)
-        fileload = fragmentShader->loadSourceFile("../../../bin/resources/shaders/parallaxmapping.frag");
-#endif
-    }*/
+// base name of the haptic timing files written at exit (none if empty)
+string hapticTimingsFilename;
 
-    // create program shader
-    cShaderProgramPtr programShader = cShaderProgram::create();
+//------------------------------------------------------------------------------
+// MULTIRATE HAPTICS
+//------------------------------------------------------------------------------
 
-    // assign vertex shader to program shader
-    programShader->attachShader(vertexShader);
+// nodes per side of a contact patch
+const int CONTACT_PATCH_NODES = 17;
 
-    // assign fragment shader to program shader
-    programShader->attachShader(fragmentShader);
-    
-    // assign program shader to object
-    object->setShaderProgram(programShader);
-    
-    // link program shader
-    programShader->linkProgram();
+// fastest tool motion a contact patch is sized for [world units / s]
+const double CONTACT_MODEL_MAX_SPEED = 2.0;
 
-    // set uniforms
-    programShader->setUniformi("uColorMap", 0);
-    //programShader->setUniformi("uColorMap2", 4);
-    programShader->setUniformi("uDepthMap", 4);
-    //programShader->setUniformi("uShadowMap", 0);
-    programShader->setUniformi("uNormalMap", 2);
-    programShader->setUniformf("uInvRadius", 0.0f);
+// default rate of the contact model thread [Hz]
+const double CONTACT_MODEL_RATE = 250.0;
 
+// periods of the contact model thread after which a patch is too old, it is
+// then only held until the next one arrives
+const double CONTACT_PATCH_MAX_PERIODS = 4.0;
 
-    //--------------------------------------------------------------------------
-   // CREATE SPHERES
-   //--------------------------------------------------------------------------
-    
-    // create a virtual mesh
-    spheres = new cMesh();
+// local contact model of the displaced plane around the tool, sampled by the
+// contact model thread: height at which the tool sphere rests on the surface
+// and surface normal on a small grid of the plane local frame. The haptic
+// loop only interpolates it, the pyramid search runs at the lower rate.
+struct ContactPatch
+{
+    // true once the patch has been sampled
+    bool m_valid;
 
-    // add object to world
-    world->addChild(spheres);
+    // plane position of the first node and distance between nodes, at least
+    // one texel, wider when the patch must cover a larger motion of the tool
+    double m_originX;
+    double m_originY;
+    double m_spacing;
 
-    spheres->setLocalPos(tool->getDeviceGlobalPos());
+    // depth scale the height map was sampled with
+    double m_depthScale;
 
-    cCreateSphere(spheres, toolRadius*1.01);
-    //cCreateBox(spheres, toolRadius*2, toolRadius*2, toolRadius*2);
+    // monotonic time at which the patch was published [ns]
+    long long m_time;
 
-   // create texture
-    cTexture2dPtr texture3 = cTexture2d::create();
+    // rest height of the sphere center (-C_LARGE where the sphere cannot
+    // touch the plane) and unit normal at each node
+    float m_height[CONTACT_PATCH_NODES * CONTACT_PATCH_NODES];
+    float m_normal[3 * CONTACT_PATCH_NODES * CONTACT_PATCH_NODES];
+};
 
-    // load texture file
-    fileload = texture3->loadFromFile(RESOURCE_PATH("../resources/images/spheremap-3.jpg"));
-    if (!fileload)
-    {
-#if defined(_MSVC)
-        fileload = texture3->loadFromFile("../../../bin/resources/images/spheremap-3.jpg");
-#endif
-    }
-    if (!fileload)
-    {
-        cout << "Error - Texture image failed to load correctly." << endl;
-        close();
-        return (-1);
-    }
+// tool position around which the next patch is sampled (plane local frame)
+struct ContactPatchRequest
+{
+    cVector3d m_localPos;
+    double m_depthScale;
+};
 
+// if true, displacement map forces are interpolated from contact patches
+bool useContactModel = false;
 
-    // apply texture to object
-    spheres->setTexture(texture3);
-    // enable texture rendering 
-    spheres->setUseTexture(true);
+// rate of the contact model thread [Hz]
+double contactModelRate = CONTACT_MODEL_RATE;
 
-    // Since we don't need to see our polygons from both sides, we enable culling.
-    spheres->setUseCulling(true);
+// contact model thread
+cThread* contactModelThread = NULL;
 
-    // set material properties to light gray
-    spheres->m_material->setWhite();
+// flags that control and report the termination of the contact model thread
+atomic<bool> contactModelRunning(false);
+atomic<bool> contactModelFinished(true);
 
-    // set material shininess
-    spheres->m_material->setShininess(80);
+// signaled when the contact model thread terminates
+mutex contactModelMutex;
+condition_variable contactModelCondition;
 
-    // compute collision detection algorithm
-    //spheres->createAABBCollisionDetector(toolRadius);
+// a frequency counter to measure the contact patch rate
+cFrequencyCounter freqCounterContactModel;
 
-    // define a default stiffness for the object
-    //object->m_material->setStiffness(0.5 * maxStiffness);
-    spheres->m_material->setStiffness(0.8 * maxStiffness);
+//------------------------------------------------------------------------------
+// SCENE GRAPH UPDATES
+//------------------------------------------------------------------------------
 
-    // define some static friction
-    spheres->m_material->setStaticFriction(0.0); //0.2
+// incremental update of global reference frames. Local poses are changed
+// through the setters of the updater, which flag the objects that actually
+// moved (markDirty() flags objects moved by other means); update() then only
+// descends along flagged paths and recomputes the subtrees of flagged nodes.
+// Each instance must only be used by a single thread.
+class GlobalPoseUpdater
+{
+public:
+    GlobalPoseUpdater() : m_updateAll(true), m_numUpdated(0) {}
 
-    // define some dynamic friction
-    spheres->m_material->setDynamicFriction(0.0); //0.2
+    // set the local position of an object, flagged if it has changed
+    void setLocalPos(cGenericObject* a_object, const cVector3d& a_pos);
 
-    // define some texture rendering
-    spheres->m_material->setTextureLevel(1.0);
+    // rotate an object about an axis of its local frame, flagged if the angle is not zero
+    void rotateAboutLocalAxisDeg(cGenericObject* a_object, const cVector3d& a_axis, double a_angle);
 
-    
-    // compute tangent vectors
-    spheres->computeBTN();
+    // flag an object whose local position or rotation has changed
+    void markDirty(cGenericObject* a_object);
 
-    // create fragment shader
-    cShaderPtr fragmentShader2 = cShader::create(C_FRAGMENT_SHADER);
-    cShaderPtr vertexShader2 = cShader::create(C_VERTEX_SHADER);
+    // flag every object, e.g. after the scene graph has been modified
+    void markAllDirty() { m_updateAll = true; m_numNodes.clear(); }
 
-    fileload = vertexShader2->loadSourceFile(RESOURCE_PATH("../resources/shaders/phong.vert"));
-    if (!fileload)
-{
-#if defined(_MSVC)
-        fileload = vertexShader2->loadSourceFile("../../../bin/resources/shaders/phong.vert");
-#endif
-    }
-    fileload = fragmentShader2->loadSourceFile(RESOURCE_PATH("../resources/shaders/phong.frag"));
-    if (!fileload){
-#if defined(_MSVC)
-    fileload = fragmentShader2->loadSourceFile("../../../bin/resources/shaders/phong.frag");
-#endif
-    }
+    // add a subtree handled by this updater
+    void addRoot(cGenericObject* a_root) { m_roots.push_back(a_root); markAllDirty(); }
 
-    // create program shader
-    cShaderProgramPtr programShader2 = cShaderProgram::create();
-    // assign vertex shader to program shader
-    programShader2->attachShader(vertexShader2);
+    // recompute the flagged subtrees, returns the number of nodes updated
+    int update();
 
-    // assign fragment shader to program shader
-    programShader2->attachShader(fragmentShader2);
+    // number of nodes updated since the last call to resetCounter()
+    int getNumUpdated() const { return (m_numUpdated); }
+    void resetCounter() { m_numUpdated = 0; }
 
-    spheres->setShaderProgram(programShader2);
+private:
+    int updateNode(cGenericObject* a_object, const cVector3d& a_parentPos, const cMatrix3d& a_parentRot);
+    int getNumNodes(cGenericObject* a_object);
+    static int countNodes(cGenericObject* a_object);
+    static bool contains(const vector<cGenericObject*>& a_list, cGenericObject* a_object);
 
-    // link program shader
-    programShader2->linkProgram();
-    // set uniforms
-    //programShader2->setUniformi("uColorMap", 0);
-    //programShader->setUniformi("uColorMap2", 4);
-    //programShader2->setUniformi("uDepthMap", 4);
-    programShader->setUniformi("uShadowMap", 0);
-    //programShader2->setUniformi("uNormalMap", 2);
-    //programShader2->setUniformf("uInvRadius", 0.0f);
+    bool m_updateAll;
+    int m_numUpdated;
+    vector<cGenericObject*> m_roots;
+    vector<cGenericObject*> m_dirty;
+    vector<cGenericObject*> m_onPath;
 
+    // size of the subtrees recomputed so far, until the scene graph changes
+    map<cGenericObject*, int> m_numNodes;
+};
 
-    //tool->setShaderProgram(programShader2);
-    // link program shader
+// pose updates of the objects owned by the graphics thread
+GlobalPoseUpdater graphicsPoseUpdater;
 
-    //--------------------------------------------------------------------------
-// FRAMEBUFFERS
-//--------------------------------------------------------------------------
+// state published by the haptic thread once per tick
+struct HapticState
+{
+    // device pose in world coordinates
+    cVector3d m_devicePos;
+    cMatrix3d m_deviceRot;
 
-    // create framebuffer for view 1
-    frameBuffer1 = cFrameBuffer::create();
-    frameBuffer1->setup(cameraView1);
+    // proxy position of the finger-proxy algorithm
+    cVector3d m_proxyPos;
 
-    // create framebuffer for view 2
-    frameBuffer2 = cFrameBuffer::create();
-    frameBuffer2->setup(cameraView2);
+    // position of the cursor sphere (resting on the surface when in contact)
+    cVector3d m_cursorPos;
 
-    //--------------------------------------------------------------------------
-// VIEW PANELS
-//--------------------------------------------------------------------------
+    // force sent to the device in world coordinates
+    cVector3d m_force;
 
-    // create and setup view panel 1
-    viewPanel1 = new cViewPanel(frameBuffer1);
-    camera->m_frontLayer->addChild(viewPanel1);
+    // contact with the displacement map
+    bool m_inContact;
+    double m_contactDepth;
 
-    // create and setup view panel 2
-    viewPanel2 = new cViewPanel(frameBuffer2);
-    camera->m_frontLayer->addChild(viewPanel2);
+    // number of scene graph nodes whose global frame was recomputed this tick
+    int m_numPoseUpdates;
 
-    //--------------------------------------------------------------------------
-    // WIDGETS
-    //--------------------------------------------------------------------------
+    // number of probe points in contact with the plane
+    int m_numProbeContacts;
 
-    // create a font
-    font = NEW_CFONTCALIBRI20();
+    // number of ticks the contact patch was too old or did not cover the tool
+    unsigned int m_numPatchMisses;
 
-    // create a label to display the haptic and graphic rate of the simulation
-    labelRates = new cLabel(font);
-    cameraView1->m_frontLayer->addChild(labelRates);
+    // number of ticks that ended after their deadline in real-time mode
+    unsigned int m_numOverruns;
 
-    // set font color
-    labelRates->m_fontColor.setWhite();
+    // haptic tick counter
+    unsigned int m_tick;
+};
 
-    // create a background
-    background = new cBackground();
-    cameraView1->m_backLayer->addChild(background);
+// parameters published by the input callbacks for the haptic thread
+struct InputState
+{
+    float m_heightScale;
+    double m_heighC;
+    bool m_useHeightField;
+    bool m_useMultiPoint;
+    bool m_useContactModel;
+};
 
-    // set background properties
-    background->setCornerColors(cColorf(0.3, 0.3, 0.3),
-                                cColorf(0.3, 0.3, 0.3),
-                                cColorf(0.1, 0.1, 0.1),
-                                cColorf(0.1, 0.1, 0.1));
-    //-----------------------------------------
-    // create a label to display the haptic and graphic rate of the simulation
-    labelRates2 = new cLabel(font);
-    cameraView2->m_frontLayer->addChild(labelRates2);
+// state of the plane shared by all devices. The servo thread of the first
+// device is the only one that modifies the plane, the other ones read the
+// copies it publishes.
+struct PlaneState
+{
+    // frame of the plane in world coordinates
+    cVector3d m_globalPos;
+    cMatrix3d m_globalRot;
 
-    // set font color
-    labelRates2->m_fontColor.setWhite();
+    // stiffness of its material and haptic offset of the flat surface
+    double m_stiffness;
+    double m_heighC;
+};
 
-    // create a background
-    background2 = new cBackground();
-    cameraView2->m_backLayer->addChild(background2);
+// plane state when the servo threads start
+PlaneState planeState;
 
-    // set background properties
-    background2->setCornerColors(cColorf(0.3, 0.3, 0.3),
-                                cColorf(0.3, 0.3, 0.3),
-                                cColorf(0.1, 0.1, 0.1),
-                                cColorf(0.1, 0.1, 0.1));
+//------------------------------------------------------------------------------
+// HAPTIC DEVICES
+//------------------------------------------------------------------------------
 
+// maximum number of haptic devices driven at once
+const int MAX_HAPTIC_DEVICES = 8;
 
-    //--------------------------------------------------------------------------
-    // START SIMULATION
-    //--------------------------------------------------------------------------
+// a haptic device, the tool rendering it and the servo thread running it.
+// Every channel has a single producer and a single consumer, so that the
+// servo threads of different devices never wait for each other.
+struct HapticStation
+{
+    // position of the station in the device manager
+    int m_index;
 
-    // create a thread which starts the main haptics rendering loop
-    hapticsThread = new cThread();
-    hapticsThread->start(updateHaptics, CTHREAD_PRIORITY_HAPTICS);
+    // device and tool
+    cGenericHapticDevicePtr m_device;
+    cToolCursor* m_tool;
 
-    // setup callback when application exits
-    atexit(close);
+    // sphere showing the cursor of the device
+    cMesh* m_cursor;
 
-    //object->setWireMode(true);
-    //object->setShowNormals(true);
-    
-    //object->setShowTangents(true);
-    //object->setNormalsProperties(0.5, cColorf(0.1, 0.8, 0.2));
+    // images of the proxy and device positions and of the line between them,
+    // moved by the graphics thread from the published state
+    cShapeSphere* m_proxyImage;
+    cShapeSphere* m_goalImage;
+    cShapeLine* m_lineImage;
 
-    
-    heightScale = 0.0;
-    //object->heighC = 0.3125 * heightScale + 0.01;
-    object->heighC = 0.45977 * heightScale + 0.01;
+    // servo thread and the core it is pinned to (-1 if not pinned)
+    cThread* m_thread;
+    int m_core;
 
-    //--------------------------------------------------------------------------
-    // MAIN GRAPHIC LOOP
-    //--------------------------------------------------------------------------
+    // a flag that indicates if the servo thread has terminated
+    bool m_finished;
+
+    // a frequency counter to measure the servo rate
+    cFrequencyCounter m_freqCounter;
+
+    // input -> servo and servo -> graphics channels
+    TripleBuffer<InputState> m_inputChannel;
+    TripleBuffer<HapticState> m_stateChannel;
+
+    // first servo -> servo channel of the plane state
+    TripleBuffer<PlaneState> m_planeChannel;
+
+    // servo -> contact model and contact model -> servo channels
+    TripleBuffer<ContactPatchRequest> m_contactRequestChannel;
+    TripleBuffer<ContactPatch> m_contactPatchChannel;
+
+    // latest state seen by the graphics thread
+    HapticState m_state;
+};
+
+// creates one tool and one servo thread per haptic device. Servo threads
+// are pinned to the last cores, one each, leaving the first ones to the
+// graphics thread and the system.
+class HapticDeviceManager
+{
+public:
+    HapticDeviceManager() {}
+    ~HapticDeviceManager();
+
+    // create the tool of a device in the world, returns its station
+    HapticStation* addDevice(cGenericHapticDevicePtr a_device, cWorld* a_world, double a_radius);
+
+    // start one servo thread per station running a_loop(station)
+    void start(void (*a_loop)(void*));
+
+    // wait for the servo threads to terminate and stop the tools
+    void stop();
+
+    // true when no servo thread is running
+    bool isFinished() const;
+
+    // wait for all servo threads to terminate
+    void waitFinished();
+
+    // signal the termination of the servo thread of a station (servo thread)
+    void setFinished(HapticStation* a_station);
+
+    // true if the object is the tool of a station
+    bool isTool(cGenericObject* a_object) const;
+
+    // send input parameters to every servo thread
+    void publishInput(const InputState& a_input);
+
+    // fetch the latest state of every servo thread (graphics thread)
+    void consumeStates();
+
+    // number of tools applying a contact force, merged from the latest states
+    int getNumInContact() const;
+
+    int getNumStations() const { return ((int)m_stations.size()); }
+    HapticStation* getStation(int a_index) { return (m_stations[a_index]); }
+
+private:
+    vector<HapticStation*> m_stations;
+    mutable mutex m_finishedMutex;
+    condition_variable m_finishedCondition;
+};
+
+// haptic devices of the simulation
+HapticDeviceManager hapticDevices;
+
+//------------------------------------------------------------------------------
+// REAL-TIME HAPTICS
+//------------------------------------------------------------------------------
+
+// default rate of the haptic loops in real-time mode [Hz]
+const double REALTIME_RATE = 1000.0;
+
+// SCHED_FIFO priority of the servo threads
+const int REALTIME_PRIORITY = 80;
+
+// part of each period spent spinning before the deadline [ns]
+const long long REALTIME_SPIN_NS = 100000;
+
+// stack touched by each servo thread before its loop [bytes]
+const int REALTIME_STACK_PREFAULT = 256 * 1024;
+
+// if true, servo threads run with real-time priority at a fixed rate
+bool realtimeMode = false;
+
+// rate of the haptic loops in real-time mode [Hz]
+double realtimeRate = REALTIME_RATE;
+
+// absolute deadlines of a periodic loop. The thread sleeps until shortly
+// before each deadline and spins for the rest: a sleep alone wakes up tens
+// of microseconds late, a spin alone takes a whole core from the system.
+class PeriodicTimer
+{
+public:
+    PeriodicTimer() : m_period(0), m_deadline(0), m_numOverruns(0), m_maxLateness(0) {}
+
+    // first deadline one period from now
+    void start(double a_period);
+
+    // wait for the next deadline, false if it has already passed. The next
+    // deadline then starts from now instead of catching up with a burst.
+    bool wait();
+
+    unsigned long long getNumOverruns() const { return (m_numOverruns); }
+    double getMaxLateness() const { return (1e-9 * (double)m_maxLateness); }
+
+    // monotonic time [ns]
+    static long long now();
+
+private:
+    static void sleepUntil(long long a_time);
+
+    long long m_period;
+    long long m_deadline;
+    unsigned long long m_numOverruns;
+    long long m_maxLateness;
+};
+
+//------------------------------------------------------------------------------
+// HAPTIC RECORDING
+//------------------------------------------------------------------------------
+
+// device data read and written during one haptic tick, stored as is on disk
+struct HapticDeviceSample
+{
+    double m_pos[3];
+    double m_rot[9];
+    double m_linVel[3];
+    double m_angVel[3];
+    double m_gripperAngle;
+    double m_gripperAngVel;
+    double m_force[3];
+    double m_torque[3];
+    double m_gripperForce;
+    double m_heighC;
+    float m_heightScale;
+    unsigned int m_userSwitches;
+    unsigned int m_useHeightField;
+    unsigned int m_useMultiPoint;
+};
+
+// header of a recording file, followed by the samples up to the end of file
+struct HapticRecordingHeader
+{
+    char m_magic[4];
+    unsigned int m_version;
+    unsigned int m_sampleSize;
+    unsigned int m_reserved;
+    char m_modelName[64];
+    double m_workspaceRadius;
+    double m_maxLinearStiffness;
+    double m_maxLinearDamping;
+    double m_maxLinearForce;
+    double m_maxAngularStiffness;
+    double m_maxAngularDamping;
+    double m_maxAngularTorque;
+    double m_maxGripperForce;
+    double m_maxGripperLinearStiffness;
+    double m_maxGripperAngularDamping;
+    double m_gripperMaxAngleRad;
+};
+
+// version of the recording file format
+const unsigned int HAPTIC_RECORDING_VERSION = 1;
+
+// a haptic device that forwards every call to another device and logs the
+// values exchanged during each tick, a tick ends when forces are sent
+class RecordingHapticDevice : public cGenericHapticDevice
+{
+public:
+    RecordingHapticDevice(cGenericHapticDevicePtr a_device, const string& a_filename);
+    virtual ~RecordingHapticDevice() { close(); }
+
+    virtual bool open();
+    virtual bool close();
+    virtual bool calibrate(bool a_forceCalibration = false) { return (m_device->calibrate(a_forceCalibration)); }
+    virtual bool getPosition(cVector3d& a_position);
+    virtual bool getRotation(cMatrix3d& a_rotation);
+    virtual bool getLinearVelocity(cVector3d& a_linearVelocity);
+    virtual bool getAngularVelocity(cVector3d& a_angularVelocity);
+    virtual bool getGripperAngleRad(double& a_angle);
+    virtual bool getGripperAngularVelocity(double& a_gripperAngularVelocity);
+    virtual bool getUserSwitches(unsigned int& a_userSwitches);
+    virtual bool setForceAndTorqueAndGripperForce(const cVector3d& a_force,
+                                                  const cVector3d& a_torque,
+                                                  double a_gripperForce);
+
+    // log the input parameters applied during the current tick
+    void setInputState(const InputState& a_input);
+
+    // number of ticks written
+    unsigned int getNumSamples() const { return (m_numSamples); }
+
+private:
+    cGenericHapticDevicePtr m_device;
+    FILE* m_file;
+    HapticDeviceSample m_sample;
+    unsigned int m_numSamples;
+};
+
+// a haptic device that plays back a recording, one sample per tick. The forces
+// sent to the device are compared bit for bit against the recorded forces.
+class ReplayHapticDevice : public cGenericHapticDevice
+{
+public:
+    ReplayHapticDevice();
+    virtual ~ReplayHapticDevice() {}
+
+    // read a recording file
+    bool loadFromFile(const string& a_filename);
+
+    virtual bool open() { m_deviceReady = true; return (true); }
+    virtual bool close() { m_deviceReady = false; return (true); }
+    virtual bool calibrate(bool /*a_forceCalibration*/ = false) { return (true); }
+    virtual bool getPosition(cVector3d& a_position);
+    virtual bool getRotation(cMatrix3d& a_rotation);
+    virtual bool getLinearVelocity(cVector3d& a_linearVelocity);
+    virtual bool getAngularVelocity(cVector3d& a_angularVelocity);
+    virtual bool getGripperAngleRad(double& a_angle);
+    virtual bool getGripperAngularVelocity(double& a_gripperAngularVelocity);
+    virtual bool getUserSwitches(unsigned int& a_userSwitches);
+    virtual bool setForceAndTorqueAndGripperForce(const cVector3d& a_force,
+                                                  const cVector3d& a_torque,
+                                                  double a_gripperForce);
+
+    // input parameters applied during the current tick
+    void getInputState(InputState& a_input) const;
+
+    // true once every sample has been played
+    bool isFinished() const { return (m_current >= m_samples.size()); }
+
+    // number of samples played and of samples whose force differed
+    unsigned int getNumPlayed() const { return (m_current); }
+    unsigned int getNumMismatches() const { return (m_numMismatches); }
+
+    // largest force difference and first tick with a difference
+    double getMaxForceError() const { return (m_maxForceError); }
+    int getFirstMismatch() const { return (m_firstMismatch); }
+
+private:
+    const HapticDeviceSample& current() const;
+
+    vector<HapticDeviceSample> m_samples;
+    unsigned int m_current;
+    unsigned int m_numMismatches;
+    double m_maxForceError;
+    int m_firstMismatch;
+};
+
+// device logging to a file, NULL when not recording
+shared_ptr<RecordingHapticDevice> recordingDevice;
+
+// device playing a recording, NULL when using a real device
+shared_ptr<ReplayHapticDevice> replayDevice;
+
+//------------------------------------------------------------------------------
+// MAXIMUM MIPMAP RELIEF MAPPING (modeM = 3)
+//------------------------------------------------------------------------------
+
+// texture unit of the min depth pyramid
+const int PYRAMID_TEXTURE_UNIT = 5;
+
+// maximum number of traversal steps per fragment
+const int PYRAMID_MAX_ITERATIONS = 128;
+
+// GPU copy of the min depth levels of heightPyramid
+GLuint heightPyramidTexture = 0;
+
+// vertex shader: texture space view and light vectors
+const char* PYRAMID_RELIEF_VERT =
+"#version 120\n"
+"attribute vec3 aPosition;\n"
+"attribute vec3 aNormal;\n"
+"attribute vec3 aTexCoord;\n"
+"attribute vec3 aTangent;\n"
+"attribute vec3 aBitangent;\n"
+"varying vec2 vTexCoord;\n"
+"varying vec3 vViewTS;\n"
+"varying vec3 vLightTS;\n"
+"void main(void)\n"
+"{\n"
+"    vec4 pos = gl_ModelViewMatrix * vec4(aPosition, 1.0);\n"
+"    vec3 n = normalize(gl_NormalMatrix * aNormal);\n"
+"    vec3 t = normalize(gl_NormalMatrix * aTangent);\n"
+"    vec3 b = normalize(gl_NormalMatrix * aBitangent);\n"
+"    vec3 v = -pos.xyz;\n"
+"    vec3 l = gl_LightSource[0].position.xyz - pos.xyz;\n"
+"    vViewTS = vec3(dot(v, t), dot(v, b), dot(v, n));\n"
+"    vLightTS = vec3(dot(l, t), dot(l, b), dot(l, n));\n"
+"    vTexCoord = aTexCoord.xy;\n"
+"    gl_Position = gl_ModelViewProjectionMatrix * vec4(aPosition, 1.0);\n"
+"}\n";
+
+// fragment shader: quadtree stepping over the min depth pyramid. Must stay
+// in sync with traceHeightPyramid(), its CPU reference.
+const char* PYRAMID_RELIEF_FRAG =
+"#version 120\n"
+"#extension GL_ARB_shader_texture_lod : enable\n"
+"uniform sampler2D uColorMap;\n"
+"uniform sampler2D uNormalMap;\n"
+"uniform sampler2D uDepthPyramid;\n"
+"uniform float heightScale;\n"
+"uniform float uPyramidSize;\n"
+"uniform int uPyramidLevels;\n"
+"uniform int uMaxIterations;\n"
+"varying vec2 vTexCoord;\n"
+"varying vec3 vViewTS;\n"
+"varying vec3 vLightTS;\n"
+"void main(void)\n"
+"{\n"
+"    vec3 v = normalize(vViewTS);\n"
+"    vec2 dir = -v.xy / max(v.z, 0.05) * heightScale;\n"
+"    vec2 dirStep = vec2(dir.x >= 0.0 ? 1.0 : -1.0, dir.y >= 0.0 ? 1.0 : -1.0);\n"
+"    vec2 dirSign = max(dirStep, 0.0);\n"
+"    vec2 invDir = vec2(abs(dir.x) > 1e-8 ? 1.0 / dir.x : 1e8, abs(dir.y) > 1e-8 ? 1.0 / dir.y : 1e8);\n"
+"    int topLevel = uPyramidLevels - 1;\n"
+"    int level = topLevel;\n"
+"    float cells = uPyramidSize / exp2(float(level));\n"
+"    vec2 cell = floor(vTexCoord * cells);\n"
+"    float t = 0.0;\n"
+"    for (int i = 0; i < 512; i++)\n"
+"    {\n"
+"        if ((level < 0) || (i >= uMaxIterations) || (t >= 1.0)) break;\n"
+"        float d = texture2DLod(uDepthPyramid, (cell + 0.5) / cells, float(level)).r;\n"
+"        bool descend = true;\n"
+"        if (t < d)\n"
+"        {\n"
+"            vec2 tb = ((cell + dirSign) / cells - vTexCoord) * invDir;\n"
+"            float tExit = min(tb.x, tb.y);\n"
+"            if (d <= tExit) { t = d; }\n"
+"            else\n"
+"            {\n"
+"                t = tExit;\n"
+"                vec2 parent = floor(cell * 0.5);\n"
+"                cell += dirStep * vec2(tb.x <= tExit ? 1.0 : 0.0, tb.y <= tExit ? 1.0 : 0.0);\n"
+"                if ((level < topLevel) && any(notEqual(floor(cell * 0.5), parent)))\n"
+"                {\n"
+"                    level++; cells *= 0.5; cell = floor(cell * 0.5);\n"
+"                }\n"
+"                descend = false;\n"
+"            }\n"
+"        }\n"
+"        if (descend)\n"
+"        {\n"
+"            level--;\n"
+"            cells *= 2.0;\n"
+"            cell = clamp(floor((vTexCoord + t * dir) * cells), 2.0 * cell, 2.0 * cell + 1.0);\n"
+"        }\n"
+"    }\n"
+"    vec2 uv = vTexCoord + min(t, 1.0) * dir;\n"
+"#ifdef PACKED_NORMAL_MAP\n"
+"    vec2 nxy = texture2D(uNormalMap, uv).xy * 2.0 - 1.0;\n"
+"    vec3 n = vec3(nxy, sqrt(max(1.0 - dot(nxy, nxy), 0.0)));\n"
+"#else\n"
+"    vec3 n = normalize(texture2D(uNormalMap, uv).xyz * 2.0 - 1.0);\n"
+"#endif\n"
+"    vec3 l = normalize(vLightTS);\n"
+"    vec3 h = normalize(l + v);\n"
+"    float diffuse = max(dot(n, l), 0.0);\n"
+"    float specular = pow(max(dot(n, h), 0.0), max(gl_FrontMaterial.shininess, 1.0));\n"
+"    vec4 color = texture2D(uColorMap, uv);\n"
+"    gl_FragColor = vec4(color.rgb * (0.2 + 0.8 * diffuse) + 0.3 * specular, color.a);\n"
+"}\n";
+
+//------------------------------------------------------------------------------
+// SHADER CACHE
+//------------------------------------------------------------------------------
+
+// shader program that can be created from a driver binary and that keeps the
+// locations of its uniforms, so that they are looked up by name only once
+class CachedShaderProgram : public cShaderProgram
+{
+public:
+    CachedShaderProgram() {}
+    virtual ~CachedShaderProgram() {}
+
+    // create the program from a binary returned by getBinary(), false if the
+    // driver rejects it (other driver or GPU)
+    bool loadBinary(GLenum a_format, const vector<unsigned char>& a_binary);
+
+    // binary of the linked program
+    bool getBinary(GLenum& a_format, vector<unsigned char>& a_binary);
+
+    // location of a uniform, -1 if the program does not use it
+    GLint getCachedUniformLocation(const string& a_name);
+
+    // set uniforms by location
+    using cShaderProgram::setUniformi;
+    using cShaderProgram::setUniformf;
+    void setUniformi(GLint a_location, GLint a_value);
+    void setUniformf(GLint a_location, GLfloat a_value);
+
+private:
+    map<string, GLint> m_uniformLocations;
+};
+
+typedef shared_ptr<CachedShaderProgram> CachedShaderProgramPtr;
+
+// shader programs keyed by a hash of their sources and defines. The binaries
+// of the linked programs are kept on disk, so that later runs with the same
+// sources and driver skip compiling and linking.
+class ShaderProgramCache
+{
+public:
+    ShaderProgramCache() : m_numLoaded(0), m_numCompiled(0) {}
+
+    // program made of two shaders, a_defines (lines of "#define NAME VALUE")
+    // are inserted after the #version line of both sources
+    CachedShaderProgramPtr getProgram(const string& a_vertexSource,
+                                      const string& a_fragmentSource,
+                                      const string& a_defines = "");
+
+    // number of programs loaded from disk and compiled from source
+    int getNumLoaded() const { return (m_numLoaded); }
+    int getNumCompiled() const { return (m_numCompiled); }
+
+private:
+    mutex m_mutex;
+    map<unsigned long long, CachedShaderProgramPtr> m_programs;
+    int m_numLoaded;
+    int m_numCompiled;
+};
+
+// prefix of the program binary files written in the working directory
+const string SHADER_CACHE_PREFIX = "shadercache_";
+
+// programs used by the application
+ShaderProgramCache shaderCache;
+
+//------------------------------------------------------------------------------
+// SHADER MANAGER
+//------------------------------------------------------------------------------
+
+// mapping modes of the plane (modeM)
+const int MAPPING_MODE_COUNT = 4;
+const char* MAPPING_MODE_NAMES[MAPPING_MODE_COUNT] = { "bump", "parallax", "relief", "max mipmap relief" };
+
+// frames ignored after a swap, the GPU timings lag behind by the frames in flight
+const int MAPPING_MODE_WARMUP_FRAMES = 8;
+
+// program of the plane for each mapping mode. The shader files are watched and
+// a background thread rebuilds the program of the current mode when they change,
+// or the program of a newly requested mode. With a hidden window sharing the
+// display context the thread also compiles, otherwise it only reads the
+// sources and swapProgram() compiles them. Programs are swapped between frames.
+class ShaderManager
+{
+public:
+    ShaderManager();
+    ~ShaderManager() { stop(); }
+
+    // sources of a mode, read from files or embedded
+    void setShaderFiles(int a_mode, const string& a_vertexFile, const string& a_fragmentFile);
+    void setShaderSources(int a_mode, const string& a_vertexSource, const string& a_fragmentSource);
+    void setModeAvailable(int a_mode, bool a_available) { m_available[a_mode] = a_available; }
+
+    // embedded sources of a mode, used instead of its own ones while
+    // selected. Selecting them rebuilds the program of the current mode.
+    void setAlternateSources(int a_mode, const string& a_vertexSource, const string& a_fragmentSource);
+    void useAlternateSources(int a_mode, bool a_use);
+
+    // defines inserted in the sources of all modes
+    void setDefines(const string& a_defines) { m_defines = a_defines; }
+
+    // build the program of a mode and start watching the shader files
+    bool start(int a_mode, GLFWwindow* a_sharedContext);
+
+    // stop the background thread
+    void stop();
+
+    // switch to another mode once its program is built
+    void requestMode(int a_mode);
+
+    // install a rebuilt program, true if the program has changed
+    bool swapProgram();
+
+    int getMode() const { return (m_mode); }
+    CachedShaderProgramPtr getProgram() const { return (m_program); }
+
+    // update the height scale of the current program
+    void setHeightScale(float a_heightScale);
+
+    // accumulate the frame times of the current mode
+    void recordFrameTime(double a_frameMs, double a_gpuMs);
+
+    // print the mean frame times of each mode
+    void printFrameTimes();
+
+private:
+    bool loadSources(int a_mode, string& a_vertexSource, string& a_fragmentSource);
+    bool waitForFileChanges(int a_timeoutMs);
+    void run(int a_mode);
+
+    string m_vertexFile[MAPPING_MODE_COUNT];
+    string m_fragmentFile[MAPPING_MODE_COUNT];
+    string m_vertexSource[MAPPING_MODE_COUNT];
+    string m_fragmentSource[MAPPING_MODE_COUNT];
+    string m_alternateVertex[MAPPING_MODE_COUNT];
+    string m_alternateFragment[MAPPING_MODE_COUNT];
+    atomic<bool> m_useAlternate[MAPPING_MODE_COUNT];
+    atomic<bool> m_rebuild;
+    bool m_available[MAPPING_MODE_COUNT];
+    string m_defines;
+
+    // state of the graphics thread
+    int m_mode;
+    CachedShaderProgramPtr m_program;
+    GLint m_uniformHeightScale;
+    int m_warmupFrames;
+    double m_frameMs[MAPPING_MODE_COUNT];
+    double m_gpuMs[MAPPING_MODE_COUNT];
+    int m_numFrames[MAPPING_MODE_COUNT];
+
+    // background thread
+    thread m_thread;
+    atomic<bool> m_running;
+    atomic<int> m_requestedMode;
+    GLFWwindow* m_context;
+
+    // watched files
+    vector<string> m_watchedFiles;
+    vector<time_t> m_watchedTimes;
+    int m_inotify;
+
+    // program (or sources) waiting to be swapped in
+    mutex m_mutex;
+    bool m_hasPending;
+    int m_pendingMode;
+    string m_pendingVertex;
+    string m_pendingFragment;
+    CachedShaderProgramPtr m_pendingProgram;
+};
+
+// programs of the plane
+ShaderManager shaderManager;
+
+// hidden window sharing objects with the display context
+GLFWwindow* shaderContext = NULL;
+
+//------------------------------------------------------------------------------
+// ADAPTIVE RELIEF MAPPING
+//------------------------------------------------------------------------------
+
+// linear search steps of relief mapping, head-on and grazing views
+const int ADAPTIVE_MIN_STEPS = 8;
+const int ADAPTIVE_MAX_STEPS = 32;
+
+// default GPU time of both views [ms] and lowest step budget
+const double ADAPTIVE_TARGET_MS = 8.0;
+const double ADAPTIVE_MIN_BUDGET = 0.25;
+
+// fragment shader: relief mapping whose linear search takes more steps at
+// grazing angles, no more than one per texel of the mip level covering the
+// pixel, times a step budget set from the frame time. With uAdaptive = 0 it
+// always takes uMaxSteps steps.
+const char* ADAPTIVE_RELIEF_FRAG =
+"#version 120\n"
+"#extension GL_ARB_shader_texture_lod : enable\n"
+"uniform sampler2D uColorMap;\n"
+"uniform sampler2D uNormalMap;\n"
+"uniform sampler2D uDepthMap;\n"
+"uniform float heightScale;\n"
+"uniform float uDepthSize;\n"
+"uniform float uAdaptive;\n"
+"uniform float uMinSteps;\n"
+"uniform float uMaxSteps;\n"
+"uniform float uStepBudget;\n"
+"uniform float uLodBias;\n"
+"varying vec2 vTexCoord;\n"
+"varying vec3 vViewTS;\n"
+"varying vec3 vLightTS;\n"
+"float depthAt(vec2 uv, float lod)\n"
+"{\n"
+"#ifdef GL_ARB_shader_texture_lod\n"
+"    return texture2DLod(uDepthMap, uv, lod).r;\n"
+"#else\n"
+"    return texture2D(uDepthMap, uv).r;\n"
+"#endif\n"
+"}\n"
+"void main(void)\n"
+"{\n"
+"    vec3 v = normalize(vViewTS);\n"
+"    vec2 dir = -v.xy / max(v.z, 0.05) * heightScale;\n"
+"    vec2 footprint = max(abs(dFdx(vTexCoord)), abs(dFdy(vTexCoord))) * uDepthSize;\n"
+"    float lod = uAdaptive * max(log2(max(max(footprint.x, footprint.y), 1e-6)) + uLodBias, 0.0);\n"
+"    float texels = length(dir) * uDepthSize / exp2(lod);\n"
+"    float steps = min(mix(uMinSteps, uMaxSteps, 1.0 - abs(v.z)), texels + 1.0) * uStepBudget;\n"
+"    steps = floor(mix(uMaxSteps, clamp(steps, 4.0, uMaxSteps), uAdaptive));\n"
+"    float dt = 1.0 / steps;\n"
+"    float t = 0.0;\n"
+"    for (int i = 0; i < 64; i++)\n"
+"    {\n"
+"        if ((float(i) >= steps) || (t >= depthAt(vTexCoord + t * dir, lod))) break;\n"
+"        t += dt;\n"
+"    }\n"
+"    float t0 = max(t - dt, 0.0);\n"
+"    float t1 = min(t, 1.0);\n"
+"    for (int i = 0; i < 8; i++)\n"
+"    {\n"
+"        float tm = 0.5 * (t0 + t1);\n"
+"        if (tm >= depthAt(vTexCoord + tm * dir, lod)) { t1 = tm; } else { t0 = tm; }\n"
+"    }\n"
+"    vec2 uv = vTexCoord + t1 * dir;\n"
+"#ifdef PACKED_NORMAL_MAP\n"
+"    vec2 nxy = texture2D(uNormalMap, uv).xy * 2.0 - 1.0;\n"
+"    vec3 n = vec3(nxy, sqrt(max(1.0 - dot(nxy, nxy), 0.0)));\n"
+"#else\n"
+"    vec3 n = normalize(texture2D(uNormalMap, uv).xyz * 2.0 - 1.0);\n"
+"#endif\n"
+"    vec3 l = normalize(vLightTS);\n"
+"    vec3 h = normalize(l + v);\n"
+"    float diffuse = max(dot(n, l), 0.0);\n"
+"    float specular = pow(max(dot(n, h), 0.0), max(gl_FrontMaterial.shininess, 1.0));\n"
+"    vec4 color = texture2D(uColorMap, uv);\n"
+"    gl_FragColor = vec4(color.rgb * (0.2 + 0.8 * diffuse) + 0.3 * specular, color.a);\n"
+"}\n";
+
+// step budget of the relief searches, lowered while the views take longer
+// than a target time and raised again when they are faster
+class AdaptiveQuality
+{
+public:
+    AdaptiveQuality() : m_enabled(false), m_targetMs(ADAPTIVE_TARGET_MS), m_budget(1.0) {}
+
+    void setEnabled(bool a_enabled) { m_enabled = a_enabled; m_budget = 1.0; }
+    bool getEnabled() const { return (m_enabled); }
+
+    void setTargetTime(double a_targetMs) { m_targetMs = a_targetMs; }
+
+    // fraction of the steps taken, in [ADAPTIVE_MIN_BUDGET, 1]
+    double getBudget() const { return (m_budget); }
+
+    // adjust the budget to the time of the last frame
+    void update(double a_frameMs);
+
+    // set the step uniforms of the program of a mapping mode
+    void apply(CachedShaderProgramPtr a_program, int a_mode);
+
+private:
+    bool m_enabled;
+    double m_targetMs;
+    double m_budget;
+};
+
+// step budget of relief mapping (modeM = 2 and 3)
+AdaptiveQuality adaptiveQuality;
+
+//------------------------------------------------------------------------------
+// ASSET LOADER
+//------------------------------------------------------------------------------
+
+// texture uploaded by the asset loader instead of at its first rendering
+template <class T>
+class StreamedTexture : public T
+{
+public:
+    static shared_ptr<StreamedTexture<T> > create() { return (make_shared<StreamedTexture<T> >()); }
+
+    // upload the image from a pixel buffer object, or from memory if a_pixelBuffer is 0
+    void upload(GLuint a_pixelBuffer);
+
+    // upload all levels of a packed texture instead of the image
+    bool uploadPacked(const class PackedTexture& a_packed);
+
+    // sample the image with or without mipmaps, generated if already uploaded
+    void setMipmapped(bool a_mipmapped);
+};
+
+typedef StreamedTexture<cTexture2d> StreamedTexture2d;
+typedef shared_ptr<StreamedTexture2d> StreamedTexture2dPtr;
+typedef StreamedTexture<cNormalMap> StreamedNormalMap;
+typedef shared_ptr<StreamedNormalMap> StreamedNormalMapPtr;
+
+// displacement map of the plane loaded from a PNG, mipmapped only while the
+// adaptive relief shader reads its coarser levels (NULL if packed)
+StreamedTexture2dPtr adaptiveDepthMap;
+
+// images decoded in parallel by a pool of worker threads and uploaded by the
+// display thread as soon as each of them is decoded
+class AssetLoader
+{
+public:
+    AssetLoader() : m_numDecoded(0), m_totalTime(0.0) {}
+
+    // directories searched in order, ending with a separator
+    void addSearchPath(const string& a_path) { m_searchPaths.push_back(a_path); }
+
+    // first existing file named a_name in the search paths
+    bool resolvePath(const string& a_name, string& a_path) const;
+
+    // queue an image to decode into a texture
+    template <class T>
+    void requestTexture(const string& a_name, shared_ptr<StreamedTexture<T> > a_texture);
+
+    // decode and upload all queued images, false if any of them failed
+    bool loadAll(int a_numThreads = 0);
+
+    // true if the image was decoded and uploaded
+    bool isLoaded(const string& a_name) const;
+
+    // print decode and upload times
+    void printTimings() const;
+
+private:
+    struct Asset
+    {
+        string m_name;
+        string m_path;
+        cImagePtr m_image;
+        function<void(GLuint)> m_upload;
+        bool m_loaded;
+        double m_decodeTime;
+        double m_uploadTime;
+    };
+
+    void decodeAssets();
+
+    vector<string> m_searchPaths;
+    vector<Asset> m_assets;
+
+    // indices of the decoded assets, in order of completion
+    mutex m_mutex;
+    condition_variable m_decodedCondition;
+    vector<int> m_decoded;
+    atomic<int> m_nextAsset;
+    int m_numDecoded;
+
+    double m_totalTime;
+};
+
+// number of pixel buffer objects used in turn for uploads
+const int ASSET_PIXEL_BUFFER_COUNT = 2;
+
+//------------------------------------------------------------------------------
+// PACKED TEXTURES
+//------------------------------------------------------------------------------
+
+// pixel formats of a packed texture: one channel heights, or two channel
+// normals compressed in 4x4 blocks (BC5)
+enum PackedFormat
+{
+    PACKED_R8,
+    PACKED_R16,
+    PACKED_RGTC2
+};
+
+const unsigned int PACKED_TEXTURE_VERSION = 1;
+const int PACKED_MAX_LEVELS = 16;
+
+// levels start at multiples of this size in the file
+const unsigned int PACKED_ALIGNMENT = 64;
+
+// header of a packed texture file, followed by the mip levels from the finest
+struct PackedTextureHeader
+{
+    char m_magic[4];
+    unsigned int m_version;
+    unsigned int m_format;
+    unsigned int m_width;
+    unsigned int m_height;
+    unsigned int m_numLevels;
+    unsigned long long m_offset[PACKED_MAX_LEVELS];
+    unsigned long long m_size[PACKED_MAX_LEVELS];
+};
+
+// read only mapping of a whole file
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile() { close(); }
+
+    bool open(const string& a_filename);
+    void close();
+
+    const unsigned char* getData() const { return (m_data); }
+    size_t getSize() const { return (m_size); }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    const unsigned char* m_data;
+    size_t m_size;
+#if defined(_WIN32)
+    HANDLE m_file;
+    HANDLE m_mapping;
+#endif
+};
+
+// packed texture mapped from disk, the levels are read in place
+class PackedTexture
+{
+public:
+    // map and validate a packed texture file
+    bool open(const string& a_filename);
+    void close() { m_file.close(); }
+
+    const PackedTextureHeader& getHeader() const { return (*(const PackedTextureHeader*)m_file.getData()); }
+    const unsigned char* getLevel(int a_level) const { return (m_file.getData() + getHeader().m_offset[a_level]); }
+
+private:
+    MappedFile m_file;
+};
+
+//------------------------------------------------------------------------------
+
+template <class T>
+bool StreamedTexture<T>::uploadPacked(const PackedTexture& a_packed)
+{
+    const PackedTextureHeader& header = a_packed.getHeader();
+    if ((header.m_format == PACKED_RGTC2) && !GLEW_ARB_texture_compression_rgtc)
+    {
+        return (false);
+    }
+
+    if (this->m_textureID == 0)
+    {
+        glGenTextures(1, &this->m_textureID);
+    }
+    glBindTexture(GL_TEXTURE_2D, this->m_textureID);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_FALSE);
+
+    // heights go up as luminance so that the shaders can read any of .rgb
+    for (unsigned int level = 0; level < header.m_numLevels; level++)
+    {
+        GLsizei w = cMax(header.m_width >> level, 1u);
+        GLsizei h = cMax(header.m_height >> level, 1u);
+        const GLvoid* data = a_packed.getLevel(level);
+        if (header.m_format == PACKED_R8)
+        {
+            glTexImage2D(GL_TEXTURE_2D, level, GL_LUMINANCE8, w, h, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, data);
+        }
+        else if (header.m_format == PACKED_R16)
+        {
+            glTexImage2D(GL_TEXTURE_2D, level, GL_LUMINANCE16, w, h, 0, GL_LUMINANCE, GL_UNSIGNED_SHORT, data);
+        }
+        else
+        {
+            glCompressedTexImage2D(GL_TEXTURE_2D, level, GL_COMPRESSED_RG_RGTC2, w, h, 0,
+                                   (GLsizei)header.m_size[level], data);
+        }
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, header.m_numLevels - 1);
+
+    // shaders unaware of packed normals read (x, y, 1)
+    if ((header.m_format == PACKED_RGTC2) && GLEW_ARB_texture_swizzle)
+    {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_B, GL_ONE);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    this->m_useMipmaps = true;
+    this->setMinFunction(GL_LINEAR_MIPMAP_LINEAR);
+    this->m_updateTextureFlag = false;
+    return (true);
+}
+
+//------------------------------------------------------------------------------
+// MESH BUFFERS
+//------------------------------------------------------------------------------
+
+// vertex of a mesh buffer, all attributes of a vertex side by side
+struct PackedVertex
+{
+    float m_position[3];
+    float m_normal[3];
+    float m_texCoord[2];
+    float m_tangent[3];
+    float m_bitangent[3];
+};
+
+// copies of the vertices of a persistently mapped mesh buffer: an update
+// writes the copy the GPU finished drawing frames ago while it draws another
+const int MESH_BUFFER_REGIONS = MAX_FRAMES_IN_FLIGHT + 1;
+
+// vertices of a mesh kept in one interleaved buffer object. The buffer is
+// mapped once for the life of the mesh where ARB_buffer_storage is available,
+// and only the vertex ranges marked dirty are copied to it. None of the
+// meshes of the demo deform per frame: the dirty ranges come from edits made
+// after a mesh was first drawn, such as recomputed tangents.
+class MeshBuffer
+{
+public:
+    MeshBuffer();
+    ~MeshBuffer() { release(); }
+
+    // create the buffers of a mesh and copy all its vertices and triangles
+    bool create(cMesh* a_mesh);
+    void release();
+
+    // vertices modified on the CPU
+    void markDirty(unsigned int a_first, unsigned int a_count);
+
+    // copy the dirty vertices to the buffer, returns the number of bytes written
+    size_t update();
+
+    // draw the triangles, attribute locations are -1 for the fixed pipeline arrays
+    void draw(const GLint a_locations[5]);
+
+private:
+    MeshBuffer(const MeshBuffer&);
+    MeshBuffer& operator=(const MeshBuffer&);
+
+    void packVertices(unsigned int a_first, unsigned int a_end, PackedVertex* a_destination);
+    static void mergeRanges(vector<pair<unsigned int, unsigned int> >& a_ranges);
+
+    cMesh* m_mesh;
+    GLuint m_vertexBuffer;
+    GLuint m_indexBuffer;
+    unsigned int m_numVertices;
+    unsigned int m_numIndices;
+
+    // persistent mapping of MESH_BUFFER_REGIONS copies of the vertices,
+    // NULL if the buffer holds one copy updated with glBufferSubData
+    PackedVertex* m_mapped;
+
+    // copy drawn, and per copy the fence of its last draw (waited for before
+    // writing to it) and the ranges changed since it was last written
+    int m_region;
+    GLsync m_fences[MESH_BUFFER_REGIONS];
+    vector<pair<unsigned int, unsigned int> > m_pending[MESH_BUFFER_REGIONS];
+
+    // dirty ranges [first, end) of vertices
+    vector<pair<unsigned int, unsigned int> > m_dirty;
+    vector<PackedVertex> m_staging;
+};
+
+// buffers of the meshes drawn by the render queue
+map<cMesh*, shared_ptr<MeshBuffer> > meshBuffers;
+
+//------------------------------------------------------------------------------
+// TANGENT SPACE
+//------------------------------------------------------------------------------
+
+// Same result as cMesh::computeBTN(), computed by several threads. Each thread
+// sums the tangents of a contiguous range of triangles over the vertex range
+// they touch, then the sums are reduced and orthogonalized per vertex block.
+
+// vertices reduced and orthogonalized together
+const int TANGENT_BLOCK_SIZE = 256;
+
+// fewest triangles given to a thread
+const unsigned int TANGENT_TRIANGLES_PER_THREAD = 16384;
+
+// sums of the triangle tangents and bitangents of a thread
+struct TangentAccumulator
+{
+    // vertex range [first, end) touched by the triangles of the thread
+    unsigned int m_first;
+    unsigned int m_end;
+
+    // tx, ty, tz, bx, by, bz of the vertices of the range
+    vector<double> m_sums[6];
+};
+
+//------------------------------------------------------------------------------
+// REFERENCE RENDERER
+//------------------------------------------------------------------------------
+
+// CPU rendering of the textured plane with the mapping modes of the shaders,
+// for machines without a GPU. Images are split in tiles rendered by all cores,
+// and the relief searches step four pixels at a time.
+
+// tiles of pixels handed to the threads
+const int REFERENCE_TILE_SIZE = 32;
+
+// iteration count shown as the hottest color of the heatmaps
+const int REFERENCE_HEATMAP_MAX = 64;
+
+// camera, light and mapping parameters of a reference image (world frame)
+struct ReferenceView
+{
+    cVector3d m_eye;
+    cVector3d m_target;
+    cVector3d m_up;
+    double m_fieldViewDeg;
+    int m_width;
+    int m_height;
+
+    // center of the plane, which lies in the xy plane
+    cVector3d m_planeCenter;
+
+    cVector3d m_light;
+    double m_shininess;
+
+    int m_mode;
+    double m_heightScale;
+
+    // search steps of relief mapping (mode 2)
+    int m_numLinearSteps;
+    int m_numBinarySteps;
+
+    // iteration limit of maximum mipmap relief mapping (mode 3)
+    int m_maxIterations;
+};
+
+// maps sampled by the reference renderer
+struct ReferenceTextures
+{
+    // rgb in [0,1]
+    int m_colorWidth;
+    int m_colorHeight;
+    vector<float> m_color;
+
+    // xyz in [-1,1]
+    int m_normalWidth;
+    int m_normalHeight;
+    vector<float> m_normal;
+
+    // depth of the displacement map
+    HeightPyramid m_pyramid;
+};
+
+// rendered colors (rgb in [0,1]) and search iterations of each pixel
+struct ReferenceImage
+{
+    int m_width;
+    int m_height;
+    vector<float> m_color;
+    vector<int> m_iterations;
+};
+
+//------------------------------------------------------------------------------
+// MULTI-VIEW RENDERING
+//------------------------------------------------------------------------------
+
+// maximum number of views, one bit each in the view mask of a draw item
+const int MULTI_VIEW_MAX_VIEWS = 32;
+
+// texture slots of a mesh: color map, second texture and normal map
+const int RENDER_QUEUE_TEXTURES = 3;
+
+// mesh drawn by the render queue, or object rendered by CHAI3D
+struct RenderQueueItem
+{
+    cGenericObject* m_object;
+
+    // NULL if the object is rendered by CHAI3D
+    cMesh* m_mesh;
+
+    // state of the mesh, used as the sort key
+    cShaderProgram* m_program;
+    cGenericTexture* m_textures[RENDER_QUEUE_TEXTURES];
+    cMaterial* m_material;
+
+    // back faces of the mesh are culled
+    bool m_useCulling;
+
+    // views in which the object is visible
+    unsigned int m_viewMask;
+};
+
+// work done by the render queue during a frame
+struct RenderQueueStats
+{
+    size_t m_numBytesUploaded;
+    int m_numDraws;
+    int m_numFallbackDraws;
+    int m_numProgramBinds;
+    int m_numTextureBinds;
+    int m_numMaterialBinds;
+};
+
+// retained list of draws, sorted by program, textures and material. Shader
+// meshes are drawn by the queue, which only changes the state that differs
+// from the previous draw. Other objects are rendered by CHAI3D after them.
+class RenderQueue
+{
+public:
+    RenderQueue() { resetStats(); }
+
+    // remove all items, keeping the allocated storage
+    void clear() { m_items.clear(); }
+
+    // add an enabled and shown object. Shader meshes without children are
+    // drawn by the queue, other objects are rendered with their children by CHAI3D.
+    void submit(cGenericObject* a_object, unsigned int a_viewMask);
+
+    // order the items by state
+    void sort();
+
+    // draw the items visible in a view, with a_view the view matrix
+    void execute(cRenderOptions& a_options, const double a_view[16], unsigned int a_viewMask);
+
+    const RenderQueueStats& getStats() const { return (m_stats); }
+    void resetStats() { memset(&m_stats, 0, sizeof(m_stats)); }
+
+private:
+    // vertex attributes of a program, -1 for the fixed pipeline arrays
+    struct AttributeLocations
+    {
+        GLint m_position;
+        GLint m_normal;
+        GLint m_texCoord;
+        GLint m_tangent;
+        GLint m_bitangent;
+    };
+
+    const AttributeLocations& getAttributes(cShaderProgram* a_program);
+
+    vector<RenderQueueItem> m_items;
+    map<GLuint, AttributeLocations> m_attributes;
+    RenderQueueStats m_stats;
+};
+
+// camera rendered in a viewport of the window
+struct RenderView
+{
+    cCamera* m_camera;
+
+    // viewport in pixels from the lower left corner of the window
+    int m_x;
+    int m_y;
+    int m_width;
+    int m_height;
+
+    // projection and view matrices (column major) and normalized frustum planes
+    double m_projection[16];
+    double m_view[16];
+    double m_planes[6][4];
+};
+
+// top level object of the world and the views in which it is visible
+struct MultiViewItem
+{
+    cGenericObject* m_object;
+
+    // bounding sphere in the object frame, negative radius if unbounded
+    cVector3d m_center;
+    double m_radius;
+
+    unsigned int m_viewMask;
+};
+
+// renders several cameras of one world directly into viewports of the window.
+// The world is traversed and culled once per frame for all views, and each
+// view then draws the same list of objects, sorted by shader program, instead
+// of rendering each camera into a framebuffer and compositing the panels.
+class MultiViewRenderer
+{
+public:
+    MultiViewRenderer() : m_world(NULL), m_numChildren(0), m_numDraws(0), m_numCulled(0) {}
+
+    void setWorld(cWorld* a_world) { m_world = a_world; m_items.clear(); m_numChildren = 0; }
+
+    // add a camera, returns the index of its view
+    int addView(cCamera* a_camera);
+
+    // set the viewport of a view
+    void setViewport(int a_view, int a_x, int a_y, int a_width, int a_height);
+
+    // render all views into the current framebuffer
+    void render();
+
+    // draws issued and objects culled by the last frame, over all views
+    int getNumDraws() const { return (m_numDraws); }
+    int getNumCulled() const { return (m_numCulled); }
+    const RenderQueueStats& getQueueStats() const { return (m_queue.getStats()); }
+
+private:
+    void collectItems();
+    void updateView(RenderView& a_view);
+    void renderLayer(cGenericObject* a_layer, const RenderView& a_view, cRenderOptions& a_options);
+
+    cWorld* m_world;
+    vector<RenderView> m_views;
+    vector<MultiViewItem> m_items;
+    RenderQueue m_queue;
+    unsigned int m_numChildren;
+    int m_numDraws;
+    int m_numCulled;
+};
+
+// render both views in a single pass instead of through the framebuffers
+bool useMultiView = false;
+
+// views of cameraView1 and cameraView2
+MultiViewRenderer multiViewRenderer;
+
+// textures and images of the application
+AssetLoader assetLoader;
+
+//------------------------------------------------------------------------------
+
+template <class T>
+void StreamedTexture<T>::upload(GLuint a_pixelBuffer)
+{
+    cImagePtr image = this->m_image;
+    const GLvoid* pixels = image->getData();
+
+    // copy the pixels into a fresh store of the buffer, so that the driver does
+    // not wait for a previous upload from the same buffer
+    if (a_pixelBuffer != 0)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, a_pixelBuffer);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, image->getSizeInBytes(), NULL, GL_STREAM_DRAW);
+        void* data = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+        if (data)
+        {
+            memcpy(data, image->getData(), image->getSizeInBytes());
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            pixels = NULL;
+        }
+        else
+        {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        }
+    }
+
+    if (this->m_textureID == 0)
+    {
+        glGenTextures(1, &this->m_textureID);
+    }
+    glBindTexture(GL_TEXTURE_2D, this->m_textureID);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, this->m_useMipmaps ? GL_TRUE : GL_FALSE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image->getWidth(), image->getHeight(), 0,
+                 image->getFormat(), image->getType(), pixels);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, this->m_useMipmaps ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    // CHAI3D only binds the texture from now on
+    this->m_updateTextureFlag = false;
+}
+
+//------------------------------------------------------------------------------
+
+template <class T>
+void StreamedTexture<T>::setMipmapped(bool a_mipmapped)
+{
+    GLint minFunction = a_mipmapped ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR;
+    this->m_useMipmaps = a_mipmapped;
+    this->setMinFunction(minFunction);
+    if (this->m_textureID != 0)
+    {
+        glBindTexture(GL_TEXTURE_2D, this->m_textureID);
+        if (a_mipmapped)
+        {
+            glGenerateMipmap(GL_TEXTURE_2D);
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, minFunction);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        this->m_updateTextureFlag = false;
+    }
+}
+
+//------------------------------------------------------------------------------
+
+template <class T>
+void AssetLoader::requestTexture(const string& a_name, shared_ptr<StreamedTexture<T> > a_texture)
+{
+    Asset asset;
+    asset.m_name = a_name;
+    asset.m_image = a_texture->m_image;
+    asset.m_upload = [a_texture](GLuint a_pixelBuffer) { a_texture->upload(a_pixelBuffer); };
+    asset.m_loaded = false;
+    asset.m_decodeTime = 0.0;
+    asset.m_uploadTime = 0.0;
+    if (!resolvePath(a_name, asset.m_path))
+    {
+        cout << "Error - " << a_name << " not found in the search paths." << endl;
+    }
+    m_assets.push_back(asset);
+}
+
+
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+// DECLARED MACROS
+//------------------------------------------------------------------------------
+// convert to resource path
+#define RESOURCE_PATH(p)    (char*)((resourceRoot+string(p)).c_str())
+
+// trace the enclosing scope, or name the calling thread on the trace timeline
+#if defined(USE_TRACING)
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b)  TRACE_CONCAT_(a, b)
+#define TRACE_ZONE(name)    TraceZone TRACE_CONCAT(traceZone, __LINE__)(name)
+#define TRACE_THREAD(name)  tracer.setThreadName(name)
+#else
+#define TRACE_ZONE(name)
+#define TRACE_THREAD(name)
+#endif
+
+
+//------------------------------------------------------------------------------
+// DECLARED FUNCTIONS
+//------------------------------------------------------------------------------
+
+// callback when the window display is resized
+void windowSizeCallback(GLFWwindow* a_window, int a_width, int a_height);
+
+// callback when an error GLFW occurs
+void errorCallback(int error, const char* a_description);
+
+// callback when a key is pressed
+void keyCallback(GLFWwindow* a_window, int a_key, int a_scancode, int a_action, int a_mods);
+
+// callback to handle mouse click
+void mouseButtonCallback(GLFWwindow* a_window, int a_button, int a_action, int a_mods);
+
+// callback to handle mouse motion
+void mouseMotionCallback(GLFWwindow* a_window, double a_posX, double a_posY);
+
+// this function renders the scene
+void updateGraphics(void);
+
+// this function contains the main haptics simulation loop of a device
+void updateHaptics(void* a_station);
+
+// pin the calling thread to a core
+bool pinThreadToCore(int a_core);
+
+// cores removed from the scheduler by the isolcpus kernel parameter
+vector<int> getIsolatedCores(void);
+
+// lock the memory of the process for real-time threads
+bool setupRealtimeProcess(void);
+
+// give the calling thread a SCHED_FIFO priority and prefault its stack
+bool setupRealtimeThread(int a_priority);
+
+// this function samples contact patches around the tool at a lower rate
+void updateContactModel(void);
+
+// start the contact model thread, if not running
+void startContactModel(void);
+
+// stop the contact model thread and wait for it to terminate
+void stopContactModel(void);
+
+// this function closes the application
+void close(void);
+
+// send the current input parameters to the haptic thread
+void publishInputState(void);
+
+// period above which a haptic tick counts as a deadline miss [s]
+double getHapticDeadline(void);
+
+// move the queued haptic timings into the histograms
+void collectHapticTimings(void);
+
+// write the haptic timing histograms to CSV and JSON files
+void writeHapticTimings(const string& a_basename);
+
+// print the comparison of replayed and recorded forces
+void printReplayReport(void);
+
+// build the min-max pyramid of a displacement image
+bool buildHeightPyramid(HeightPyramid& a_pyramid, cImagePtr a_image);
+
+// build the min-max pyramid of a packed displacement map
+bool buildHeightPyramid(HeightPyramid& a_pyramid, const PackedTexture& a_packed);
+
+// true if level 0 is square with a power of two size. Only then do the
+// levels match GL mipmaps and cells of 2^level texels, as the maximum mipmap
+// traversal assumes: other sizes round up, GL rounds down.
+bool isSquarePowerOfTwo(const HeightPyramid& a_pyramid);
+
+// compute the contact between a sphere and the displaced plane
+bool computeHeightFieldContact(const HeightPyramid& a_pyramid,
+                               const cVector3d& a_localPos,
+                               double a_radius,
+                               double a_depthScale,
+                               HeightFieldContact& a_contact);
+
+// sample the contact patch of the displaced plane around a tool position,
+// covering at least a_halfExtent on each side of it
+void buildContactPatch(const HeightPyramid& a_pyramid,
+                       const cVector3d& a_localPos,
+                       double a_radius,
+                       double a_depthScale,
+                       double a_halfExtent,
+                       ContactPatch& a_patch);
+
+// interpolate the contact of a sphere from a patch, clamped to its border.
+// False if the patch does not cover the sphere position with the current
+// depth scale, the nearest nodes then hold the last sampled surface.
+bool evaluateContactPatch(const ContactPatch& a_patch,
+                          const cVector3d& a_localPos,
+                          double a_radius,
+                          double a_depthScale,
+                          HeightFieldContact& a_contact);
+
+// buffer of a mesh, created at its first use
+MeshBuffer* getMeshBuffer(cMesh* a_mesh);
+
+// vertices of a mesh modified on the CPU, uploaded before its next draw
+void markMeshVerticesDirty(cMesh* a_mesh, unsigned int a_first, unsigned int a_count);
+
+// upload the min depth levels of a square power of two pyramid as a
+// mipmapped texture, 0 for other pyramids
+GLuint createHeightPyramidTexture(const HeightPyramid& a_pyramid);
+
+// CPU reference of the maximum mipmap traversal of a square power of two
+// pyramid, returns the iteration count
+int traceHeightPyramid(const HeightPyramid& a_pyramid,
+                       double a_u, double a_v,
+                       double a_dirU, double a_dirV,
+                       int a_maxIterations,
+                       double& a_depth);
+
+// CPU reference of the fixed linear + binary search relief traversal
+int traceReliefLinearBinary(const HeightPyramid& a_pyramid,
+                            double a_u, double a_v,
+                            double a_dirU, double a_dirV,
+                            int a_numLinearSteps,
+                            int a_numBinarySteps,
+                            double& a_depth);
+
+// exact ray/height field intersection by texel walk (ground truth)
+double traceHeightFieldExact(const HeightPyramid& a_pyramid,
+                             double a_u, double a_v,
+                             double a_dirU, double a_dirV);
+
+// benchmark the relief traversals on the CPU
+void benchmarkReliefTraversal(const HeightPyramid& a_pyramid);
+
+// create fences and timer queries for frame pacing
+void initFramePacing(void);
+
+// wait until a frame slot is free and collect its GPU timings
+void beginFrame(void);
+
+// mark the end of a frame with a fence
+void endFrame(void);
+
+// start/stop timing a GPU stage of the current frame
+void beginGpuStage(GpuStage a_stage);
+void endGpuStage(void);
+
+// release fences and timer queries
+void releaseFramePacing(void);
+
+// create an offscreen display context for headless mode
+bool createHeadlessContext(int a_width, int a_height);
+
+// release the offscreen display context
+void destroyHeadlessContext(void);
+
+// print timing statistics of a series of frames
+void printFrameStats(vector<double>& a_frameTimes);
+
+// read a whole text file
+bool readTextFile(const string& a_filename, string& a_text);
+
+// set the uniforms of a program of the plane
+void setupMappingProgram(CachedShaderProgramPtr a_program, int a_mode);
+
+// switch relief mapping between its shader files and the adaptive shader
+void setAdaptiveRelief(bool a_enabled);
+
+// render the view panels through the framebuffers, or both views in one pass
+void renderViews(void);
+
+// write the mip levels of the displacement map as R8 or R16
+bool packHeightMap(cImagePtr a_image, bool a_16bit, const string& a_filename);
+
+// write the mip levels of the normal map compressed as BC5
+bool packNormalMap(cImagePtr a_image, const string& a_filename);
+
+// convert the displacement and normal maps to packed textures next to them
+bool packTextures(bool a_height16);
+
+// build a bounding volume hierarchy over an indexed triangle list
+void buildTriangleBVH(TriangleBVH& a_bvh,
+                      const vector<cVector3d>& a_vertices,
+                      const vector<unsigned int>& a_indices);
+
+// build a bounding volume hierarchy over the triangles of a mesh
+void buildTriangleBVH(TriangleBVH& a_bvh, cMesh* a_mesh);
+
+// allocate the buffers of a batch up front, queries then do not allocate
+void reserveContactBatch(const TriangleBVH& a_bvh, ContactBatch& a_batch);
+
+// query all spheres of a batch against a tree in a single traversal
+void queryContactsBatch(const TriangleBVH& a_bvh, float a_radius, ContactBatch& a_batch);
+
+// resolve the (point, triangle) candidates of a batch
+void narrowPhaseContacts(const TriangleBVH& a_bvh, float a_radius, ContactBatch& a_batch);
+
+// benchmark batched against per-point contact queries on a displaced grid
+void benchmarkContactQueries(const HeightPyramid& a_pyramid);
+
+// collapse a binary tree into a 4-wide tree
+void buildWideBVH(WideBVH& a_wide, const TriangleBVH& a_bvh);
+
+// query all spheres of a batch against a wide tree, one traversal per sphere
+void queryContactsWide(const WideBVH& a_wide, float a_radius, ContactBatch& a_batch);
+
+// select the collision detector of a mesh
+void setCollisionTree(cMesh* a_mesh, CollisionTree a_tree, double a_radius);
+
+// compare the CHAI3D and wide trees on meshes whose wide nodes have fewer
+// than 4 children, returns the number of segments with a different contact
+int checkWidePartialNodes(void);
+
+// benchmark the CHAI3D and wide trees on the plane and on a displaced grid
+void benchmarkCollisionTrees(const HeightPyramid& a_pyramid);
+
+// benchmark the bake and queries of signed distance fields against the CHAI3D tree
+void benchmarkSignedDistance(const HeightPyramid& a_pyramid);
+
+// compute the tangents and bitangents of a mesh on all cores, same as computeBTN()
+void computeTangentsParallel(cMesh* a_mesh, int a_numThreads = 0);
+
+// benchmark computeBTN() against computeTangentsParallel() on grids of up to a_maxTriangles
+void benchmarkTangents(unsigned int a_maxTriangles);
+
+// view of the first camera and light of the scene
+void getDefaultReferenceView(ReferenceView& a_view);
+
+// load the color, displacement and normal maps of the plane
+bool loadReferenceTextures(ReferenceTextures& a_textures);
+
+// render the plane on the CPU with all cores
+void renderReference(const ReferenceTextures& a_textures,
+                     const ReferenceView& a_view,
+                     ReferenceImage& a_image,
+                     int a_numThreads = 0);
+
+// write the colors to a_prefix.png and the iteration heatmap to a_prefix_iterations.png
+bool saveReferenceImage(const ReferenceImage& a_image, const string& a_prefix);
+
+// render all mapping modes at a height scale to images named after a_prefix
+bool renderReferenceImages(const string& a_prefix, double a_heightScale);
+
+
+bool moveW = false;
+
+//==============================================================================
+/*
+    DEMO:   08-shaders.cpp
+
+    This example illustrates how to build a small mesh cube.
+    The applications also presents the use of texture properties by defining 
+    a texture image and associated texture coordinates for each of the vertices.
+    A bump map is also used in combination with a shader to create a more
+    realistic rendering of the surface.
+*/
+//==============================================================================
+
+int main(int argc, char* argv[])
+{
+    //--------------------------------------------------------------------------
+    // INITIALIZATION
+    //--------------------------------------------------------------------------
+
+    cout << endl;
+    cout << "-----------------------------------" << endl;
+    cout << "Final Project" << endl;
+    cout << "-----------------------------------" << endl << endl << endl;
+    cout << "Keyboard Options:" << endl << endl;
+    cout << "[f] - Enable/Disable full screen mode" << endl;
+    cout << "[m] - Enable/Disable vertical mirroring" << endl;
+    cout << "[h] - Enable/Disable displacement map haptic rendering" << endl;
+    cout << "[p] - Enable/Disable multi-point probe" << endl;
+    cout << "[1-4] - Bump, parallax, relief or max mipmap relief mapping" << endl;
+    cout << "[v] - Enable/Disable single pass multi-view rendering" << endl;
+    cout << "[l] - Enable/Disable adaptive relief steps" << endl;
+    cout << "[c] - Enable/Disable multirate displacement map haptics" << endl;
+    cout << "[q] - Exit application" << endl;
+    cout << endl << endl;
+
+    // parse first arg to try and locate resources
+    string resourceRoot = string(argv[0]).substr(0,string(argv[0]).find_last_of("/\\")+1);
+
+    // directories of the images
+    assetLoader.addSearchPath(resourceRoot + "../resources/images/");
+    assetLoader.addSearchPath(resourceRoot + "../../../resources/images/");
+#if defined(_MSVC)
+    assetLoader.addSearchPath("../../../bin/resources/images/");
+#endif
+
+    // mapping mode of the plane: bump, parallax, relief or max mipmap relief
+    int modeM = 1;
+
+    // haptic device recording and replay files
+    string recordFilename;
+    string replayFilename;
+
+    // number of haptic devices to drive, 0 for all connected devices
+    int maxDevices = 1;
+
+    // parse command line options
+    for (int i = 1; i < argc; i++)
+    {
+        // render offscreen for a fixed number of frames and exit
+        if (string(argv[i]) == "--headless")
+        {
+            headless = true;
+        }
+        else if ((string(argv[i]) == "--frames") && (i + 1 < argc))
+        {
+            headlessFrames = cMax(atoi(argv[++i]), 1);
+        }
+
+        // log the haptic device, or replace it by a log
+        else if ((string(argv[i]) == "--record") && (i + 1 < argc))
+        {
+            recordFilename = argv[++i];
+        }
+        else if ((string(argv[i]) == "--replay") && (i + 1 < argc))
+        {
+            replayFilename = argv[++i];
+        }
+
+        // drive several haptic devices, each from its own servo thread
+        else if ((string(argv[i]) == "--devices") && (i + 1 < argc))
+        {
+            maxDevices = cMax(atoi(argv[++i]), 0);
+        }
+
+        // real-time servo threads, with an optional loop rate [Hz]
+        else if (string(argv[i]) == "--realtime")
+        {
+            realtimeMode = true;
+            if ((i + 1 < argc) && (atof(argv[i + 1]) > 0.0))
+            {
+                realtimeRate = atof(argv[++i]);
+            }
+        }
+
+        // render both views in a single pass
+        else if (string(argv[i]) == "--multiview")
+        {
+            useMultiView = true;
+        }
+
+        // adaptive relief steps, with an optional GPU time target [ms]
+        else if (string(argv[i]) == "--adaptive")
+        {
+            adaptiveQuality.setEnabled(true);
+            if ((i + 1 < argc) && (atof(argv[i + 1]) > 0.0))
+            {
+                adaptiveQuality.setTargetTime(atof(argv[++i]));
+            }
+        }
+
+        // displacement map haptics from contact patches, with an optional
+        // contact model rate [Hz]
+        else if (string(argv[i]) == "--multirate")
+        {
+            useContactModel = true;
+            if ((i + 1 < argc) && (atof(argv[i + 1]) > 0.0))
+            {
+                contactModelRate = atof(argv[++i]);
+            }
+        }
+
+        // write the haptic timing histograms at exit
+        else if ((string(argv[i]) == "--timings") && (i + 1 < argc))
+        {
+            hapticTimingsFilename = argv[++i];
+        }
+
+        // record the zones of all threads to a Chrome trace file
+        else if ((string(argv[i]) == "--trace") && (i + 1 < argc))
+        {
+            traceFilename = argv[++i];
+#if defined(USE_TRACING)
+            tracer.setEnabled(true);
+#else
+            cout << "> Tracing is compiled out (NO_TRACING)" << endl;
+#endif
+        }
+
+        // initial mapping mode
+        else if ((string(argv[i]) == "--mode") && (i + 1 < argc))
+        {
+            modeM = cClamp(atoi(argv[++i]), 0, MAPPING_MODE_COUNT - 1);
+        }
+
+        // convert the displacement and normal maps to packed textures and exit
+        else if ((string(argv[i]) == "--pack-textures") && (i + 1 < argc))
+        {
+            return (packTextures(string(argv[++i]) == "r16") ? 0 : 1);
+        }
+
+        // collision tree of the plane
+        else if ((string(argv[i]) == "--collision") && (i + 1 < argc))
+        {
+            string tree = argv[++i];
+            objectCollisionTree = (tree == "wide") ? COLLISION_TREE_WIDE :
+                                  (tree == "sdf") ? COLLISION_TREE_SDF : COLLISION_TREE_AABB;
+        }
+
+        // render all mapping modes on the CPU to <prefix>_<mode>.png and
+        // <prefix>_<mode>_iterations.png, no display required
+        else if ((string(argv[i]) == "--reference") && (i + 1 < argc))
+        {
+            string prefix = argv[++i];
+            double scale = 0.05;
+            if ((i + 1 < argc) && (atof(argv[i + 1]) > 0.0))
+            {
+                scale = atof(argv[++i]);
+            }
+            return (renderReferenceImages(prefix, scale) ? 0 : 1);
+        }
+
+        // benchmark the tangent space generation on grids of 10^4 up to 10^7 triangles
+        else if (string(argv[i]) == "--bench-tangents")
+        {
+            unsigned int maxTriangles = 10000000;
+            if ((i + 1 < argc) && (atoi(argv[i + 1]) > 0))
+            {
+                maxTriangles = (unsigned int)atoi(argv[++i]);
+            }
+            benchmarkTangents(maxTriangles);
+            return 0;
+        }
+
+        // benchmark relief traversals or collision queries on the CPU, no display required
+        else if ((string(argv[i]) == "--bench-relief") ||
+                 (string(argv[i]) == "--bench-contacts") ||
+                 (string(argv[i]) == "--bench-collision") ||
+                 (string(argv[i]) == "--bench-sdf"))
+        {
+            cImagePtr image = cImage::create();
+            string filename;
+            bool fileload = assetLoader.resolvePath("toy_box_disp.png", filename) && image->loadFromFile(filename);
+            HeightPyramid pyramid;
+            if (!fileload || !buildHeightPyramid(pyramid, image))
+            {
+                cout << "Error - Displacement image failed to load correctly." << endl;
+                return 1;
+            }
+            if ((string(argv[i]) == "--bench-relief") && !isSquarePowerOfTwo(pyramid))
+            {
+                cout << "Error - Relief traversals need a square, power of two displacement image." << endl;
+                return 1;
+            }
+            if (string(argv[i]) == "--bench-relief")
+            {
+                benchmarkReliefTraversal(pyramid);
+            }
+            else if (string(argv[i]) == "--bench-contacts")
+            {
+                benchmarkContactQueries(pyramid);
+            }
+            else if (string(argv[i]) == "--bench-collision")
+            {
+                benchmarkCollisionTrees(pyramid);
+            }
+            else
+            {
+                benchmarkSignedDistance(pyramid);
+            }
+            return 0;
+        }
+    }
+
+    // the main thread renders the graphics
+    TRACE_THREAD("graphics");
+
+
+    //--------------------------------------------------------------------------
+    // OPEN GL - WINDOW DISPLAY
+    //--------------------------------------------------------------------------
+
+    if (headless)
+    {
+        // create offscreen display context
+        if (!createHeadlessContext(HEADLESS_WIDTH, HEADLESS_HEIGHT))
+        {
+            return 1;
+        }
+        width  = HEADLESS_WIDTH;
+        height = HEADLESS_HEIGHT;
+    }
+    else
+    {
+        // initialize GLFW library
+        if (!glfwInit())
+        {
+            cout << "failed initialization" << endl;
+            cSleepMs(1000);
+            return 1;
+        }
+
+        // set error callback
+        glfwSetErrorCallback(errorCallback);
+
+        // compute desired size of window
+        const GLFWvidmode* mode = glfwGetVideoMode(glfwGetPrimaryMonitor());
+        int w = 0.8 * mode->height;
+        int h = 0.5 * mode->height;
+        int x = 0.5 * (mode->width - w);
+        int y = 0.5 * (mode->height - h);
+
+        // set OpenGL version
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
+
+        // set active stereo mode
+        if (stereoMode == C_STEREO_ACTIVE)
+        {
+            glfwWindowHint(GLFW_STEREO, GL_TRUE);
+        }
+        else
+        {
+            glfwWindowHint(GLFW_STEREO, GL_FALSE);
+        }
+
+        // create display context
+        window = glfwCreateWindow(w, h, "Final Project", NULL, NULL);
+        if (!window)
+        {
+            cout << "failed to create window" << endl;
+            cSleepMs(1000);
+            glfwTerminate();
+            return 1;
+        }
+
+        // create a hidden window to compile shaders in the background
+        glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+        shaderContext = glfwCreateWindow(1, 1, "", NULL, window);
+        glfwWindowHint(GLFW_VISIBLE, GL_TRUE);
+
+        // get width and height of window
+        glfwGetWindowSize(window, &width, &height);
+
+        // set position of window
+        glfwSetWindowPos(window, x, y);
+
+        // set key callback
+        glfwSetKeyCallback(window, keyCallback);
+
+        // set resize callback
+        glfwSetWindowSizeCallback(window, windowSizeCallback);
+
+        // set mouse position callback
+        glfwSetCursorPosCallback(window, mouseMotionCallback);
+
+        // set mouse button callback
+        glfwSetMouseButtonCallback(window, mouseButtonCallback);
+
+        // set current display context
+        glfwMakeContextCurrent(window);
+
+        // sets the swap interval for the current display context
+        glfwSwapInterval(swapInterval);
+    }
+
+#ifdef GLEW_VERSION
+    // initialize GLEW library
+    if (glewInit() != GLEW_OK)
+    {
+        cout << "failed to initialize GLEW library" << endl;
+        if (headless) destroyHeadlessContext(); else glfwTerminate();
+        return 1;
+    }
+#endif
+
+    if (headless)
+    {
+        cout << "> Headless rendering on: " << (const char*)glGetString(GL_RENDERER) << endl;
+    }
+
+    // setup fenced frame submission
+    initFramePacing();
+
+
+    //--------------------------------------------------------------------------
+    // WORLD
+    //--------------------------------------------------------------------------
+    // create a new world.
+    world = new cWorld();
+
+    // set the background color of the environment
+    // the color is defined by its (R,G,B) components.
+    world->m_backgroundColor.setWhite();
+
+    //--------------------------------------------------------------------------
+    // CAMERA
+    //--------------------------------------------------------------------------
+
+    // create a camera and insert it into the virtual world
+    //camera = new cCamera(world);
+    camera = new cCamera(NULL);
+
+    cameraView1 = new cCamera(world);
+
+    world->addChild(cameraView1);
+
+    // position and orient the camera
+    cameraView1->set(cVector3d(1.43, 0.4, 0.860),    // camera position (eye)
+                    cVector3d(-0.732, -0.252, -0.63),    // lookat position (target)
+                    cVector3d(-0.602, -0.180, 0.773));   // direction of the "up" vector
+
+// set the near and far clipping planes of the camera
+// anything in front or behind these clipping planes will not be rendered
+    cameraView1->setClippingPlanes(0.01, 10.0);
+
+    // set stereo mode
+    cameraView1->setStereoMode(stereoMode);
+
+    // set stereo eye separation and focal length (applies only if stereo is enabled)
+    cameraView1->setStereoEyeSeparation(0.03);
+    cameraView1->setStereoFocalLength(3.0);
+
+    // set vertical mirrored display mode
+    cameraView1->setMirrorVertical(mirroredDisplay);
+
+    // set camera field of view 
+    cameraView1->setFieldViewAngleDeg(45);
+
+    //create camera 2
+
+    cameraView2 = new cCamera(world);
+
+    world->addChild(cameraView2);
+
+    // position and orient the camera
+    cameraView2->set(cVector3d(1.5, 0.0, -0.27),    // camera position (eye)
+                    cVector3d(0.0, 0.0, 0.0),    // lookat position (target)
+                    cVector3d(0.0, 0.0, 1.0));   // direction of the "up" vector
+
+// set the near and far clipping planes of the camera
+// anything in front or behind these clipping planes will not be rendered
+    cameraView2->setClippingPlanes(0.01, 10.0);
+
+    // set stereo mode
+    cameraView2->setStereoMode(stereoMode);
+
+    // set stereo eye separation and focal length (applies only if stereo is enabled)
+    cameraView2->setStereoEyeSeparation(0.03);
+    cameraView2->setStereoFocalLength(3.0);
+
+    // set vertical mirrored display mode
+    cameraView2->setMirrorVertical(mirroredDisplay);
+
+    // set camera field of view 
+    cameraView2->setFieldViewAngleDeg(45);
+
+
+    //--------------------------------------------------------------------------
+    // LIGHT SOURCES
+    //--------------------------------------------------------------------------
+
+    // create a light source
+    light = new cSpotLight(world);
+
+    // add light to world
+    world->addChild(light);
+
+    // enable light source
+    light->setEnabled(true);
+
+    // position the light source
+    light->setLocalPos(3.5, 2.0, 8.0);
+
+    // define the direction of the light beam
+    light->setDir(-3.5, -2.0, -8.0);
+
+    // set light cone half angle
+    light->setCutOffAngleDeg(20);
+
+
+    //--------------------------------------------------------------------------
+    // HAPTIC DEVICES / TOOLS
+    //--------------------------------------------------------------------------
+
+    // create a haptic device handler
+    handler = new cHapticDeviceHandler();
+
+    // number of devices to drive, a recording or a replay stands for a single one
+    int numDevices = (int)handler->getNumDevices();
+    if (maxDevices > 0)
+    {
+        numDevices = cMin(numDevices, maxDevices);
+    }
+    if (!replayFilename.empty() || !recordFilename.empty())
+    {
+        numDevices = 1;
+    }
+    numDevices = cClamp(numDevices, 1, MAX_HAPTIC_DEVICES);
+
+    // define the radius of the tool (sphere)
+    double toolRadius = SPHERE_RADIUS;
+
+    for (int i = 0; i < numDevices; i++)
+    {
+        // get access to the available haptic devices, or to a recording
+        cGenericHapticDevicePtr hapticDevice;
+        if (!replayFilename.empty())
+        {
+            replayDevice = shared_ptr<ReplayHapticDevice>(new ReplayHapticDevice());
+            if (!replayDevice->loadFromFile(replayFilename))
+            {
+                cout << "Error - Haptic recording " << replayFilename << " failed to load correctly." << endl;
+                return (-1);
+            }
+            hapticDevice = replayDevice;
+        }
+        else
+        {
+            handler->getDevice(hapticDevice, i);
+        }
+
+        // log everything exchanged with the device
+        if (!recordFilename.empty())
+        {
+            recordingDevice = shared_ptr<RecordingHapticDevice>(new RecordingHapticDevice(hapticDevice, recordFilename));
+            hapticDevice = recordingDevice;
+        }
+
+        // create a 3D tool for the device
+        hapticDevices.addDevice(hapticDevice, world, toolRadius);
+    }
+
+    // patches are sampled by another thread at its own pace, forces computed
+    // from them cannot be replayed bit for bit
+    if (useContactModel && (recordingDevice || replayDevice))
+    {
+        cout << "> Multirate haptics disabled while recording or replaying" << endl;
+        useContactModel = false;
+    }
+
+    // workspace and stiffness are taken from the first device
+    cGenericHapticDevicePtr hapticDevice = hapticDevices.getStation(0)->m_device;
+    cToolCursor* tool = hapticDevices.getStation(0)->m_tool;
+
+    // retrieve information about the current haptic device
+    cHapticDeviceInfo hapticDeviceInfo = hapticDevice->getSpecifications();
+
+    // create small line to illustrate the velocity of the haptic device
+    velocity = new cShapeLine(cVector3d(0, 0, 0),
+        cVector3d(0, 0, 0));
+
+    // insert line inside world
+    world->addChild(velocity);
+
+    //--------------------------------------------------------------------------
+    // LOAD TEXTURES
+    //--------------------------------------------------------------------------
+
+    // color, displacement and normal maps of the plane, texture of the cursor
+    StreamedTexture2dPtr texture = StreamedTexture2d::create();
+    StreamedTexture2dPtr texture2 = StreamedTexture2d::create();
+    StreamedNormalMapPtr normalMap = StreamedNormalMap::create();
+    StreamedTexture2dPtr texture3 = StreamedTexture2d::create();
+
+    // packed displacement and normal maps written by --pack-textures, if any
+    PackedTexture packedHeight, packedNormal;
+    string packedFilename;
+    bool usePackedHeight = assetLoader.resolvePath("toy_box_disp.ptex", packedFilename) &&
+                           packedHeight.open(packedFilename) &&
+                           texture2->uploadPacked(packedHeight);
+    bool usePackedNormal = assetLoader.resolvePath("toy_box_normal.ptex", packedFilename) &&
+                           packedNormal.open(packedFilename) &&
+                           normalMap->uploadPacked(packedNormal);
+    packedNormal.close();
+    if (usePackedNormal)
+    {
+        shaderManager.setDefines("#define PACKED_NORMAL_MAP\n");
+    }
+
+    assetLoader.requestTexture("wood.png", texture);
+    if (!usePackedHeight)
+    {
+        adaptiveDepthMap = texture2;
+        if (adaptiveQuality.getEnabled())
+        {
+            adaptiveDepthMap->setMipmapped(true);
+        }
+        assetLoader.requestTexture("toy_box_disp.png", texture2);
+    }
+    if (!usePackedNormal)
+    {
+        assetLoader.requestTexture("toy_box_normal.png", normalMap);
+    }
+    assetLoader.requestTexture("spheremap-3.jpg", texture3);
+
+    // decode in parallel and upload as they arrive
+    assetLoader.loadAll();
+    assetLoader.printTimings();
+    cout << "> Packed textures: displacement " << (usePackedHeight ? "ON" : "OFF")
+         << ", normals " << (usePackedNormal ? "ON" : "OFF") << endl;
+
+    //--------------------------------------------------------------------------
+    // CREATE OBJECT
+    //--------------------------------------------------------------------------
+
+    // read the scale factor between the physical workspace of the haptic
+    // device and the virtual workspace defined for the tool
+    double workspaceScaleFactor = tool->getWorkspaceScaleFactor();
+
+    // stiffness properties
+    double maxStiffness = hapticDeviceInfo.m_maxLinearStiffness / workspaceScaleFactor;
+
+    // create a virtual mesh
+    object = new cMesh();
+
+    // add object to world
+    world->addChild(object);
+
+    // set the position of the object at the center of the world
+    //object->setLocalPos(0.0, 0.0, -0.75);
+    object->setLocalPos(0.0, 0.0, -0.3);
+
+    // create cube
+    //cCreateBox(object, 0.8, 0.8, 0.8);
+    
+    // create plane
+    cCreatePlane(object, PLANE_SIZE, PLANE_SIZE);
+
+    // texture of the plane
+    bool fileload = assetLoader.isLoaded("wood.png");
+    if (!fileload)
+    {
+        cout << "Error - Texture image failed to load correctly." << endl;
+       // close();
+       // return (-1);
+    }
+
+    texture2->setTextureUnit(GL_TEXTURE4);
+    fileload = usePackedHeight || assetLoader.isLoaded("toy_box_disp.png");
+    if (!fileload)
+    {
+        cout << "Error - Texture2 image failed to load correctly." << endl;
+        // close();
+        // return (-1);
+    }
+
+    // build min-max pyramid of the displacement map for haptic rendering
+    if (usePackedHeight)
+    {
+        buildHeightPyramid(heightPyramid, packedHeight);
+        packedHeight.close();
+    }
+    else if (!fileload || !buildHeightPyramid(heightPyramid, texture2->m_image))
+    {
+        cout << "Error - Displacement map haptic rendering is unavailable." << endl;
+        useHeightFieldHaptics = false;
+    }
+
+
+    // apply texture to object
+    object->setTexture(texture);
+    object->setTexture2(texture2);
+    // enable texture rendering 
+    object->setUseTexture(true);
+
+    // Since we don't need to see our polygons from both sides, we enable culling.
+    object->setUseCulling(true);
+
+    // set material properties to light gray
+    object->m_material->setWhite();
+
+    // set material shininess
+    object->m_material->setShininess(80);
+
+    // compute collision detection algorithm
+    setCollisionTree(object, objectCollisionTree, toolRadius);
+
+    // tree of the same triangles for the batched queries of the multi-point tool
+    buildTriangleBVH(objectBVH, object);
+
+    // define a default stiffness for the object
+    //object->m_material->setStiffness(0.5 * maxStiffness);
+    object->m_material->setStiffness(0.5 * maxStiffness);
+
+    // define some static friction
+    object->m_material->setStaticFriction(0.0); //0.2
+
+    // define some dynamic friction
+    object->m_material->setDynamicFriction(0.0); //0.2
+
+    // define some texture rendering
+    object->m_material->setTextureLevel(1.0);
+
+    // render triangles haptically on front side only
+    object->m_material->setHapticTriangleSides(true, false);
+
+    // normal map of the plane
+    fileload = usePackedNormal || assetLoader.isLoaded("toy_box_normal.png");
+    if (!fileload)
+    {
+        cout << "Error - Texture image failed to load correctly." << endl;
+        close();
+        return (-1);
+    }
+
+    // assign normal map to object
+    object->m_normalMap = normalMap;
+
+    // compute tangent vectors
+    computeTangentsParallel(object);
+    
+
+    //--------------------------------------------------------------------------
+    // CREATE SHADERS
+    //--------------------------------------------------------------------------
+
+    // time spent compiling or loading shaders
+    cPrecisionClock shaderClock;
+    shaderClock.start(true);
+
+    // the maximum mipmap mode needs a power of two pyramid and explicit lod lookups
+    bool powerOfTwo = isSquarePowerOfTwo(heightPyramid);
+    shaderManager.setModeAvailable(3, powerOfTwo && GLEW_ARB_shader_texture_lod);
+    if ((modeM == 3) && !(powerOfTwo && GLEW_ARB_shader_texture_lod))
+    {
+        cout << "Error - Maximum mipmap relief mapping unavailable, using relief mapping." << endl;
+        modeM = 2;
+    }
+
+    // shader files of each mode
+    const char* modeShaderNames[] = { "bump", "parallaxmapping", "ReliefMapping" };
+    for (int mode = 0; mode < 3; mode++)
+    {
+        string modeMappingV = RESOURCE_PATH("../resources/shaders/" + string(modeShaderNames[mode]) + ".vert");
+        string modeMappingF = RESOURCE_PATH("../resources/shaders/" + string(modeShaderNames[mode]) + ".frag");
+#if defined(_MSVC)
+        modeMappingV = "../../../bin/resources/shaders/" + string(modeShaderNames[mode]) + ".vert";
+        modeMappingF = "../../../bin/resources/shaders/" + string(modeShaderNames[mode]) + ".frag";
+#endif
+        shaderManager.setShaderFiles(mode, modeMappingV, modeMappingF);
+    }
+
+    // maximum mipmap relief mapping, shaders are embedded above
+    shaderManager.setShaderSources(3, PYRAMID_RELIEF_VERT, PYRAMID_RELIEF_FRAG);
+
+    // adaptive relief mapping replaces the relief shader files while it is on
+    shaderManager.setAlternateSources(2, PYRAMID_RELIEF_VERT, ADAPTIVE_RELIEF_FRAG);
+    shaderManager.useAlternateSources(2, adaptiveQuality.getEnabled());
+
+    // create program shader, or load it from a previous run
+    if (!shaderManager.start(modeM, shaderContext))
+    {
+        cout << "Error - Shader files failed to load correctly." << endl;
+        close();
+        return (-1);
+    }
+    CachedShaderProgramPtr programShader = shaderManager.getProgram();
+
+    // set uniforms
+    setupMappingProgram(programShader, modeM);
+
+    // assign program shader to object
+    object->setShaderProgram(programShader);
+
+
+    //--------------------------------------------------------------------------
+   // CREATE SPHERES
+   //--------------------------------------------------------------------------
+    
+    // create a virtual mesh
+    spheres = new cMesh();
+
+    // add object to world
+    world->addChild(spheres);
+
+    hapticDevices.getStation(0)->m_cursor = spheres;
+    spheres->setLocalPos(tool->getDeviceGlobalPos());
+    spheres->setHapticEnabled(false);
+
+    cCreateSphere(spheres, toolRadius*1.01);
+    //cCreateBox(spheres, toolRadius*2, toolRadius*2, toolRadius*2);
+
+    // texture of the cursor
+    fileload = assetLoader.isLoaded("spheremap-3.jpg");
+    if (!fileload)
+    {
+        cout << "Error - Texture image failed to load correctly." << endl;
+        close();
+        return (-1);
+    }
+
+
+    // apply texture to object
+    spheres->setTexture(texture3);
+    // enable texture rendering 
+    spheres->setUseTexture(true);
+
+    // Since we don't need to see our polygons from both sides, we enable culling.
+    spheres->setUseCulling(true);
+
+    // set material properties to light gray
+    spheres->m_material->setWhite();
+
+    // set material shininess
+    spheres->m_material->setShininess(80);
+
+    // compute collision detection algorithm
+    //spheres->createAABBCollisionDetector(toolRadius);
+
+    // define a default stiffness for the object
+    //object->m_material->setStiffness(0.5 * maxStiffness);
+    spheres->m_material->setStiffness(0.8 * maxStiffness);
+
+    // define some static friction
+    spheres->m_material->setStaticFriction(0.0); //0.2
+
+    // define some dynamic friction
+    spheres->m_material->setDynamicFriction(0.0); //0.2
+
+    // define some texture rendering
+    spheres->m_material->setTextureLevel(1.0);
+
+    
+    // compute tangent vectors
+    computeTangentsParallel(spheres);
+
+    // load shader sources
+    string vertexSource2, fragmentSource2;
+    fileload = readTextFile(RESOURCE_PATH("../resources/shaders/phong.vert"), vertexSource2);
+    if (!fileload)
+{
+#if defined(_MSVC)
+        fileload = readTextFile("../../../bin/resources/shaders/phong.vert", vertexSource2);
+#endif
+    }
+    fileload = readTextFile(RESOURCE_PATH("../resources/shaders/phong.frag"), fragmentSource2);
+    if (!fileload){
+#if defined(_MSVC)
+    fileload = readTextFile("../../../bin/resources/shaders/phong.frag", fragmentSource2);
+#endif
+    }
+
+    // create program shader, or load it from a previous run
+    CachedShaderProgramPtr programShader2 = shaderCache.getProgram(vertexSource2, fragmentSource2);
+
+    spheres->setShaderProgram(programShader2);
+    // set uniforms
+    //programShader2->setUniformi("uColorMap", 0);
+    //programShader->setUniformi("uColorMap2", 4);
+    //programShader2->setUniformi("uDepthMap", 4);
+    programShader->setUniformi("uShadowMap", 0);
+    //programShader2->setUniformi("uNormalMap", 2);
+    //programShader2->setUniformf("uInvRadius", 0.0f);
+
+
+    //tool->setShaderProgram(programShader2);
+    // link program shader
+
+    // plain cursors for the other devices
+    for (int i = 1; i < hapticDevices.getNumStations(); i++)
+    {
+        HapticStation* station = hapticDevices.getStation(i);
+        station->m_cursor = new cMesh();
+        world->addChild(station->m_cursor);
+        cCreateSphere(station->m_cursor, toolRadius * 1.01);
+        station->m_cursor->setLocalPos(station->m_tool->getDeviceGlobalPos());
+        station->m_cursor->setHapticEnabled(false);
+        station->m_cursor->m_material->setBlueCornflower();
+        station->m_cursor->m_material->setShininess(80);
+    }
+
+    cout << "> Shaders: " << shaderCache.getNumLoaded() << " programs loaded from cache, "
+         << shaderCache.getNumCompiled() << " compiled in " << cStr(1e3 * shaderClock.stop(), 1) << " ms" << endl;
+
+    //--------------------------------------------------------------------------
+// FRAMEBUFFERS
+//--------------------------------------------------------------------------
+
+    // create framebuffer for view 1
+    frameBuffer1 = cFrameBuffer::create();
+    frameBuffer1->setup(cameraView1);
+
+    // create framebuffer for view 2
+    frameBuffer2 = cFrameBuffer::create();
+    frameBuffer2->setup(cameraView2);
+
+    //--------------------------------------------------------------------------
+// VIEW PANELS
+//--------------------------------------------------------------------------
+
+    // create and setup view panel 1
+    viewPanel1 = new cViewPanel(frameBuffer1);
+    camera->m_frontLayer->addChild(viewPanel1);
+
+    // create and setup view panel 2
+    viewPanel2 = new cViewPanel(frameBuffer2);
+    camera->m_frontLayer->addChild(viewPanel2);
+
+    // same views, rendered without the framebuffers
+    multiViewRenderer.setWorld(world);
+    multiViewRenderer.addView(cameraView1);
+    multiViewRenderer.addView(cameraView2);
+
+    //--------------------------------------------------------------------------
+    // WIDGETS
+    //--------------------------------------------------------------------------
+
+    // create a font
+    font = NEW_CFONTCALIBRI20();
+
+    // create a label to display the haptic and graphic rate of the simulation
+    labelRates = new cLabel(font);
+    cameraView1->m_frontLayer->addChild(labelRates);
+
+    // set font color
+    labelRates->m_fontColor.setWhite();
+
+    // create a background
+    background = new cBackground();
+    cameraView1->m_backLayer->addChild(background);
+
+    // set background properties
+    background->setCornerColors(cColorf(0.3, 0.3, 0.3),
+                                cColorf(0.3, 0.3, 0.3),
+                                cColorf(0.1, 0.1, 0.1),
+                                cColorf(0.1, 0.1, 0.1));
+    //-----------------------------------------
+    // create a label to display the haptic and graphic rate of the simulation
+    labelRates2 = new cLabel(font);
+    cameraView2->m_frontLayer->addChild(labelRates2);
+
+    // set font color
+    labelRates2->m_fontColor.setWhite();
+
+    // create a background
+    background2 = new cBackground();
+    cameraView2->m_backLayer->addChild(background2);
+
+    // set background properties
+    background2->setCornerColors(cColorf(0.3, 0.3, 0.3),
+                                cColorf(0.3, 0.3, 0.3),
+                                cColorf(0.1, 0.1, 0.1),
+                                cColorf(0.1, 0.1, 0.1));
+
+
+    //--------------------------------------------------------------------------
+    // START SIMULATION
+    //--------------------------------------------------------------------------
+
+    // the plane is static: its frame is computed once, then only read by
+    // the servo threads and the renderers
+    world->computeGlobalPositions(true);
+
+    // the graphics thread updates the frames of everything but the haptic objects
+    for (unsigned int i = 0; i < world->getNumChildren(); i++)
+    {
+        cGenericObject* child = world->getChild(i);
+        if ((child != object) && !hapticDevices.isTool(child))
+        {
+            graphicsPoseUpdater.addRoot(child);
+        }
+    }
+
+    //object->setWireMode(true);
+    //object->setShowNormals(true);
+    
+    //object->setShowTangents(true);
+    //object->setNormalsProperties(0.5, cColorf(0.1, 0.8, 0.2));
+
+    
+    heightScale = 0.0;
+    //heighC = 0.3125 * heightScale + 0.01;
+    heighC = 0.45977 * heightScale + 0.01;
+    object->heighC = heighC;
+
+    // initial parameters of the haptic thread
+    publishInputState();
+    planeState.m_globalPos = object->getGlobalPos();
+    planeState.m_globalRot = object->getGlobalRot();
+    planeState.m_stiffness = object->m_material->getStiffness();
+    planeState.m_heighC = object->heighC;
+
+    // keep every page in memory before the servo threads start
+    if (realtimeMode)
+    {
+        setupRealtimeProcess();
+    }
+
+    // create a thread per device which starts the main haptics rendering loop
+    hapticDevices.start(updateHaptics);
+
+    // create a thread which samples contact patches for the haptics loop
+    if (useContactModel)
+    {
+        startContactModel();
+    }
+
+    // setup callback when application exits
+    atexit(close);
+
+    //--------------------------------------------------------------------------
+    // MAIN GRAPHIC LOOP
+    //--------------------------------------------------------------------------
 
     // call window size callback at initialization
     windowSizeCallback(window, width, height);
 
-    // main graphic loop
-    while (!glfwWindowShouldClose(window))
+    // headless loop: render a fixed number of frames and report timings
+    if (headless)
+    {
+        vector<double> frameTimes;
+        frameTimes.reserve(headlessFrames);
+        cPrecisionClock frameClock;
+        for (int i = 0; i < headlessFrames; i++)
+        {
+            TRACE_ZONE("frame");
+            frameClock.start(true);
+
+            // render graphics
+            updateGraphics();
+
+            shaderManager.setHeightScale(heightScale);
+
+            // signal frequency counter
+            freqCounterGraphics.signal(1);
+
+            frameTimes.push_back(frameClock.stop());
+            shaderManager.recordFrameTime(1e3 * frameTimes.back(),
+                                          gpuStageTimeMs[GPU_STAGE_VIEW1] + gpuStageTimeMs[GPU_STAGE_VIEW2]);
+            adaptiveQuality.update(useTimerQueries ? gpuStageTimeMs[GPU_STAGE_VIEW1] + gpuStageTimeMs[GPU_STAGE_VIEW2] :
+                                                     1e3 * frameTimes.back());
+            adaptiveQuality.apply(shaderManager.getProgram(), shaderManager.getMode());
+        }
+
+        shaderManager.stop();
+        printFrameStats(frameTimes);
+        if (useTimerQueries)
+        {
+            for (int i = 0; i < GPU_STAGE_COUNT; i++)
+            {
+                cout << "GPU " << GPU_STAGE_NAMES[i] << ": " << cStr(gpuStageTimeMs[i], 3) << " ms" << endl;
+            }
+        }
+
+        // let a replay run to its end
+        if (replayDevice)
+        {
+            hapticDevices.waitFinished();
+            printReplayReport();
+            collectHapticTimings();
+            if (!hapticTimingsFilename.empty())
+            {
+                writeHapticTimings(hapticTimingsFilename);
+            }
+        }
+
+        // release offscreen context
+        releaseFramePacing();
+        meshBuffers.clear();
+        destroyHeadlessContext();
+
+        // exit
+        return 0;
+    }
+
+    // main graphic loop
+    cPrecisionClock frameClock;
+    frameClock.start(true);
+    while (!glfwWindowShouldClose(window))
+    {
+        TRACE_ZONE("frame");
+
+        // get width and height of window
+        glfwGetWindowSize(window, &width, &height);
+
+        // render graphics
+        updateGraphics();
+
+        // swap buffers
+        {
+            TRACE_ZONE("glfwSwapBuffers");
+            glfwSwapBuffers(window);
+        }
+
+        // process events
+        {
+            TRACE_ZONE("glfwPollEvents");
+            glfwPollEvents();
+        }
+        shaderManager.setHeightScale(heightScale);
+        //programShader2->setUniformf("heightScale", heightScale);
+
+        //print scale relieve
+        //cout << heightScale <<", "<< heighC << endl;
+
+        // signal frequency counter
+        freqCounterGraphics.signal(1);
+
+        // frame time of the current mapping mode
+        double frameMs = 1e3 * frameClock.stop();
+        shaderManager.recordFrameTime(frameMs, gpuStageTimeMs[GPU_STAGE_VIEW1] + gpuStageTimeMs[GPU_STAGE_VIEW2]);
+        frameClock.start(true);
+
+        // step budget of relief mapping for the next frame
+        adaptiveQuality.update(useTimerQueries ? gpuStageTimeMs[GPU_STAGE_VIEW1] + gpuStageTimeMs[GPU_STAGE_VIEW2] : frameMs);
+        adaptiveQuality.apply(shaderManager.getProgram(), shaderManager.getMode());
+    }
+
+    // stop watching shader files
+    shaderManager.stop();
+    shaderManager.printFrameTimes();
+    if (shaderContext)
+    {
+        glfwDestroyWindow(shaderContext);
+    }
+
+    // release fences, timer queries and mesh buffers
+    releaseFramePacing();
+    meshBuffers.clear();
+
+    // close window
+    glfwDestroyWindow(window);
+
+    // terminate GLFW library
+    glfwTerminate();
+
+    // exit
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+
+void windowSizeCallback(GLFWwindow* a_window, int a_width, int a_height)
+{
+    // update window size
+    width  = a_width;
+    height = a_height;
+
+    int halfW = width / 2;
+    int halfH = height;
+    int offset = 1;
+
+    // update display panel sizes and positions
+    viewPanel1->setLocalPos(0.0, 0.0);
+    viewPanel1->setSize(halfW, halfH);
+
+    viewPanel2->setLocalPos(halfW, 0.0);
+    viewPanel2->setSize(halfW, halfH);
+
+    // update viewports of the multi-view path
+    multiViewRenderer.setViewport(0, 0, 0, halfW, halfH);
+    multiViewRenderer.setViewport(1, halfW, 0, width - halfW, halfH);
+
+    // update frame buffer sizes
+    frameBuffer1->setSize(halfW, halfH);
+    frameBuffer2->setSize(halfW, halfH);
+}
+
+//------------------------------------------------------------------------------
+
+void errorCallback(int a_error, const char* a_description)
+{
+    cout << "Error: " << a_description << endl;
+}
+
+//------------------------------------------------------------------------------
+
+void keyCallback(GLFWwindow* a_window, int a_key, int a_scancode, int a_action, int a_mods)
+{
+    // filter calls that only include a key press
+    if ((a_action != GLFW_PRESS) && (a_action != GLFW_REPEAT))
+    {
+        return;
+    }
+
+    // option - exit
+    else if ((a_key == GLFW_KEY_ESCAPE) || (a_key == GLFW_KEY_Q))
+    {
+        glfwSetWindowShouldClose(a_window, GLFW_TRUE);
+    }
+
+    // option - toggle fullscreen
+    else if (a_key == GLFW_KEY_F)
+    {
+        // toggle state variable
+        fullscreen = !fullscreen;
+
+        // get handle to monitor
+        GLFWmonitor* monitor = glfwGetPrimaryMonitor();
+
+        // get information about monitor
+        const GLFWvidmode* mode = glfwGetVideoMode(monitor);
+
+        // set fullscreen or window mode
+        if (fullscreen)
+        {
+            glfwSetWindowMonitor(window, monitor, 0, 0, mode->width, mode->height, mode->refreshRate);
+            glfwSwapInterval(swapInterval);
+        }
+        else
+        {
+            int w = 0.8 * mode->height;
+            int h = 0.5 * mode->height;
+            int x = 0.5 * (mode->width - w);
+            int y = 0.5 * (mode->height - h);
+            glfwSetWindowMonitor(window, NULL, x, y, w, h, mode->refreshRate);
+            glfwSwapInterval(swapInterval);
+        }
+    }
+
+    // option - toggle vertical mirroring
+    else if (a_key == GLFW_KEY_M)
+    {
+        mirroredDisplay = !mirroredDisplay;
+        camera->setMirrorVertical(mirroredDisplay);
+    }
+    // option - toggle displacement map haptic rendering
+    else if (a_key == GLFW_KEY_H)
+    {
+        if (heightPyramid.m_numLevels > 0)
+        {
+            useHeightFieldHaptics = !useHeightFieldHaptics;
+            publishInputState();
+        }
+        cout << "> Displacement map haptics: " << (useHeightFieldHaptics ? "ON" : "OFF") << endl;
+    }
+    // option - toggle multi-point probe
+    else if (a_key == GLFW_KEY_P)
+    {
+        useMultiPointTool = !useMultiPointTool;
+        publishInputState();
+        cout << "> Multi-point probe: " << (useMultiPointTool ? "ON" : "OFF") << endl;
+    }
+    // option - chage Scale of height Depth
+    else if (a_key == GLFW_KEY_R)
+    {
+        if (heightScale > 0.0f)
+            heightScale -= 0.0005f;
+        else
+            heightScale = 0.0f;
+       // heighC = 0.3125 * heightScale + 0.01; 
+        heighC = 0.45977 * heightScale + 0.01;
+        publishInputState();
+    }
+    else if (a_key == GLFW_KEY_E)
+    {
+        if (heightScale < 1.0f)
+            heightScale += 0.0005f;
+        else
+            heightScale = 1.0f;
+        //heighC = 0.3125 * heightScale + 0.01;
+        heighC = 0.45977 * heightScale + 0.01;
+        publishInputState();
+    }
+    // option - chage Scale of height Depth
+    else if (a_key == GLFW_KEY_T)
+    {
+        heighC -= 0.005f;
+        publishInputState();
+    }
+    else if (a_key == GLFW_KEY_Y)
+    {
+        heighC += 0.005f;
+        publishInputState();
+    }
+    //----------------MOVE-----------------
+    else if (a_key == GLFW_KEY_W)
+    {
+        graphicsPoseUpdater.setLocalPos(cameraView1, cameraView1->getLocalPos()+cVector3d(-0.01,0.0,0.0));
+    }
+    else if (a_key == GLFW_KEY_S)
+    {
+        graphicsPoseUpdater.setLocalPos(cameraView1, cameraView1->getLocalPos() + cVector3d(0.01, 0.0, 0.0));
+    }
+    else if (a_key == GLFW_KEY_A)
+    {
+        graphicsPoseUpdater.setLocalPos(cameraView1, cameraView1->getLocalPos() + cVector3d(0.0, -0.01, 0.0));
+    }
+    else if (a_key == GLFW_KEY_D)
+    {
+        graphicsPoseUpdater.setLocalPos(cameraView1, cameraView1->getLocalPos() + cVector3d(0.0, 0.01, 0.0));
+    }
+    else if (a_key == GLFW_KEY_Z)
+    {
+        graphicsPoseUpdater.setLocalPos(cameraView1, cameraView1->getLocalPos() + cVector3d(0.0, 0.00, -0.01));
+    }
+    else if (a_key == GLFW_KEY_X)
+    {
+        graphicsPoseUpdater.setLocalPos(cameraView1, cameraView1->getLocalPos() + cVector3d(0.0, 0.0, 0.01));
+    }
+    else if (a_key == GLFW_KEY_U)
+    {
+        cout << cameraView1->getLocalPos().str(3) << endl;
+        cout << cameraView1->getLookVector().str(3) << endl;
+        cout << cameraView1->getUpVector().str(3) << endl;
+    }
+
+    // option - toggle single pass multi-view rendering
+    else if (a_key == GLFW_KEY_V)
+    {
+        useMultiView = !useMultiView;
+        cout << "> Multi-view rendering: " << (useMultiView ? "ON" : "OFF") << endl;
+    }
+    // option - toggle adaptive relief steps
+    else if (a_key == GLFW_KEY_L)
+    {
+        setAdaptiveRelief(!adaptiveQuality.getEnabled());
+        cout << "> Adaptive relief steps: " << (adaptiveQuality.getEnabled() ? "ON" : "OFF") << endl;
+    }
+    // option - toggle multirate displacement map haptics
+    else if (a_key == GLFW_KEY_C)
+    {
+        if (recordingDevice || replayDevice)
+        {
+            cout << "> Multirate haptics unavailable while recording or replaying" << endl;
+            return;
+        }
+        useContactModel = !useContactModel;
+        if (useContactModel)
+        {
+            startContactModel();
+        }
+        else
+        {
+            stopContactModel();
+        }
+        publishInputState();
+        cout << "> Multirate displacement map haptics: " << (useContactModel ? "ON" : "OFF") << endl;
+    }
+    // option - mapping mode of the plane
+    else if ((a_key >= GLFW_KEY_1) && (a_key < GLFW_KEY_1 + MAPPING_MODE_COUNT))
+    {
+        shaderManager.requestMode(a_key - GLFW_KEY_1);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void mouseButtonCallback(GLFWwindow* a_window, int a_button, int a_action, int a_mods)
+{
+    if (a_action == GLFW_PRESS)
+    {
+        // store mouse position
+        glfwGetCursorPos(window, &mouseX, &mouseY);
+
+        // variable for storing collision information
+        cCollisionRecorder recorder;
+        cCollisionSettings settings;
+        mouseState = MOUSE_SELECTION;
+        //cout << "hola" << endl;
+            
+    }
+    else
+    {
+        mouseState = MOUSE_IDLE;
+    }
+}
+
+void mouseMotionCallback(GLFWwindow* a_window, double a_posX, double a_posY)
+{
+    if (mouseState == MOUSE_SELECTION)
+    {
+        
+        double posRelX = (a_posX - (0.5 * width));
+        double posRelY = ((height - a_posY) - (0.5 * height));
+        double Xnew = mouseX - a_posX;
+        double Ynew = mouseY - a_posY;
+        //cout << Xnew << endl;
+        graphicsPoseUpdater.rotateAboutLocalAxisDeg(cameraView1, cVector3d(0.0,0.0,1.0),Xnew/100.0);
+        graphicsPoseUpdater.rotateAboutLocalAxisDeg(cameraView1, cVector3d(0.0, 1.0, 0.0), Ynew / 100.0);
+        
+        //cout << "hola" << endl;
+
+        // get the vector that goes from the camera to the selected point (mouse click)
+        /*cVector3d vCameraObject = selectedPoint - camera->getLocalPos();
+        
+        // get the vector that point in the direction of the camera. ("where the camera is looking at")
+        cVector3d vCameraLookAt = camera->getLookVector();
+
+        // compute the angle between both vectors
+        double angle = cAngle(vCameraObject, vCameraLookAt);
+
+        // compute the distance between the camera and the plane that intersects the object and 
+        // which is parallel to the camera plane
+        double distanceToObjectPlane = vCameraObject.length() * cos(angle);
+
+        // convert the pixel in mouse space into a relative position in the world
+        double factor = (distanceToObjectPlane * tan(0.5 * camera->getFieldViewAngleRad())) / (0.5 * height);
+        double posRelX = factor * (a_posX - (0.5 * width));
+        double posRelY = factor * ((height - a_posY) - (0.5 * height));
+
+        // compute the new position in world coordinates
+        cVector3d pos = camera->getLocalPos() +
+            distanceToObjectPlane * camera->getLookVector() +
+            posRelX * camera->getRightVector() +
+            posRelY * camera->getUpVector();
+
+        // compute position of object by taking in account offset
+        cVector3d posObject = pos - selectedObjectOffset;
+
+        // apply new position to object
+        selectedObject->setLocalPos(posObject);
+
+        // place cursor at the position of the mouse click
+        sphereSelect->setLocalPos(pos);*/
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void close(void)
+{
+    // stop the simulation
+    simulationRunning = false;
+
+    // wait for haptics loops to terminate and close haptic devices
+    hapticDevices.stop();
+
+    // stop the contact model thread
+    stopContactModel();
+
+    // export haptic loop timings
+    collectHapticTimings();
+    if (!hapticTimingsFilename.empty())
+    {
+        writeHapticTimings(hapticTimingsFilename);
+    }
+    if (replayDevice)
+    {
+        printReplayReport();
+    }
+
+    // timeline of all threads
+    if (tracer.getEnabled())
+    {
+        tracer.write(traceFilename);
+    }
+
+    // delete resources
+    delete contactModelThread;
+    delete world;
+    delete handler;
+}
+
+//------------------------------------------------------------------------------
+
+void updateGraphics(void)
+{
+    TRACE_ZONE("updateGraphics");
+
+    // wait until the GPU has consumed the oldest frame in flight
+    beginFrame();
+
+    // install a rebuilt or newly selected program of the plane
+    if (shaderManager.swapProgram())
+    {
+        setupMappingProgram(shaderManager.getProgram(), shaderManager.getMode());
+        object->setShaderProgram(shaderManager.getProgram());
+    }
+
+    /////////////////////////////////////////////////////////////////////
+    // UPDATE WIDGETS
+    /////////////////////////////////////////////////////////////////////
+
+    {
+        TRACE_ZONE("update labels");
+
+        // servo rate of each device
+        const HapticState& hapticState = hapticDevices.getStation(0)->m_state;
+        string hapticRates;
+        for (int i = 0; i < hapticDevices.getNumStations(); i++)
+        {
+            hapticRates += ((i > 0) ? ", " : "") + cStr(hapticDevices.getStation(i)->m_freqCounter.getFrequency(), 0);
+        }
+
+        // update haptic and graphic rate data
+        labelRates->setText(cStr(freqCounterGraphics.getFrequency(), 0) + " Hz / " +
+                            hapticRates + " Hz - " +
+                            cStr(hapticState.m_numPoseUpdates) + " nodes/tick" +
+                            (useMultiPointTool ? " - " + cStr(hapticState.m_numProbeContacts) + " contacts" : "") +
+                            (useContactModel ? " - patches " + cStr(freqCounterContactModel.getFrequency(), 0) + " Hz, " +
+                                               cStr(hapticState.m_numPatchMisses) + " misses" : "") +
+                            ((hapticDevices.getNumStations() > 1) ? " - " + cStr(hapticDevices.getNumInContact()) + "/" +
+                                                                    cStr(hapticDevices.getNumStations()) + " tools in contact" : "") +
+                            (realtimeMode ? " - " + cStr(hapticState.m_numOverruns) + " overruns" : ""));
+
+        // update position of label
+        labelRates->setLocalPos((int)(0.5 * (width - labelRates->getWidth())), 15);
+
+        // update haptic and graphic rate data
+        string gpuTimes;
+        if (useTimerQueries)
+        {
+            gpuTimes = " - GPU " + cStr(gpuStageTimeMs[GPU_STAGE_VIEW1], 2) + " / " +
+                       cStr(gpuStageTimeMs[GPU_STAGE_VIEW2], 2) + " / " +
+                       cStr(gpuStageTimeMs[GPU_STAGE_COMPOSITE], 2) + " ms";
+        }
+        labelRates2->setText(cStr(freqCounterGraphics.getFrequency(), 0) + " Hz / " +
+            hapticRates + " Hz" + gpuTimes + " - " +
+            MAPPING_MODE_NAMES[shaderManager.getMode()] +
+            (adaptiveQuality.getEnabled() ? " (" + cStr((int)(100.0 * adaptiveQuality.getBudget())) + "% steps)" : "") +
+            (useMultiView ? " - multi-view " + cStr(multiViewRenderer.getNumDraws()) + " draws, " +
+                            cStr(multiViewRenderer.getQueueStats().m_numProgramBinds) + " program / " +
+                            cStr(multiViewRenderer.getQueueStats().m_numTextureBinds) + " texture binds, " +
+                            cStr((int)(multiViewRenderer.getQueueStats().m_numBytesUploaded / 1024)) + " KB uploaded" : ""));
+
+        // update position of label
+        labelRates2->setLocalPos((int)(0.5 * (width - labelRates2->getWidth())), 15);
+    }
+
+    {
+        TRACE_ZONE("haptic states and poses");
+
+        // fetch the latest state of the haptic threads
+        hapticDevices.consumeStates();
+        collectHapticTimings();
+
+        // update position of cursor spheres and tool images from the states,
+        // never from the tool nodes the servo threads are moving
+        for (int i = 0; i < hapticDevices.getNumStations(); i++)
+        {
+            HapticStation* station = hapticDevices.getStation(i);
+            const HapticState& state = station->m_state;
+            graphicsPoseUpdater.setLocalPos(station->m_cursor, state.m_cursorPos);
+            graphicsPoseUpdater.setLocalPos(station->m_proxyImage, state.m_proxyPos);
+            graphicsPoseUpdater.setLocalPos(station->m_goalImage, state.m_devicePos);
+            station->m_lineImage->m_pointA = state.m_proxyPos;
+            station->m_lineImage->m_pointB = state.m_devicePos;
+        }
+
+        // compute global reference frames of the objects owned by the graphics thread
+        graphicsPoseUpdater.update();
+    }
+
+    // update haptic and graphic rate data
+    /*labelRatesPos->setText("Position Tool : " + hapticDevices.getStation(0)->m_state.m_devicePos.str(3));
+
+    // update position of label
+    labelRatesPos->setLocalPos((int)(0.5 * (width - labelRatesPos->getWidth())), 30);*/
+
+
+    /////////////////////////////////////////////////////////////////////
+    // RENDER SCENE
+    /////////////////////////////////////////////////////////////////////
+
+    // update shadow maps (if any)
+    //world->updateShadowMaps(false, mirroredDisplay);
+
+    // render both views
+    renderViews();
+
+    // fence the frame instead of waiting for all GL commands to complete
+    endFrame();
+}
+
+//------------------------------------------------------------------------------
+
+void updateHaptics(void* a_station)
+{
+    // device and tool of this servo thread
+    HapticStation* station = (HapticStation*)a_station;
+    cToolCursor* tool = station->m_tool;
+    TRACE_THREAD("haptics " + cStr(station->m_index));
+    if (station->m_core >= 0)
+    {
+        pinThreadToCore(station->m_core);
+    }
+
+    // fixed rate with real-time priority
+    PeriodicTimer timer;
+    if (realtimeMode)
+    {
+        setupRealtimeThread(REALTIME_PRIORITY);
+        timer.start(1.0 / realtimeRate);
+    }
+
+    // angular velocity of object
+    cVector3d angVel(0.0, 0.2, 0.3);
+
+    // reset clock
+    cPrecisionClock clock;
+    clock.reset();
+
+    // haptic state of the plane mesh (disabled when the height field renders it)
+    bool meshHapticEnabled = true;
+
+    // true while the proxy of the cursor follows the plane mesh
+    bool cursorOnMesh = true;
+
+    // plane state, modified by the first device and copied by the other ones
+    PlaneState plane = planeState;
+
+    // sphere query of the cursor of the other devices against the plane mesh
+    ContactBatch cursorQuery;
+    cursorQuery.m_numPoints = 1;
+    reserveContactBatch(objectBVH, cursorQuery);
+
+    // parameters set by the input callbacks
+    InputState input;
+    input.m_heightScale = 0.0f;
+    input.m_heighC = plane.m_heighC;
+    input.m_useHeightField = false;
+    input.m_useMultiPoint = false;
+    input.m_useContactModel = false;
+
+    // latest contact patch, and number of ticks it did not cover the tool
+    ContactPatch contactPatch;
+    contactPatch.m_valid = false;
+    contactPatch.m_time = 0;
+    unsigned int numPatchMisses = 0;
+
+    // age after which a held patch counts as a miss [ns]
+    long long maxPatchAge = (long long)(1e9 * CONTACT_PATCH_MAX_PERIODS / contactModelRate);
+
+    // contact points of the probe, in the tool frame
+    ContactBatch probe;
+    probe.m_numPoints = PROBE_POINTS_PER_SIDE * PROBE_POINTS_PER_SIDE;
+    vector<cVector3d> probeOffsets;
+    for (int j = 0; j < PROBE_POINTS_PER_SIDE; j++)
+    {
+        for (int i = 0; i < PROBE_POINTS_PER_SIDE; i++)
+        {
+            double x = PROBE_SIZE * ((double)i / (double)(PROBE_POINTS_PER_SIDE - 1) - 0.5);
+            double y = PROBE_SIZE * ((double)j / (double)(PROBE_POINTS_PER_SIDE - 1) - 0.5);
+            probeOffsets.push_back(cVector3d(x, y, 0.0));
+        }
+    }
+
+    // buffers of the probe queries, allocated here and not in the servo loop
+    reserveContactBatch(objectBVH, probe);
+    int numProbeContacts = 0;
+
+    // last computed height field contact
+    HeightFieldContact heightFieldContact;
+    heightFieldContact.m_inContact = false;
+
+    // haptic tick counter
+    unsigned int tick = 0;
+
+    // continuously running clock timing the stages of each tick
+    cPrecisionClock stageClock;
+    stageClock.start(true);
+    double lastInterval = 0.0;
+
+    // pose updates of the tool, the frame of the static plane is computed
+    // before the servo threads start
+    GlobalPoseUpdater hapticPoseUpdater;
+    hapticPoseUpdater.addRoot(tool);
+
+    // main haptic simulation loop
+    while(simulationRunning)
+    {
+        TRACE_ZONE("haptic tick");
+
+        /////////////////////////////////////////////////////////////////////
+        // SIMULATION TIME
+        /////////////////////////////////////////////////////////////////////
+
+        // stop the simulation clock
+        clock.stop();
+
+        // read the time increment in seconds
+        double timeInterval = clock.getCurrentTimeSeconds();
+
+        // restart the simulation clock
+        clock.reset();
+        clock.start();
+
+        // signal frequency counter
+        station->m_freqCounter.signal(1);
+
+        // timings of this tick
+        HapticTimingSample timing;
+        timing.m_values[HAPTIC_PERIOD] = timeInterval;
+        timing.m_values[HAPTIC_JITTER] = fabs(timeInterval - lastInterval);
+        lastInterval = timeInterval;
+        double timeStart = stageClock.getCurrentTimeSeconds();
+
+
+        /////////////////////////////////////////////////////////////////////
+        // HAPTIC FORCE COMPUTATION
+        /////////////////////////////////////////////////////////////////////
+
+        // apply parameters changed by the input callbacks, or recorded ones
+        bool inputChanged = station->m_inputChannel.consume(input);
+        if (replayDevice)
+        {
+            if (replayDevice->isFinished())
+            {
+                break;
+            }
+            replayDevice->getInputState(input);
+            inputChanged = true;
+        }
+        if (inputChanged && (station->m_index == 0))
+        {
+            // the first device writes the plane and publishes it to the other ones
+            plane.m_heighC = input.m_heighC;
+            object->heighC = plane.m_heighC;
+            for (int i = 1; i < hapticDevices.getNumStations(); i++)
+            {
+                HapticStation* other = hapticDevices.getStation(i);
+                other->m_planeChannel.getWriteBuffer() = plane;
+                other->m_planeChannel.publish();
+            }
+        }
+        else if (station->m_index > 0)
+        {
+            station->m_planeChannel.consume(plane);
+        }
+        if (recordingDevice)
+        {
+            recordingDevice->setInputState(input);
+        }
+
+        // compute global reference frames of the tool, the rest of the scene
+        // belongs to the graphics thread. The tool node itself stays in place,
+        // updateFromDevice() derives the device pose from its frame, so only
+        // the first tick recomputes it.
+        hapticPoseUpdater.resetCounter();
+        hapticPoseUpdater.update();
+
+        // update position and orientation of tool
+        double timeRead = stageClock.getCurrentTimeSeconds();
+        {
+            TRACE_ZONE("updateFromDevice");
+            tool->updateFromDevice();
+        }
+        double timeForces = stageClock.getCurrentTimeSeconds();
+
+        // the plane mesh is only rendered haptically by the cursor when neither
+        // the height field nor the probe is used. The plane is shared by all
+        // devices, the first one owns its haptic state.
+        bool meshHaptic = !input.m_useHeightField && !input.m_useMultiPoint;
+        if ((station->m_index == 0) && (meshHapticEnabled != meshHaptic))
+        {
+            meshHapticEnabled = meshHaptic;
+            object->setHapticEnabled(meshHapticEnabled);
+        }
+
+        // compute interaction forces of the cursor with the plane mesh. The
+        // height field and the probe compute their own forces, the proxy then
+        // restarts from the device when the mesh is touched again. The proxy
+        // and the collision state of the mesh belong to the first device.
+        if (meshHaptic && (station->m_index == 0))
+        {
+            TRACE_ZONE("computeInteractionForces");
+            if (!cursorOnMesh)
+            {
+                tool->m_hapticPoint->initialize(tool->getDeviceGlobalPos());
+                cursorOnMesh = true;
+            }
+            tool->computeInteractionForces();
+        }
+        else
+        {
+            tool->setDeviceGlobalForce(cVector3d(0.0, 0.0, 0.0));
+            cursorOnMesh = false;
+        }
+
+        // position of cursor sphere
+        cVector3d cursorPos = tool->getDeviceGlobalPos();
+
+        // compute interaction forces of the probe points with the plane mesh
+        numProbeContacts = 0;
+        if (input.m_useMultiPoint)
+        {
+            TRACE_ZONE("probe contacts");
+
+            // express probe points in the local frame of the plane, against
+            // the flat surface offset by heighC as for the cursor
+            cMatrix3d rot = plane.m_globalRot;
+            cMatrix3d toolRot = tool->getDeviceGlobalRot();
+            cVector3d origin = plane.m_globalPos;
+            for (int i = 0; i < probe.m_numPoints; i++)
+            {
+                cVector3d localPos = cTranspose(rot) * (cursorPos + toolRot * probeOffsets[i] - origin);
+                probe.m_x[i] = (float)localPos.x();
+                probe.m_y[i] = (float)localPos.y();
+                probe.m_z[i] = (float)(localPos.z() - plane.m_heighC);
+            }
+            if (objectWideCollision != NULL)
+            {
+                queryContactsWide(objectWideCollision->getTree(), (float)PROBE_POINT_RADIUS, probe);
+            }
+            else
+            {
+                queryContactsBatch(objectBVH, (float)PROBE_POINT_RADIUS, probe);
+            }
+
+            // penalty forces, the whole probe is as stiff as the single cursor
+            double stiffness = plane.m_stiffness / (double)probe.m_numPoints;
+            cVector3d force(0.0, 0.0, 0.0);
+            for (int i = 0; i < probe.m_numPoints; i++)
+            {
+                if (probe.m_depth[i] > 0.0f)
+                {
+                    force = force + (stiffness * probe.m_depth[i]) * cVector3d(probe.m_nx[i], probe.m_ny[i], probe.m_nz[i]);
+                    numProbeContacts++;
+                }
+            }
+            tool->addDeviceGlobalForce(rot * force);
+            heightFieldContact.m_inContact = false;
+        }
+
+        // compute interaction forces with the displacement map
+        else if (input.m_useHeightField)
+        {
+            TRACE_ZONE("height field contact");
+
+            // express tool position in the local frame of the plane
+            cMatrix3d rot = plane.m_globalRot;
+            cVector3d localPos = cTranspose(rot) * (cursorPos - plane.m_globalPos);
+
+            // a contact may only start from above the surface, never from beneath it
+            bool wasInContact = heightFieldContact.m_inContact;
+            double depthScale = PLANE_SIZE * input.m_heightScale;
+            HeightFieldContact contact;
+            if (input.m_useContactModel)
+            {
+                // center the next patch on the tool, interpolate the latest one
+                ContactPatchRequest& request = station->m_contactRequestChannel.getWriteBuffer();
+                request.m_localPos = localPos;
+                request.m_depthScale = depthScale;
+                station->m_contactRequestChannel.publish();
+                station->m_contactPatchChannel.consume(contactPatch);
+                bool patchRecent = (PeriodicTimer::now() - contactPatch.m_time <= maxPatchAge);
+                if (!evaluateContactPatch(contactPatch, localPos, SPHERE_RADIUS, depthScale, contact) || !patchRecent)
+                {
+                    // hold the last patch, the search stays out of the servo loop
+                    numPatchMisses++;
+                }
+            }
+            else
+            {
+                computeHeightFieldContact(heightPyramid, localPos, SPHERE_RADIUS, depthScale, contact);
+            }
+            if (contact.m_inContact && !wasInContact && (contact.m_lift > SPHERE_RADIUS))
+            {
+                contact.m_inContact = false;
+            }
+
+            if (contact.m_inContact)
+            {
+                // penalty force along the surface normal
+                double stiffness = plane.m_stiffness;
+                double depth = contact.m_lift * contact.m_normal.z();
+                cVector3d force = rot * (stiffness * depth * contact.m_normal);
+                tool->addDeviceGlobalForce(force);
+
+                // display cursor resting on the surface
+                cursorPos = cursorPos + rot * cVector3d(0.0, 0.0, contact.m_lift);
+            }
+            heightFieldContact = contact;
+        }
+
+        // the other devices touch the plane mesh through a sphere query of
+        // their own, against the flat surface offset by heighC
+        else if (station->m_index > 0)
+        {
+            TRACE_ZONE("cursor contact");
+
+            cVector3d localPos = cTranspose(plane.m_globalRot) * (cursorPos - plane.m_globalPos);
+            cursorQuery.m_x[0] = (float)localPos.x();
+            cursorQuery.m_y[0] = (float)localPos.y();
+            cursorQuery.m_z[0] = (float)(localPos.z() - plane.m_heighC);
+            if (objectWideCollision != NULL)
+            {
+                queryContactsWide(objectWideCollision->getTree(), (float)SPHERE_RADIUS, cursorQuery);
+            }
+            else
+            {
+                queryContactsBatch(objectBVH, (float)SPHERE_RADIUS, cursorQuery);
+            }
+            if (cursorQuery.m_depth[0] > 0.0f)
+            {
+                cVector3d normal(cursorQuery.m_nx[0], cursorQuery.m_ny[0], cursorQuery.m_nz[0]);
+                tool->addDeviceGlobalForce(plane.m_globalRot * ((plane.m_stiffness * cursorQuery.m_depth[0]) * normal));
+            }
+            heightFieldContact.m_inContact = false;
+        }
+        else
+        {
+            heightFieldContact.m_inContact = false;
+        }
+
+        // send forces to haptic device
+        double timeWrite = stageClock.getCurrentTimeSeconds();
+        {
+            TRACE_ZONE("applyToDevice");
+            tool->applyToDevice();
+        }
+        double timeEnd = stageClock.getCurrentTimeSeconds();
+
+        // queue timings of the first device, the first two ticks have no
+        // meaningful period or jitter
+        timing.m_values[HAPTIC_DEVICE_READ] = timeForces - timeRead;
+        timing.m_values[HAPTIC_FORCES] = timeWrite - timeForces;
+        timing.m_values[HAPTIC_DEVICE_WRITE] = timeEnd - timeWrite;
+        timing.m_values[HAPTIC_TICK] = timeEnd - timeStart;
+        if ((station->m_index == 0) && (tick > 1) && !hapticTimingQueue.push(timing))
+        {
+            hapticTimingDropped++;
+        }
+
+        // publish state for the graphics thread
+        HapticState& state = station->m_stateChannel.getWriteBuffer();
+        state.m_devicePos = tool->getDeviceGlobalPos();
+        state.m_deviceRot = tool->getDeviceGlobalRot();
+        state.m_proxyPos = cursorOnMesh ? tool->m_hapticPoint->getGlobalPosProxy() : cursorPos;
+        state.m_cursorPos = cursorPos;
+        state.m_force = tool->getDeviceGlobalForce();
+        state.m_inContact = heightFieldContact.m_inContact;
+        state.m_contactDepth = heightFieldContact.m_inContact ? heightFieldContact.m_lift : 0.0;
+        state.m_numPoseUpdates = hapticPoseUpdater.getNumUpdated();
+        state.m_numProbeContacts = numProbeContacts;
+        state.m_numPatchMisses = numPatchMisses;
+        state.m_numOverruns = (unsigned int)timer.getNumOverruns();
+        state.m_tick = ++tick;
+        station->m_stateChannel.publish();
+
+        // wait for the deadline of the next tick
+        if (realtimeMode)
+        {
+            TRACE_ZONE("wait for deadline");
+            timer.wait();
+        }
+
+        /////////////////////////////////////////////////////////////////////
+        // DYNAMIC SIMULATION
+        /////////////////////////////////////////////////////////////////////
+        /*
+        // some constants
+        const double INERTIA = 0.4;
+        const double MAX_ANG_VEL = 10.0;
+        const double DAMPING = 0.1;
+
+        // get position of cursor in global coordinates
+        cVector3d toolPos = tool->getDeviceGlobalPos();
+
+        // get position of object in global coordinates
+        cVector3d objectPos = object->getGlobalPos();
+
+        // compute a vector from the center of mass of the object (point of rotation) to the tool
+        cVector3d v = cSub(toolPos, objectPos);
+
+        // compute angular acceleration based on the interaction forces
+        // between the tool and the object
+        cVector3d angAcc(0,0,0);
+        if (v.length() > 0.0)
+        {
+            // get the last force applied to the cursor in global coordinates
+            // we negate the result to obtain the opposite force that is applied on the
+            // object
+            cVector3d toolForce = -tool->getDeviceGlobalForce();
+
+            // compute the effective force that contributes to rotating the object.
+            cVector3d force = toolForce - cProject(toolForce, v);
+
+            // compute the resulting torque
+            cVector3d torque = cMul(v.length(), cCross( cNormalize(v), force));
+
+            // update rotational acceleration
+            angAcc = (1.0 / INERTIA) * torque;
+        }
+
+        // update rotational velocity
+        angVel.add(timeInterval * angAcc);
+
+        // set a threshold on the rotational velocity term
+        double vel = angVel.length();
+        if (vel > MAX_ANG_VEL)
+        {
+            angVel.mul(MAX_ANG_VEL / vel);
+        }
+
+        // add some damping too
+        angVel.mul(1.0 - DAMPING * timeInterval);
+
+        // if user switch is pressed, set velocity to zero
+        if (tool->getUserSwitch(0) == 1)
+        {
+            angVel.zero();
+        }
+
+        // compute the next rotation configuration of the object
+        if (angVel.length() > C_SMALL)
+        {
+            object->rotateAboutGlobalAxisRad(cNormalize(angVel), timeInterval * angVel.length());
+        }*/
+    }
+    
+    if (realtimeMode)
+    {
+        cout << "> Haptic device " << station->m_index << ": " << tick << " ticks at " << cStr(realtimeRate, 0) << " Hz, "
+             << timer.getNumOverruns() << " overruns, max lateness " << cStr(1e6 * timer.getMaxLateness(), 0) << " us" << endl;
+    }
+
+    // exit haptics thread
+    hapticDevices.setFinished(station);
+}
+
+//------------------------------------------------------------------------------
+
+void updateContactModel(void)
+{
+    ContactPatchRequest request;
+    cPrecisionClock clock;
+    TRACE_THREAD("contact model");
+
+    // a patch is used until it is CONTACT_PATCH_MAX_PERIODS old, the tool
+    // must not leave it before
+    double halfExtent = CONTACT_MODEL_MAX_SPEED * CONTACT_PATCH_MAX_PERIODS / contactModelRate;
+
+    // sample a patch around each new tool position, at most at contactModelRate
+    while (contactModelRunning)
+    {
+        clock.start(true);
+        for (int i = 0; i < hapticDevices.getNumStations(); i++)
+        {
+            HapticStation* station = hapticDevices.getStation(i);
+            if (station->m_contactRequestChannel.consume(request))
+            {
+                TRACE_ZONE("buildContactPatch");
+                ContactPatch& patch = station->m_contactPatchChannel.getWriteBuffer();
+                buildContactPatch(heightPyramid, request.m_localPos, SPHERE_RADIUS, request.m_depthScale, halfExtent, patch);
+                patch.m_time = PeriodicTimer::now();
+                station->m_contactPatchChannel.publish();
+                freqCounterContactModel.signal(1);
+            }
+        }
+
+        // wait for the next period
+        double remaining = 1.0 / contactModelRate - clock.stop();
+        if (remaining > 0.0)
+        {
+            this_thread::sleep_for(chrono::microseconds((long long)(1e6 * remaining)));
+        }
+    }
+
+    // exit contact model thread
+    lock_guard<mutex> lock(contactModelMutex);
+    contactModelFinished = true;
+    contactModelCondition.notify_all();
+}
+
+//------------------------------------------------------------------------------
+
+void startContactModel(void)
+{
+    if (contactModelRunning)
+    {
+        return;
+    }
+
+    // the thread of a previous start has terminated
+    delete contactModelThread;
+    contactModelRunning = true;
+    contactModelFinished = false;
+    contactModelThread = new cThread();
+    contactModelThread->start(updateContactModel, CTHREAD_PRIORITY_GRAPHICS);
+}
+
+//------------------------------------------------------------------------------
+
+void stopContactModel(void)
+{
+    contactModelRunning = false;
+    unique_lock<mutex> lock(contactModelMutex);
+    while (!contactModelFinished)
+    {
+        contactModelCondition.wait(lock);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+bool pinThreadToCore(int a_core)
+{
+#if defined(_WIN32)
+    return (SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << a_core) != 0);
+#elif defined(__linux__)
+    cpu_set_t cores;
+    CPU_ZERO(&cores);
+    CPU_SET(a_core, &cores);
+    return (pthread_setaffinity_np(pthread_self(), sizeof(cores), &cores) == 0);
+#else
+    return (false);
+#endif
+}
+
+//------------------------------------------------------------------------------
+
+vector<int> getIsolatedCores(void)
+{
+    // list of ranges such as "2-3,6"
+    vector<int> cores;
+#if defined(__linux__)
+    ifstream file("/sys/devices/system/cpu/isolated");
+    string list, range;
+    getline(file, list);
+    stringstream ranges(list);
+    while (getline(ranges, range, ','))
+    {
+        if (range.empty() || !isdigit((unsigned char)range[0]))
+        {
+            continue;
+        }
+        size_t dash = range.find('-');
+        int first = atoi(range.c_str());
+        int last = (dash == string::npos) ? first : atoi(range.c_str() + dash + 1);
+        for (int core = first; core <= last; core++)
+        {
+            cores.push_back(core);
+        }
+    }
+#endif
+    return (cores);
+}
+
+//------------------------------------------------------------------------------
+
+bool setupRealtimeProcess(void)
+{
+#if defined(__linux__)
+    // page faults in a servo loop cost milliseconds
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+    {
+        cout << "> Real-time: mlockall failed (" << strerror(errno) << "), memory may be paged out" << endl;
+        return (false);
+    }
+    return (true);
+#else
+    cout << "> Real-time: scheduling is only set on Linux, the haptic loops are only rate limited" << endl;
+    return (false);
+#endif
+}
+
+//------------------------------------------------------------------------------
+
+// touch the stack pages the servo loop may use, so that it never faults on them
+static void prefaultStack(void)
+{
+    unsigned char stack[REALTIME_STACK_PREFAULT];
+    volatile unsigned char* page = stack;
+    for (int i = 0; i < REALTIME_STACK_PREFAULT; i += 4096)
+    {
+        page[i] = 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+
+bool setupRealtimeThread(int a_priority)
+{
+#if defined(__linux__)
+    sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = a_priority;
+    int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (error != 0)
+    {
+        cout << "> Real-time: SCHED_FIFO priority " << a_priority << " refused (" << strerror(error)
+             << "), needs CAP_SYS_NICE or an rtprio limit" << endl;
+    }
+    prefaultStack();
+    return (error == 0);
+#else
+    return (false);
+#endif
+}
+
+//------------------------------------------------------------------------------
+
+long long PeriodicTimer::now()
+{
+#if defined(__linux__)
+    timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return ((long long)time.tv_sec * 1000000000LL + time.tv_nsec);
+#else
+    return (chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+//------------------------------------------------------------------------------
+
+void PeriodicTimer::sleepUntil(long long a_time)
+{
+#if defined(__linux__)
+    timespec time;
+    time.tv_sec = (time_t)(a_time / 1000000000LL);
+    time.tv_nsec = (long)(a_time % 1000000000LL);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &time, NULL) == EINTR) {}
+#else
+    this_thread::sleep_until(chrono::steady_clock::time_point(
+        chrono::duration_cast<chrono::steady_clock::duration>(chrono::nanoseconds(a_time))));
+#endif
+}
+
+//------------------------------------------------------------------------------
+
+void PeriodicTimer::start(double a_period)
+{
+    m_period = (long long)(1e9 * a_period);
+    m_deadline = now() + m_period;
+    m_numOverruns = 0;
+    m_maxLateness = 0;
+}
+
+//------------------------------------------------------------------------------
+
+bool PeriodicTimer::wait()
+{
+    // the tick took longer than its period
+    long long time = now();
+    if (time > m_deadline)
+    {
+        m_numOverruns++;
+        m_maxLateness = cMax(m_maxLateness, time - m_deadline);
+        m_deadline = time + m_period;
+        return (false);
+    }
+
+    // sleep, then spin for the last part of the period
+    if (m_deadline - time > REALTIME_SPIN_NS)
+    {
+        sleepUntil(m_deadline - REALTIME_SPIN_NS);
+    }
+    while ((time = now()) < m_deadline) {}
+
+    // a sleep may still overshoot the deadline
+    m_maxLateness = cMax(m_maxLateness, time - m_deadline);
+    m_deadline += m_period;
+    return (true);
+}
+
+//------------------------------------------------------------------------------
+
+HapticDeviceManager::~HapticDeviceManager()
+{
+    for (unsigned int i = 0; i < m_stations.size(); i++)
+    {
+        delete m_stations[i]->m_thread;
+        delete m_stations[i];
+    }
+}
+
+//------------------------------------------------------------------------------
+
+HapticStation* HapticDeviceManager::addDevice(cGenericHapticDevicePtr a_device, cWorld* a_world, double a_radius)
+{
+    // if the device has a gripper, enable the gripper to simulate a user switch
+    a_device->setEnableGripperUserSwitch(true);
+
+    // create a 3D tool and add it to the world
+    cToolCursor* tool = new cToolCursor(a_world);
+    a_world->addChild(tool);
+
+    // connect the haptic device to the tool
+    tool->setHapticDevice(a_device);
+
+    // define a radius for the tool
+    tool->setRadius(a_radius);
+
+    // set color of proxy sphere
+    tool->m_hapticPoint->m_sphereProxy->m_material->setGreenLimeGreen();
+
+    // proxy and device position of finger-proxy algorithm are shown by
+    // images, the tool nodes themselves are moved by the servo thread
+    tool->setShowContactPoints(false, false);
+
+    // enable if objects in the scene are going to rotate of translate
+    // or possibly collide against the tool. If the environment
+    // is entirely static, you can set this parameter to "false"
+    tool->enableDynamicObjects(false);
+
+    // map the physical workspace of the haptic device to a larger virtual workspace.
+    tool->setWorkspaceRadius(0.9);
+
+    // start the haptic tool
+    tool->start();
+
+    HapticStation* station = new HapticStation();
+    station->m_index = (int)m_stations.size();
+    station->m_device = a_device;
+    station->m_tool = tool;
+    station->m_cursor = NULL;
+    station->m_thread = NULL;
+
+    // images of the proxy and device positions, ignored by haptic rendering
+    station->m_proxyImage = new cShapeSphere(a_radius);
+    station->m_proxyImage->m_material->setGreenLimeGreen();
+    station->m_goalImage = new cShapeSphere(a_radius);
+    station->m_goalImage->m_material = tool->m_hapticPoint->m_sphereGoal->m_material;
+    station->m_lineImage = new cShapeLine(tool->getDeviceGlobalPos(), tool->getDeviceGlobalPos());
+    station->m_lineImage->m_colorPointA.setBlack();
+    station->m_lineImage->m_colorPointB.setBlack();
+    station->m_proxyImage->setLocalPos(tool->getDeviceGlobalPos());
+    station->m_goalImage->setLocalPos(tool->getDeviceGlobalPos());
+    cGenericObject* images[3] = { station->m_proxyImage, station->m_goalImage, station->m_lineImage };
+    for (int i = 0; i < 3; i++)
+    {
+        images[i]->setHapticEnabled(false);
+        a_world->addChild(images[i]);
+    }
+    station->m_core = -1;
+    station->m_finished = true;
+
+    // state shown until the servo thread publishes one
+    HapticState& state = station->m_state;
+    state.m_devicePos = tool->getDeviceGlobalPos();
+    state.m_deviceRot = tool->getDeviceGlobalRot();
+    state.m_proxyPos = state.m_devicePos;
+    state.m_cursorPos = state.m_devicePos;
+    state.m_force.zero();
+    state.m_inContact = false;
+    state.m_contactDepth = 0.0;
+    state.m_numPoseUpdates = 0;
+    state.m_numProbeContacts = 0;
+    state.m_numPatchMisses = 0;
+    state.m_numOverruns = 0;
+    state.m_tick = 0;
+
+    m_stations.push_back(station);
+    return (station);
+}
+
+//------------------------------------------------------------------------------
+
+void HapticDeviceManager::start(void (*a_loop)(void*))
+{
+    // one core per servo thread: cores isolated from the scheduler if there
+    // are enough, else the last ones if one is left for everything else
+    int numCores = (int)thread::hardware_concurrency();
+    vector<int> isolated = getIsolatedCores();
+    bool useIsolated = (isolated.size() >= m_stations.size());
+    bool pin = useIsolated || (numCores > (int)m_stations.size());
+
+    // simulation in now running
+    simulationRunning = true;
+    for (unsigned int i = 0; i < m_stations.size(); i++)
+    {
+        HapticStation* station = m_stations[i];
+        station->m_core = useIsolated ? isolated[i] : (pin ? numCores - 1 - (int)i : -1);
+        station->m_finished = false;
+        station->m_thread = new cThread();
+        station->m_thread->start(a_loop, CTHREAD_PRIORITY_HAPTICS, station);
+        cout << "> Haptic device " << i << ": " << station->m_device->getSpecifications().m_modelName << ", servo thread "
+             << ((station->m_core >= 0) ? "on core " + cStr(station->m_core) : string("not pinned")) << endl;
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void HapticDeviceManager::stop()
+{
+    waitFinished();
+    for (unsigned int i = 0; i < m_stations.size(); i++)
+    {
+        m_stations[i]->m_tool->stop();
+    }
+}
+
+//------------------------------------------------------------------------------
+
+bool HapticDeviceManager::isFinished() const
+{
+    lock_guard<mutex> lock(m_finishedMutex);
+    for (unsigned int i = 0; i < m_stations.size(); i++)
+    {
+        if (!m_stations[i]->m_finished)
+        {
+            return (false);
+        }
+    }
+    return (true);
+}
+
+//------------------------------------------------------------------------------
+
+void HapticDeviceManager::waitFinished()
+{
+    unique_lock<mutex> lock(m_finishedMutex);
+    for (unsigned int i = 0; i < m_stations.size(); i++)
+    {
+        while (!m_stations[i]->m_finished)
+        {
+            m_finishedCondition.wait(lock);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void HapticDeviceManager::setFinished(HapticStation* a_station)
+{
+    lock_guard<mutex> lock(m_finishedMutex);
+    a_station->m_finished = true;
+    m_finishedCondition.notify_all();
+}
+
+//------------------------------------------------------------------------------
+
+bool HapticDeviceManager::isTool(cGenericObject* a_object) const
+{
+    for (unsigned int i = 0; i < m_stations.size(); i++)
+    {
+        if (m_stations[i]->m_tool == a_object)
+        {
+            return (true);
+        }
+    }
+    return (false);
+}
+
+//------------------------------------------------------------------------------
+
+void HapticDeviceManager::publishInput(const InputState& a_input)
+{
+    for (unsigned int i = 0; i < m_stations.size(); i++)
+    {
+        m_stations[i]->m_inputChannel.getWriteBuffer() = a_input;
+        m_stations[i]->m_inputChannel.publish();
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void HapticDeviceManager::consumeStates()
+{
+    for (unsigned int i = 0; i < m_stations.size(); i++)
+    {
+        m_stations[i]->m_stateChannel.consume(m_stations[i]->m_state);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+int HapticDeviceManager::getNumInContact() const
+{
+    // each state comes from its own channel, no lock is shared by the servo threads
+    int count = 0;
+    for (unsigned int i = 0; i < m_stations.size(); i++)
+    {
+        count += (m_stations[i]->m_state.m_force.length() > 0.0) ? 1 : 0;
+    }
+    return (count);
+}
+
+//------------------------------------------------------------------------------
+
+// builds all levels of a pyramid from its level 0
+static void buildHeightPyramidLevels(HeightPyramid& a_pyramid, int w, int h, const vector<float>& level)
+{
+    a_pyramid.m_width.clear();
+    a_pyramid.m_height.clear();
+    a_pyramid.m_min.clear();
+    a_pyramid.m_max.clear();
+    a_pyramid.m_width.push_back(w);
+    a_pyramid.m_height.push_back(h);
+    a_pyramid.m_min.push_back(level);
+    a_pyramid.m_max.push_back(level);
+
+    // coarser levels: min/max over the 2x2 children
+    while ((w > 1) || (h > 1))
+    {
+        int pw = (w + 1) / 2;
+        int ph = (h + 1) / 2;
+        const vector<float>& childMin = a_pyramid.m_min.back();
+        const vector<float>& childMax = a_pyramid.m_max.back();
+        vector<float> levelMin(pw * ph);
+        vector<float> levelMax(pw * ph);
+        for (int y = 0; y < ph; y++)
+        {
+            for (int x = 0; x < pw; x++)
+            {
+                int x0 = 2 * x, x1 = cMin(2 * x + 1, w - 1);
+                int y0 = 2 * y, y1 = cMin(2 * y + 1, h - 1);
+                levelMin[y * pw + x] = cMin(cMin(childMin[y0 * w + x0], childMin[y0 * w + x1]),
+                                            cMin(childMin[y1 * w + x0], childMin[y1 * w + x1]));
+                levelMax[y * pw + x] = cMax(cMax(childMax[y0 * w + x0], childMax[y0 * w + x1]),
+                                            cMax(childMax[y1 * w + x0], childMax[y1 * w + x1]));
+            }
+        }
+        w = pw;
+        h = ph;
+        a_pyramid.m_width.push_back(w);
+        a_pyramid.m_height.push_back(h);
+        a_pyramid.m_min.push_back(levelMin);
+        a_pyramid.m_max.push_back(levelMax);
+    }
+
+    a_pyramid.m_numLevels = (int)a_pyramid.m_width.size();
+}
+
+//------------------------------------------------------------------------------
+
+bool buildHeightPyramid(HeightPyramid& a_pyramid, cImagePtr a_image)
+{
+    a_pyramid.m_numLevels = 0;
+
+    if ((!a_image) || (a_image->getWidth() == 0) || (a_image->getHeight() == 0))
+    {
+        return (false);
+    }
+
+    // level 0: one depth value per texel, read from the red channel
+    int w = a_image->getWidth();
+    int h = a_image->getHeight();
+    vector<float> level(w * h);
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            cColorb color;
+            a_image->getPixelColor(x, y, color);
+            float value = (float)color.getR() / 255.0f;
+            level[y * w + x] = DISPLACEMENT_IS_DEPTH ? value : 1.0f - value;
+        }
+    }
+    buildHeightPyramidLevels(a_pyramid, w, h, level);
+    return (true);
+}
+
+//------------------------------------------------------------------------------
+
+bool buildHeightPyramid(HeightPyramid& a_pyramid, const PackedTexture& a_packed)
+{
+    a_pyramid.m_numLevels = 0;
+
+    const PackedTextureHeader& header = a_packed.getHeader();
+    if (header.m_format == PACKED_RGTC2)
+    {
+        return (false);
+    }
+
+    // level 0 of the packed file, without the filtering of 8 bit images
+    int w = header.m_width;
+    int h = header.m_height;
+    vector<float> level(w * h);
+    for (int i = 0; i < w * h; i++)
+    {
+        float value;
+        if (header.m_format == PACKED_R8)
+        {
+            value = (float)a_packed.getLevel(0)[i] / 255.0f;
+        }
+        else
+        {
+            value = (float)((const unsigned short*)a_packed.getLevel(0))[i] / 65535.0f;
+        }
+        level[i] = DISPLACEMENT_IS_DEPTH ? value : 1.0f - value;
+    }
+    buildHeightPyramidLevels(a_pyramid, w, h, level);
+    return (true);
+}
+
+//------------------------------------------------------------------------------
+
+bool isSquarePowerOfTwo(const HeightPyramid& a_pyramid)
+{
+    if (a_pyramid.m_numLevels == 0)
+    {
+        return (false);
+    }
+    int size = a_pyramid.m_width[0];
+    return ((a_pyramid.m_height[0] == size) && ((size & (size - 1)) == 0));
+}
+
+//------------------------------------------------------------------------------
+
+bool computeHeightFieldContact(const HeightPyramid& a_pyramid,
+                               const cVector3d& a_localPos,
+                               double a_radius,
+                               double a_depthScale,
+                               HeightFieldContact& a_contact)
+{
+    a_contact.m_inContact = false;
+    a_contact.m_lift = 0.0;
+    a_contact.m_point.zero();
+    a_contact.m_normal.set(0.0, 0.0, 1.0);
+    a_contact.m_numNodes = 0;
+
+    if (a_pyramid.m_numLevels == 0)
+    {
+        return (false);
+    }
+
+    // texel size in the plane frame; texel centers span the plane
+    const int w0 = a_pyramid.m_width[0];
+    const int h0 = a_pyramid.m_height[0];
+    const double texelX = PLANE_SIZE / (double)w0;
+    const double texelY = PLANE_SIZE / (double)h0;
+    const double originX = -0.5 * PLANE_SIZE + 0.5 * texelX;
+    const double originY = -0.5 * PLANE_SIZE + 0.5 * texelY;
+    const double r2 = a_radius * a_radius;
+
+    // best lift found so far; nodes that cannot raise the sphere higher are pruned
+    double bestLift = 0.0;
+    int bestX = -1, bestY = -1;
+
+    // depth-first branch and bound, children visited in order of decreasing bound
+    struct Node { int level, x, y; double bound; };
+    Node stack[4 * 32];
+    int stackSize = 0;
+    Node root = { a_pyramid.m_numLevels - 1, 0, 0, C_LARGE };
+    stack[stackSize++] = root;
+
+    while (stackSize > 0)
+    {
+        Node node = stack[--stackSize];
+        if (node.bound <= bestLift)
+        {
+            continue;
+        }
+        a_contact.m_numNodes++;
+
+        // leaf: exact lift for this texel
+        if (node.level == 0)
+        {
+            double px = originX + node.x * texelX;
+            double py = originY + node.y * texelY;
+            double dx = px - a_localPos.x();
+            double dy = py - a_localPos.y();
+            double d2 = dx * dx + dy * dy;
+            if (d2 < r2)
+            {
+                double pz = -a_depthScale * a_pyramid.m_min[0][node.y * w0 + node.x];
+                double lift = pz + sqrt(r2 - d2) - a_localPos.z();
+                if (lift > bestLift)
+                {
+                    bestLift = lift;
+                    bestX = node.x;
+                    bestY = node.y;
+                }
+            }
+            continue;
+        }
+
+        // expand children
+        int level = node.level - 1;
+        int cw = a_pyramid.m_width[level];
+        int ch = a_pyramid.m_height[level];
+        const vector<float>& levelMin = a_pyramid.m_min[level];
+        Node children[4];
+        int numChildren = 0;
+        for (int j = 0; j < 2; j++)
+        {
+            int cy = 2 * node.y + j;
+            if (cy >= ch) continue;
+            for (int i = 0; i < 2; i++)
+            {
+                int cx = 2 * node.x + i;
+                if (cx >= cw) continue;
+
+                // texel center extent covered by the child
+                int tx0 = cx << level;
+                int ty0 = cy << level;
+                int tx1 = cMin(((cx + 1) << level), w0) - 1;
+                int ty1 = cMin(((cy + 1) << level), h0) - 1;
+                double minX = originX + tx0 * texelX;
+                double maxX = originX + tx1 * texelX;
+                double minY = originY + ty0 * texelY;
+                double maxY = originY + ty1 * texelY;
+
+                // closest horizontal distance from sphere center to the node
+                double dx = cMax(cMax(minX - a_localPos.x(), a_localPos.x() - maxX), 0.0);
+                double dy = cMax(cMax(minY - a_localPos.y(), a_localPos.y() - maxY), 0.0);
+                double d2 = dx * dx + dy * dy;
+                if (d2 >= r2) continue;
+
+                // highest surface point of the node bounds the lift
+                double top = -a_depthScale * levelMin[cy * cw + cx];
+                double bound = top + sqrt(r2 - d2) - a_localPos.z();
+                if (bound <= bestLift) continue;
+
+                Node child = { level, cx, cy, bound };
+                children[numChildren++] = child;
+            }
+        }
+
+        // push lowest bound first so the most promising child is popped next
+        for (int i = 1; i < numChildren; i++)
+        {
+            Node n = children[i];
+            int k = i - 1;
+            while ((k >= 0) && (children[k].bound > n.bound))
+            {
+                children[k + 1] = children[k];
+                k--;
+            }
+            children[k + 1] = n;
+        }
+        for (int i = 0; i < numChildren; i++)
+        {
+            stack[stackSize++] = children[i];
+        }
+    }
+
+    if (bestX < 0)
+    {
+        return (false);
+    }
+
+    // contact point and normal of the lifted sphere
+    a_contact.m_inContact = true;
+    a_contact.m_lift = bestLift;
+    a_contact.m_point.set(originX + bestX * texelX,
+                          originY + bestY * texelY,
+                          -a_depthScale * a_pyramid.m_min[0][bestY * w0 + bestX]);
+    cVector3d center = a_localPos + cVector3d(0.0, 0.0, bestLift);
+    a_contact.m_normal = center - a_contact.m_point;
+    if (a_contact.m_normal.length() > C_SMALL)
+    {
+        a_contact.m_normal.normalize();
+    }
+    else
+    {
+        a_contact.m_normal.set(0.0, 0.0, 1.0);
+    }
+
+    return (true);
+}
+
+//------------------------------------------------------------------------------
+
+void buildContactPatch(const HeightPyramid& a_pyramid,
+                       const cVector3d& a_localPos,
+                       double a_radius,
+                       double a_depthScale,
+                       double a_halfExtent,
+                       ContactPatch& a_patch)
+{
+    a_patch.m_valid = false;
+    if (a_pyramid.m_numLevels == 0)
+    {
+        return;
+    }
+
+    // nodes at least one texel apart, centered on the tool
+    const int n = CONTACT_PATCH_NODES;
+    a_patch.m_spacing = cMax(PLANE_SIZE / (double)a_pyramid.m_width[0], 2.0 * a_halfExtent / (double)(n - 1));
+    a_patch.m_originX = a_localPos.x() - 0.5 * (n - 1) * a_patch.m_spacing;
+    a_patch.m_originY = a_localPos.y() - 0.5 * (n - 1) * a_patch.m_spacing;
+    a_patch.m_depthScale = a_depthScale;
+
+    // a sphere below the deepest point of the surface is always lifted onto it,
+    // which gives its rest height whatever the current tool height
+    double below = -a_depthScale - 2.0 * a_radius;
+    for (int j = 0; j < n; j++)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            int k = j * n + i;
+            cVector3d pos(a_patch.m_originX + i * a_patch.m_spacing, a_patch.m_originY + j * a_patch.m_spacing, below);
+            HeightFieldContact contact;
+            computeHeightFieldContact(a_pyramid, pos, a_radius, a_depthScale, contact);
+            a_patch.m_height[k] = contact.m_inContact ? (float)(below + contact.m_lift) : (float)-C_LARGE;
+            a_patch.m_normal[3 * k] = (float)contact.m_normal.x();
+            a_patch.m_normal[3 * k + 1] = (float)contact.m_normal.y();
+            a_patch.m_normal[3 * k + 2] = (float)contact.m_normal.z();
+        }
+    }
+    a_patch.m_valid = true;
+}
+
+//------------------------------------------------------------------------------
+
+bool evaluateContactPatch(const ContactPatch& a_patch,
+                          const cVector3d& a_localPos,
+                          double a_radius,
+                          double a_depthScale,
+                          HeightFieldContact& a_contact)
+{
+    a_contact.m_inContact = false;
+    a_contact.m_lift = 0.0;
+    a_contact.m_point.zero();
+    a_contact.m_normal.set(0.0, 0.0, 1.0);
+    a_contact.m_numNodes = 0;
+
+    // the patch should have been sampled around the tool with the current
+    // depth scale, otherwise its nearest nodes are used
+    const int n = CONTACT_PATCH_NODES;
+    if (!a_patch.m_valid)
+    {
+        return (false);
+    }
+    double u = (a_localPos.x() - a_patch.m_originX) / a_patch.m_spacing;
+    double v = (a_localPos.y() - a_patch.m_originY) / a_patch.m_spacing;
+    bool covered = (a_patch.m_depthScale == a_depthScale) && (u >= 0.0) && (v >= 0.0) && (u < n - 1) && (v < n - 1);
+    u = cClamp(u, 0.0, (double)(n - 1));
+    v = cClamp(v, 0.0, (double)(n - 1));
+
+    // no contact if the sphere cannot touch the plane at one of the corners
+    int i = cMin((int)u, n - 2);
+    int j = cMin((int)v, n - 2);
+    double fu = u - i;
+    double fv = v - j;
+    int corners[4] = { j * n + i, j * n + i + 1, (j + 1) * n + i, (j + 1) * n + i + 1 };
+    double weights[4] = { (1.0 - fu) * (1.0 - fv), fu * (1.0 - fv), (1.0 - fu) * fv, fu * fv };
+    double height = 0.0;
+    cVector3d normal(0.0, 0.0, 0.0);
+    for (int k = 0; k < 4; k++)
+    {
+        int c = corners[k];
+        if (a_patch.m_height[c] <= -0.5 * C_LARGE)
+        {
+            return (covered);
+        }
+        height += weights[k] * a_patch.m_height[c];
+        normal = normal + weights[k] * cVector3d(a_patch.m_normal[3 * c], a_patch.m_normal[3 * c + 1], a_patch.m_normal[3 * c + 2]);
+    }
+
+    // bilinear rest height and normal of the sphere
+    double lift = height - a_localPos.z();
+    if (lift <= 0.0)
+    {
+        return (covered);
+    }
+    a_contact.m_inContact = true;
+    a_contact.m_lift = lift;
+    if (normal.length() > C_SMALL)
+    {
+        a_contact.m_normal = cNormalize(normal);
+    }
+    a_contact.m_point = cVector3d(a_localPos.x(), a_localPos.y(), height) - a_radius * a_contact.m_normal;
+    return (covered);
+}
+
+//------------------------------------------------------------------------------
+
+GLuint createHeightPyramidTexture(const HeightPyramid& a_pyramid)
+{
+    // other sizes would give an incomplete mipmap chain
+    if (!isSquarePowerOfTwo(a_pyramid))
+    {
+        cout << "Error - The depth pyramid texture needs a square, power of two displacement image." << endl;
+        return (0);
+    }
+
+    GLuint textureId = 0;
+    glGenTextures(1, &textureId);
+
+    // the texture stays bound to its own unit, CHAI3D does not use it
+    glActiveTexture(GL_TEXTURE0 + PYRAMID_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_2D, textureId);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (int level = 0; level < a_pyramid.m_numLevels; level++)
+    {
+        int w = a_pyramid.m_width[level];
+        int h = a_pyramid.m_height[level];
+        vector<GLubyte> data(w * h);
+        for (int i = 0; i < w * h; i++)
+        {
+            data[i] = (GLubyte)(255.0f * a_pyramid.m_min[level][i] + 0.5f);
+        }
+        glTexImage2D(GL_TEXTURE_2D, level, GL_LUMINANCE8, w, h, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, &data[0]);
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, a_pyramid.m_numLevels - 1);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glActiveTexture(GL_TEXTURE0);
+
+    return (textureId);
+}
+
+//------------------------------------------------------------------------------
+
+// min depth of the pyramid node containing (u,v), clamped to the edges
+static inline double samplePyramidDepth(const HeightPyramid& a_pyramid, int a_level, double a_u, double a_v)
+{
+    int w = a_pyramid.m_width[a_level];
+    int h = a_pyramid.m_height[a_level];
+    int x = cClamp((int)floor(a_u * w), 0, w - 1);
+    int y = cClamp((int)floor(a_v * h), 0, h - 1);
+    return (a_pyramid.m_min[a_level][y * w + x]);
+}
+
+//------------------------------------------------------------------------------
+
+int traceHeightPyramid(const HeightPyramid& a_pyramid,
+                       double a_u, double a_v,
+                       double a_dirU, double a_dirV,
+                       int a_maxIterations,
+                       double& a_depth)
+{
+    // same traversal as PYRAMID_RELIEF_FRAG, cells are 2^level texels wide.
+    // The current cell is tracked explicitly so that boundary crossings never
+    // depend on rounding the ray position.
+    const double size = a_pyramid.m_width[0];
+    const double stepU = (a_dirU >= 0.0) ? 1.0 : -1.0;
+    const double stepV = (a_dirV >= 0.0) ? 1.0 : -1.0;
+    const double signU = cMax(stepU, 0.0);
+    const double signV = cMax(stepV, 0.0);
+    const double invU = (fabs(a_dirU) > 1e-8) ? 1.0 / a_dirU : 1e8;
+    const double invV = (fabs(a_dirV) > 1e-8) ? 1.0 / a_dirV : 1e8;
+    const int topLevel = a_pyramid.m_numLevels - 1;
+
+    int level = topLevel;
+    double cells = size / (double)(1 << level);
+    double cellU = floor(a_u * cells);
+    double cellV = floor(a_v * cells);
+    double t = 0.0;
+    int iterations = 0;
+    while ((level >= 0) && (iterations < a_maxIterations) && (t < 1.0))
+    {
+        iterations++;
+        double d = samplePyramidDepth(a_pyramid, level, (cellU + 0.5) / cells, (cellV + 0.5) / cells);
+        bool descend = true;
+        if (t < d)
+        {
+            double tU = ((cellU + signU) / cells - a_u) * invU;
+            double tV = ((cellV + signV) / cells - a_v) * invV;
+            double tExit = cMin(tU, tV);
+            if (d <= tExit)
+            {
+                // the ray reaches the top of the node inside the cell
+                t = d;
+            }
+            else
+            {
+                // the ray leaves the cell above the node, move to its neighbor
+                // and go up a level if the neighbor belongs to another parent
+                t = tExit;
+                double parentU = floor(0.5 * cellU);
+                double parentV = floor(0.5 * cellV);
+                if (tU <= tExit) cellU += stepU;
+                if (tV <= tExit) cellV += stepV;
+                if ((level < topLevel) &&
+                    ((floor(0.5 * cellU) != parentU) || (floor(0.5 * cellV) != parentV)))
+                {
+                    level++;
+                    cells *= 0.5;
+                    cellU = floor(0.5 * cellU);
+                    cellV = floor(0.5 * cellV);
+                }
+                descend = false;
+            }
+        }
+        if (descend)
+        {
+            // refine into the child containing the ray
+            level--;
+            cells *= 2.0;
+            cellU = cClamp(floor((a_u + t * a_dirU) * cells), 2.0 * cellU, 2.0 * cellU + 1.0);
+            cellV = cClamp(floor((a_v + t * a_dirV) * cells), 2.0 * cellV, 2.0 * cellV + 1.0);
+        }
+    }
+
+    a_depth = cMin(t, 1.0);
+    return (iterations);
+}
+
+//------------------------------------------------------------------------------
+
+int traceReliefLinearBinary(const HeightPyramid& a_pyramid,
+                            double a_u, double a_v,
+                            double a_dirU, double a_dirV,
+                            int a_numLinearSteps,
+                            int a_numBinarySteps,
+                            double& a_depth)
+{
+    int iterations = 0;
+
+    // linear search for the first sample below the surface
+    double step = 1.0 / (double)a_numLinearSteps;
+    double t = 0.0;
+    for (int i = 0; i < a_numLinearSteps; i++)
+    {
+        iterations++;
+        if (t >= samplePyramidDepth(a_pyramid, 0, a_u + t * a_dirU, a_v + t * a_dirV))
+        {
+            break;
+        }
+        t += step;
+    }
+
+    // binary refinement between the last two samples
+    double t0 = cMax(t - step, 0.0);
+    double t1 = cMin(t, 1.0);
+    for (int i = 0; i < a_numBinarySteps; i++)
+    {
+        iterations++;
+        double tm = 0.5 * (t0 + t1);
+        if (tm >= samplePyramidDepth(a_pyramid, 0, a_u + tm * a_dirU, a_v + tm * a_dirV))
+        {
+            t1 = tm;
+        }
+        else
+        {
+            t0 = tm;
+        }
+    }
+
+    a_depth = t1;
+    return (iterations);
+}
+
+//------------------------------------------------------------------------------
+
+double traceHeightFieldExact(const HeightPyramid& a_pyramid,
+                             double a_u, double a_v,
+                             double a_dirU, double a_dirV)
+{
+    // walk the texels crossed by the ray until one is entered below its depth
+    const int w = a_pyramid.m_width[0];
+    const int h = a_pyramid.m_height[0];
+    const double invU = (fabs(a_dirU) > 1e-12) ? 1.0 / a_dirU : 1e12;
+    const double invV = (fabs(a_dirV) > 1e-12) ? 1.0 / a_dirV : 1e12;
+
+    double x = floor(a_u * w);
+    double y = floor(a_v * h);
+    int stepX = (a_dirU >= 0.0) ? 1 : -1;
+    int stepY = (a_dirV >= 0.0) ? 1 : -1;
+    double tEnter = 0.0;
+    while (tEnter < 1.0)
+    {
+        double tExitU = ((x + (stepX > 0 ? 1.0 : 0.0)) / w - a_u) * invU;
+        double tExitV = ((y + (stepY > 0 ? 1.0 : 0.0)) / h - a_v) * invV;
+        double tExit = cMin(tExitU, tExitV);
+        double d = samplePyramidDepth(a_pyramid, 0, (x + 0.5) / w, (y + 0.5) / h);
+        if (d <= tExit)
+        {
+            return (cMin(cMax(d, tEnter), 1.0));
+        }
+        tEnter = tExit;
+        if (tExitU < tExitV) x += stepX; else y += stepY;
+    }
+
+    return (1.0);
+}
+
+//------------------------------------------------------------------------------
+
+void benchmarkReliefTraversal(const HeightPyramid& a_pyramid)
+{
+    const int NUM_RAYS = 100000;
+    const double scales[] = { 0.02, 0.05, 0.1, 0.2 };
+    const double grazing[] = { 0.9, 0.5, 0.2 };
+
+    cout << "Relief traversal benchmark (" << a_pyramid.m_width[0] << "x" << a_pyramid.m_height[0]
+         << ", " << NUM_RAYS << " rays per row)" << endl;
+    cout << "scale, view z, method, mean iterations, max iterations, mean error, max error, ns/ray" << endl;
+
+    srand(1);
+    for (unsigned int s = 0; s < sizeof(scales) / sizeof(scales[0]); s++)
+    {
+        for (unsigned int g = 0; g < sizeof(grazing) / sizeof(grazing[0]); g++)
+        {
+            // random rays with a fixed tangent space view elevation
+            vector<double> u(NUM_RAYS), v(NUM_RAYS), du(NUM_RAYS), dv(NUM_RAYS), exact(NUM_RAYS);
+            for (int i = 0; i < NUM_RAYS; i++)
+            {
+                double angle = 2.0 * C_PI * (double)rand() / (double)RAND_MAX;
+                double vz = grazing[g];
+                double vxy = sqrt(1.0 - vz * vz);
+                u[i] = (double)rand() / (double)RAND_MAX;
+                v[i] = (double)rand() / (double)RAND_MAX;
+                du[i] = -vxy * cos(angle) / vz * scales[s];
+                dv[i] = -vxy * sin(angle) / vz * scales[s];
+                exact[i] = traceHeightFieldExact(a_pyramid, u[i], v[i], du[i], dv[i]);
+            }
+
+            for (int method = 0; method < 2; method++)
+            {
+                long long sumIterations = 0;
+                int maxIterations = 0;
+                double sumError = 0.0, maxError = 0.0;
+                cPrecisionClock clock;
+                clock.start(true);
+                for (int i = 0; i < NUM_RAYS; i++)
+                {
+                    double depth;
+                    int iterations = (method == 0) ?
+                        traceReliefLinearBinary(a_pyramid, u[i], v[i], du[i], dv[i], 32, 8, depth) :
+                        traceHeightPyramid(a_pyramid, u[i], v[i], du[i], dv[i], PYRAMID_MAX_ITERATIONS, depth);
+                    double error = fabs(depth - exact[i]);
+                    sumIterations += iterations;
+                    maxIterations = cMax(maxIterations, iterations);
+                    sumError += error;
+                    maxError = cMax(maxError, error);
+                }
+                double elapsed = clock.stop();
+
+                cout << scales[s] << ", " << grazing[g] << ", "
+                     << ((method == 0) ? "linear+binary" : "max mipmap") << ", "
+                     << cStr((double)sumIterations / NUM_RAYS, 2) << ", " << maxIterations << ", "
+                     << cStr(sumError / NUM_RAYS, 5) << ", " << cStr(maxError, 5) << ", "
+                     << cStr(1e9 * elapsed / NUM_RAYS, 1) << endl;
+            }
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+
+#if defined(USE_OSMESA)
+// offscreen context and color buffer used in headless mode
+OSMesaContext headlessContext = NULL;
+vector<GLubyte> headlessBuffer;
+#endif
+
+//------------------------------------------------------------------------------
+
+bool createHeadlessContext(int a_width, int a_height)
+{
+#if defined(USE_OSMESA)
+    // software context (llvmpipe) rendering into client memory
+    headlessContext = OSMesaCreateContextExt(OSMESA_RGBA, 24, 8, 0, NULL);
+    if (!headlessContext)
+    {
+        cout << "failed to create offscreen context" << endl;
+        return (false);
+    }
+
+    headlessBuffer.resize(4 * a_width * a_height);
+    if (!OSMesaMakeCurrent(headlessContext, &headlessBuffer[0], GL_UNSIGNED_BYTE, a_width, a_height))
+    {
+        cout << "failed to activate offscreen context" << endl;
+        OSMesaDestroyContext(headlessContext);
+        headlessContext = NULL;
+        return (false);
+    }
+
+    return (true);
+#else
+    (void)a_width;
+    (void)a_height;
+    cout << "headless mode requires a build with USE_OSMESA defined" << endl;
+    return (false);
+#endif
+}
+
+//------------------------------------------------------------------------------
+
+void destroyHeadlessContext(void)
+{
+#if defined(USE_OSMESA)
+    if (headlessContext)
+    {
+        OSMesaDestroyContext(headlessContext);
+        headlessContext = NULL;
+    }
+    headlessBuffer.clear();
+#endif
+}
+
+//------------------------------------------------------------------------------
+
+void printFrameStats(vector<double>& a_frameTimes)
+{
+    if (a_frameTimes.empty())
+    {
+        return;
+    }
+
+    double total = 0.0;
+    for (unsigned int i = 0; i < a_frameTimes.size(); i++)
+    {
+        total += a_frameTimes[i];
+    }
+    sort(a_frameTimes.begin(), a_frameTimes.end());
+
+    int n = (int)a_frameTimes.size();
+    double mean = total / n;
+    cout << "Frames:    " << n << endl;
+    cout << "Total:     " << cStr(total, 3) << " s" << endl;
+    cout << "Mean:      " << cStr(1000.0 * mean, 3) << " ms (" << cStr(1.0 / mean, 1) << " Hz)" << endl;
+    cout << "Min:       " << cStr(1000.0 * a_frameTimes[0], 3) << " ms" << endl;
+    cout << "Median:    " << cStr(1000.0 * a_frameTimes[n / 2], 3) << " ms" << endl;
+    cout << "95th:      " << cStr(1000.0 * a_frameTimes[(95 * (n - 1)) / 100], 3) << " ms" << endl;
+    cout << "99th:      " << cStr(1000.0 * a_frameTimes[(99 * (n - 1)) / 100], 3) << " ms" << endl;
+    cout << "Max:       " << cStr(1000.0 * a_frameTimes[n - 1], 3) << " ms" << endl;
+}
+
+//------------------------------------------------------------------------------
+
+void initFramePacing(void)
+{
+    useFrameFences = (GLEW_ARB_sync != 0);
+    useTimerQueries = (GLEW_ARB_timer_query != 0);
+
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+    {
+        frameFences[i] = 0;
+        frameQueriesIssued[i] = false;
+        if (useTimerQueries)
+        {
+            glGenQueries(GPU_STAGE_COUNT, frameQueries[i]);
+        }
+    }
+    for (int i = 0; i < GPU_STAGE_COUNT; i++)
+    {
+        gpuStageTimeMs[i] = 0.0;
+    }
+    frameSlot = 0;
+}
+
+//------------------------------------------------------------------------------
+
+void beginFrame(void)
+{
+    TRACE_ZONE("beginFrame");
+
+    // wait for the fence of the frame that last used this slot
+    GLsync fence = frameFences[frameSlot];
+    if (fence)
+    {
+        GLenum result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+        while (result == GL_TIMEOUT_EXPIRED)
+        {
+            result = glClientWaitSync(fence, 0, 1000000000);
+        }
+        glDeleteSync(fence);
+        frameFences[frameSlot] = 0;
+    }
+
+    // the frame is complete, its timer results are available without stalling
+    if (frameQueriesIssued[frameSlot])
+    {
+        for (int i = 0; i < GPU_STAGE_COUNT; i++)
+        {
+            GLuint64 elapsed = 0;
+            glGetQueryObjectui64v(frameQueries[frameSlot][i], GL_QUERY_RESULT, &elapsed);
+            gpuStageTimeMs[i] = 0.95 * gpuStageTimeMs[i] + 0.05 * (1e-6 * (double)elapsed);
+        }
+        frameQueriesIssued[frameSlot] = false;
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void beginGpuStage(GpuStage a_stage)
+{
+    if (useTimerQueries)
+    {
+        glBeginQuery(GL_TIME_ELAPSED, frameQueries[frameSlot][a_stage]);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void endGpuStage(void)
+{
+    if (useTimerQueries)
+    {
+        glEndQuery(GL_TIME_ELAPSED);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void endFrame(void)
+{
+    frameQueriesIssued[frameSlot] = useTimerQueries;
+
+    if (useFrameFences)
+    {
+        frameFences[frameSlot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        frameSlot = (frameSlot + 1) % MAX_FRAMES_IN_FLIGHT;
+    }
+    else
+    {
+        // no fences: wait until all GL commands are completed
+        TRACE_ZONE("glFinish");
+        glFinish();
+    }
+
+#if defined(_DEBUG)
+    // check for any OpenGL errors (forces a round trip to the driver)
+    GLenum err = glGetError();
+    if (err != GL_NO_ERROR) cout << "Error: " << gluErrorString(err) << endl;
+#endif
+}
+
+//------------------------------------------------------------------------------
+
+void releaseFramePacing(void)
+{
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+    {
+        if (frameFences[i])
+        {
+            glDeleteSync(frameFences[i]);
+            frameFences[i] = 0;
+        }
+        if (useTimerQueries)
+        {
+            glDeleteQueries(GPU_STAGE_COUNT, frameQueries[i]);
+        }
+        frameQueriesIssued[i] = false;
+    }
+    useTimerQueries = false;
+    useFrameFences = false;
+}
+
+//------------------------------------------------------------------------------
+
+void publishInputState(void)
+{
+    InputState state;
+    state.m_heightScale = heightScale;
+    state.m_heighC = heighC;
+    state.m_useHeightField = useHeightFieldHaptics;
+    state.m_useMultiPoint = useMultiPointTool;
+    state.m_useContactModel = useContactModel;
+    hapticDevices.publishInput(state);
+}
+
+//------------------------------------------------------------------------------
+
+void GlobalPoseUpdater::setLocalPos(cGenericObject* a_object, const cVector3d& a_pos)
+{
+    if (a_object->getLocalPos().equals(a_pos))
+    {
+        return;
+    }
+    a_object->setLocalPos(a_pos);
+    markDirty(a_object);
+}
+
+//------------------------------------------------------------------------------
+
+void GlobalPoseUpdater::rotateAboutLocalAxisDeg(cGenericObject* a_object, const cVector3d& a_axis, double a_angle)
+{
+    if (a_angle == 0.0)
+    {
+        return;
+    }
+    a_object->rotateAboutLocalAxisDeg(a_axis, a_angle);
+    markDirty(a_object);
+}
+
+//------------------------------------------------------------------------------
+
+void GlobalPoseUpdater::markDirty(cGenericObject* a_object)
+{
+    if (contains(m_dirty, a_object))
+    {
+        return;
+    }
+    m_dirty.push_back(a_object);
+
+    // flag the path from the root down to the object
+    cGenericObject* parent = a_object->getParent();
+    while ((parent != NULL) && !contains(m_onPath, parent))
+    {
+        m_onPath.push_back(parent);
+        parent = parent->getParent();
+    }
+}
+
+//------------------------------------------------------------------------------
+
+int GlobalPoseUpdater::update()
+{
+    int numUpdated = 0;
+    for (unsigned int i = 0; i < m_roots.size(); i++)
+    {
+        cGenericObject* root = m_roots[i];
+
+        // frame of the parent of the root, which is not updated here
+        cVector3d parentPos(0.0, 0.0, 0.0);
+        cMatrix3d parentRot;
+        parentRot.identity();
+        cGenericObject* parent = root->getParent();
+        if (parent != NULL)
+        {
+            parentPos = parent->getGlobalPos();
+            parentRot = parent->getGlobalRot();
+        }
+
+        if (m_updateAll)
+        {
+            root->computeGlobalPositions(true, parentPos, parentRot);
+            numUpdated += getNumNodes(root);
+        }
+        else if (!m_dirty.empty())
+        {
+            numUpdated += updateNode(root, parentPos, parentRot);
+        }
+    }
+
+    m_updateAll = false;
+    m_dirty.clear();
+    m_onPath.clear();
+
+    m_numUpdated += numUpdated;
+    return (numUpdated);
+}
+
+//------------------------------------------------------------------------------
+
+int GlobalPoseUpdater::updateNode(cGenericObject* a_object, const cVector3d& a_parentPos, const cMatrix3d& a_parentRot)
+{
+    // dirty node: recompute its whole subtree
+    if (contains(m_dirty, a_object))
+    {
+        a_object->computeGlobalPositions(true, a_parentPos, a_parentRot);
+        return (getNumNodes(a_object));
+    }
+
+    // clean node above a dirty one: its frame is valid, descend
+    int numUpdated = 0;
+    if (contains(m_onPath, a_object))
+    {
+        cVector3d pos = a_object->getGlobalPos();
+        cMatrix3d rot = a_object->getGlobalRot();
+        for (unsigned int i = 0; i < a_object->getNumChildren(); i++)
+        {
+            numUpdated += updateNode(a_object->getChild(i), pos, rot);
+        }
+    }
+    return (numUpdated);
+}
+
+//------------------------------------------------------------------------------
+
+int GlobalPoseUpdater::getNumNodes(cGenericObject* a_object)
+{
+    map<cGenericObject*, int>::iterator it = m_numNodes.find(a_object);
+    if (it == m_numNodes.end())
+    {
+        it = m_numNodes.insert(make_pair(a_object, countNodes(a_object))).first;
+    }
+    return (it->second);
+}
+
+//------------------------------------------------------------------------------
+
+int GlobalPoseUpdater::countNodes(cGenericObject* a_object)
+{
+    int count = 1;
+    for (unsigned int i = 0; i < a_object->getNumChildren(); i++)
+    {
+        count += countNodes(a_object->getChild(i));
+    }
+    return (count);
+}
+
+//------------------------------------------------------------------------------
+
+bool GlobalPoseUpdater::contains(const vector<cGenericObject*>& a_list, cGenericObject* a_object)
+{
+    return (find(a_list.begin(), a_list.end(), a_object) != a_list.end());
+}
+
+//------------------------------------------------------------------------------
+
+void LatencyHistogram::reset()
+{
+    for (int i = 0; i < NUM_BUCKETS; i++)
+    {
+        m_counts[i] = 0;
+    }
+    m_count = 0;
+    m_sum = 0;
+    m_min = ~0ULL;
+    m_max = 0;
+}
+
+//------------------------------------------------------------------------------
+
+int LatencyHistogram::getBucket(unsigned long long a_value)
+{
+    // values below SUB_COUNT have their own bucket
+    if (a_value < SUB_COUNT)
+    {
+        return ((int)a_value);
+    }
+
+    // above, keep the SUB_BITS most significant bits
+    int magnitude = 0;
+    while ((a_value >> magnitude) >= SUB_COUNT)
+    {
+        magnitude++;
+    }
+    int sub = (int)(a_value >> magnitude);
+    return (SUB_COUNT + (magnitude - 1) * HALF_COUNT + (sub - HALF_COUNT));
+}
+
+//------------------------------------------------------------------------------
+
+unsigned long long LatencyHistogram::getBucketLowerBound(int a_bucket)
+{
+    if (a_bucket < SUB_COUNT)
+    {
+        return ((unsigned long long)a_bucket);
+    }
+    int magnitude = (a_bucket - SUB_COUNT) / HALF_COUNT + 1;
+    int sub = (a_bucket - SUB_COUNT) % HALF_COUNT + HALF_COUNT;
+    return ((unsigned long long)sub << magnitude);
+}
+
+//------------------------------------------------------------------------------
+
+void LatencyHistogram::record(double a_seconds)
+{
+    unsigned long long value = (unsigned long long)(cMax(a_seconds, 0.0) * 1e9 + 0.5);
+    m_counts[getBucket(value)]++;
+    m_count++;
+    m_sum += value;
+    m_min = cMin(m_min, value);
+    m_max = cMax(m_max, value);
+}
+
+//------------------------------------------------------------------------------
+
+double LatencyHistogram::getQuantile(double a_quantile) const
+{
+    if (m_count == 0)
+    {
+        return (0.0);
+    }
+
+    // walk the buckets until the requested rank, report the bucket upper bound
+    unsigned long long rank = (unsigned long long)ceil(cClamp(a_quantile, 0.0, 1.0) * (double)m_count);
+    rank = cMax(rank, 1ULL);
+    unsigned long long total = 0;
+    for (int i = 0; i < NUM_BUCKETS; i++)
+    {
+        total += m_counts[i];
+        if (total >= rank)
+        {
+            unsigned long long upper = getBucketLowerBound(i + 1) - 1;
+            return (1e-9 * (double)cMin(upper, m_max));
+        }
+    }
+    return (getMax());
+}
+
+//------------------------------------------------------------------------------
+
+void LatencyHistogram::writeBuckets(ostream& a_stream, const string& a_name) const
+{
+    for (int i = 0; i < NUM_BUCKETS; i++)
+    {
+        if (m_counts[i] > 0)
+        {
+            a_stream << a_name << "," << 1e-3 * (double)getBucketLowerBound(i) << ","
+                     << 1e-3 * (double)getBucketLowerBound(i + 1) << "," << m_counts[i] << "\n";
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+
+double getHapticDeadline(void)
+{
+    double rate = realtimeMode ? realtimeRate : HAPTIC_NOMINAL_RATE;
+    return ((1.0 + HAPTIC_DEADLINE_TOLERANCE) / rate);
+}
+
+//------------------------------------------------------------------------------
+
+void collectHapticTimings(void)
+{
+    double deadline = getHapticDeadline();
+    HapticTimingSample sample;
+    while (hapticTimingQueue.pop(sample))
+    {
+        for (int i = 0; i < HAPTIC_METRIC_COUNT; i++)
+        {
+            hapticHistograms[i].record(sample.m_values[i]);
+        }
+        if (sample.m_values[HAPTIC_PERIOD] > deadline)
+        {
+            hapticDeadlineMisses++;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void writeHapticTimings(const string& a_basename)
+{
+    const LatencyHistogram& period = hapticHistograms[HAPTIC_PERIOD];
+    if (period.getCount() == 0)
+    {
+        return;
+    }
+
+    // summary of each metric [us]
+    ofstream json((a_basename + ".json").c_str());
+    json << "{\n";
+    json << "  \"deadline_us\": " << 1e6 * getHapticDeadline() << ",\n";
+    json << "  \"deadline_misses\": " << hapticDeadlineMisses << ",\n";
+    json << "  \"dropped_samples\": " << hapticTimingDropped.load() << ",\n";
+    json << "  \"metrics\": {\n";
+    for (int i = 0; i < HAPTIC_METRIC_COUNT; i++)
+    {
+        const LatencyHistogram& h = hapticHistograms[i];
+        json << "    \"" << HAPTIC_METRIC_NAMES[i] << "\": { "
+             << "\"count\": " << h.getCount() << ", "
+             << "\"mean\": " << 1e6 * h.getMean() << ", "
+             << "\"min\": " << 1e6 * h.getMin() << ", "
+             << "\"p50\": " << 1e6 * h.getQuantile(0.5) << ", "
+             << "\"p99\": " << 1e6 * h.getQuantile(0.99) << ", "
+             << "\"p99.9\": " << 1e6 * h.getQuantile(0.999) << ", "
+             << "\"max\": " << 1e6 * h.getMax() << " }"
+             << ((i < HAPTIC_METRIC_COUNT - 1) ? "," : "") << "\n";
+    }
+    json << "  }\n";
+    json << "}\n";
+
+    // full histograms
+    ofstream csv((a_basename + ".csv").c_str());
+    csv << "metric,lower_us,upper_us,count\n";
+    for (int i = 0; i < HAPTIC_METRIC_COUNT; i++)
+    {
+        hapticHistograms[i].writeBuckets(csv, HAPTIC_METRIC_NAMES[i]);
+    }
+
+    cout << "> Haptic period p50/p99/p99.9/max: "
+         << cStr(1e6 * period.getQuantile(0.5), 1) << " / "
+         << cStr(1e6 * period.getQuantile(0.99), 1) << " / "
+         << cStr(1e6 * period.getQuantile(0.999), 1) << " / "
+         << cStr(1e6 * period.getMax(), 1) << " us, "
+         << hapticDeadlineMisses << " deadline misses in " << period.getCount() << " ticks" << endl;
+    cout << "> Haptic timings written to " << a_basename << ".json/.csv" << endl;
+}
+
+//------------------------------------------------------------------------------
+
+RecordingHapticDevice::RecordingHapticDevice(cGenericHapticDevicePtr a_device, const string& a_filename)
+{
+    m_device = a_device;
+    m_specifications = a_device->getSpecifications();
+    m_numSamples = 0;
+    memset(&m_sample, 0, sizeof(m_sample));
+
+    // write header
+    m_file = fopen(a_filename.c_str(), "wb");
+    if (m_file == NULL)
+    {
+        cout << "Error - Cannot write haptic recording " << a_filename << endl;
+        return;
+    }
+    HapticRecordingHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.m_magic, "HREC", 4);
+    header.m_version = HAPTIC_RECORDING_VERSION;
+    header.m_sampleSize = sizeof(HapticDeviceSample);
+    strncpy(header.m_modelName, m_specifications.m_modelName.c_str(), sizeof(header.m_modelName) - 1);
+    header.m_workspaceRadius = m_specifications.m_workspaceRadius;
+    header.m_maxLinearStiffness = m_specifications.m_maxLinearStiffness;
+    header.m_maxLinearDamping = m_specifications.m_maxLinearDamping;
+    header.m_maxLinearForce = m_specifications.m_maxLinearForce;
+    header.m_maxAngularStiffness = m_specifications.m_maxAngularStiffness;
+    header.m_maxAngularDamping = m_specifications.m_maxAngularDamping;
+    header.m_maxAngularTorque = m_specifications.m_maxAngularTorque;
+    header.m_maxGripperForce = m_specifications.m_maxGripperForce;
+    header.m_maxGripperLinearStiffness = m_specifications.m_maxGripperLinearStiffness;
+    header.m_maxGripperAngularDamping = m_specifications.m_maxGripperAngularDamping;
+    header.m_gripperMaxAngleRad = m_specifications.m_gripperMaxAngleRad;
+    fwrite(&header, sizeof(header), 1, m_file);
+}
+
+//------------------------------------------------------------------------------
+
+bool RecordingHapticDevice::open()
+{
+    m_deviceReady = m_device->open();
+    return (m_deviceReady);
+}
+
+//------------------------------------------------------------------------------
+
+bool RecordingHapticDevice::close()
+{
+    if (m_file != NULL)
+    {
+        fclose(m_file);
+        m_file = NULL;
+        cout << "> Recorded " << m_numSamples << " haptic ticks" << endl;
+    }
+    m_deviceReady = false;
+    return (m_device->close());
+}
+
+//------------------------------------------------------------------------------
+
+bool RecordingHapticDevice::getPosition(cVector3d& a_position)
+{
+    bool result = m_device->getPosition(a_position);
+    for (int i = 0; i < 3; i++) m_sample.m_pos[i] = a_position(i);
+    return (result);
+}
+
+//------------------------------------------------------------------------------
+
+bool RecordingHapticDevice::getRotation(cMatrix3d& a_rotation)
+{
+    bool result = m_device->getRotation(a_rotation);
+    for (int i = 0; i < 9; i++) m_sample.m_rot[i] = a_rotation(i / 3, i % 3);
+    return (result);
+}
+
+//------------------------------------------------------------------------------
+
+bool RecordingHapticDevice::getLinearVelocity(cVector3d& a_linearVelocity)
+{
+    bool result = m_device->getLinearVelocity(a_linearVelocity);
+    for (int i = 0; i < 3; i++) m_sample.m_linVel[i] = a_linearVelocity(i);
+    return (result);
+}
+
+//------------------------------------------------------------------------------
+
+bool RecordingHapticDevice::getAngularVelocity(cVector3d& a_angularVelocity)
+{
+    bool result = m_device->getAngularVelocity(a_angularVelocity);
+    for (int i = 0; i < 3; i++) m_sample.m_angVel[i] = a_angularVelocity(i);
+    return (result);
+}
+
+//------------------------------------------------------------------------------
+
+bool RecordingHapticDevice::getGripperAngleRad(double& a_angle)
+{
+    bool result = m_device->getGripperAngleRad(a_angle);
+    m_sample.m_gripperAngle = a_angle;
+    return (result);
+}
+
+//------------------------------------------------------------------------------
+
+bool RecordingHapticDevice::getGripperAngularVelocity(double& a_gripperAngularVelocity)
+{
+    bool result = m_device->getGripperAngularVelocity(a_gripperAngularVelocity);
+    m_sample.m_gripperAngVel = a_gripperAngularVelocity;
+    return (result);
+}
+
+//------------------------------------------------------------------------------
+
+bool RecordingHapticDevice::getUserSwitches(unsigned int& a_userSwitches)
+{
+    bool result = m_device->getUserSwitches(a_userSwitches);
+    m_sample.m_userSwitches = a_userSwitches;
+    return (result);
+}
+
+//------------------------------------------------------------------------------
+
+bool RecordingHapticDevice::setForceAndTorqueAndGripperForce(const cVector3d& a_force,
+                                                             const cVector3d& a_torque,
+                                                             double a_gripperForce)
+{
+    bool result = m_device->setForceAndTorqueAndGripperForce(a_force, a_torque, a_gripperForce);
+
+    // the tick is complete, write it out
+    for (int i = 0; i < 3; i++)
+    {
+        m_sample.m_force[i] = a_force(i);
+        m_sample.m_torque[i] = a_torque(i);
+    }
+    m_sample.m_gripperForce = a_gripperForce;
+    if (m_file != NULL)
+    {
+        fwrite(&m_sample, sizeof(m_sample), 1, m_file);
+        m_numSamples++;
+    }
+    return (result);
+}
+
+//------------------------------------------------------------------------------
+
+void RecordingHapticDevice::setInputState(const InputState& a_input)
+{
+    m_sample.m_heightScale = a_input.m_heightScale;
+    m_sample.m_heighC = a_input.m_heighC;
+    m_sample.m_useHeightField = a_input.m_useHeightField ? 1 : 0;
+    m_sample.m_useMultiPoint = a_input.m_useMultiPoint ? 1 : 0;
+}
+
+//------------------------------------------------------------------------------
+
+ReplayHapticDevice::ReplayHapticDevice()
+{
+    m_current = 0;
+    m_numMismatches = 0;
+    m_maxForceError = 0.0;
+    m_firstMismatch = -1;
+    m_deviceAvailable = false;
+    m_deviceReady = false;
+}
+
+//------------------------------------------------------------------------------
+
+bool ReplayHapticDevice::loadFromFile(const string& a_filename)
+{
+    FILE* file = fopen(a_filename.c_str(), "rb");
+    if (file == NULL)
+    {
+        return (false);
+    }
+
+    // check header
+    HapticRecordingHeader header;
+    if ((fread(&header, sizeof(header), 1, file) != 1) ||
+        (memcmp(header.m_magic, "HREC", 4) != 0) ||
+        (header.m_version != HAPTIC_RECORDING_VERSION) ||
+        (header.m_sampleSize != sizeof(HapticDeviceSample)))
+    {
+        fclose(file);
+        return (false);
+    }
+
+    // read samples up to the end of file
+    m_samples.clear();
+    HapticDeviceSample sample;
+    while (fread(&sample, sizeof(sample), 1, file) == 1)
+    {
+        m_samples.push_back(sample);
+    }
+    fclose(file);
+
+    // the replayed device has the specifications of the recorded one
+    header.m_modelName[sizeof(header.m_modelName) - 1] = 0;
+    m_specifications.m_modelName = string(header.m_modelName) + " (replay)";
+    m_specifications.m_workspaceRadius = header.m_workspaceRadius;
+    m_specifications.m_maxLinearStiffness = header.m_maxLinearStiffness;
+    m_specifications.m_maxLinearDamping = header.m_maxLinearDamping;
+    m_specifications.m_maxLinearForce = header.m_maxLinearForce;
+    m_specifications.m_maxAngularStiffness = header.m_maxAngularStiffness;
+    m_specifications.m_maxAngularDamping = header.m_maxAngularDamping;
+    m_specifications.m_maxAngularTorque = header.m_maxAngularTorque;
+    m_specifications.m_maxGripperForce = header.m_maxGripperForce;
+    m_specifications.m_maxGripperLinearStiffness = header.m_maxGripperLinearStiffness;
+    m_specifications.m_maxGripperAngularDamping = header.m_maxGripperAngularDamping;
+    m_specifications.m_gripperMaxAngleRad = header.m_gripperMaxAngleRad;
+
+    m_current = 0;
+    m_numMismatches = 0;
+    m_maxForceError = 0.0;
+    m_firstMismatch = -1;
+    m_deviceAvailable = true;
+    return (!m_samples.empty());
+}
+
+//------------------------------------------------------------------------------
+
+const HapticDeviceSample& ReplayHapticDevice::current() const
+{
+    // past the end, the device stays at its last recorded state
+    return (m_samples[cMin(m_current, (unsigned int)m_samples.size() - 1)]);
+}
+
+//------------------------------------------------------------------------------
+
+bool ReplayHapticDevice::getPosition(cVector3d& a_position)
+{
+    const HapticDeviceSample& sample = current();
+    a_position.set(sample.m_pos[0], sample.m_pos[1], sample.m_pos[2]);
+    return (true);
+}
+
+//------------------------------------------------------------------------------
+
+bool ReplayHapticDevice::getRotation(cMatrix3d& a_rotation)
+{
+    const HapticDeviceSample& sample = current();
+    a_rotation.set(sample.m_rot[0], sample.m_rot[1], sample.m_rot[2],
+                   sample.m_rot[3], sample.m_rot[4], sample.m_rot[5],
+                   sample.m_rot[6], sample.m_rot[7], sample.m_rot[8]);
+    return (true);
+}
+
+//------------------------------------------------------------------------------
+
+bool ReplayHapticDevice::getLinearVelocity(cVector3d& a_linearVelocity)
+{
+    const HapticDeviceSample& sample = current();
+    a_linearVelocity.set(sample.m_linVel[0], sample.m_linVel[1], sample.m_linVel[2]);
+    return (true);
+}
+
+//------------------------------------------------------------------------------
+
+bool ReplayHapticDevice::getAngularVelocity(cVector3d& a_angularVelocity)
+{
+    const HapticDeviceSample& sample = current();
+    a_angularVelocity.set(sample.m_angVel[0], sample.m_angVel[1], sample.m_angVel[2]);
+    return (true);
+}
+
+//------------------------------------------------------------------------------
+
+bool ReplayHapticDevice::getGripperAngleRad(double& a_angle)
+{
+    a_angle = current().m_gripperAngle;
+    return (true);
+}
+
+//------------------------------------------------------------------------------
+
+bool ReplayHapticDevice::getGripperAngularVelocity(double& a_gripperAngularVelocity)
+{
+    a_gripperAngularVelocity = current().m_gripperAngVel;
+    return (true);
+}
+
+//------------------------------------------------------------------------------
+
+bool ReplayHapticDevice::getUserSwitches(unsigned int& a_userSwitches)
+{
+    a_userSwitches = current().m_userSwitches;
+    return (true);
+}
+
+//------------------------------------------------------------------------------
+
+bool ReplayHapticDevice::setForceAndTorqueAndGripperForce(const cVector3d& a_force,
+                                                          const cVector3d& a_torque,
+                                                          double a_gripperForce)
+{
+    if (isFinished())
+    {
+        return (true);
+    }
+
+    // compare with the recorded output, then move on to the next tick
+    const HapticDeviceSample& sample = current();
+    bool identical = true;
+    for (int i = 0; i < 3; i++)
+    {
+        double force = a_force(i);
+        double torque = a_torque(i);
+        identical = identical && (memcmp(&force, &sample.m_force[i], sizeof(double)) == 0);
+        identical = identical && (memcmp(&torque, &sample.m_torque[i], sizeof(double)) == 0);
+        m_maxForceError = cMax(m_maxForceError, fabs(force - sample.m_force[i]));
+    }
+    identical = identical && (memcmp(&a_gripperForce, &sample.m_gripperForce, sizeof(double)) == 0);
+    if (!identical)
+    {
+        if (m_firstMismatch < 0)
+        {
+            m_firstMismatch = (int)m_current;
+        }
+        m_numMismatches++;
+    }
+    m_current++;
+    return (true);
+}
+
+//------------------------------------------------------------------------------
+
+void ReplayHapticDevice::getInputState(InputState& a_input) const
+{
+    const HapticDeviceSample& sample = current();
+    a_input.m_heightScale = sample.m_heightScale;
+    a_input.m_heighC = sample.m_heighC;
+    a_input.m_useHeightField = (sample.m_useHeightField != 0);
+    a_input.m_useMultiPoint = (sample.m_useMultiPoint != 0);
+
+    // recordings are made without the contact model, see main()
+    a_input.m_useContactModel = false;
+}
+
+//------------------------------------------------------------------------------
+
+void printReplayReport(void)
+{
+    cout << "> Replayed " << replayDevice->getNumPlayed() << " haptic ticks, ";
+    if (replayDevice->getNumMismatches() == 0)
+    {
+        cout << "forces identical to the recording" << endl;
+    }
+    else
+    {
+        cout << replayDevice->getNumMismatches() << " ticks differ from the recording, first at tick "
+             << replayDevice->getFirstMismatch() << ", max force error "
+             << cStr(replayDevice->getMaxForceError(), 9) << " N" << endl;
+    }
+}
+
+//------------------------------------------------------------------------------
+
+// fills node a_index with the subtree of the triangles a_order[a_first, a_first + a_count)
+static void buildBVHNode(TriangleBVH& a_bvh,
+                         int a_index,
+                         vector<int>& a_order,
+                         const vector<cVector3d>& a_centers,
+                         const vector<cVector3d>& a_lower,
+                         const vector<cVector3d>& a_upper,
+                         int a_first,
+                         int a_count,
+                         int a_depth)
+{
+    a_bvh.m_maxDepth = cMax(a_bvh.m_maxDepth, a_depth);
+
+    // bounds of the triangles and of their centers
+    double lower[3], upper[3], centerLower[3], centerUpper[3];
+    for (int k = 0; k < 3; k++)
+    {
+        lower[k] = centerLower[k] = C_LARGE;
+        upper[k] = centerUpper[k] = -C_LARGE;
+    }
+    for (int i = a_first; i < a_first + a_count; i++)
+    {
+        int t = a_order[i];
+        for (int k = 0; k < 3; k++)
+        {
+            lower[k] = cMin(lower[k], a_lower[t](k));
+            upper[k] = cMax(upper[k], a_upper[t](k));
+            centerLower[k] = cMin(centerLower[k], a_centers[t](k));
+            centerUpper[k] = cMax(centerUpper[k], a_centers[t](k));
+        }
+    }
+    TriangleBVH::Node& node = a_bvh.m_nodes[a_index];
+    for (int k = 0; k < 3; k++)
+    {
+        node.m_min[k] = (float)lower[k];
+        node.m_max[k] = (float)upper[k];
+    }
+
+    if (a_count <= BVH_LEAF_SIZE)
+    {
+        node.m_left = -1;
+        node.m_first = a_first;
+        node.m_count = a_count;
+        return;
+    }
+
+    // split at the median along the longest axis of the centers
+    int axis = 0;
+    for (int k = 1; k < 3; k++)
+    {
+        if (centerUpper[k] - centerLower[k] > centerUpper[axis] - centerLower[axis]) axis = k;
+    }
+    int half = a_count / 2;
+    nth_element(a_order.begin() + a_first, a_order.begin() + a_first + half, a_order.begin() + a_first + a_count,
+                [&](int a, int b) { return (a_centers[a](axis) < a_centers[b](axis)); });
+
+    // both children are stored next to each other
+    int left = (int)a_bvh.m_nodes.size();
+    node.m_left = left;
+    node.m_first = 0;
+    node.m_count = 0;
+    a_bvh.m_nodes.resize(left + 2);
+    buildBVHNode(a_bvh, left, a_order, a_centers, a_lower, a_upper, a_first, half, a_depth + 1);
+    buildBVHNode(a_bvh, left + 1, a_order, a_centers, a_lower, a_upper, a_first + half, a_count - half, a_depth + 1);
+}
+
+//------------------------------------------------------------------------------
+
+void buildTriangleBVH(TriangleBVH& a_bvh,
+                      const vector<cVector3d>& a_vertices,
+                      const vector<unsigned int>& a_indices)
+{
+    a_bvh.m_nodes.clear();
+    a_bvh.m_maxDepth = 0;
+    int numTriangles = (int)a_indices.size() / 3;
+
+    // bounds and center of each triangle with a non zero area
+    vector<cVector3d> centers(numTriangles), lower(numTriangles), upper(numTriangles);
+    vector<int> order;
+    for (int t = 0; t < numTriangles; t++)
+    {
+        const cVector3d& a = a_vertices[a_indices[3 * t + 0]];
+        const cVector3d& b = a_vertices[a_indices[3 * t + 1]];
+        const cVector3d& c = a_vertices[a_indices[3 * t + 2]];
+        for (int k = 0; k < 3; k++)
+        {
+            lower[t](k) = cMin(a(k), cMin(b(k), c(k)));
+            upper[t](k) = cMax(a(k), cMax(b(k), c(k)));
+        }
+        centers[t] = (a + b + c) / 3.0;
+        if (cCross(b - a, c - a).lengthsq() > 0.0)
+        {
+            order.push_back(t);
+        }
+    }
+    numTriangles = (int)order.size();
+    a_bvh.m_numTriangles = numTriangles;
+
+    if (numTriangles > 0)
+    {
+        a_bvh.m_nodes.reserve(2 * numTriangles);
+        a_bvh.m_nodes.resize(1);
+        buildBVHNode(a_bvh, 0, order, centers, lower, upper, 0, numTriangles, 0);
+    }
+
+    // store triangles in leaf order
+    for (int f = 0; f < TRI_FIELD_COUNT; f++)
+    {
+        a_bvh.m_triangles[f].resize(numTriangles);
+    }
+    a_bvh.m_indices = order;
+    for (int i = 0; i < numTriangles; i++)
+    {
+        int t = order[i];
+        const cVector3d& a = a_vertices[a_indices[3 * t + 0]];
+        cVector3d e0 = a_vertices[a_indices[3 * t + 1]] - a;
+        cVector3d e1 = a_vertices[a_indices[3 * t + 2]] - a;
+        cVector3d n = cCross(e0, e1);
+        double nn = n.lengthsq();
+        cVector3d g0 = cCross(e1, n) / nn;
+        cVector3d g1 = cCross(n, e0) / nn;
+        for (int k = 0; k < 3; k++)
+        {
+            a_bvh.m_triangles[TRI_AX + k][i] = (float)a(k);
+            a_bvh.m_triangles[TRI_E0X + k][i] = (float)e0(k);
+            a_bvh.m_triangles[TRI_E1X + k][i] = (float)e1(k);
+            a_bvh.m_triangles[TRI_NX + k][i] = (float)(n(k) / sqrt(nn));
+            a_bvh.m_triangles[TRI_G0X + k][i] = (float)g0(k);
+            a_bvh.m_triangles[TRI_G1X + k][i] = (float)g1(k);
+        }
+        a_bvh.m_triangles[TRI_INV_E0][i] = (float)(1.0 / e0.lengthsq());
+        a_bvh.m_triangles[TRI_INV_E1][i] = (float)(1.0 / e1.lengthsq());
+        a_bvh.m_triangles[TRI_INV_E2][i] = (float)(1.0 / (e1 - e0).lengthsq());
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void buildTriangleBVH(TriangleBVH& a_bvh, cMesh* a_mesh)
+{
+    vector<cVector3d> vertices(a_mesh->getNumVertices());
+    for (unsigned int i = 0; i < vertices.size(); i++)
+    {
+        vertices[i] = a_mesh->m_vertices->getLocalPos(i);
+    }
+
+    vector<unsigned int> indices;
+    vector<int> triangles;
+    for (unsigned int i = 0; i < a_mesh->getNumTriangles(); i++)
+    {
+        if (a_mesh->m_triangles->getAllocated(i))
+        {
+            indices.push_back(a_mesh->m_triangles->getVertexIndex0(i));
+            indices.push_back(a_mesh->m_triangles->getVertexIndex1(i));
+            indices.push_back(a_mesh->m_triangles->getVertexIndex2(i));
+            triangles.push_back(i);
+        }
+    }
+
+    buildTriangleBVH(a_bvh, vertices, indices);
+
+    // refer to the triangles of the mesh, some of which may be unallocated
+    for (unsigned int i = 0; i < a_bvh.m_indices.size(); i++)
+    {
+        a_bvh.m_indices[i] = triangles[a_bvh.m_indices[i]];
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void reserveContactBatch(const TriangleBVH& a_bvh, ContactBatch& a_batch)
+{
+    int n = a_batch.m_numPoints;
+    a_batch.m_x.resize(n);
+    a_batch.m_y.resize(n);
+    a_batch.m_z.resize(n);
+    a_batch.m_depth.resize(n);
+    a_batch.m_nx.resize(n);
+    a_batch.m_ny.resize(n);
+    a_batch.m_nz.resize(n);
+    a_batch.m_work.resize(n * (2 * a_bvh.m_maxDepth + 3));
+
+    // a query only reallocates if a point touches more candidates than this
+    int numPairs = n * CONTACT_BATCH_PAIRS_PER_POINT;
+    a_batch.m_pairPoint.reserve(numPairs);
+    a_batch.m_pairTriangle.reserve(numPairs);
+    a_batch.m_pairDepth.reserve(numPairs);
+    a_batch.m_pairNx.reserve(numPairs);
+    a_batch.m_pairNy.reserve(numPairs);
+    a_batch.m_pairNz.reserve(numPairs);
+}
+
+//------------------------------------------------------------------------------
+
+void queryContactsBatch(const TriangleBVH& a_bvh, float a_radius, ContactBatch& a_batch)
+{
+    int n = a_batch.m_numPoints;
+    a_batch.m_depth.assign(n, 0.0f);
+    a_batch.m_nx.assign(n, 0.0f);
+    a_batch.m_ny.assign(n, 0.0f);
+    a_batch.m_nz.assign(n, 0.0f);
+    a_batch.m_pairPoint.clear();
+    a_batch.m_pairTriangle.clear();
+    a_batch.m_numNodes = 0;
+    if (a_bvh.m_nodes.empty() || (n == 0))
+    {
+        return;
+    }
+
+    // each pending node owns a range of point indices of the work list. Nodes
+    // are processed last in first out, so the list only grows above the
+    // range of the node being processed and never holds more than one range
+    // per pending node.
+    int capacity = n * (2 * a_bvh.m_maxDepth + 3);
+    if ((int)a_batch.m_work.size() < capacity)
+    {
+        a_batch.m_work.resize(capacity);
+    }
+    int* work = &a_batch.m_work[0];
+    for (int i = 0; i < n; i++)
+    {
+        work[i] = i;
+    }
+
+    struct Pending { int m_node; int m_begin; int m_end; };
+    Pending stack[128];
+    int stackSize = 0;
+    stack[stackSize].m_node = 0;
+    stack[stackSize].m_begin = 0;
+    stack[stackSize].m_end = n;
+    stackSize++;
+
+    const float* x = &a_batch.m_x[0];
+    const float* y = &a_batch.m_y[0];
+    const float* z = &a_batch.m_z[0];
+    while (stackSize > 0)
+    {
+        Pending pending = stack[--stackSize];
+        int workSize = pending.m_end;
+        const TriangleBVH::Node& node = a_bvh.m_nodes[pending.m_node];
+        a_batch.m_numNodes++;
+
+        // leaf: every remaining point is a candidate for every triangle
+        if (node.m_left < 0)
+        {
+            for (int t = node.m_first; t < node.m_first + node.m_count; t++)
+            {
+                for (int i = pending.m_begin; i < pending.m_end; i++)
+                {
+                    a_batch.m_pairPoint.push_back(work[i]);
+                    a_batch.m_pairTriangle.push_back(t);
+                }
+            }
+            continue;
+        }
+
+        // split the points among the children whose box they touch
+        for (int c = 0; c < 2; c++)
+        {
+            const TriangleBVH::Node& child = a_bvh.m_nodes[node.m_left + c];
+            int begin = workSize;
+            for (int i = pending.m_begin; i < pending.m_end; i++)
+            {
+                int p = work[i];
+                bool overlap = (x[p] >= child.m_min[0] - a_radius) && (x[p] <= child.m_max[0] + a_radius) &&
+                               (y[p] >= child.m_min[1] - a_radius) && (y[p] <= child.m_max[1] + a_radius) &&
+                               (z[p] >= child.m_min[2] - a_radius) && (z[p] <= child.m_max[2] + a_radius);
+                work[workSize] = p;
+                workSize += overlap ? 1 : 0;
+            }
+            if (workSize > begin)
+            {
+                stack[stackSize].m_node = node.m_left + c;
+                stack[stackSize].m_begin = begin;
+                stack[stackSize].m_end = workSize;
+                stackSize++;
+            }
+        }
+    }
+
+    narrowPhaseContacts(a_bvh, a_radius, a_batch);
+}
+
+//------------------------------------------------------------------------------
+
+// penetration depth of a sphere into triangle a_t of a structure of arrays
+// (see TriangleField), computed without branches so that loops calling it can
+// be vectorized: the projection on the triangle plane when it falls inside the
+// triangle, the closest edge point otherwise
+static inline float sphereTriangleContact(const float* const* a_tri,
+                                          int a_t,
+                                          float a_px,
+                                          float a_py,
+                                          float a_pz,
+                                          float a_radius,
+                                          float& a_nx,
+                                          float& a_ny,
+                                          float& a_nz)
+{
+    const float* const* tri = a_tri;
+    int t = a_t;
+    float dx = a_px - tri[TRI_AX][t], dy = a_py - tri[TRI_AY][t], dz = a_pz - tri[TRI_AZ][t];
+    float e0x = tri[TRI_E0X][t], e0y = tri[TRI_E0Y][t], e0z = tri[TRI_E0Z][t];
+    float e1x = tri[TRI_E1X][t], e1y = tri[TRI_E1Y][t], e1z = tri[TRI_E1Z][t];
+    float nx = tri[TRI_NX][t], ny = tri[TRI_NY][t], nz = tri[TRI_NZ][t];
+
+    // barycentric coordinates of the projection and height above the plane
+    float u = dx * tri[TRI_G0X][t] + dy * tri[TRI_G0Y][t] + dz * tri[TRI_G0Z][t];
+    float v = dx * tri[TRI_G1X][t] + dy * tri[TRI_G1Y][t] + dz * tri[TRI_G1Z][t];
+    bool inside = (u >= 0.0f) && (v >= 0.0f) && (u + v <= 1.0f);
+    float height = dx * nx + dy * ny + dz * nz;
+
+    // closest points on the three edges
+    float e2x = e1x - e0x, e2y = e1y - e0y, e2z = e1z - e0z;
+    float fx = dx - e0x, fy = dy - e0y, fz = dz - e0z;
+    float t0 = cClamp((dx * e0x + dy * e0y + dz * e0z) * tri[TRI_INV_E0][t], 0.0f, 1.0f);
+    float t1 = cClamp((dx * e1x + dy * e1y + dz * e1z) * tri[TRI_INV_E1][t], 0.0f, 1.0f);
+    float t2 = cClamp((fx * e2x + fy * e2y + fz * e2z) * tri[TRI_INV_E2][t], 0.0f, 1.0f);
+    float r0x = dx - t0 * e0x, r0y = dy - t0 * e0y, r0z = dz - t0 * e0z;
+    float r1x = dx - t1 * e1x, r1y = dy - t1 * e1y, r1z = dz - t1 * e1z;
+    float r2x = fx - t2 * e2x, r2y = fy - t2 * e2y, r2z = fz - t2 * e2z;
+    float d0 = r0x * r0x + r0y * r0y + r0z * r0z;
+    float d1 = r1x * r1x + r1y * r1y + r1z * r1z;
+    float d2 = r2x * r2x + r2y * r2y + r2z * r2z;
+    bool use1 = (d1 < d0);
+    float rx = use1 ? r1x : r0x, ry = use1 ? r1y : r0y, rz = use1 ? r1z : r0z;
+    float dEdge = use1 ? d1 : d0;
+    bool use2 = (d2 < dEdge);
+    rx = use2 ? r2x : rx; ry = use2 ? r2y : ry; rz = use2 ? r2z : rz;
+    dEdge = use2 ? d2 : dEdge;
+    float edgeDistance = sqrtf(dEdge);
+    float invEdge = (edgeDistance > 0.0f) ? 1.0f / edgeDistance : 0.0f;
+
+    // inside, the signed height allows pushing back a point that went
+    // below the surface by less than a radius; outside, the nearest edge
+    // pushes along the separating direction
+    bool faceContact = inside && (height > -a_radius);
+    a_nx = faceContact ? nx : rx * invEdge;
+    a_ny = faceContact ? ny : ry * invEdge;
+    a_nz = faceContact ? nz : rz * invEdge;
+    return (faceContact ? a_radius - height : a_radius - edgeDistance);
+}
+
+//------------------------------------------------------------------------------
+
+void narrowPhaseContacts(const TriangleBVH& a_bvh, float a_radius, ContactBatch& a_batch)
+{
+    int numPairs = (int)a_batch.m_pairPoint.size();
+    a_batch.m_pairDepth.resize(numPairs);
+    a_batch.m_pairNx.resize(numPairs);
+    a_batch.m_pairNy.resize(numPairs);
+    a_batch.m_pairNz.resize(numPairs);
+    if (numPairs == 0)
+    {
+        return;
+    }
+
+    // closest point of each candidate triangle
+    const int* pairPoint = &a_batch.m_pairPoint[0];
+    const int* pairTriangle = &a_batch.m_pairTriangle[0];
+    const float* px = &a_batch.m_x[0];
+    const float* py = &a_batch.m_y[0];
+    const float* pz = &a_batch.m_z[0];
+    const float* tri[TRI_FIELD_COUNT];
+    for (int f = 0; f < TRI_FIELD_COUNT; f++)
+    {
+        tri[f] = &a_bvh.m_triangles[f][0];
+    }
+    float* pairDepth = &a_batch.m_pairDepth[0];
+    float* pairNx = &a_batch.m_pairNx[0];
+    float* pairNy = &a_batch.m_pairNy[0];
+    float* pairNz = &a_batch.m_pairNz[0];
+    for (int k = 0; k < numPairs; k++)
+    {
+        int p = pairPoint[k];
+        pairDepth[k] = sphereTriangleContact(tri, pairTriangle[k], px[p], py[p], pz[p], a_radius,
+                                             pairNx[k], pairNy[k], pairNz[k]);
+    }
+
+    // keep the deepest contact of each point
+    for (int k = 0; k < numPairs; k++)
+    {
+        int p = pairPoint[k];
+        if (pairDepth[k] > a_batch.m_depth[p])
+        {
+            a_batch.m_depth[p] = pairDepth[k];
+            a_batch.m_nx[p] = pairNx[k];
+            a_batch.m_ny[p] = pairNy[k];
+            a_batch.m_nz[p] = pairNz[k];
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+
+// triangulated grid of a_gridSize^2 quads covering the plane, displaced
+// along -z by the depth of the displacement map
+static void createDisplacedGrid(const HeightPyramid& a_pyramid,
+                                int a_gridSize,
+                                double a_depthScale,
+                                vector<cVector3d>& a_vertices,
+                                vector<unsigned int>& a_indices)
+{
+    a_vertices.clear();
+    a_indices.clear();
+    for (int j = 0; j <= a_gridSize; j++)
+    {
+        for (int i = 0; i <= a_gridSize; i++)
+        {
+            int tx = cMin(i * a_pyramid.m_width[0] / a_gridSize, a_pyramid.m_width[0] - 1);
+            int ty = cMin(j * a_pyramid.m_height[0] / a_gridSize, a_pyramid.m_height[0] - 1);
+            double depth = a_pyramid.m_min[0][ty * a_pyramid.m_width[0] + tx];
+            a_vertices.push_back(cVector3d(PLANE_SIZE * ((double)i / a_gridSize - 0.5),
+                                           PLANE_SIZE * ((double)j / a_gridSize - 0.5),
+                                           -a_depthScale * depth));
+        }
+    }
+    for (int j = 0; j < a_gridSize; j++)
+    {
+        for (int i = 0; i < a_gridSize; i++)
+        {
+            unsigned int v = j * (a_gridSize + 1) + i;
+            unsigned int quad[6] = { v, v + 1, v + a_gridSize + 2, v, v + a_gridSize + 2, v + a_gridSize + 1 };
+            a_indices.insert(a_indices.end(), quad, quad + 6);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void benchmarkContactQueries(const HeightPyramid& a_pyramid)
+{
+    const int GRID_SIZE = 256;
+    const int NUM_PROBES = 2000;
+    const int NUM_CHECKED = 20;
+    const double depthScale = 0.05 * PLANE_SIZE;
+    const float radius = (float)PROBE_POINT_RADIUS;
+
+    // displaced grid covering the plane
+    vector<cVector3d> vertices;
+    vector<unsigned int> indices;
+    createDisplacedGrid(a_pyramid, GRID_SIZE, depthScale, vertices, indices);
+
+    cPrecisionClock clock;
+    clock.start(true);
+    TriangleBVH bvh;
+    buildTriangleBVH(bvh, vertices, indices);
+    double buildTime = clock.stop();
+
+    // probes resting on the surface along a random path, moving 1 mm per
+    // query as a tool sliding at 1 m/s sampled at 1 kHz
+    int numPoints = PROBE_POINTS_PER_SIDE * PROBE_POINTS_PER_SIDE;
+    vector<float> probeX, probeY, probeZ;
+    srand(1);
+    double cx = 0.0, cy = 0.0, heading = 0.0;
+    for (int k = 0; k < NUM_PROBES; k++)
+    {
+        heading += 0.2 * ((double)rand() / (double)RAND_MAX - 0.5);
+        cx += 0.001 * cos(heading);
+        cy += 0.001 * sin(heading);
+        if (fabs(cx) > 0.4 * PLANE_SIZE) { heading = C_PI - heading; cx = cClamp(cx, -0.4 * PLANE_SIZE, 0.4 * PLANE_SIZE); }
+        if (fabs(cy) > 0.4 * PLANE_SIZE) { heading = -heading; cy = cClamp(cy, -0.4 * PLANE_SIZE, 0.4 * PLANE_SIZE); }
+        int tx = cClamp((int)((cx / PLANE_SIZE + 0.5) * a_pyramid.m_width[0]), 0, a_pyramid.m_width[0] - 1);
+        int ty = cClamp((int)((cy / PLANE_SIZE + 0.5) * a_pyramid.m_height[0]), 0, a_pyramid.m_height[0] - 1);
+        double cz = -depthScale * a_pyramid.m_min[0][ty * a_pyramid.m_width[0] + tx] + PROBE_POINT_RADIUS * ((double)rand() / (double)RAND_MAX - 0.5);
+        for (int j = 0; j < PROBE_POINTS_PER_SIDE; j++)
+        {
+            for (int i = 0; i < PROBE_POINTS_PER_SIDE; i++)
+            {
+                probeX.push_back((float)(cx + PROBE_SIZE * ((double)i / (PROBE_POINTS_PER_SIDE - 1) - 0.5)));
+                probeY.push_back((float)(cy + PROBE_SIZE * ((double)j / (PROBE_POINTS_PER_SIDE - 1) - 0.5)));
+                probeZ.push_back((float)cz);
+            }
+        }
+    }
+
+    // one traversal per probe
+    ContactBatch batch;
+    batch.m_numPoints = numPoints;
+    vector<float> batchDepth;
+    long long numContacts = 0, numNodes = 0, numPairs = 0;
+    clock.start(true);
+    for (int k = 0; k < NUM_PROBES; k++)
+    {
+        batch.m_x.assign(probeX.begin() + k * numPoints, probeX.begin() + (k + 1) * numPoints);
+        batch.m_y.assign(probeY.begin() + k * numPoints, probeY.begin() + (k + 1) * numPoints);
+        batch.m_z.assign(probeZ.begin() + k * numPoints, probeZ.begin() + (k + 1) * numPoints);
+        queryContactsBatch(bvh, radius, batch);
+        numNodes += batch.m_numNodes;
+        numPairs += batch.m_pairPoint.size();
+        batchDepth.insert(batchDepth.end(), batch.m_depth.begin(), batch.m_depth.end());
+    }
+    double batchTime = clock.stop();
+    for (unsigned int i = 0; i < batchDepth.size(); i++)
+    {
+        numContacts += (batchDepth[i] > 0.0f) ? 1 : 0;
+    }
+
+    // one traversal per point
+    ContactBatch single;
+    single.m_numPoints = 1;
+    single.m_x.resize(1); single.m_y.resize(1); single.m_z.resize(1);
+    long long numNodesSingle = 0;
+    int numDifferent = 0;
+    clock.start(true);
+    for (int i = 0; i < NUM_PROBES * numPoints; i++)
+    {
+        single.m_x[0] = probeX[i];
+        single.m_y[0] = probeY[i];
+        single.m_z[0] = probeZ[i];
+        queryContactsBatch(bvh, radius, single);
+        numNodesSingle += single.m_numNodes;
+        numDifferent += (single.m_depth[0] != batchDepth[i]) ? 1 : 0;
+    }
+    double singleTime = clock.stop();
+
+    // check a few probes against every triangle
+    int numTriangles = bvh.m_numTriangles;
+    double maxError = 0.0;
+    for (int k = 0; k < NUM_PROBES; k += NUM_PROBES / NUM_CHECKED)
+    {
+        batch.m_x.assign(probeX.begin() + k * numPoints, probeX.begin() + (k + 1) * numPoints);
+        batch.m_y.assign(probeY.begin() + k * numPoints, probeY.begin() + (k + 1) * numPoints);
+        batch.m_z.assign(probeZ.begin() + k * numPoints, probeZ.begin() + (k + 1) * numPoints);
+        batch.m_pairPoint.clear();
+        batch.m_pairTriangle.clear();
+        for (int t = 0; t < numTriangles; t++)
+        {
+            for (int i = 0; i < numPoints; i++)
+            {
+                batch.m_pairPoint.push_back(i);
+                batch.m_pairTriangle.push_back(t);
+            }
+        }
+        batch.m_depth.assign(numPoints, 0.0f);
+        narrowPhaseContacts(bvh, radius, batch);
+        for (int i = 0; i < numPoints; i++)
+        {
+            maxError = cMax(maxError, (double)fabs(batch.m_depth[i] - batchDepth[k * numPoints + i]));
+        }
+    }
+
+    cout << "Contact query benchmark (" << numTriangles << " triangles, depth " << bvh.m_maxDepth
+         << ", built in " << cStr(1e3 * buildTime, 1) << " ms)" << endl;
+    cout << NUM_PROBES << " probes of " << numPoints << " points, "
+         << cStr((double)numContacts / NUM_PROBES, 1) << " contacts per probe" << endl;
+    cout << "batched:   " << cStr(1e6 * batchTime / NUM_PROBES, 2) << " us/probe, "
+         << cStr((double)numNodes / NUM_PROBES, 1) << " nodes/probe, "
+         << cStr((double)numPairs / NUM_PROBES, 1) << " pairs/probe" << endl;
+    cout << "per point: " << cStr(1e6 * singleTime / NUM_PROBES, 2) << " us/probe, "
+         << cStr((double)numNodesSingle / NUM_PROBES, 1) << " nodes/probe, "
+         << numDifferent << " results differ from batched" << endl;
+    cout << "max depth error against all triangles (" << NUM_CHECKED << " probes): " << maxError << endl;
+}
+
+//------------------------------------------------------------------------------
+
+// appends the wide node covering binary node a_node, returns its index
+static int collapseBVHNode(WideBVH& a_wide, const TriangleBVH& a_bvh, int a_node)
+{
+    int index = (int)a_wide.m_nodes.size();
+    a_wide.m_nodes.push_back(WideBVH::Node());
+
+    // replace the largest inner descendant by its two children until there are 4
+    int children[4];
+    int numChildren = 0;
+    const TriangleBVH::Node& node = a_bvh.m_nodes[a_node];
+    if (node.m_left < 0)
+    {
+        children[numChildren++] = a_node;
+    }
+    else
+    {
+        children[numChildren++] = node.m_left;
+        children[numChildren++] = node.m_left + 1;
+    }
+    while (numChildren < 4)
+    {
+        int largest = -1;
+        float largestArea = -1.0f;
+        for (int i = 0; i < numChildren; i++)
+        {
+            const TriangleBVH::Node& child = a_bvh.m_nodes[children[i]];
+            float ex = child.m_max[0] - child.m_min[0];
+            float ey = child.m_max[1] - child.m_min[1];
+            float ez = child.m_max[2] - child.m_min[2];
+            float area = ex * ey + ey * ez + ez * ex;
+            if ((child.m_left >= 0) && (area > largestArea))
+            {
+                largest = i;
+                largestArea = area;
+            }
+        }
+        if (largest < 0)
+        {
+            break;
+        }
+        int left = a_bvh.m_nodes[children[largest]].m_left;
+        children[largest] = left;
+        children[numChildren++] = left + 1;
+    }
+
+    for (int lane = 0; lane < 4; lane++)
+    {
+        float lower[3] = { C_LARGE, C_LARGE, C_LARGE };
+        float upper[3] = { -C_LARGE, -C_LARGE, -C_LARGE };
+        int child = -1;
+        int count = 0;
+        if (lane < numChildren)
+        {
+            const TriangleBVH::Node& binary = a_bvh.m_nodes[children[lane]];
+            for (int k = 0; k < 3; k++)
+            {
+                lower[k] = binary.m_min[k];
+                upper[k] = binary.m_max[k];
+            }
+            if (binary.m_left < 0)
+            {
+                // leaf: copy its triangles into a packet of 4
+                child = (int)a_wide.m_indices.size();
+                count = binary.m_count;
+                for (int j = 0; j < 4; j++)
+                {
+                    bool used = (j < binary.m_count);
+                    int t = binary.m_first + j;
+                    for (int f = 0; f < TRI_FIELD_COUNT; f++)
+                    {
+                        a_wide.m_triangles[f].push_back(used ? a_bvh.m_triangles[f][t] : 0.0f);
+                    }
+                    a_wide.m_indices.push_back(used ? a_bvh.m_indices[t] : -1);
+                }
+            }
+            else
+            {
+                child = collapseBVHNode(a_wide, a_bvh, children[lane]);
+            }
+        }
+
+        // the node may have moved while its children were appended
+        WideBVH::Node& wide = a_wide.m_nodes[index];
+        wide.m_minX[lane] = lower[0]; wide.m_minY[lane] = lower[1]; wide.m_minZ[lane] = lower[2];
+        wide.m_maxX[lane] = upper[0]; wide.m_maxY[lane] = upper[1]; wide.m_maxZ[lane] = upper[2];
+        wide.m_child[lane] = child;
+        wide.m_count[lane] = count;
+        wide.m_laneMask |= (lane < numChildren) ? (1 << lane) : 0;
+    }
+    return (index);
+}
+
+//------------------------------------------------------------------------------
+
+void buildWideBVH(WideBVH& a_wide, const TriangleBVH& a_bvh)
+{
+    a_wide.m_nodes.clear();
+    a_wide.m_indices.clear();
+    for (int f = 0; f < TRI_FIELD_COUNT; f++)
+    {
+        a_wide.m_triangles[f].clear();
+    }
+    if (!a_bvh.m_nodes.empty())
+    {
+        collapseBVHNode(a_wide, a_bvh, 0);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+// bit i set if the sphere overlaps the box of child i
+static inline int overlapWideNode(const WideBVH::Node& a_node, float a_x, float a_y, float a_z, float a_radius)
+{
+#if defined(USE_SSE2)
+    __m128 r = _mm_set1_ps(a_radius);
+    __m128 x = _mm_set1_ps(a_x);
+    __m128 y = _mm_set1_ps(a_y);
+    __m128 z = _mm_set1_ps(a_z);
+    __m128 in = _mm_and_ps(_mm_cmpge_ps(x, _mm_sub_ps(_mm_loadu_ps(a_node.m_minX), r)),
+                           _mm_cmple_ps(x, _mm_add_ps(_mm_loadu_ps(a_node.m_maxX), r)));
+    in = _mm_and_ps(in, _mm_and_ps(_mm_cmpge_ps(y, _mm_sub_ps(_mm_loadu_ps(a_node.m_minY), r)),
+                                   _mm_cmple_ps(y, _mm_add_ps(_mm_loadu_ps(a_node.m_maxY), r))));
+    in = _mm_and_ps(in, _mm_and_ps(_mm_cmpge_ps(z, _mm_sub_ps(_mm_loadu_ps(a_node.m_minZ), r)),
+                                   _mm_cmple_ps(z, _mm_add_ps(_mm_loadu_ps(a_node.m_maxZ), r))));
+    return (_mm_movemask_ps(in));
+#else
+    int mask = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        bool in = (a_x >= a_node.m_minX[i] - a_radius) && (a_x <= a_node.m_maxX[i] + a_radius) &&
+                  (a_y >= a_node.m_minY[i] - a_radius) && (a_y <= a_node.m_maxY[i] + a_radius) &&
+                  (a_z >= a_node.m_minZ[i] - a_radius) && (a_z <= a_node.m_maxZ[i] + a_radius);
+        mask |= in ? (1 << i) : 0;
+    }
+    return (mask);
+#endif
+}
+
+//------------------------------------------------------------------------------
+
+// bit i set if the segment a + t (b - a), t in [0,1], crosses the box of child
+// i grown by a_radius (slab test, a_invDir holds 1 / (b - a) per axis)
+static inline int crossWideNode(const WideBVH::Node& a_node, const float* a_origin, const float* a_invDir, float a_radius)
+{
+#if defined(USE_SSE2)
+    __m128 r = _mm_set1_ps(a_radius);
+    __m128 tNear = _mm_setzero_ps();
+    __m128 tFar = _mm_set1_ps(1.0f);
+    const float* lower[3] = { a_node.m_minX, a_node.m_minY, a_node.m_minZ };
+    const float* upper[3] = { a_node.m_maxX, a_node.m_maxY, a_node.m_maxZ };
+    for (int k = 0; k < 3; k++)
+    {
+        __m128 o = _mm_set1_ps(a_origin[k]);
+        __m128 inv = _mm_set1_ps(a_invDir[k]);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(lower[k]), r), o), inv);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(_mm_loadu_ps(upper[k]), r), o), inv);
+        tNear = _mm_max_ps(tNear, _mm_min_ps(t0, t1));
+        tFar = _mm_min_ps(tFar, _mm_max_ps(t0, t1));
+    }
+    return (_mm_movemask_ps(_mm_cmple_ps(tNear, tFar)) & a_node.m_laneMask);
+#else
+    int mask = 0;
+    const float* lower[3] = { a_node.m_minX, a_node.m_minY, a_node.m_minZ };
+    const float* upper[3] = { a_node.m_maxX, a_node.m_maxY, a_node.m_maxZ };
+    for (int i = 0; i < 4; i++)
+    {
+        float tNear = 0.0f, tFar = 1.0f;
+        for (int k = 0; k < 3; k++)
+        {
+            float t0 = (lower[k][i] - a_radius - a_origin[k]) * a_invDir[k];
+            float t1 = (upper[k][i] + a_radius - a_origin[k]) * a_invDir[k];
+            tNear = cMax(tNear, cMin(t0, t1));
+            tFar = cMin(tFar, cMax(t0, t1));
+        }
+        mask |= (tNear <= tFar) ? (1 << i) : 0;
+    }
+    return (mask & a_node.m_laneMask);
+#endif
+}
+
+//------------------------------------------------------------------------------
+
+// deepest contact of a sphere with the packet of a_count triangles starting
+// at a_first, all four lanes are computed together
+static inline float sphereTrianglePacket(const float* const* a_tri,
+                                         int a_first,
+                                         int a_count,
+                                         float a_px,
+                                         float a_py,
+                                         float a_pz,
+                                         float a_radius,
+                                         float& a_nx,
+                                         float& a_ny,
+                                         float& a_nz)
+{
+    float depth[4], nx[4], ny[4], nz[4];
+#if defined(USE_SSE2)
+    #define LOAD(f) _mm_loadu_ps(a_tri[f] + a_first)
+    #define SELECT(m, a, b) _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b))
+    #define DOT(ax, ay, az, bx, by, bz) _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz))
+    __m128 zero = _mm_setzero_ps();
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 r = _mm_set1_ps(a_radius);
+    __m128 dx = _mm_sub_ps(_mm_set1_ps(a_px), LOAD(TRI_AX));
+    __m128 dy = _mm_sub_ps(_mm_set1_ps(a_py), LOAD(TRI_AY));
+    __m128 dz = _mm_sub_ps(_mm_set1_ps(a_pz), LOAD(TRI_AZ));
+    __m128 e0x = LOAD(TRI_E0X), e0y = LOAD(TRI_E0Y), e0z = LOAD(TRI_E0Z);
+    __m128 e1x = LOAD(TRI_E1X), e1y = LOAD(TRI_E1Y), e1z = LOAD(TRI_E1Z);
+    __m128 fnx = LOAD(TRI_NX), fny = LOAD(TRI_NY), fnz = LOAD(TRI_NZ);
+
+    // barycentric coordinates of the projection and height above the plane
+    __m128 u = DOT(dx, dy, dz, LOAD(TRI_G0X), LOAD(TRI_G0Y), LOAD(TRI_G0Z));
+    __m128 v = DOT(dx, dy, dz, LOAD(TRI_G1X), LOAD(TRI_G1Y), LOAD(TRI_G1Z));
+    __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero)),
+                               _mm_cmple_ps(_mm_add_ps(u, v), one));
+    __m128 height = DOT(dx, dy, dz, fnx, fny, fnz);
+
+    // closest points on the three edges
+    __m128 e2x = _mm_sub_ps(e1x, e0x), e2y = _mm_sub_ps(e1y, e0y), e2z = _mm_sub_ps(e1z, e0z);
+    __m128 fx = _mm_sub_ps(dx, e0x), fy = _mm_sub_ps(dy, e0y), fz = _mm_sub_ps(dz, e0z);
+    __m128 t0 = _mm_min_ps(_mm_max_ps(_mm_mul_ps(DOT(dx, dy, dz, e0x, e0y, e0z), LOAD(TRI_INV_E0)), zero), one);
+    __m128 t1 = _mm_min_ps(_mm_max_ps(_mm_mul_ps(DOT(dx, dy, dz, e1x, e1y, e1z), LOAD(TRI_INV_E1)), zero), one);
+    __m128 t2 = _mm_min_ps(_mm_max_ps(_mm_mul_ps(DOT(fx, fy, fz, e2x, e2y, e2z), LOAD(TRI_INV_E2)), zero), one);
+    __m128 r0x = _mm_sub_ps(dx, _mm_mul_ps(t0, e0x)), r0y = _mm_sub_ps(dy, _mm_mul_ps(t0, e0y)), r0z = _mm_sub_ps(dz, _mm_mul_ps(t0, e0z));
+    __m128 r1x = _mm_sub_ps(dx, _mm_mul_ps(t1, e1x)), r1y = _mm_sub_ps(dy, _mm_mul_ps(t1, e1y)), r1z = _mm_sub_ps(dz, _mm_mul_ps(t1, e1z));
+    __m128 r2x = _mm_sub_ps(fx, _mm_mul_ps(t2, e2x)), r2y = _mm_sub_ps(fy, _mm_mul_ps(t2, e2y)), r2z = _mm_sub_ps(fz, _mm_mul_ps(t2, e2z));
+    __m128 d0 = DOT(r0x, r0y, r0z, r0x, r0y, r0z);
+    __m128 d1 = DOT(r1x, r1y, r1z, r1x, r1y, r1z);
+    __m128 d2 = DOT(r2x, r2y, r2z, r2x, r2y, r2z);
+    __m128 use1 = _mm_cmplt_ps(d1, d0);
+    __m128 rx = SELECT(use1, r1x, r0x), ry = SELECT(use1, r1y, r0y), rz = SELECT(use1, r1z, r0z);
+    __m128 dEdge = SELECT(use1, d1, d0);
+    __m128 use2 = _mm_cmplt_ps(d2, dEdge);
+    rx = SELECT(use2, r2x, rx); ry = SELECT(use2, r2y, ry); rz = SELECT(use2, r2z, rz);
+    dEdge = SELECT(use2, d2, dEdge);
+    __m128 edgeDistance = _mm_sqrt_ps(dEdge);
+    __m128 invEdge = _mm_and_ps(_mm_cmpgt_ps(edgeDistance, zero), _mm_div_ps(one, edgeDistance));
+
+    // same contact rule as sphereTriangleContact()
+    __m128 face = _mm_and_ps(inside, _mm_cmpgt_ps(height, _mm_sub_ps(zero, r)));
+    _mm_storeu_ps(depth, SELECT(face, _mm_sub_ps(r, height), _mm_sub_ps(r, edgeDistance)));
+    _mm_storeu_ps(nx, SELECT(face, fnx, _mm_mul_ps(rx, invEdge)));
+    _mm_storeu_ps(ny, SELECT(face, fny, _mm_mul_ps(ry, invEdge)));
+    _mm_storeu_ps(nz, SELECT(face, fnz, _mm_mul_ps(rz, invEdge)));
+    #undef LOAD
+    #undef SELECT
+    #undef DOT
+#else
+    for (int i = 0; i < 4; i++)
+    {
+        depth[i] = sphereTriangleContact(a_tri, a_first + i, a_px, a_py, a_pz, a_radius, nx[i], ny[i], nz[i]);
+    }
+#endif
+
+    // keep the deepest of the used lanes
+    float best = 0.0f;
+    for (int i = 0; i < a_count; i++)
+    {
+        if (depth[i] > best)
+        {
+            best = depth[i];
+            a_nx = nx[i];
+            a_ny = ny[i];
+            a_nz = nz[i];
+        }
+    }
+    return (best);
+}
+
+//------------------------------------------------------------------------------
+
+void queryContactsWide(const WideBVH& a_wide, float a_radius, ContactBatch& a_batch)
+{
+    int n = a_batch.m_numPoints;
+    a_batch.m_depth.assign(n, 0.0f);
+    a_batch.m_nx.assign(n, 0.0f);
+    a_batch.m_ny.assign(n, 0.0f);
+    a_batch.m_nz.assign(n, 0.0f);
+    a_batch.m_numNodes = 0;
+    if (a_wide.m_nodes.empty())
+    {
+        return;
+    }
+
+    const float* tri[TRI_FIELD_COUNT];
+    for (int f = 0; f < TRI_FIELD_COUNT; f++)
+    {
+        tri[f] = &a_wide.m_triangles[f][0];
+    }
+
+    for (int p = 0; p < n; p++)
+    {
+        float x = a_batch.m_x[p], y = a_batch.m_y[p], z = a_batch.m_z[p];
+        int stack[256];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0)
+        {
+            const WideBVH::Node& node = a_wide.m_nodes[stack[--stackSize]];
+            a_batch.m_numNodes++;
+            int mask = overlapWideNode(node, x, y, z, a_radius);
+            for (int lane = 0; lane < 4; lane++)
+            {
+                if ((mask & (1 << lane)) == 0)
+                {
+                    continue;
+                }
+                if (node.m_count[lane] > 0)
+                {
+                    float nx = 0.0f, ny = 0.0f, nz = 0.0f;
+                    float depth = sphereTrianglePacket(tri, node.m_child[lane], node.m_count[lane],
+                                                       x, y, z, a_radius, nx, ny, nz);
+                    if (depth > a_batch.m_depth[p])
+                    {
+                        a_batch.m_depth[p] = depth;
+                        a_batch.m_nx[p] = nx;
+                        a_batch.m_ny[p] = ny;
+                        a_batch.m_nz[p] = nz;
+                    }
+                }
+                else
+                {
+                    stack[stackSize++] = node.m_child[lane];
+                }
+            }
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+
+WideBVHCollision::WideBVHCollision(cMesh* a_mesh)
+{
+    m_mesh = a_mesh;
+    TriangleBVH bvh;
+    buildTriangleBVH(bvh, a_mesh);
+    buildWideBVH(m_tree, bvh);
+}
+
+//------------------------------------------------------------------------------
+
+bool WideBVHCollision::computeCollision(cGenericObject* a_object,
+                                        cVector3d& a_segmentPointA,
+                                        cVector3d& a_segmentPointB,
+                                        cCollisionRecorder& a_recorder,
+                                        cCollisionSettings& a_settings)
+{
+    if (m_tree.m_nodes.empty())
+    {
+        return (false);
+    }
+
+    // segment in the mesh frame, axes along which it does not move never cut a slab
+    float origin[3], invDir[3];
+    for (int k = 0; k < 3; k++)
+    {
+        double dir = a_segmentPointB(k) - a_segmentPointA(k);
+        origin[k] = (float)a_segmentPointA(k);
+        invDir[k] = (fabs(dir) > 1e-12) ? (float)(1.0 / dir) : ((dir < 0.0) ? -1e12f : 1e12f);
+    }
+    float radius = (float)a_settings.m_collisionRadius;
+
+    bool hit = false;
+    int stack[256];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0)
+    {
+        const WideBVH::Node& node = m_tree.m_nodes[stack[--stackSize]];
+        int mask = crossWideNode(node, origin, invDir, radius);
+        for (int lane = 0; lane < 4; lane++)
+        {
+            if ((mask & (1 << lane)) == 0)
+            {
+                continue;
+            }
+            if (node.m_count[lane] > 0)
+            {
+                for (int j = 0; j < node.m_count[lane]; j++)
+                {
+                    int triangle = m_tree.m_indices[node.m_child[lane] + j];
+                    hit = m_mesh->m_triangles->computeCollision(triangle, a_object, a_segmentPointA, a_segmentPointB,
+                                                                a_recorder, a_settings) || hit;
+                }
+            }
+            else
+            {
+                stack[stackSize++] = node.m_child[lane];
+            }
+        }
+    }
+    return (hit);
+}
+
+//------------------------------------------------------------------------------
+
+void setCollisionTree(cMesh* a_mesh, CollisionTree a_tree, double a_radius)
+{
+    if (a_mesh == object)
+    {
+        objectWideCollision = NULL;
+    }
+
+    // the CHAI3D tree replaces any previous detector of the mesh
+    if (a_tree == COLLISION_TREE_AABB)
+    {
+        a_mesh->createAABBCollisionDetector(a_radius);
+        return;
+    }
+
+    cGenericCollision* collision = NULL;
+    WideBVHCollision* wideCollision = NULL;
+    if (a_tree == COLLISION_TREE_SDF)
+    {
+        collision = new SignedDistanceCollision(a_mesh, a_radius);
+    }
+    else
+    {
+        wideCollision = new WideBVHCollision(a_mesh);
+        collision = wideCollision;
+    }
+    cGenericCollision* previous = a_mesh->getCollisionDetector();
+    a_mesh->setCollisionDetector(collision);
+    delete previous;
+    if (a_mesh == object)
+    {
+        objectWideCollision = wideCollision;
+    }
+}
+
+//------------------------------------------------------------------------------
+
+int checkWidePartialNodes(void)
+{
+    const int MAX_TRIANGLES = 12;
+    const int NUM_SEGMENTS = 2000;
+    const double SPACING = 0.02;
+
+    srand(2);
+    int numPartialNodes = 0;
+    int numDifferent = 0;
+    for (int numTriangles = 1; numTriangles <= MAX_TRIANGLES; numTriangles++)
+    {
+        // a row of small triangles: up to BVH_LEAF_SIZE form a single leaf,
+        // more give inner nodes with 2 or 3 children
+        cMesh* mesh = new cMesh();
+        for (int i = 0; i < numTriangles; i++)
+        {
+            double x = SPACING * i;
+            unsigned int v0 = mesh->newVertex(cVector3d(x, -0.005, 0.0));
+            unsigned int v1 = mesh->newVertex(cVector3d(x + 0.01, -0.005, 0.0));
+            unsigned int v2 = mesh->newVertex(cVector3d(x, 0.005, 0.0));
+            mesh->newTriangle(v0, v1, v2);
+        }
+        TriangleBVH bvh;
+        buildTriangleBVH(bvh, mesh);
+        WideBVH wide;
+        buildWideBVH(wide, bvh);
+        for (unsigned int i = 0; i < wide.m_nodes.size(); i++)
+        {
+            numPartialNodes += (wide.m_nodes[i].m_laneMask != 15) ? 1 : 0;
+        }
+
+        // segments crossing the row from above, and next to it
+        vector<double> nearest[2];
+        for (int tree = 0; tree < 2; tree++)
+        {
+            setCollisionTree(mesh, (tree == 0) ? COLLISION_TREE_AABB : COLLISION_TREE_WIDE, SPHERE_RADIUS);
+            cCollisionRecorder recorder;
+            cCollisionSettings settings;
+            settings.m_checkForNearestCollisionOnly = true;
+            settings.m_returnMinimalCollisionData = false;
+            settings.m_collisionRadius = SPHERE_RADIUS;
+            srand(3 + numTriangles);
+            for (int i = 0; i < NUM_SEGMENTS; i++)
+            {
+                double x = (SPACING * (numTriangles + 2)) * (double)rand() / (double)RAND_MAX - SPACING;
+                double y = 0.06 * ((double)rand() / (double)RAND_MAX - 0.5);
+                cVector3d a(x, y, 0.02 * (double)rand() / (double)RAND_MAX);
+                cVector3d b(x + 0.01 * ((double)rand() / (double)RAND_MAX - 0.5), y, -0.02 * (double)rand() / (double)RAND_MAX);
+                recorder.clear();
+                bool hit = mesh->computeCollisionDetection(a, b, recorder, settings);
+                nearest[tree].push_back(hit ? recorder.m_nearestCollision.m_squareDistance : -1.0);
+            }
+        }
+        for (int i = 0; i < NUM_SEGMENTS; i++)
+        {
+            numDifferent += (nearest[0][i] != nearest[1][i]) ? 1 : 0;
+        }
+        delete mesh;
+    }
+
+    cout << "partial nodes: " << numPartialNodes << " wide nodes with empty children, " << numDifferent
+         << " segments with a different nearest contact" << endl;
+    return (numDifferent);
+}
+
+//------------------------------------------------------------------------------
+
+void benchmarkCollisionTrees(const HeightPyramid& a_pyramid)
+{
+    const int GRID_SIZE = 512;
+    const int NUM_SEGMENTS = 20000;
+    const int NUM_PROBES = 2000;
+    const double depthScale = 0.05 * PLANE_SIZE;
+    const float radius = (float)PROBE_POINT_RADIUS;
+
+    // the plane as created in main() and a dense displaced grid
+    cMesh* meshes[2];
+    meshes[0] = new cMesh();
+    cCreatePlane(meshes[0], PLANE_SIZE, PLANE_SIZE);
+    meshes[1] = new cMesh();
+    vector<cVector3d> vertices;
+    vector<unsigned int> indices;
+    createDisplacedGrid(a_pyramid, GRID_SIZE, depthScale, vertices, indices);
+    for (unsigned int i = 0; i < vertices.size(); i++)
+    {
+        meshes[1]->newVertex(vertices[i]);
+    }
+    for (unsigned int i = 0; i < indices.size(); i += 3)
+    {
+        meshes[1]->newTriangle(indices[i], indices[i + 1], indices[i + 2]);
+    }
+    const char* meshNames[2] = { "plane", "displaced grid" };
+
+    // proxy motions: short segments ending near the surface
+    srand(1);
+    vector<cVector3d> segmentA(NUM_SEGMENTS), segmentB(NUM_SEGMENTS);
+    for (int i = 0; i < NUM_SEGMENTS; i++)
+    {
+        double x = PLANE_SIZE * (0.9 * (double)rand() / (double)RAND_MAX - 0.45);
+        double y = PLANE_SIZE * (0.9 * (double)rand() / (double)RAND_MAX - 0.45);
+        double z = -depthScale * (double)rand() / (double)RAND_MAX;
+        cVector3d step(0.002 * ((double)rand() / (double)RAND_MAX - 0.5),
+                       0.002 * ((double)rand() / (double)RAND_MAX - 0.5),
+                       0.01 * (double)rand() / (double)RAND_MAX);
+        segmentA[i] = cVector3d(x, y, z) + step;
+        segmentB[i] = cVector3d(x, y, z);
+    }
+
+    // empty children of wide nodes must never be traversed
+    checkWidePartialNodes();
+
+    cout << "Collision tree benchmark (" << NUM_SEGMENTS << " proxy segments of radius " << SPHERE_RADIUS
+         << ", " << NUM_PROBES << " probes of " << PROBE_POINTS_PER_SIDE * PROBE_POINTS_PER_SIDE << " points)" << endl;
+    cout << "mesh, triangles, tree, build ms, ns/segment, hits, us/probe, probe contacts" << endl;
+    for (int m = 0; m < 2; m++)
+    {
+        cMesh* mesh = meshes[m];
+        TriangleBVH bvh;
+        buildTriangleBVH(bvh, mesh);
+        WideBVH wide;
+        buildWideBVH(wide, bvh);
+        vector<double> nearest[2];
+
+        // probe positions over the mesh
+        ContactBatch probe;
+        probe.m_numPoints = PROBE_POINTS_PER_SIDE * PROBE_POINTS_PER_SIDE;
+        vector<float> probeX, probeY, probeZ;
+        for (int k = 0; k < NUM_PROBES; k++)
+        {
+            float cx = (float)segmentB[k](0), cy = (float)segmentB[k](1), cz = (float)segmentB[k](2);
+            for (int i = 0; i < probe.m_numPoints; i++)
+            {
+                probeX.push_back(cx + (float)PROBE_SIZE * ((float)(i % PROBE_POINTS_PER_SIDE) / (PROBE_POINTS_PER_SIDE - 1) - 0.5f));
+                probeY.push_back(cy + (float)PROBE_SIZE * ((float)(i / PROBE_POINTS_PER_SIDE) / (PROBE_POINTS_PER_SIDE - 1) - 0.5f));
+                probeZ.push_back(cz);
+            }
+        }
+
+        for (int tree = 0; tree < 2; tree++)
+        {
+            cPrecisionClock clock;
+            clock.start(true);
+            setCollisionTree(mesh, (tree == 0) ? COLLISION_TREE_AABB : COLLISION_TREE_WIDE, SPHERE_RADIUS);
+            double buildTime = clock.stop();
+
+            // proxy segment queries through the mesh detector
+            cCollisionRecorder recorder;
+            cCollisionSettings settings;
+            settings.m_checkForNearestCollisionOnly = true;
+            settings.m_returnMinimalCollisionData = false;
+            settings.m_collisionRadius = SPHERE_RADIUS;
+            int numHits = 0;
+            clock.start(true);
+            for (int i = 0; i < NUM_SEGMENTS; i++)
+            {
+                recorder.clear();
+                bool hit = mesh->computeCollisionDetection(segmentA[i], segmentB[i], recorder, settings);
+                numHits += hit ? 1 : 0;
+                nearest[tree].push_back(hit ? recorder.m_nearestCollision.m_squareDistance : -1.0);
+            }
+            double segmentTime = clock.stop();
+
+            // probe queries, batched on the binary tree or per point on the wide one
+            long long numContacts = 0;
+            clock.start(true);
+            for (int k = 0; k < NUM_PROBES; k++)
+            {
+                probe.m_x.assign(probeX.begin() + k * probe.m_numPoints, probeX.begin() + (k + 1) * probe.m_numPoints);
+                probe.m_y.assign(probeY.begin() + k * probe.m_numPoints, probeY.begin() + (k + 1) * probe.m_numPoints);
+                probe.m_z.assign(probeZ.begin() + k * probe.m_numPoints, probeZ.begin() + (k + 1) * probe.m_numPoints);
+                if (tree == 0)
+                {
+                    queryContactsBatch(bvh, radius, probe);
+                }
+                else
+                {
+                    queryContactsWide(wide, radius, probe);
+                }
+                for (int i = 0; i < probe.m_numPoints; i++)
+                {
+                    numContacts += (probe.m_depth[i] > 0.0f) ? 1 : 0;
+                }
+            }
+            double probeTime = clock.stop();
+
+            cout << meshNames[m] << ", " << bvh.m_numTriangles << ", " << ((tree == 0) ? "aabb" : "wide") << ", "
+                 << cStr(1e3 * buildTime, 1) << ", " << cStr(1e9 * segmentTime / NUM_SEGMENTS, 0) << ", "
+                 << numHits << ", " << cStr(1e6 * probeTime / NUM_PROBES, 2) << ", " << numContacts << endl;
+        }
+
+        // both detectors must report the same nearest contacts
+        int numDifferent = 0;
+        for (int i = 0; i < NUM_SEGMENTS; i++)
+        {
+            numDifferent += (nearest[0][i] != nearest[1][i]) ? 1 : 0;
+        }
+        cout << meshNames[m] << ": " << numDifferent << " segments with a different nearest contact" << endl;
+        delete mesh;
+    }
+}
+
+//------------------------------------------------------------------------------
+
+bool readTextFile(const string& a_filename, string& a_text)
+{
+    ifstream file(a_filename.c_str(), ios::in | ios::binary);
+    if (!file)
+    {
+        return (false);
+    }
+    stringstream text;
+    text << file.rdbuf();
+    a_text = text.str();
+    return (true);
+}
+
+//------------------------------------------------------------------------------
+
+bool CachedShaderProgram::loadBinary(GLenum a_format, const vector<unsigned char>& a_binary)
+{
+    if (a_binary.empty())
+    {
+        return (false);
+    }
+
+    GLuint id = glCreateProgram();
+    glProgramBinary(id, a_format, &a_binary[0], (GLsizei)a_binary.size());
+    GLint status = GL_FALSE;
+    glGetProgramiv(id, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE)
+    {
+        glDeleteProgram(id);
+        return (false);
+    }
+
+    m_id = id;
+    m_linked = true;
+    m_uniformLocations.clear();
+    return (true);
+}
+
+//------------------------------------------------------------------------------
+
+bool CachedShaderProgram::getBinary(GLenum& a_format, vector<unsigned char>& a_binary)
+{
+    if (!isLinked())
+    {
+        return (false);
+    }
+
+    GLint length = 0;
+    glGetProgramiv(getId(), GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+    {
+        return (false);
+    }
+    a_binary.resize(length);
+    GLsizei written = 0;
+    glGetProgramBinary(getId(), length, &written, &a_format, &a_binary[0]);
+    a_binary.resize(written);
+    return (written > 0);
+}
+
+//------------------------------------------------------------------------------
+
+GLint CachedShaderProgram::getCachedUniformLocation(const string& a_name)
+{
+    map<string, GLint>::iterator it = m_uniformLocations.find(a_name);
+    if (it != m_uniformLocations.end())
+    {
+        return (it->second);
+    }
+    GLint location = glGetUniformLocation(getId(), a_name.c_str());
+    m_uniformLocations[a_name] = location;
+    return (location);
+}
+
+//------------------------------------------------------------------------------
+
+void CachedShaderProgram::setUniformi(GLint a_location, GLint a_value)
+{
+    if (a_location < 0)
+    {
+        return;
+    }
+    if (GLEW_ARB_separate_shader_objects)
+    {
+        glProgramUniform1i(getId(), a_location, a_value);
+    }
+    else
+    {
+        glUseProgram(getId());
+        glUniform1i(a_location, a_value);
+        glUseProgram(0);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void CachedShaderProgram::setUniformf(GLint a_location, GLfloat a_value)
+{
+    if (a_location < 0)
+    {
+        return;
+    }
+    if (GLEW_ARB_separate_shader_objects)
+    {
+        glProgramUniform1f(getId(), a_location, a_value);
+    }
+    else
+    {
+        glUseProgram(getId());
+        glUniform1f(a_location, a_value);
+        glUseProgram(0);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+// inserts the define lines after the #version directive of a source, if any
+static string insertShaderDefines(const string& a_source, const string& a_defines)
+{
+    if (a_defines.empty())
+    {
+        return (a_source);
+    }
+    size_t start = a_source.find_first_not_of(" \t\r\n");
+    if ((start != string::npos) && (a_source.compare(start, 8, "#version") == 0))
+    {
+        size_t end = a_source.find('\n', start);
+        if (end == string::npos)
+        {
+            return (a_source + "\n" + a_defines);
+        }
+        return (a_source.substr(0, end + 1) + a_defines + a_source.substr(end + 1));
+    }
+    return (a_defines + a_source);
+}
+
+//------------------------------------------------------------------------------
+
+// 64 bit FNV-1a hash
+static unsigned long long hashString(const string& a_text, unsigned long long a_hash = 14695981039346656037ULL)
+{
+    for (size_t i = 0; i < a_text.size(); i++)
+    {
+        a_hash ^= (unsigned char)a_text[i];
+        a_hash *= 1099511628211ULL;
+    }
+    return (a_hash);
+}
+
+//------------------------------------------------------------------------------
+
+CachedShaderProgramPtr ShaderProgramCache::getProgram(const string& a_vertexSource,
+                                                      const string& a_fragmentSource,
+                                                      const string& a_defines)
+{
+    string vertexSource = insertShaderDefines(a_vertexSource, a_defines);
+    string fragmentSource = insertShaderDefines(a_fragmentSource, a_defines);
+
+    // binaries only fit the driver that produced them
+    const char* renderer = (const char*)glGetString(GL_RENDERER);
+    const char* version = (const char*)glGetString(GL_VERSION);
+    unsigned long long key = hashString(vertexSource);
+    key = hashString(string(1, '\0') + fragmentSource, key);
+    key = hashString(string(1, '\0') + (renderer ? renderer : "") + (version ? version : ""), key);
+
+    // program already created during this run
+    lock_guard<mutex> lock(m_mutex);
+    map<unsigned long long, CachedShaderProgramPtr>::iterator it = m_programs.find(key);
+    if (it != m_programs.end())
+    {
+        return (it->second);
+    }
+
+    char name[32];
+    sprintf(name, "%016llx.bin", key);
+    string filename = SHADER_CACHE_PREFIX + name;
+    CachedShaderProgramPtr program(new CachedShaderProgram());
+
+    // program linked by a previous run: format, then driver binary
+    bool loaded = false;
+    if (GLEW_ARB_get_program_binary)
+    {
+        ifstream file(filename.c_str(), ios::in | ios::binary);
+        GLenum format = 0;
+        if (file.read((char*)&format, sizeof(format)))
+        {
+            vector<unsigned char> binary((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+            loaded = program->loadBinary(format, binary);
+        }
+    }
+
+    if (loaded)
+    {
+        m_numLoaded++;
+    }
+    else
+    {
+        // compile and link from source
+        cShaderPtr vertexShader = cShader::create(C_VERTEX_SHADER);
+        cShaderPtr fragmentShader = cShader::create(C_FRAGMENT_SHADER);
+        vertexShader->loadSourceCode(vertexSource);
+        fragmentShader->loadSourceCode(fragmentSource);
+        program->attachShader(vertexShader);
+        program->attachShader(fragmentShader);
+        program->linkProgram();
+        m_numCompiled++;
+
+        // keep the binary for the next run
+        GLenum format = 0;
+        vector<unsigned char> binary;
+        if (GLEW_ARB_get_program_binary && program->getBinary(format, binary))
+        {
+            ofstream file(filename.c_str(), ios::out | ios::binary);
+            file.write((const char*)&format, sizeof(format));
+            file.write((const char*)&binary[0], binary.size());
+        }
+    }
+
+    // a program that failed to link is rebuilt the next time it is asked for
+    if (program->isLinked())
+    {
+        m_programs[key] = program;
+    }
+    return (program);
+}
+
+//------------------------------------------------------------------------------
+
+void setupMappingProgram(CachedShaderProgramPtr a_program, int a_mode)
+{
+    a_program->setUniformi("uColorMap", 0);
+    //a_program->setUniformi("uColorMap2", 4);
+    a_program->setUniformi("uDepthMap", 4);
+    //a_program->setUniformi("uShadowMap", 0);
+    a_program->setUniformi("uNormalMap", 2);
+    a_program->setUniformf("uInvRadius", 0.0f);
+
+    // min depth pyramid for maximum mipmap relief mapping
+    if (a_mode == 3)
+    {
+        if (heightPyramidTexture == 0)
+        {
+            heightPyramidTexture = createHeightPyramidTexture(heightPyramid);
+        }
+        a_program->setUniformi("uDepthPyramid", PYRAMID_TEXTURE_UNIT);
+        a_program->setUniformf("uPyramidSize", (float)heightPyramid.m_width[0]);
+        a_program->setUniformi("uPyramidLevels", heightPyramid.m_numLevels);
+        a_program->setUniformi("uMaxIterations", PYRAMID_MAX_ITERATIONS);
+    }
+
+    // step uniforms of relief mapping
+    adaptiveQuality.apply(a_program, a_mode);
+}
+
+//------------------------------------------------------------------------------
+
+void setAdaptiveRelief(bool a_enabled)
+{
+    adaptiveQuality.setEnabled(a_enabled);
+    shaderManager.useAlternateSources(2, a_enabled);
+
+    // the adaptive search reads the coarser levels of the depth map
+    if (adaptiveDepthMap)
+    {
+        adaptiveDepthMap->setMipmapped(a_enabled);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+ShaderManager::ShaderManager() :
+    m_mode(0),
+    m_uniformHeightScale(-1),
+    m_warmupFrames(0),
+    m_running(false),
+    m_requestedMode(0),
+    m_context(NULL),
+    m_inotify(-1),
+    m_hasPending(false),
+    m_pendingMode(0)
+{
+    m_rebuild = false;
+    for (int i = 0; i < MAPPING_MODE_COUNT; i++)
+    {
+        m_useAlternate[i] = false;
+        m_available[i] = true;
+        m_frameMs[i] = 0.0;
+        m_gpuMs[i] = 0.0;
+        m_numFrames[i] = 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void ShaderManager::setShaderFiles(int a_mode, const string& a_vertexFile, const string& a_fragmentFile)
+{
+    m_vertexFile[a_mode] = a_vertexFile;
+    m_fragmentFile[a_mode] = a_fragmentFile;
+}
+
+//------------------------------------------------------------------------------
+
+void ShaderManager::setShaderSources(int a_mode, const string& a_vertexSource, const string& a_fragmentSource)
+{
+    m_vertexFile[a_mode].clear();
+    m_fragmentFile[a_mode].clear();
+    m_vertexSource[a_mode] = a_vertexSource;
+    m_fragmentSource[a_mode] = a_fragmentSource;
+}
+
+//------------------------------------------------------------------------------
+
+void ShaderManager::setAlternateSources(int a_mode, const string& a_vertexSource, const string& a_fragmentSource)
+{
+    m_alternateVertex[a_mode] = a_vertexSource;
+    m_alternateFragment[a_mode] = a_fragmentSource;
+}
+
+//------------------------------------------------------------------------------
+
+void ShaderManager::useAlternateSources(int a_mode, bool a_use)
+{
+    if (m_useAlternate[a_mode] != a_use)
+    {
+        m_useAlternate[a_mode] = a_use;
+        m_rebuild = true;
+    }
+}
+
+//------------------------------------------------------------------------------
+
+bool ShaderManager::loadSources(int a_mode, string& a_vertexSource, string& a_fragmentSource)
+{
+    if (m_useAlternate[a_mode] && !m_alternateFragment[a_mode].empty())
+    {
+        a_vertexSource = m_alternateVertex[a_mode];
+        a_fragmentSource = m_alternateFragment[a_mode];
+        return (true);
+    }
+    if (m_vertexFile[a_mode].empty())
+    {
+        a_vertexSource = m_vertexSource[a_mode];
+        a_fragmentSource = m_fragmentSource[a_mode];
+        return (true);
+    }
+    return (readTextFile(m_vertexFile[a_mode], a_vertexSource) &&
+            readTextFile(m_fragmentFile[a_mode], a_fragmentSource));
+}
+
+//------------------------------------------------------------------------------
+
+bool ShaderManager::start(int a_mode, GLFWwindow* a_sharedContext)
+{
+    // first program, built on the display context
+    string vertexSource, fragmentSource;
+    if (!loadSources(a_mode, vertexSource, fragmentSource))
+    {
+        return (false);
+    }
+    m_mode = a_mode;
+    m_requestedMode = a_mode;
+    m_program = shaderCache.getProgram(vertexSource, fragmentSource, m_defines);
+    m_uniformHeightScale = m_program->getCachedUniformLocation("heightScale");
+    m_warmupFrames = MAPPING_MODE_WARMUP_FRAMES;
+
+    // watch the shader files
+    for (int i = 0; i < MAPPING_MODE_COUNT; i++)
+    {
+        if (!m_vertexFile[i].empty())
+        {
+            m_watchedFiles.push_back(m_vertexFile[i]);
+            m_watchedFiles.push_back(m_fragmentFile[i]);
+        }
+    }
+    m_watchedTimes.resize(m_watchedFiles.size(), 0);
+    for (size_t i = 0; i < m_watchedFiles.size(); i++)
+    {
+        struct stat info;
+        if (stat(m_watchedFiles[i].c_str(), &info) == 0)
+        {
+            m_watchedTimes[i] = info.st_mtime;
+        }
+    }
+
+#if defined(__linux__)
+    // editors often replace files, so watch their directories
+    m_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    for (size_t i = 0; (m_inotify >= 0) && (i < m_watchedFiles.size()); i++)
+    {
+        size_t slash = m_watchedFiles[i].find_last_of("/\\");
+        string directory = (slash == string::npos) ? "." : m_watchedFiles[i].substr(0, slash);
+        inotify_add_watch(m_inotify, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+    }
+#endif
+
+    // the hidden window is current on the background thread only
+    m_context = a_sharedContext;
+    m_running = true;
+    m_thread = thread(&ShaderManager::run, this, a_mode);
+
+    return (true);
+}
+
+//------------------------------------------------------------------------------
+
+void ShaderManager::stop()
+{
+    m_running = false;
+    if (m_thread.joinable())
+    {
+        m_thread.join();
+    }
+#if defined(__linux__)
+    if (m_inotify >= 0)
+    {
+        ::close(m_inotify);
+        m_inotify = -1;
+    }
+#endif
+}
+
+//------------------------------------------------------------------------------
+
+void ShaderManager::requestMode(int a_mode)
+{
+    if (!m_available[a_mode])
+    {
+        cout << "Error - " << MAPPING_MODE_NAMES[a_mode] << " mapping unavailable." << endl;
+        return;
+    }
+    m_requestedMode = a_mode;
+}
+
+//------------------------------------------------------------------------------
+
+bool ShaderManager::waitForFileChanges(int a_timeoutMs)
+{
+#if defined(__linux__)
+    if (m_inotify >= 0)
+    {
+        pollfd fd = { m_inotify, POLLIN, 0 };
+        if (poll(&fd, 1, a_timeoutMs) <= 0)
+        {
+            return (false);
+        }
+
+        // keep the events naming one of the shader files
+        alignas(inotify_event) char buffer[4096];
+        bool changed = false;
+        ssize_t length;
+        while ((length = read(m_inotify, buffer, sizeof(buffer))) > 0)
+        {
+            for (char* p = buffer; p < buffer + length; p += sizeof(inotify_event) + ((inotify_event*)p)->len)
+            {
+                inotify_event* event = (inotify_event*)p;
+                for (size_t i = 0; (event->len > 0) && (i < m_watchedFiles.size()); i++)
+                {
+                    const string& file = m_watchedFiles[i];
+                    size_t slash = file.find_last_of("/\\");
+                    if (file.compare(slash + 1, string::npos, event->name) == 0)
+                    {
+                        changed = true;
+                    }
+                }
+            }
+        }
+        return (changed);
+    }
+#endif
+
+    // poll the modification times
+    cSleepMs(a_timeoutMs);
+    bool changed = false;
+    for (size_t i = 0; i < m_watchedFiles.size(); i++)
+    {
+        struct stat info;
+        if ((stat(m_watchedFiles[i].c_str(), &info) == 0) && (info.st_mtime != m_watchedTimes[i]))
+        {
+            m_watchedTimes[i] = info.st_mtime;
+            changed = true;
+        }
+    }
+    return (changed);
+}
+
+//------------------------------------------------------------------------------
+
+void ShaderManager::run(int a_mode)
+{
+    if (m_context)
+    {
+        glfwMakeContextCurrent(m_context);
+    }
+
+    int builtMode = a_mode;
+    while (m_running)
+    {
+        bool changed = waitForFileChanges(100);
+        changed = m_rebuild.exchange(false) || changed;
+        int mode = m_requestedMode;
+        if (!changed && (mode == builtMode))
+        {
+            continue;
+        }
+        builtMode = mode;
+
+        string vertexSource, fragmentSource;
+        if (!loadSources(mode, vertexSource, fragmentSource))
+        {
+            cout << "Error - Shader files of " << MAPPING_MODE_NAMES[mode] << " mapping failed to load." << endl;
+            continue;
+        }
+
+        // compile here if objects are shared with the display context
+        CachedShaderProgramPtr program;
+        if (m_context)
+        {
+            program = shaderCache.getProgram(vertexSource, fragmentSource, m_defines);
+            glFinish();
+        }
+
+        lock_guard<mutex> lock(m_mutex);
+        m_hasPending = true;
+        m_pendingMode = mode;
+        m_pendingVertex = vertexSource;
+        m_pendingFragment = fragmentSource;
+        m_pendingProgram = program;
+    }
+
+    if (m_context)
+    {
+        glfwMakeContextCurrent(NULL);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+bool ShaderManager::swapProgram()
+{
+    int mode;
+    string vertexSource, fragmentSource;
+    CachedShaderProgramPtr program;
+    {
+        lock_guard<mutex> lock(m_mutex);
+        if (!m_hasPending)
+        {
+            return (false);
+        }
+        m_hasPending = false;
+        mode = m_pendingMode;
+        vertexSource.swap(m_pendingVertex);
+        fragmentSource.swap(m_pendingFragment);
+        program = m_pendingProgram;
+        m_pendingProgram.reset();
+    }
+
+    // no shared context: compile on the display context
+    if (!program)
+    {
+        program = shaderCache.getProgram(vertexSource, fragmentSource, m_defines);
+    }
+
+    // keep the current program if the new one does not link
+    if (!program->isLinked())
+    {
+        cout << "Error - " << MAPPING_MODE_NAMES[mode] << " mapping shaders failed to link, keeping "
+             << MAPPING_MODE_NAMES[m_mode] << " mapping." << endl;
+        return (false);
+    }
+    if ((program == m_program) && (mode == m_mode))
+    {
+        return (false);
+    }
+
+    if (mode != m_mode)
+    {
+        printFrameTimes();
+        cout << "> Mapping mode: " << MAPPING_MODE_NAMES[mode] << endl;
+    }
+    else
+    {
+        cout << "> Reloaded " << MAPPING_MODE_NAMES[mode] << " mapping shaders" << endl;
+    }
+
+    m_mode = mode;
+    m_program = program;
+    m_uniformHeightScale = m_program->getCachedUniformLocation("heightScale");
+    m_warmupFrames = MAPPING_MODE_WARMUP_FRAMES;
+    return (true);
+}
+
+//------------------------------------------------------------------------------
+
+void ShaderManager::setHeightScale(float a_heightScale)
+{
+    m_program->setUniformf(m_uniformHeightScale, a_heightScale);
+}
+
+//------------------------------------------------------------------------------
+
+void ShaderManager::recordFrameTime(double a_frameMs, double a_gpuMs)
+{
+    if (m_warmupFrames > 0)
+    {
+        m_warmupFrames--;
+        return;
+    }
+    m_frameMs[m_mode] += a_frameMs;
+    m_gpuMs[m_mode] += a_gpuMs;
+    m_numFrames[m_mode]++;
+}
+
+//------------------------------------------------------------------------------
+
+void ShaderManager::printFrameTimes()
+{
+    for (int i = 0; i < MAPPING_MODE_COUNT; i++)
+    {
+        if (m_numFrames[i] > 0)
+        {
+            cout << "> " << MAPPING_MODE_NAMES[i] << " mapping: "
+                 << cStr(m_frameMs[i] / m_numFrames[i], 3) << " ms/frame, "
+                 << cStr(m_gpuMs[i] / m_numFrames[i], 3) << " ms GPU (views), "
+                 << m_numFrames[i] << " frames" << endl;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+
+bool AssetLoader::resolvePath(const string& a_name, string& a_path) const
+{
+    for (size_t i = 0; i < m_searchPaths.size(); i++)
+    {
+        string path = m_searchPaths[i] + a_name;
+        ifstream file(path.c_str(), ios::in | ios::binary);
+        if (file)
+        {
+            a_path = path;
+            return (true);
+        }
+    }
+    return (false);
+}
+
+//------------------------------------------------------------------------------
+
+void AssetLoader::decodeAssets()
+{
+    TRACE_THREAD("asset decoder");
+    cPrecisionClock clock;
+    int index;
+    while ((index = m_nextAsset++) < (int)m_assets.size())
+    {
+        TRACE_ZONE("decode image");
+        Asset& asset = m_assets[index];
+        clock.start(true);
+        asset.m_loaded = !asset.m_path.empty() && asset.m_image->loadFromFile(asset.m_path);
+        asset.m_decodeTime = clock.stop();
+
+        lock_guard<mutex> lock(m_mutex);
+        m_decoded.push_back(index);
+        m_decodedCondition.notify_one();
+    }
+}
+
+//------------------------------------------------------------------------------
+
+bool AssetLoader::loadAll(int a_numThreads)
+{
+    TRACE_ZONE("AssetLoader::loadAll");
+    cPrecisionClock totalClock;
+    totalClock.start(true);
+
+    int numAssets = (int)m_assets.size() - m_numDecoded;
+    if (numAssets <= 0)
+    {
+        return (true);
+    }
+
+    // one worker per core, no more than images
+    int numThreads = (a_numThreads > 0) ? a_numThreads : (int)thread::hardware_concurrency();
+    numThreads = cClamp(numThreads, 1, numAssets);
+    m_nextAsset = m_numDecoded;
+    vector<thread> workers;
+    for (int i = 0; i < numThreads; i++)
+    {
+        workers.push_back(thread(&AssetLoader::decodeAssets, this));
+    }
+
+    // without pixel buffer objects, textures are uploaded from memory
+    GLuint pixelBuffers[ASSET_PIXEL_BUFFER_COUNT] = { 0 };
+    if (GLEW_ARB_pixel_buffer_object)
+    {
+        glGenBuffers(ASSET_PIXEL_BUFFER_COUNT, pixelBuffers);
+    }
+
+    // upload each image as soon as it is decoded
+    bool success = true;
+    cPrecisionClock uploadClock;
+    for (int i = 0; i < numAssets; i++)
+    {
+        int index;
+        {
+            unique_lock<mutex> lock(m_mutex);
+            while (m_decoded.empty())
+            {
+                m_decodedCondition.wait(lock);
+            }
+            index = m_decoded.front();
+            m_decoded.erase(m_decoded.begin());
+        }
+
+        Asset& asset = m_assets[index];
+        if (!asset.m_loaded)
+        {
+            success = false;
+            continue;
+        }
+        TRACE_ZONE("upload texture");
+        uploadClock.start(true);
+        asset.m_upload(pixelBuffers[i % ASSET_PIXEL_BUFFER_COUNT]);
+        asset.m_uploadTime = uploadClock.stop();
+    }
+
+    for (int i = 0; i < numThreads; i++)
+    {
+        workers[i].join();
+    }
+    if (GLEW_ARB_pixel_buffer_object)
+    {
+        glDeleteBuffers(ASSET_PIXEL_BUFFER_COUNT, pixelBuffers);
+    }
+
+    m_numDecoded = (int)m_assets.size();
+    m_totalTime += totalClock.stop();
+    return (success);
+}
+
+//------------------------------------------------------------------------------
+
+bool AssetLoader::isLoaded(const string& a_name) const
+{
+    for (size_t i = 0; i < m_assets.size(); i++)
+    {
+        if (m_assets[i].m_name == a_name)
+        {
+            return (m_assets[i].m_loaded);
+        }
+    }
+    return (false);
+}
+
+//------------------------------------------------------------------------------
+
+void AssetLoader::printTimings() const
+{
+    double decodeTime = 0.0;
+    double uploadTime = 0.0;
+    for (size_t i = 0; i < m_assets.size(); i++)
+    {
+        const Asset& asset = m_assets[i];
+        if (!asset.m_loaded)
+        {
+            cout << "> " << asset.m_name << ": failed" << endl;
+            continue;
+        }
+        cout << "> " << asset.m_name << ": " << asset.m_image->getWidth() << "x" << asset.m_image->getHeight()
+             << ", decode " << cStr(1e3 * asset.m_decodeTime, 2) << " ms"
+             << ", upload " << cStr(1e3 * asset.m_uploadTime, 2) << " ms" << endl;
+        decodeTime += asset.m_decodeTime;
+        uploadTime += asset.m_uploadTime;
+    }
+    cout << "> Assets: " << cStr(1e3 * m_totalTime, 2) << " ms total, "
+         << cStr(1e3 * (decodeTime + uploadTime), 2) << " ms decode + upload"
+         << (GLEW_ARB_pixel_buffer_object ? " (pixel buffer objects)" : "") << endl;
+}
+
+//------------------------------------------------------------------------------
+
+MappedFile::MappedFile() :
+    m_data(NULL),
+    m_size(0)
+#if defined(_WIN32)
+    , m_file(INVALID_HANDLE_VALUE),
+    m_mapping(NULL)
+#endif
+{
+}
+
+//------------------------------------------------------------------------------
+
+bool MappedFile::open(const string& a_filename)
+{
+    close();
+
+#if defined(_WIN32)
+    m_file = CreateFileA(a_filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER size;
+    if ((m_file == INVALID_HANDLE_VALUE) || !GetFileSizeEx(m_file, &size) || (size.QuadPart == 0))
+    {
+        close();
+        return (false);
+    }
+    m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+    m_data = m_mapping ? (const unsigned char*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    m_size = (size_t)size.QuadPart;
+#else
+    int file = ::open(a_filename.c_str(), O_RDONLY);
+    struct stat info;
+    if ((file < 0) || (fstat(file, &info) != 0) || (info.st_size == 0))
+    {
+        if (file >= 0)
+        {
+            ::close(file);
+        }
+        return (false);
+    }
+    void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    ::close(file);
+    m_data = (data != MAP_FAILED) ? (const unsigned char*)data : NULL;
+    m_size = (size_t)info.st_size;
+#endif
+
+    if (m_data == NULL)
+    {
+        close();
+        return (false);
+    }
+    return (true);
+}
+
+//------------------------------------------------------------------------------
+
+void MappedFile::close()
+{
+#if defined(_WIN32)
+    if (m_data)
+    {
+        UnmapViewOfFile(m_data);
+    }
+    if (m_mapping)
+    {
+        CloseHandle(m_mapping);
+    }
+    if (m_file != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_file);
+    }
+    m_mapping = NULL;
+    m_file = INVALID_HANDLE_VALUE;
+#else
+    if (m_data)
+    {
+        munmap((void*)m_data, m_size);
+    }
+#endif
+    m_data = NULL;
+    m_size = 0;
+}
+
+//------------------------------------------------------------------------------
+
+// size in bytes of a level of a packed texture
+static unsigned long long packedLevelSize(unsigned int a_format, unsigned int a_width, unsigned int a_height)
+{
+    if (a_format == PACKED_RGTC2)
+    {
+        return (16ULL * ((a_width + 3) / 4) * ((a_height + 3) / 4));
+    }
+    return ((a_format == PACKED_R16 ? 2ULL : 1ULL) * a_width * a_height);
+}
+
+//------------------------------------------------------------------------------
+
+bool PackedTexture::open(const string& a_filename)
+{
+    if (!m_file.open(a_filename))
+    {
+        return (false);
+    }
+
+    // reject files that are truncated or were written by another version
+    const PackedTextureHeader& header = getHeader();
+    bool valid = (m_file.getSize() >= sizeof(PackedTextureHeader)) &&
+                 (memcmp(header.m_magic, "PTEX", 4) == 0) &&
+                 (header.m_version == PACKED_TEXTURE_VERSION) &&
+                 (header.m_format <= PACKED_RGTC2) &&
+                 (header.m_numLevels >= 1) && (header.m_numLevels <= (unsigned int)PACKED_MAX_LEVELS);
+    for (unsigned int level = 0; valid && (level < header.m_numLevels); level++)
+    {
+        unsigned int w = cMax(header.m_width >> level, 1u);
+        unsigned int h = cMax(header.m_height >> level, 1u);
+        valid = (header.m_size[level] == packedLevelSize(header.m_format, w, h)) &&
+                (header.m_offset[level] % PACKED_ALIGNMENT == 0) &&
+                (header.m_offset[level] + header.m_size[level] <= m_file.getSize());
+    }
+    if (!valid)
+    {
+        cout << "Error - " << a_filename << " is not a valid packed texture." << endl;
+        m_file.close();
+    }
+    return (valid);
+}
+
+//------------------------------------------------------------------------------
+
+// writes the header and levels of a packed texture
+static bool writePackedTexture(const string& a_filename,
+                               unsigned int a_format,
+                               unsigned int a_width,
+                               unsigned int a_height,
+                               const vector<vector<unsigned char> >& a_levels)
+{
+    PackedTextureHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.m_magic, "PTEX", 4);
+    header.m_version = PACKED_TEXTURE_VERSION;
+    header.m_format = a_format;
+    header.m_width = a_width;
+    header.m_height = a_height;
+    header.m_numLevels = cMin((unsigned int)a_levels.size(), (unsigned int)PACKED_MAX_LEVELS);
+
+    unsigned long long offset = sizeof(header);
+    for (unsigned int level = 0; level < header.m_numLevels; level++)
+    {
+        offset = (offset + PACKED_ALIGNMENT - 1) / PACKED_ALIGNMENT * PACKED_ALIGNMENT;
+        header.m_offset[level] = offset;
+        header.m_size[level] = a_levels[level].size();
+        offset += a_levels[level].size();
+    }
+
+    ofstream file(a_filename.c_str(), ios::out | ios::binary);
+    if (!file)
+    {
+        return (false);
+    }
+    file.write((const char*)&header, sizeof(header));
+    for (unsigned int level = 0; level < header.m_numLevels; level++)
+    {
+        vector<char> padding((size_t)(header.m_offset[level] - file.tellp()), 0);
+        if (!padding.empty())
+        {
+            file.write(&padding[0], padding.size());
+        }
+        file.write((const char*)&a_levels[level][0], a_levels[level].size());
+    }
+    return (file.good());
+}
+
+//------------------------------------------------------------------------------
+
+// number of levels of a full mip chain
+static int numMipLevels(int a_width, int a_height)
+{
+    int numLevels = 1;
+    while ((a_width > 1) || (a_height > 1))
+    {
+        a_width = cMax(a_width / 2, 1);
+        a_height = cMax(a_height / 2, 1);
+        numLevels++;
+    }
+    return (cMin(numLevels, PACKED_MAX_LEVELS));
+}
+
+//------------------------------------------------------------------------------
+
+bool packHeightMap(cImagePtr a_image, bool a_16bit, const string& a_filename)
+{
+    int w = a_image->getWidth();
+    int h = a_image->getHeight();
+    if ((w == 0) || (h == 0))
+    {
+        return (false);
+    }
+
+    // red channel, as read by the shaders
+    vector<float> level(w * h);
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            cColorb color;
+            a_image->getPixelColor(x, y, color);
+            level[y * w + x] = (float)color.getR() / 255.0f;
+        }
+    }
+
+    // box filtered mip chain, quantized per level
+    int numLevels = numMipLevels(w, h);
+    vector<vector<unsigned char> > levels(numLevels);
+    for (int i = 0; i < numLevels; i++)
+    {
+        if (i > 0)
+        {
+            int pw = cMax(w / 2, 1);
+            int ph = cMax(h / 2, 1);
+            vector<float> parent(pw * ph);
+            for (int y = 0; y < ph; y++)
+            {
+                for (int x = 0; x < pw; x++)
+                {
+                    int x0 = cMin(2 * x, w - 1), x1 = cMin(2 * x + 1, w - 1);
+                    int y0 = cMin(2 * y, h - 1), y1 = cMin(2 * y + 1, h - 1);
+                    parent[y * pw + x] = 0.25f * (level[y0 * w + x0] + level[y0 * w + x1] +
+                                                  level[y1 * w + x0] + level[y1 * w + x1]);
+                }
+            }
+            level.swap(parent);
+            w = pw;
+            h = ph;
+        }
+
+        levels[i].resize((a_16bit ? 2 : 1) * w * h);
+        for (int j = 0; j < w * h; j++)
+        {
+            if (a_16bit)
+            {
+                ((unsigned short*)&levels[i][0])[j] = (unsigned short)(65535.0f * level[j] + 0.5f);
+            }
+            else
+            {
+                levels[i][j] = (unsigned char)(255.0f * level[j] + 0.5f);
+            }
+        }
+    }
+
+    return (writePackedTexture(a_filename, a_16bit ? PACKED_R16 : PACKED_R8,
+                               a_image->getWidth(), a_image->getHeight(), levels));
+}
+
+//------------------------------------------------------------------------------
+
+// compresses a 4x4 block of one channel (BC4, 8 interpolated values)
+static void encodeBC4Block(const unsigned char a_values[16], unsigned char a_block[8])
+{
+    unsigned char lo = 255;
+    unsigned char hi = 0;
+    for (int i = 0; i < 16; i++)
+    {
+        lo = cMin(lo, a_values[i]);
+        hi = cMax(hi, a_values[i]);
+    }
+    a_block[0] = hi;
+    a_block[1] = lo;
+
+    // the palette is uniform from hi (index 0) to lo (index 1), the other
+    // indices 2..7 are the interior steps
+    unsigned long long bits = 0;
+    if (hi > lo)
+    {
+        for (int i = 0; i < 16; i++)
+        {
+            int step = (7 * (hi - a_values[i]) + (hi - lo) / 2) / (hi - lo);
+            unsigned long long index = (step == 0) ? 0 : (step == 7) ? 1 : step + 1;
+            bits |= index << (3 * i);
+        }
+    }
+    for (int i = 0; i < 6; i++)
+    {
+        a_block[2 + i] = (unsigned char)(bits >> (8 * i));
+    }
+}
+
+//------------------------------------------------------------------------------
+
+bool packNormalMap(cImagePtr a_image, const string& a_filename)
+{
+    int w = a_image->getWidth();
+    int h = a_image->getHeight();
+    if ((w == 0) || (h == 0))
+    {
+        return (false);
+    }
+
+    // unit normals of level 0
+    vector<cVector3d> level(w * h);
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            cColorb color;
+            a_image->getPixelColor(x, y, color);
+            cVector3d normal(color.getR() / 127.5 - 1.0, color.getG() / 127.5 - 1.0, color.getB() / 127.5 - 1.0);
+            normal.normalize();
+            level[y * w + x] = normal;
+        }
+    }
+
+    int numLevels = numMipLevels(w, h);
+    vector<vector<unsigned char> > levels(numLevels);
+    for (int i = 0; i < numLevels; i++)
+    {
+        // average and renormalize the 2x2 children
+        if (i > 0)
+        {
+            int pw = cMax(w / 2, 1);
+            int ph = cMax(h / 2, 1);
+            vector<cVector3d> parent(pw * ph);
+            for (int y = 0; y < ph; y++)
+            {
+                for (int x = 0; x < pw; x++)
+                {
+                    int x0 = cMin(2 * x, w - 1), x1 = cMin(2 * x + 1, w - 1);
+                    int y0 = cMin(2 * y, h - 1), y1 = cMin(2 * y + 1, h - 1);
+                    cVector3d normal = level[y0 * w + x0] + level[y0 * w + x1] +
+                                       level[y1 * w + x0] + level[y1 * w + x1];
+                    if (normal.length() > 1e-9)
+                    {
+                        normal.normalize();
+                    }
+                    else
+                    {
+                        normal.set(0.0, 0.0, 1.0);
+                    }
+                    parent[y * pw + x] = normal;
+                }
+            }
+            level.swap(parent);
+            w = pw;
+            h = ph;
+        }
+
+        // x and y in 4x4 blocks, z is rebuilt by the shaders
+        int blocksX = (w + 3) / 4;
+        int blocksY = (h + 3) / 4;
+        levels[i].resize(16 * blocksX * blocksY);
+        for (int by = 0; by < blocksY; by++)
+        {
+            for (int bx = 0; bx < blocksX; bx++)
+            {
+                unsigned char red[16], green[16];
+                for (int j = 0; j < 16; j++)
+                {
+                    const cVector3d& normal = level[cMin(4 * by + j / 4, h - 1) * w + cMin(4 * bx + j % 4, w - 1)];
+                    red[j] = (unsigned char)cClamp(127.5 * (normal(0) + 1.0) + 0.5, 0.0, 255.0);
+                    green[j] = (unsigned char)cClamp(127.5 * (normal(1) + 1.0) + 0.5, 0.0, 255.0);
+                }
+                unsigned char* block = &levels[i][16 * (by * blocksX + bx)];
+                encodeBC4Block(red, block);
+                encodeBC4Block(green, block + 8);
+            }
+        }
+    }
+
+    return (writePackedTexture(a_filename, PACKED_RGTC2, a_image->getWidth(), a_image->getHeight(), levels));
+}
+
+//------------------------------------------------------------------------------
+
+bool packTextures(bool a_height16)
+{
+    const char* names[] = { "toy_box_disp", "toy_box_normal" };
+    bool success = true;
+    for (int i = 0; i < 2; i++)
+    {
+        string filename;
+        cImagePtr image = cImage::create();
+        if (!assetLoader.resolvePath(string(names[i]) + ".png", filename) || !image->loadFromFile(filename))
+        {
+            cout << "Error - " << names[i] << ".png failed to load correctly." << endl;
+            success = false;
+            continue;
+        }
+
+        // written next to the image, where the loader looks first
+        string packedFilename = filename.substr(0, filename.size() - 4) + ".ptex";
+        bool packed = (i == 0) ? packHeightMap(image, a_height16, packedFilename) : packNormalMap(image, packedFilename);
+        if (!packed)
+        {
+            cout << "Error - " << packedFilename << " could not be written." << endl;
+            success = false;
+            continue;
+        }
+
+        ifstream file(packedFilename.c_str(), ios::in | ios::binary | ios::ate);
+        cout << "> " << packedFilename << ": " << (int)file.tellg() / 1024 << " KB, was "
+             << image->getSizeInBytes() / 1024 << " KB uncompressed" << endl;
+    }
+    return (success);
+}
+
+//------------------------------------------------------------------------------
+
+void renderViews(void)
+{
+    // both views in one pass, timed as the first view
+    if (useMultiView)
+    {
+        TRACE_ZONE("multiViewRenderer.render");
+        beginGpuStage(GPU_STAGE_VIEW1);
+        multiViewRenderer.render();
+        endGpuStage();
+        return;
+    }
+
+    // render all framebuffers
+    {
+        TRACE_ZONE("frameBuffer1->renderView");
+        beginGpuStage(GPU_STAGE_VIEW1);
+        frameBuffer1->renderView();
+        endGpuStage();
+    }
+    {
+        TRACE_ZONE("frameBuffer2->renderView");
+        beginGpuStage(GPU_STAGE_VIEW2);
+        frameBuffer2->renderView();
+        endGpuStage();
+    }
+
+    // render world
+    {
+        TRACE_ZONE("camera->renderView");
+        beginGpuStage(GPU_STAGE_COMPOSITE);
+        camera->renderView(width, height);
+        endGpuStage();
+    }
+}
+
+//------------------------------------------------------------------------------
+
+int MultiViewRenderer::addView(cCamera* a_camera)
+{
+    if ((int)m_views.size() >= MULTI_VIEW_MAX_VIEWS)
+    {
+        return (-1);
+    }
+    RenderView view;
+    memset(&view, 0, sizeof(view));
+    view.m_camera = a_camera;
+    m_views.push_back(view);
+    return ((int)m_views.size() - 1);
+}
+
+//------------------------------------------------------------------------------
+
+void MultiViewRenderer::setViewport(int a_view, int a_x, int a_y, int a_width, int a_height)
+{
+    RenderView& view = m_views[a_view];
+    view.m_x = a_x;
+    view.m_y = a_y;
+    view.m_width = a_width;
+    view.m_height = a_height;
+}
+
+//------------------------------------------------------------------------------
+
+void MultiViewRenderer::collectItems()
+{
+    // the bounding spheres are computed once, the objects of the world are
+    // only listed again when some are added or removed
+    if (m_numChildren != m_world->getNumChildren())
+    {
+        m_items.clear();
+        for (unsigned int i = 0; i < m_world->getNumChildren(); i++)
+        {
+            cGenericObject* child = m_world->getChild(i);
+
+            // cameras draw nothing, lights are set up once per view
+            if ((dynamic_cast<cCamera*>(child) != NULL) || (dynamic_cast<cGenericLight*>(child) != NULL))
+            {
+                continue;
+            }
+
+            MultiViewItem item;
+            item.m_object = child;
+            child->computeBoundaryBox(true);
+            cVector3d boxMin = child->getBoundaryMin();
+            cVector3d boxMax = child->getBoundaryMax();
+            bool bounded = (boxMin(0) <= boxMax(0)) && (boxMin(1) <= boxMax(1)) && (boxMin(2) <= boxMax(2));
+            item.m_center = 0.5 * (boxMin + boxMax);
+            item.m_radius = bounded ? 0.5 * (boxMax - boxMin).length() : -1.0;
+            item.m_viewMask = 0;
+            m_items.push_back(item);
+        }
+        m_numChildren = m_world->getNumChildren();
+    }
+
+    // cull each bounding sphere against all views
+    m_numCulled = 0;
+    for (size_t i = 0; i < m_items.size(); i++)
+    {
+        MultiViewItem& item = m_items[i];
+        item.m_viewMask = 0;
+        if (!item.m_object->getShowEnabled())
+        {
+            continue;
+        }
+        cVector3d center = item.m_object->getGlobalPos() + item.m_object->getGlobalRot() * item.m_center;
+        for (size_t j = 0; j < m_views.size(); j++)
+        {
+            bool visible = true;
+            for (int k = 0; visible && (item.m_radius >= 0.0) && (k < 6); k++)
+            {
+                const double* plane = m_views[j].m_planes[k];
+                visible = (plane[0] * center(0) + plane[1] * center(1) + plane[2] * center(2) + plane[3] >= -item.m_radius);
+            }
+            if (visible)
+            {
+                item.m_viewMask |= (1u << j);
+            }
+            else
+            {
+                m_numCulled++;
+            }
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void MultiViewRenderer::updateView(RenderView& a_view)
+{
+    cCamera* camera = a_view.m_camera;
+
+    // perspective projection, as set up by CHAI3D from the field of view
+    double aspect = (double)a_view.m_width / (double)cMax(a_view.m_height, 1);
+    double f = 1.0 / tan(0.5 * camera->getFieldViewAngleRad());
+    double zNear = camera->getNearClippingPlane();
+    double zFar = camera->getFarClippingPlane();
+    double* p = a_view.m_projection;
+    memset(p, 0, 16 * sizeof(double));
+    p[0] = f / aspect;
+    p[5] = f;
+    p[10] = (zFar + zNear) / (zNear - zFar);
+    p[11] = -1.0;
+    p[14] = 2.0 * zFar * zNear / (zNear - zFar);
+
+    // look-at view matrix of the camera frame
+    cVector3d eye = camera->getGlobalPos();
+    cVector3d forward = camera->getLookVector();
+    forward.normalize();
+    cVector3d side = cCross(forward, camera->getUpVector());
+    side.normalize();
+    cVector3d up = cCross(side, forward);
+    double* v = a_view.m_view;
+    v[0] = side(0);  v[4] = side(1);  v[8] = side(2);   v[12] = -cDot(side, eye);
+    v[1] = up(0);    v[5] = up(1);    v[9] = up(2);     v[13] = -cDot(up, eye);
+    v[2] = -forward(0); v[6] = -forward(1); v[10] = -forward(2); v[14] = cDot(forward, eye);
+    v[3] = 0.0;      v[7] = 0.0;      v[11] = 0.0;      v[15] = 1.0;
+
+    // frustum planes from the rows of projection * view
+    double m[16];
+    for (int c = 0; c < 4; c++)
+    {
+        for (int r = 0; r < 4; r++)
+        {
+            m[4 * c + r] = p[r] * v[4 * c] + p[4 + r] * v[4 * c + 1] + p[8 + r] * v[4 * c + 2] + p[12 + r] * v[4 * c + 3];
+        }
+    }
+    for (int k = 0; k < 6; k++)
+    {
+        int row = k / 2;
+        double sign = (k % 2 == 0) ? 1.0 : -1.0;
+        double* plane = a_view.m_planes[k];
+        for (int c = 0; c < 4; c++)
+        {
+            plane[c] = m[4 * c + 3] + sign * m[4 * c + row];
+        }
+        double length = sqrt(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+        for (int c = 0; c < 4; c++)
+        {
+            plane[c] /= length;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void MultiViewRenderer::renderLayer(cGenericObject* a_layer, const RenderView& a_view, cRenderOptions& a_options)
+{
+    // widgets are placed in pixels of the view
+    glDisable(GL_LIGHTING);
+    glDisable(GL_DEPTH_TEST);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glOrtho(0.0, a_view.m_width, 0.0, a_view.m_height, -1.0, 1.0);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    a_layer->renderSceneGraph(a_options);
+}
+
+//------------------------------------------------------------------------------
+
+void MultiViewRenderer::render()
+{
+    if ((m_world == NULL) || m_views.empty())
+    {
+        return;
+    }
+
+    // one traversal of the world for all views
+    for (size_t j = 0; j < m_views.size(); j++)
+    {
+        updateView(m_views[j]);
+    }
+    collectItems();
+
+    // draws of all views, sorted once
+    m_queue.clear();
+    m_queue.resetStats();
+    for (size_t i = 0; i < m_items.size(); i++)
+    {
+        if (m_items[i].m_viewMask != 0)
+        {
+            m_queue.submit(m_items[i].m_object, m_items[i].m_viewMask);
+        }
+    }
+    m_queue.sort();
+
+    cRenderOptions options;
+    options.m_single_pass_only = true;
+    options.m_render_opaque_objects_only = false;
+    options.m_render_transparent_front_faces_only = false;
+    options.m_render_transparent_back_faces_only = false;
+    options.m_enable_lighting = true;
+    options.m_render_materials = true;
+    options.m_render_textures = true;
+    options.m_creating_shadow_map = false;
+    options.m_rendering_shadow = false;
+    options.m_shadow_light_level = 1.0;
+    options.m_storeObjectPositions = false;
+    options.m_resetDisplay = false;
+    options.m_markForUpdate = false;
+
+    glEnable(GL_SCISSOR_TEST);
+    for (size_t j = 0; j < m_views.size(); j++)
+    {
+        const RenderView& view = m_views[j];
+        if ((view.m_width <= 0) || (view.m_height <= 0))
+        {
+            continue;
+        }
+        options.m_camera = view.m_camera;
+
+        glViewport(view.m_x, view.m_y, view.m_width, view.m_height);
+        glScissor(view.m_x, view.m_y, view.m_width, view.m_height);
+        const cColorf& background = m_world->m_backgroundColor;
+        glClearColor(background.getR(), background.getG(), background.getB(), background.getA());
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        renderLayer(view.m_camera->m_backLayer, view, options);
+
+        // lights are positioned in the eye frame of each view
+        glMatrixMode(GL_PROJECTION);
+        glLoadMatrixd(view.m_projection);
+        glMatrixMode(GL_MODELVIEW);
+        glLoadMatrixd(view.m_view);
+        glEnable(GL_DEPTH_TEST);
+        glEnable(GL_LIGHTING);
+        m_world->renderLightSources(options);
+
+        m_queue.execute(options, view.m_view, 1u << j);
+
+        renderLayer(view.m_camera->m_frontLayer, view, options);
+    }
+    glDisable(GL_SCISSOR_TEST);
+    glViewport(0, 0, width, height);
+
+    m_numDraws = m_queue.getStats().m_numDraws + m_queue.getStats().m_numFallbackDraws;
+}
+
+//------------------------------------------------------------------------------
+
+void RenderQueue::submit(cGenericObject* a_object, unsigned int a_viewMask)
+{
+    if (!a_object->getEnabled() || !a_object->getShowEnabled())
+    {
+        return;
+    }
+
+    RenderQueueItem item;
+    memset(&item, 0, sizeof(item));
+    item.m_object = a_object;
+    item.m_viewMask = a_viewMask;
+
+    // the queue draws meshes with a shader program and no children
+    cMesh* mesh = dynamic_cast<cMesh*>(a_object);
+    if ((mesh != NULL) && (mesh->getNumChildren() == 0) && mesh->getShaderProgram())
+    {
+        item.m_mesh = mesh;
+        item.m_program = mesh->getShaderProgram().get();
+        if (mesh->getUseTexture())
+        {
+            item.m_textures[0] = mesh->m_texture.get();
+            item.m_textures[1] = mesh->m_texture2.get();
+            item.m_textures[2] = mesh->m_normalMap.get();
+        }
+        item.m_material = mesh->m_material.get();
+        item.m_useCulling = mesh->getUseCulling();
+    }
+    m_items.push_back(item);
+}
+
+//------------------------------------------------------------------------------
+
+void RenderQueue::sort()
+{
+    // by program, then textures, then material, objects rendered by CHAI3D last
+    stable_sort(m_items.begin(), m_items.end(), [](const RenderQueueItem& a, const RenderQueueItem& b)
+    {
+        if ((a.m_mesh == NULL) != (b.m_mesh == NULL))
+        {
+            return (b.m_mesh == NULL);
+        }
+        if (a.m_program != b.m_program)
+        {
+            return (less<cShaderProgram*>()(a.m_program, b.m_program));
+        }
+        for (int i = 0; i < RENDER_QUEUE_TEXTURES; i++)
+        {
+            if (a.m_textures[i] != b.m_textures[i])
+            {
+                return (less<cGenericTexture*>()(a.m_textures[i], b.m_textures[i]));
+            }
+        }
+        return (less<cMaterial*>()(a.m_material, b.m_material));
+    });
+}
+
+//------------------------------------------------------------------------------
+
+const RenderQueue::AttributeLocations& RenderQueue::getAttributes(cShaderProgram* a_program)
+{
+    GLuint id = a_program->getId();
+    map<GLuint, AttributeLocations>::iterator it = m_attributes.find(id);
+    if (it != m_attributes.end())
+    {
+        return (it->second);
+    }
+
+    // names of the CHAI3D vertex attributes
+    AttributeLocations& attributes = m_attributes[id];
+    attributes.m_position = glGetAttribLocation(id, "aPosition");
+    attributes.m_normal = glGetAttribLocation(id, "aNormal");
+    attributes.m_texCoord = glGetAttribLocation(id, "aTexCoord");
+    attributes.m_tangent = glGetAttribLocation(id, "aTangent");
+    attributes.m_bitangent = glGetAttribLocation(id, "aBitangent");
+    return (attributes);
+}
+
+//------------------------------------------------------------------------------
+
+void RenderQueue::execute(cRenderOptions& a_options, const double a_view[16], unsigned int a_viewMask)
+{
+    // state left by the previous draw
+    cShaderProgram* program = NULL;
+    cGenericTexture* textures[RENDER_QUEUE_TEXTURES] = { NULL };
+    cMaterial* material = NULL;
+    int culling = -1;
+
+    glMatrixMode(GL_MODELVIEW);
+    glCullFace(GL_BACK);
+    for (size_t i = 0; i < m_items.size(); i++)
+    {
+        const RenderQueueItem& item = m_items[i];
+        if (((item.m_viewMask & a_viewMask) == 0) || (item.m_mesh == NULL))
+        {
+            continue;
+        }
+
+        if (item.m_program != program)
+        {
+            item.m_program->use(item.m_mesh, a_options);
+            program = item.m_program;
+            m_stats.m_numProgramBinds++;
+        }
+        for (int t = 0; t < RENDER_QUEUE_TEXTURES; t++)
+        {
+            if (item.m_textures[t] != textures[t])
+            {
+                if (textures[t])
+                {
+                    textures[t]->renderFinalize(a_options);
+                }
+                if (item.m_textures[t])
+                {
+                    item.m_textures[t]->renderInitialize(a_options);
+                    m_stats.m_numTextureBinds++;
+                }
+                textures[t] = item.m_textures[t];
+            }
+        }
+        if ((item.m_material != material) && (item.m_material != NULL))
+        {
+            item.m_material->render(a_options);
+            material = item.m_material;
+            m_stats.m_numMaterialBinds++;
+        }
+        if ((int)item.m_useCulling != culling)
+        {
+            if (item.m_useCulling)
+            {
+                glEnable(GL_CULL_FACE);
+            }
+            else
+            {
+                glDisable(GL_CULL_FACE);
+            }
+            culling = (int)item.m_useCulling;
+        }
+
+        // model view matrix of the mesh
+        cVector3d pos = item.m_mesh->getGlobalPos();
+        cMatrix3d rot = item.m_mesh->getGlobalRot();
+        double model[16] = { rot(0,0), rot(1,0), rot(2,0), 0.0,
+                             rot(0,1), rot(1,1), rot(2,1), 0.0,
+                             rot(0,2), rot(1,2), rot(2,2), 0.0,
+                             pos(0),   pos(1),   pos(2),   1.0 };
+        glLoadMatrixd(a_view);
+        glMultMatrixd(model);
+
+        // vertices changed since the last frame, then the draw
+        const AttributeLocations& attributes = getAttributes(item.m_program);
+        GLint locations[5] = { attributes.m_position, attributes.m_normal, attributes.m_texCoord,
+                               attributes.m_tangent, attributes.m_bitangent };
+        MeshBuffer* buffer = getMeshBuffer(item.m_mesh);
+        m_stats.m_numBytesUploaded += buffer->update();
+        buffer->draw(locations);
+        m_stats.m_numDraws++;
+    }
+
+    for (int t = 0; t < RENDER_QUEUE_TEXTURES; t++)
+    {
+        if (textures[t])
+        {
+            textures[t]->renderFinalize(a_options);
+        }
+    }
+    if (program)
+    {
+        program->disable();
+    }
+    glDisable(GL_CULL_FACE);
+
+    // objects rendered by CHAI3D
+    for (size_t i = 0; i < m_items.size(); i++)
+    {
+        const RenderQueueItem& item = m_items[i];
+        if ((item.m_mesh == NULL) && (item.m_viewMask & a_viewMask))
+        {
+            glLoadMatrixd(a_view);
+            item.m_object->renderSceneGraph(a_options);
+            m_stats.m_numFallbackDraws++;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+
+MeshBuffer::MeshBuffer() :
+    m_mesh(NULL),
+    m_vertexBuffer(0),
+    m_indexBuffer(0),
+    m_numVertices(0),
+    m_numIndices(0),
+    m_mapped(NULL),
+    m_region(0)
+{
+    for (int i = 0; i < MESH_BUFFER_REGIONS; i++)
+    {
+        m_fences[i] = 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+
+void MeshBuffer::release()
+{
+    for (int i = 0; i < MESH_BUFFER_REGIONS; i++)
+    {
+        if (m_fences[i])
+        {
+            glDeleteSync(m_fences[i]);
+        }
+        m_fences[i] = 0;
+        m_pending[i].clear();
+    }
+    if (m_mapped)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    if (m_vertexBuffer)
+    {
+        glDeleteBuffers(1, &m_vertexBuffer);
+    }
+    if (m_indexBuffer)
+    {
+        glDeleteBuffers(1, &m_indexBuffer);
+    }
+    m_mapped = NULL;
+    m_region = 0;
+    m_vertexBuffer = 0;
+    m_indexBuffer = 0;
+    m_numVertices = 0;
+    m_numIndices = 0;
+    m_dirty.clear();
+}
+
+//------------------------------------------------------------------------------
+
+void MeshBuffer::packVertices(unsigned int a_first, unsigned int a_end, PackedVertex* a_destination)
+{
+    cVertexArrayPtr vertices = m_mesh->m_vertices;
+    const cVector3d zero(0.0, 0.0, 0.0);
+    for (unsigned int i = a_first; i < a_end; i++)
+    {
+        const cVector3d& position = vertices->m_localPos[i];
+        const cVector3d& normal = (i < vertices->m_normal.size()) ? vertices->m_normal[i] : zero;
+        const cVector3d& texCoord = (i < vertices->m_texCoord.size()) ? vertices->m_texCoord[i] : zero;
+        const cVector3d& tangent = (i < vertices->m_tangent.size()) ? vertices->m_tangent[i] : zero;
+        const cVector3d& bitangent = (i < vertices->m_bitangent.size()) ? vertices->m_bitangent[i] : zero;
+
+        PackedVertex& vertex = a_destination[i - a_first];
+        for (int j = 0; j < 3; j++)
+        {
+            vertex.m_position[j] = (float)position(j);
+            vertex.m_normal[j] = (float)normal(j);
+            vertex.m_tangent[j] = (float)tangent(j);
+            vertex.m_bitangent[j] = (float)bitangent(j);
+        }
+        vertex.m_texCoord[0] = (float)texCoord(0);
+        vertex.m_texCoord[1] = (float)texCoord(1);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+bool MeshBuffer::create(cMesh* a_mesh)
+{
+    release();
+    m_mesh = a_mesh;
+    m_numVertices = a_mesh->getNumVertices();
+    m_numIndices = cMin(3 * a_mesh->getNumTriangles(), (unsigned int)a_mesh->m_triangles->m_indices.size());
+    if ((m_numVertices == 0) || (m_numIndices == 0))
+    {
+        return (false);
+    }
+
+    // triangles do not change once created
+    glGenBuffers(1, &m_indexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, m_numIndices * sizeof(unsigned int),
+                 &a_mesh->m_triangles->m_indices[0], GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    // vertices: persistent coherent mapping of several copies, or a buffer
+    // updated in place
+    GLsizeiptr size = m_numVertices * sizeof(PackedVertex);
+    glGenBuffers(1, &m_vertexBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
+    if (GLEW_ARB_buffer_storage)
+    {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_ARRAY_BUFFER, MESH_BUFFER_REGIONS * size, NULL, flags);
+        m_mapped = (PackedVertex*)glMapBufferRange(GL_ARRAY_BUFFER, 0, MESH_BUFFER_REGIONS * size, flags);
+    }
+    if (m_mapped)
+    {
+        for (int i = 0; i < MESH_BUFFER_REGIONS; i++)
+        {
+            packVertices(0, m_numVertices, m_mapped + i * m_numVertices);
+        }
+    }
+    else
+    {
+        m_staging.resize(m_numVertices);
+        packVertices(0, m_numVertices, &m_staging[0]);
+        glBufferData(GL_ARRAY_BUFFER, size, &m_staging[0], GL_DYNAMIC_DRAW);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    return (true);
+}
+
+//------------------------------------------------------------------------------
+
+void MeshBuffer::markDirty(unsigned int a_first, unsigned int a_count)
+{
+    unsigned int end = cMin(a_first + a_count, m_numVertices);
+    if (a_first < end)
+    {
+        m_dirty.push_back(make_pair(a_first, end));
+    }
+}
+
+//------------------------------------------------------------------------------
+
+size_t MeshBuffer::update()
+{
+    // vertices or triangles added or removed: rebuild everything
+    if ((m_mesh->getNumVertices() != m_numVertices) ||
+        (cMin(3 * m_mesh->getNumTriangles(), (unsigned int)m_mesh->m_triangles->m_indices.size()) != m_numIndices))
+    {
+        create(m_mesh);
+        return (m_numVertices * sizeof(PackedVertex) + m_numIndices * sizeof(unsigned int));
+    }
+    if (m_dirty.empty())
+    {
+        return (0);
+    }
+
+    size_t numBytes = 0;
+    if (m_mapped)
+    {
+        // every copy has to receive the new ranges, the next one in the ring
+        // gets all it missed. Its last draw is MESH_BUFFER_REGIONS - 1 updates
+        // old, so its fence has normally signaled and nothing waits.
+        for (int i = 0; i < MESH_BUFFER_REGIONS; i++)
+        {
+            m_pending[i].insert(m_pending[i].end(), m_dirty.begin(), m_dirty.end());
+        }
+        int region = (m_region + 1) % MESH_BUFFER_REGIONS;
+        if (m_fences[region])
+        {
+            while (glClientWaitSync(m_fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) {}
+            glDeleteSync(m_fences[region]);
+            m_fences[region] = 0;
+        }
+
+        vector<pair<unsigned int, unsigned int> >& ranges = m_pending[region];
+        mergeRanges(ranges);
+        PackedVertex* destination = m_mapped + region * m_numVertices;
+        for (size_t i = 0; i < ranges.size(); i++)
+        {
+            packVertices(ranges[i].first, ranges[i].second, destination + ranges[i].first);
+            numBytes += (ranges[i].second - ranges[i].first) * sizeof(PackedVertex);
+        }
+        ranges.clear();
+        m_region = region;
+    }
+    else
+    {
+        mergeRanges(m_dirty);
+        glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
+        for (size_t i = 0; i < m_dirty.size(); i++)
+        {
+            unsigned int first = m_dirty[i].first;
+            unsigned int end = m_dirty[i].second;
+            packVertices(first, end, &m_staging[first]);
+            glBufferSubData(GL_ARRAY_BUFFER, first * sizeof(PackedVertex),
+                            (end - first) * sizeof(PackedVertex), &m_staging[first]);
+            numBytes += (end - first) * sizeof(PackedVertex);
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    m_dirty.clear();
+
+    return (numBytes);
+}
+
+//------------------------------------------------------------------------------
+
+void MeshBuffer::mergeRanges(vector<pair<unsigned int, unsigned int> >& a_ranges)
+{
+    if (a_ranges.empty())
+    {
+        return;
+    }
+
+    // merge overlapping and adjacent ranges
+    std::sort(a_ranges.begin(), a_ranges.end());
+    size_t numRanges = 0;
+    for (size_t i = 1; i < a_ranges.size(); i++)
+    {
+        if (a_ranges[i].first <= a_ranges[numRanges].second)
+        {
+            a_ranges[numRanges].second = cMax(a_ranges[numRanges].second, a_ranges[i].second);
+        }
+        else
+        {
+            a_ranges[++numRanges] = a_ranges[i];
+        }
+    }
+    a_ranges.resize(numRanges + 1);
+}
+
+//------------------------------------------------------------------------------
+
+void MeshBuffer::draw(const GLint a_locations[5])
+{
+    if (m_vertexBuffer == 0)
+    {
+        return;
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+
+    // position, normal, texture coordinate, tangent and bitangent of the copy drawn
+    const GLint sizes[5] = { 3, 3, 2, 3, 3 };
+    const size_t offsets[5] = { offsetof(PackedVertex, m_position), offsetof(PackedVertex, m_normal),
+                                offsetof(PackedVertex, m_texCoord), offsetof(PackedVertex, m_tangent),
+                                offsetof(PackedVertex, m_bitangent) };
+    size_t base = (size_t)m_region * m_numVertices * sizeof(PackedVertex);
+    for (int i = 0; i < 5; i++)
+    {
+        const GLvoid* pointer = (const GLvoid*)(base + offsets[i]);
+        if (a_locations[i] >= 0)
+        {
+            glEnableVertexAttribArray(a_locations[i]);
+            glVertexAttribPointer(a_locations[i], sizes[i], GL_FLOAT, GL_FALSE, sizeof(PackedVertex), pointer);
+        }
+        else if (i == 0)
+        {
+            glEnableClientState(GL_VERTEX_ARRAY);
+            glVertexPointer(3, GL_FLOAT, sizeof(PackedVertex), pointer);
+        }
+        else if (i == 1)
+        {
+            glEnableClientState(GL_NORMAL_ARRAY);
+            glNormalPointer(GL_FLOAT, sizeof(PackedVertex), pointer);
+        }
+        else if (i == 2)
+        {
+            glClientActiveTexture(GL_TEXTURE0);
+            glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+            glTexCoordPointer(2, GL_FLOAT, sizeof(PackedVertex), pointer);
+        }
+    }
+
+    glDrawElements(GL_TRIANGLES, m_numIndices, GL_UNSIGNED_INT, NULL);
+
+    for (int i = 0; i < 5; i++)
+    {
+        if (a_locations[i] >= 0)
+        {
+            glDisableVertexAttribArray(a_locations[i]);
+        }
+    }
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    // writes to the copy drawn must wait for this draw
+    if (m_mapped)
+    {
+        if (m_fences[m_region])
+        {
+            glDeleteSync(m_fences[m_region]);
+        }
+        m_fences[m_region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+MeshBuffer* getMeshBuffer(cMesh* a_mesh)
+{
+    shared_ptr<MeshBuffer>& buffer = meshBuffers[a_mesh];
+    if (!buffer)
+    {
+        buffer = make_shared<MeshBuffer>();
+        buffer->create(a_mesh);
+    }
+    return (buffer.get());
+}
+
+//------------------------------------------------------------------------------
+
+void markMeshVerticesDirty(cMesh* a_mesh, unsigned int a_first, unsigned int a_count)
+{
+    map<cMesh*, shared_ptr<MeshBuffer> >::iterator it = meshBuffers.find(a_mesh);
+    if (it != meshBuffers.end())
+    {
+        it->second->markDirty(a_first, a_count);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+// sum the tangents and bitangents of the triangles [a_first, a_end) of a mesh
+// (Lengyel, "Computing Tangent Space Basis Vectors for an Arbitrary Mesh")
+static void accumulateTangents(cMesh* a_mesh,
+                               unsigned int a_first,
+                               unsigned int a_end,
+                               TangentAccumulator& a_sums)
+{
+    const vector<unsigned int>& indices = a_mesh->m_triangles->m_indices;
+    const vector<bool>& allocated = a_mesh->m_triangles->m_allocated;
+    const vector<cVector3d>& positions = a_mesh->m_vertices->m_localPos;
+    const vector<cVector3d>& texCoords = a_mesh->m_vertices->m_texCoord;
+
+    // vertex range of the triangles
+    a_sums.m_first = 0;
+    a_sums.m_end = 0;
+    if (a_first >= a_end)
+    {
+        return;
+    }
+    unsigned int first = indices[3 * a_first];
+    unsigned int last = first;
+    for (unsigned int i = 3 * a_first; i < 3 * a_end; i++)
+    {
+        first = cMin(first, indices[i]);
+        last = cMax(last, indices[i]);
+    }
+    a_sums.m_first = first;
+    a_sums.m_end = last + 1;
+
+    double* sums[6];
+    for (int k = 0; k < 6; k++)
+    {
+        a_sums.m_sums[k].assign(a_sums.m_end - a_sums.m_first, 0.0);
+        sums[k] = a_sums.m_sums[k].data();
+    }
+
+    for (unsigned int i = a_first; i < a_end; i++)
+    {
+        if (!allocated[i])
+        {
+            continue;
+        }
+
+        unsigned int index[3] = { indices[3 * i], indices[3 * i + 1], indices[3 * i + 2] };
+        const cVector3d& v0 = positions[index[0]];
+        const cVector3d& v1 = positions[index[1]];
+        const cVector3d& v2 = positions[index[2]];
+        const cVector3d& t0 = texCoords[index[0]];
+        const cVector3d& t1 = texCoords[index[1]];
+        const cVector3d& t2 = texCoords[index[2]];
+
+        double x1 = v1(0) - v0(0), x2 = v2(0) - v0(0);
+        double y1 = v1(1) - v0(1), y2 = v2(1) - v0(1);
+        double z1 = v1(2) - v0(2), z2 = v2(2) - v0(2);
+        double s1 = t1(0) - t0(0), s2 = t2(0) - t0(0);
+        double u1 = t1(1) - t0(1), u2 = t2(1) - t0(1);
+
+        // degenerate texture coordinates give no direction
+        double det = s1 * u2 - s2 * u1;
+        if (det == 0.0)
+        {
+            continue;
+        }
+        double r = 1.0 / det;
+
+        double value[6] = { (u2 * x1 - u1 * x2) * r,
+                            (u2 * y1 - u1 * y2) * r,
+                            (u2 * z1 - u1 * z2) * r,
+                            (s1 * x2 - s2 * x1) * r,
+                            (s1 * y2 - s2 * y1) * r,
+                            (s1 * z2 - s2 * z1) * r };
+
+        for (int j = 0; j < 3; j++)
+        {
+            unsigned int v = index[j] - first;
+            for (int k = 0; k < 6; k++)
+            {
+                sums[k][v] += value[k];
+            }
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+
+// reduce the sums of all threads over the vertices [a_first, a_end), then
+// orthogonalize the tangents against the normals and derive the bitangents
+static void finalizeTangents(cMesh* a_mesh,
+                             const vector<TangentAccumulator>& a_sums,
+                             unsigned int a_first,
+                             unsigned int a_end)
+{
+    const vector<cVector3d>& normals = a_mesh->m_vertices->m_normal;
+    vector<cVector3d>& tangents = a_mesh->m_vertices->m_tangent;
+    vector<cVector3d>& bitangents = a_mesh->m_vertices->m_bitangent;
+
+    double t[3][TANGENT_BLOCK_SIZE];
+    double b[3][TANGENT_BLOCK_SIZE];
+    double n[3][TANGENT_BLOCK_SIZE];
+
+    for (unsigned int block = a_first; block < a_end; block += TANGENT_BLOCK_SIZE)
     {
-        // get width and height of window
-        glfwGetWindowSize(window, &width, &height);
+        int count = (int)cMin(a_end - block, (unsigned int)TANGENT_BLOCK_SIZE);
 
-        // render graphics
-        updateGraphics();
+        // sums of the threads whose triangles touch the block
+        for (int k = 0; k < 3; k++)
+        {
+            memset(t[k], 0, count * sizeof(double));
+            memset(b[k], 0, count * sizeof(double));
+        }
+        for (unsigned int s = 0; s < a_sums.size(); s++)
+        {
+            const TangentAccumulator& sums = a_sums[s];
+            unsigned int first = cMax(block, sums.m_first);
+            unsigned int end = cMin(block + count, sums.m_end);
+            for (unsigned int v = first; v < end; v++)
+            {
+                for (int k = 0; k < 3; k++)
+                {
+                    t[k][v - block] += sums.m_sums[k][v - sums.m_first];
+                    b[k][v - block] += sums.m_sums[3 + k][v - sums.m_first];
+                }
+            }
+        }
+        for (int i = 0; i < count; i++)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                n[k][i] = normals[block + i](k);
+            }
+        }
 
-        // swap buffers
-        glfwSwapBuffers(window);
+        // tangent = normalize(t - n (n.t)), bitangent = w (n x tangent) where
+        // the handedness w is the sign of (n x t).b
+        int i = 0;
+#if defined(USE_SSE2)
+        #define DOT(ax, ay, az, bx, by, bz) _mm_add_pd(_mm_add_pd(_mm_mul_pd(ax, bx), _mm_mul_pd(ay, by)), _mm_mul_pd(az, bz))
+        #define CROSS(ax, ay, bx, by) _mm_sub_pd(_mm_mul_pd(ax, by), _mm_mul_pd(ay, bx))
+        __m128d zero = _mm_setzero_pd();
+        __m128d one = _mm_set1_pd(1.0);
+        __m128d sign = _mm_set1_pd(-0.0);
+        for (; i + 2 <= count; i += 2)
+        {
+            __m128d nx = _mm_loadu_pd(n[0] + i), ny = _mm_loadu_pd(n[1] + i), nz = _mm_loadu_pd(n[2] + i);
+            __m128d tx = _mm_loadu_pd(t[0] + i), ty = _mm_loadu_pd(t[1] + i), tz = _mm_loadu_pd(t[2] + i);
+            __m128d bx = _mm_loadu_pd(b[0] + i), by = _mm_loadu_pd(b[1] + i), bz = _mm_loadu_pd(b[2] + i);
+
+            // handedness from the sums before orthogonalization
+            __m128d h = DOT(CROSS(ny, nz, ty, tz), CROSS(nz, nx, tz, tx), CROSS(nx, ny, tx, ty), bx, by, bz);
+            __m128d w = _mm_or_pd(one, _mm_and_pd(_mm_cmplt_pd(h, zero), sign));
+
+            // Gram-Schmidt, zero length tangents stay zero
+            __m128d d = DOT(nx, ny, nz, tx, ty, tz);
+            tx = _mm_sub_pd(tx, _mm_mul_pd(nx, d));
+            ty = _mm_sub_pd(ty, _mm_mul_pd(ny, d));
+            tz = _mm_sub_pd(tz, _mm_mul_pd(nz, d));
+            __m128d length2 = DOT(tx, ty, tz, tx, ty, tz);
+            __m128d scale = _mm_and_pd(_mm_cmpgt_pd(length2, zero), _mm_div_pd(one, _mm_sqrt_pd(length2)));
+            tx = _mm_mul_pd(tx, scale);
+            ty = _mm_mul_pd(ty, scale);
+            tz = _mm_mul_pd(tz, scale);
+
+            _mm_storeu_pd(t[0] + i, tx);
+            _mm_storeu_pd(t[1] + i, ty);
+            _mm_storeu_pd(t[2] + i, tz);
+            _mm_storeu_pd(b[0] + i, _mm_mul_pd(w, CROSS(ny, nz, ty, tz)));
+            _mm_storeu_pd(b[1] + i, _mm_mul_pd(w, CROSS(nz, nx, tz, tx)));
+            _mm_storeu_pd(b[2] + i, _mm_mul_pd(w, CROSS(nx, ny, tx, ty)));
+        }
+        #undef DOT
+        #undef CROSS
+#endif
+        for (; i < count; i++)
+        {
+            double nx = n[0][i], ny = n[1][i], nz = n[2][i];
+            double tx = t[0][i], ty = t[1][i], tz = t[2][i];
+
+            double h = (ny * tz - nz * ty) * b[0][i] + (nz * tx - nx * tz) * b[1][i] + (nx * ty - ny * tx) * b[2][i];
+            double w = (h < 0.0) ? -1.0 : 1.0;
+
+            double d = nx * tx + ny * ty + nz * tz;
+            tx -= nx * d;
+            ty -= ny * d;
+            tz -= nz * d;
+            double length2 = tx * tx + ty * ty + tz * tz;
+            double scale = (length2 > 0.0) ? 1.0 / sqrt(length2) : 0.0;
+            t[0][i] = tx * scale;
+            t[1][i] = ty * scale;
+            t[2][i] = tz * scale;
+            b[0][i] = w * (ny * t[2][i] - nz * t[1][i]);
+            b[1][i] = w * (nz * t[0][i] - nx * t[2][i]);
+            b[2][i] = w * (nx * t[1][i] - ny * t[0][i]);
+        }
 
-        // process events
-        glfwPollEvents();
-        programShader->setUniformf("heightScale", heightScale);
-        //programShader2->setUniformf("heightScale", heightScale);
+        for (i = 0; i < count; i++)
+        {
+            tangents[block + i].set(t[0][i], t[1][i], t[2][i]);
+            bitangents[block + i].set(b[0][i], b[1][i], b[2][i]);
+        }
+    }
+}
 
-        //print scale relieve
-        //cout << heightScale <<", "<< object->heighC << endl;
+//------------------------------------------------------------------------------
 
-        // signal frequency counter
-        freqCounterGraphics.signal(1);
+void computeTangentsParallel(cMesh* a_mesh, int a_numThreads)
+{
+    cVertexArrayPtr vertices = a_mesh->m_vertices;
+    unsigned int numVertices = a_mesh->getNumVertices();
+    unsigned int numTriangles = a_mesh->getNumTriangles();
+    if (numVertices == 0)
+    {
+        return;
     }
+    vertices->m_tangent.resize(cMax((unsigned int)vertices->m_tangent.size(), numVertices));
+    vertices->m_bitangent.resize(cMax((unsigned int)vertices->m_bitangent.size(), numVertices));
 
-    // close window
-    glfwDestroyWindow(window);
+    // small meshes are not worth the threads
+    int numThreads = (a_numThreads > 0) ? a_numThreads : (int)thread::hardware_concurrency();
+    numThreads = cClamp(numThreads, 1, (int)(numTriangles / TANGENT_TRIANGLES_PER_THREAD) + 1);
 
-    // terminate GLFW library
-    glfwTerminate();
+    // sum the triangles of contiguous ranges, each over the vertices it touches
+    vector<TangentAccumulator> sums(numThreads);
+    vector<thread> workers;
+    for (int k = 0; k < numThreads; k++)
+    {
+        unsigned int first = (unsigned int)((unsigned long long)numTriangles * k / numThreads);
+        unsigned int end = (unsigned int)((unsigned long long)numTriangles * (k + 1) / numThreads);
+        workers.push_back(thread(accumulateTangents, a_mesh, first, end, ref(sums[k])));
+    }
+    for (int k = 0; k < numThreads; k++)
+    {
+        workers[k].join();
+    }
 
-    // exit
-    return 0;
+    // reduce and orthogonalize contiguous ranges of vertices
+    workers.clear();
+    for (int k = 0; k < numThreads; k++)
+    {
+        unsigned int first = (unsigned int)((unsigned long long)numVertices * k / numThreads);
+        unsigned int end = (unsigned int)((unsigned long long)numVertices * (k + 1) / numThreads);
+        workers.push_back(thread(finalizeTangents, a_mesh, cref(sums), first, end));
+    }
+    for (int k = 0; k < numThreads; k++)
+    {
+        workers[k].join();
+    }
+
+    // upload the new vectors
+    vertices->m_flagTangentData = true;
+    vertices->m_flagBitangentData = true;
+    markMeshVerticesDirty(a_mesh, 0, numVertices);
 }
 
 //------------------------------------------------------------------------------
 
-void windowSizeCallback(GLFWwindow* a_window, int a_width, int a_height)
+void benchmarkTangents(unsigned int a_maxTriangles)
 {
-    // update window size
-    width  = a_width;
-    height = a_height;
-
-    int halfW = width / 2;
-    int halfH = height;
-    int offset = 1;
+    const double tolerance = 1e-6;
+    bool match = true;
 
-    // update display panel sizes and positions
-    viewPanel1->setLocalPos(0.0, 0.0);
-    viewPanel1->setSize(halfW, halfH);
+    cout << "Tangent space benchmark (" << thread::hardware_concurrency() << " threads)" << endl;
+    cout << "triangles, vertices, computeBTN ms, parallel ms, speedup, max tangent error, max bitangent error" << endl;
+    for (unsigned int numTriangles = 10000; numTriangles <= a_maxTriangles; numTriangles *= 10)
+    {
+        // displaced grid of about numTriangles triangles, so that the tangents vary
+        int size = (int)ceil(sqrt(0.5 * numTriangles));
+        cMesh* mesh = new cMesh();
+        for (int j = 0; j <= size; j++)
+        {
+            for (int i = 0; i <= size; i++)
+            {
+                double u = (double)i / (double)size;
+                double v = (double)j / (double)size;
+                double z = 0.02 * sin(8.0 * C_PI * u) * cos(6.0 * C_PI * v);
+                unsigned int index = mesh->newVertex(cVector3d(u - 0.5, v - 0.5, z));
+                mesh->m_vertices->setTexCoord(index, u, v);
+            }
+        }
+        for (int j = 0; j < size; j++)
+        {
+            for (int i = 0; i < size; i++)
+            {
+                unsigned int a = j * (size + 1) + i;
+                mesh->newTriangle(a, a + 1, a + size + 2);
+                mesh->newTriangle(a, a + size + 2, a + size + 1);
+            }
+        }
+        mesh->computeAllNormals();
+        unsigned int numVertices = mesh->getNumVertices();
+
+        cPrecisionClock clock;
+        clock.start(true);
+        mesh->computeBTN();
+        double serialTime = clock.stop();
+        vector<cVector3d> tangents = mesh->m_vertices->m_tangent;
+        vector<cVector3d> bitangents = mesh->m_vertices->m_bitangent;
+
+        clock.start(true);
+        computeTangentsParallel(mesh);
+        double parallelTime = clock.stop();
+
+        double tangentError = 0.0;
+        double bitangentError = 0.0;
+        for (unsigned int i = 0; i < numVertices; i++)
+        {
+            tangentError = cMax(tangentError, cDistance(tangents[i], mesh->m_vertices->m_tangent[i]));
+            bitangentError = cMax(bitangentError, cDistance(bitangents[i], mesh->m_vertices->m_bitangent[i]));
+        }
+        match = match && (tangentError < tolerance) && (bitangentError < tolerance);
 
-    viewPanel2->setLocalPos(halfW, 0.0);
-    viewPanel2->setSize(halfW, halfH);
+        cout << mesh->getNumTriangles() << ", " << numVertices << ", "
+             << 1000.0 * serialTime << ", " << 1000.0 * parallelTime << ", "
+             << serialTime / cMax(parallelTime, 1e-9) << ", "
+             << tangentError << ", " << bitangentError << endl;
 
-    // update frame buffer sizes
-    frameBuffer1->setSize(halfW, halfH);
-    frameBuffer2->setSize(halfW, halfH);
+        delete mesh;
+    }
+    cout << "results " << (match ? "match" : "do not match") << " computeBTN() within " << tolerance << endl;
 }
 
 //------------------------------------------------------------------------------
 
-void errorCallback(int a_error, const char* a_description)
+void getDefaultReferenceView(ReferenceView& a_view)
 {
-    cout << "Error: " << a_description << endl;
+    // same as cameraView1, the light and the plane created in main()
+    a_view.m_eye.set(1.43, 0.4, 0.860);
+    a_view.m_target.set(-0.732, -0.252, -0.63);
+    a_view.m_up.set(-0.602, -0.180, 0.773);
+    a_view.m_fieldViewDeg = 45.0;
+    a_view.m_width = 800;
+    a_view.m_height = 600;
+    a_view.m_planeCenter.set(0.0, 0.0, -0.3);
+    a_view.m_light.set(3.5, 2.0, 8.0);
+    a_view.m_shininess = 80.0;
+    a_view.m_mode = 2;
+    a_view.m_heightScale = heightScale;
+    a_view.m_numLinearSteps = 32;
+    a_view.m_numBinarySteps = 8;
+    a_view.m_maxIterations = PYRAMID_MAX_ITERATIONS;
 }
 
 //------------------------------------------------------------------------------
 
-void keyCallback(GLFWwindow* a_window, int a_key, int a_scancode, int a_action, int a_mods)
+// rgb of an image in [0,1], optionally remapped to [-1,1]
+static bool readReferenceMap(const string& a_name, bool a_signed, int& a_width, int& a_height, vector<float>& a_map)
 {
-    // filter calls that only include a key press
-    if ((a_action != GLFW_PRESS) && (a_action != GLFW_REPEAT))
+    cImagePtr image = cImage::create();
+    string filename;
+    if (!assetLoader.resolvePath(a_name, filename) || !image->loadFromFile(filename))
     {
-        return;
+        cout << "Error - " << a_name << " failed to load correctly." << endl;
+        return (false);
     }
 
-    // option - exit
-    else if ((a_key == GLFW_KEY_ESCAPE) || (a_key == GLFW_KEY_Q))
+    a_width = image->getWidth();
+    a_height = image->getHeight();
+    a_map.resize(3 * a_width * a_height);
+    for (int y = 0; y < a_height; y++)
     {
-        glfwSetWindowShouldClose(a_window, GLFW_TRUE);
+        for (int x = 0; x < a_width; x++)
+        {
+            cColorb color;
+            image->getPixelColor(x, y, color);
+            float* rgb = &a_map[3 * (y * a_width + x)];
+            rgb[0] = (float)color.getR() / 255.0f;
+            rgb[1] = (float)color.getG() / 255.0f;
+            rgb[2] = (float)color.getB() / 255.0f;
+            for (int k = 0; (k < 3) && a_signed; k++)
+            {
+                rgb[k] = 2.0f * rgb[k] - 1.0f;
+            }
+        }
     }
+    return (true);
+}
 
-    // option - toggle fullscreen
-    else if (a_key == GLFW_KEY_F)
+//------------------------------------------------------------------------------
+
+bool loadReferenceTextures(ReferenceTextures& a_textures)
+{
+    if (!readReferenceMap("wood.png", false, a_textures.m_colorWidth, a_textures.m_colorHeight, a_textures.m_color) ||
+        !readReferenceMap("toy_box_normal.png", true, a_textures.m_normalWidth, a_textures.m_normalHeight, a_textures.m_normal))
     {
-        // toggle state variable
-        fullscreen = !fullscreen;
+        return (false);
+    }
 
-        // get handle to monitor
-        GLFWmonitor* monitor = glfwGetPrimaryMonitor();
+    cImagePtr image = cImage::create();
+    string filename;
+    bool fileload = assetLoader.resolvePath("toy_box_disp.png", filename) && image->loadFromFile(filename);
+    if (!fileload || !buildHeightPyramid(a_textures.m_pyramid, image))
+    {
+        cout << "Error - Displacement image failed to load correctly." << endl;
+        return (false);
+    }
+    if (!isSquarePowerOfTwo(a_textures.m_pyramid))
+    {
+        cout << "Error - Relief traversals need a square, power of two displacement image." << endl;
+        return (false);
+    }
+    return (true);
+}
 
-        // get information about monitor
-        const GLFWvidmode* mode = glfwGetVideoMode(monitor);
+//------------------------------------------------------------------------------
 
-        // set fullscreen or window mode
-        if (fullscreen)
+// bilinear sample of an rgb map, clamped to the edges like the plane textures
+static inline void sampleReferenceMap(const vector<float>& a_map, int a_width, int a_height,
+                                      double a_u, double a_v, double* a_rgb)
+{
+    double x = cClamp(a_u * a_width - 0.5, 0.0, (double)(a_width - 1));
+    double y = cClamp(a_v * a_height - 0.5, 0.0, (double)(a_height - 1));
+    int x0 = (int)x;
+    int y0 = (int)y;
+    int x1 = cMin(x0 + 1, a_width - 1);
+    int y1 = cMin(y0 + 1, a_height - 1);
+    double fx = x - x0;
+    double fy = y - y0;
+    for (int k = 0; k < 3; k++)
+    {
+        double top = (1.0 - fx) * a_map[3 * (y0 * a_width + x0) + k] + fx * a_map[3 * (y0 * a_width + x1) + k];
+        double bottom = (1.0 - fx) * a_map[3 * (y1 * a_width + x0) + k] + fx * a_map[3 * (y1 * a_width + x1) + k];
+        a_rgb[k] = (1.0 - fy) * top + fy * bottom;
+    }
+}
+
+//------------------------------------------------------------------------------
+
+// traceReliefLinearBinary() for four rays at once, lanes that found the
+// surface stop counting iterations until all four have
+static void traceReliefPacket(const HeightPyramid& a_pyramid,
+                              const float* a_u, const float* a_v,
+                              const float* a_dirU, const float* a_dirV,
+                              int a_numLinearSteps,
+                              int a_numBinarySteps,
+                              float* a_depth,
+                              int* a_iterations)
+{
+#if defined(USE_SSE2)
+    #define SELECT(m, a, b) _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b))
+    __m128 u = _mm_loadu_ps(a_u);
+    __m128 v = _mm_loadu_ps(a_v);
+    __m128 du = _mm_loadu_ps(a_dirU);
+    __m128 dv = _mm_loadu_ps(a_dirV);
+    __m128 zero = _mm_setzero_ps();
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 step = _mm_set1_ps(1.0f / (float)a_numLinearSteps);
+    float su[4], sv[4], d[4];
+
+    // linear search for the first sample below the surface
+    __m128 t = zero;
+    __m128 active = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    __m128i iterations = _mm_setzero_si128();
+    for (int i = 0; (i < a_numLinearSteps) && (_mm_movemask_ps(active) != 0); i++)
+    {
+        _mm_storeu_ps(su, _mm_add_ps(u, _mm_mul_ps(t, du)));
+        _mm_storeu_ps(sv, _mm_add_ps(v, _mm_mul_ps(t, dv)));
+        for (int k = 0; k < 4; k++)
         {
-            glfwSetWindowMonitor(window, monitor, 0, 0, mode->width, mode->height, mode->refreshRate);
-            glfwSwapInterval(swapInterval);
+            d[k] = (float)samplePyramidDepth(a_pyramid, 0, su[k], sv[k]);
         }
-        else
+        iterations = _mm_sub_epi32(iterations, _mm_castps_si128(active));
+        active = _mm_andnot_ps(_mm_cmpge_ps(t, _mm_loadu_ps(d)), active);
+        t = _mm_add_ps(t, _mm_and_ps(active, step));
+    }
+
+    // binary refinement between the last two samples
+    __m128 t0 = _mm_max_ps(_mm_sub_ps(t, step), zero);
+    __m128 t1 = _mm_min_ps(t, one);
+    for (int i = 0; i < a_numBinarySteps; i++)
+    {
+        __m128 tm = _mm_mul_ps(_mm_set1_ps(0.5f), _mm_add_ps(t0, t1));
+        _mm_storeu_ps(su, _mm_add_ps(u, _mm_mul_ps(tm, du)));
+        _mm_storeu_ps(sv, _mm_add_ps(v, _mm_mul_ps(tm, dv)));
+        for (int k = 0; k < 4; k++)
         {
-            int w = 0.8 * mode->height;
-            int h = 0.5 * mode->height;
-            int x = 0.5 * (mode->width - w);
-            int y = 0.5 * (mode->height - h);
-            glfwSetWindowMonitor(window, NULL, x, y, w, h, mode->refreshRate);
-            glfwSwapInterval(swapInterval);
+            d[k] = (float)samplePyramidDepth(a_pyramid, 0, su[k], sv[k]);
         }
+        __m128 below = _mm_cmpge_ps(tm, _mm_loadu_ps(d));
+        t1 = SELECT(below, tm, t1);
+        t0 = SELECT(below, t0, tm);
     }
+    iterations = _mm_add_epi32(iterations, _mm_set1_epi32(a_numBinarySteps));
 
-    // option - toggle vertical mirroring
-    else if (a_key == GLFW_KEY_M)
+    _mm_storeu_ps(a_depth, t1);
+    _mm_storeu_si128((__m128i*)a_iterations, iterations);
+    #undef SELECT
+#else
+    for (int k = 0; k < 4; k++)
     {
-        mirroredDisplay = !mirroredDisplay;
-        camera->setMirrorVertical(mirroredDisplay);
+        double depth;
+        a_iterations[k] = traceReliefLinearBinary(a_pyramid, a_u[k], a_v[k], a_dirU[k], a_dirV[k],
+                                                  a_numLinearSteps, a_numBinarySteps, depth);
+        a_depth[k] = (float)depth;
     }
-    // option - chage Scale of height Depth
-    else if (a_key == GLFW_KEY_R)
+#endif
+}
+
+//------------------------------------------------------------------------------
+
+// render the tiles of an image until none is left
+static void renderReferenceTiles(const ReferenceTextures& a_textures,
+                                 const ReferenceView& a_view,
+                                 ReferenceImage& a_image,
+                                 atomic<int>& a_nextTile)
+{
+    // pinhole camera, rows from top to bottom
+    cVector3d forward = cNormalize(a_view.m_target - a_view.m_eye);
+    cVector3d right = cNormalize(cCross(forward, a_view.m_up));
+    cVector3d up = cCross(right, forward);
+    double tanHalf = tan(0.5 * cDegToRad(a_view.m_fieldViewDeg));
+    double aspect = (double)a_view.m_width / (double)a_view.m_height;
+    double halfSize = 0.5 * PLANE_SIZE;
+    const HeightPyramid& pyramid = a_textures.m_pyramid;
+
+    int tilesX = (a_view.m_width + REFERENCE_TILE_SIZE - 1) / REFERENCE_TILE_SIZE;
+    int tilesY = (a_view.m_height + REFERENCE_TILE_SIZE - 1) / REFERENCE_TILE_SIZE;
+    int tile;
+    while ((tile = a_nextTile++) < tilesX * tilesY)
     {
-        if (heightScale > 0.0f)
-            heightScale -= 0.0005f;
-        else
-            heightScale = 0.0f;
-       // object->heighC = 0.3125 * heightScale + 0.01; 
-        object->heighC = 0.45977 * heightScale + 0.01;
+        int tileX = (tile % tilesX) * REFERENCE_TILE_SIZE;
+        int tileY = (tile / tilesX) * REFERENCE_TILE_SIZE;
+        int endX = cMin(tileX + REFERENCE_TILE_SIZE, a_view.m_width);
+        int endY = cMin(tileY + REFERENCE_TILE_SIZE, a_view.m_height);
+        for (int y = tileY; y < endY; y++)
+        {
+            for (int x = tileX; x < endX; x += 4)
+            {
+                // packet of up to four pixels of the row, missing lanes are idle
+                int count = cMin(4, endX - x);
+                float u[4] = { 0.5f, 0.5f, 0.5f, 0.5f };
+                float v[4] = { 0.5f, 0.5f, 0.5f, 0.5f };
+                float du[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+                float dv[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+                cVector3d viewTS[4], lightTS[4];
+                bool hit[4] = { false, false, false, false };
+                for (int k = 0; k < count; k++)
+                {
+                    double sx = (2.0 * (x + k + 0.5) / a_view.m_width - 1.0) * tanHalf * aspect;
+                    double sy = (1.0 - 2.0 * (y + 0.5) / a_view.m_height) * tanHalf;
+                    cVector3d ray = forward + sx * right + sy * up;
+
+                    // front side of the plane, tangent space is the plane frame
+                    double s = (ray(2) != 0.0) ? (a_view.m_planeCenter(2) - a_view.m_eye(2)) / ray(2) : -1.0;
+                    cVector3d point = a_view.m_eye + s * ray;
+                    cVector3d local = point - a_view.m_planeCenter;
+                    hit[k] = (s > 0.0) && (a_view.m_eye(2) > a_view.m_planeCenter(2)) &&
+                             (fabs(local(0)) <= halfSize) && (fabs(local(1)) <= halfSize);
+                    if (!hit[k])
+                    {
+                        continue;
+                    }
+                    viewTS[k] = cNormalize(a_view.m_eye - point);
+                    lightTS[k] = cNormalize(a_view.m_light - point);
+                    u[k] = (float)(local(0) / PLANE_SIZE + 0.5);
+                    v[k] = (float)(local(1) / PLANE_SIZE + 0.5);
+                    du[k] = (float)(-viewTS[k](0) / cMax(viewTS[k](2), 0.05) * a_view.m_heightScale);
+                    dv[k] = (float)(-viewTS[k](1) / cMax(viewTS[k](2), 0.05) * a_view.m_heightScale);
+                }
+
+                // depth along the view ray where the surface is found
+                float depth[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+                int iterations[4] = { 0, 0, 0, 0 };
+                if (a_view.m_mode == 1)
+                {
+                    for (int k = 0; k < 4; k++)
+                    {
+                        depth[k] = (float)samplePyramidDepth(pyramid, 0, u[k], v[k]);
+                        iterations[k] = 1;
+                    }
+                }
+                else if (a_view.m_mode == 2)
+                {
+                    traceReliefPacket(pyramid, u, v, du, dv, a_view.m_numLinearSteps, a_view.m_numBinarySteps, depth, iterations);
+                }
+                else if (a_view.m_mode == 3)
+                {
+                    for (int k = 0; k < count; k++)
+                    {
+                        double d = 0.0;
+                        iterations[k] = hit[k] ? traceHeightPyramid(pyramid, u[k], v[k], du[k], dv[k], a_view.m_maxIterations, d) : 0;
+                        depth[k] = (float)d;
+                    }
+                }
+
+                // same lighting as the shaders
+                for (int k = 0; k < count; k++)
+                {
+                    int pixel = y * a_view.m_width + x + k;
+                    float* rgb = &a_image.m_color[3 * pixel];
+                    if (!hit[k])
+                    {
+                        rgb[0] = rgb[1] = rgb[2] = 0.0f;
+                        a_image.m_iterations[pixel] = -1;
+                        continue;
+                    }
+                    double su = u[k] + depth[k] * du[k];
+                    double sv = v[k] + depth[k] * dv[k];
+                    double color[3], normal[3];
+                    sampleReferenceMap(a_textures.m_color, a_textures.m_colorWidth, a_textures.m_colorHeight, su, sv, color);
+                    sampleReferenceMap(a_textures.m_normal, a_textures.m_normalWidth, a_textures.m_normalHeight, su, sv, normal);
+                    cVector3d n = cNormalize(cVector3d(normal[0], normal[1], normal[2]));
+                    cVector3d h = cNormalize(lightTS[k] + viewTS[k]);
+                    double diffuse = cMax(cDot(n, lightTS[k]), 0.0);
+                    double specular = pow(cMax(cDot(n, h), 0.0), cMax(a_view.m_shininess, 1.0));
+                    for (int c = 0; c < 3; c++)
+                    {
+                        rgb[c] = (float)cClamp(color[c] * (0.2 + 0.8 * diffuse) + 0.3 * specular, 0.0, 1.0);
+                    }
+                    a_image.m_iterations[pixel] = iterations[k];
+                }
+            }
+        }
     }
-    else if (a_key == GLFW_KEY_E)
+}
+
+//------------------------------------------------------------------------------
+
+void renderReference(const ReferenceTextures& a_textures,
+                     const ReferenceView& a_view,
+                     ReferenceImage& a_image,
+                     int a_numThreads)
+{
+    a_image.m_width = a_view.m_width;
+    a_image.m_height = a_view.m_height;
+    a_image.m_color.assign(3 * a_view.m_width * a_view.m_height, 0.0f);
+    a_image.m_iterations.assign(a_view.m_width * a_view.m_height, -1);
+
+    int numThreads = (a_numThreads > 0) ? a_numThreads : (int)thread::hardware_concurrency();
+    numThreads = cMax(numThreads, 1);
+    atomic<int> nextTile(0);
+    vector<thread> workers;
+    for (int i = 0; i < numThreads; i++)
     {
-        if (heightScale < 1.0f)
-            heightScale += 0.0005f;
-        else
-            heightScale = 1.0f;
-        //object->heighC = 0.3125 * heightScale + 0.01;
-        object->heighC = 0.45977 * heightScale + 0.01;
+        workers.push_back(thread(renderReferenceTiles, cref(a_textures), cref(a_view), ref(a_image), ref(nextTile)));
     }
-    // option - chage Scale of height Depth
-    else if (a_key == GLFW_KEY_T)
+    for (int i = 0; i < numThreads; i++)
     {
-        object->heighC -= 0.005f;
+        workers[i].join();
     }
-    else if (a_key == GLFW_KEY_Y)
+}
+
+//------------------------------------------------------------------------------
+
+bool saveReferenceImage(const ReferenceImage& a_image, const string& a_prefix)
+{
+    cImagePtr color = cImage::create();
+    cImagePtr heatmap = cImage::create();
+    color->allocate(a_image.m_width, a_image.m_height, GL_RGB);
+    heatmap->allocate(a_image.m_width, a_image.m_height, GL_RGB);
+    for (int y = 0; y < a_image.m_height; y++)
     {
-        object->heighC += 0.005f;
+        for (int x = 0; x < a_image.m_width; x++)
+        {
+            int pixel = y * a_image.m_width + x;
+            const float* rgb = &a_image.m_color[3 * pixel];
+            color->setPixelColor(x, y, cColorb((unsigned char)(255.0f * rgb[0] + 0.5f),
+                                               (unsigned char)(255.0f * rgb[1] + 0.5f),
+                                               (unsigned char)(255.0f * rgb[2] + 0.5f)));
+
+            // black off the plane, then blue to red to yellow with the iterations
+            int iterations = a_image.m_iterations[pixel];
+            if (iterations < 0)
+            {
+                heatmap->setPixelColor(x, y, cColorb(0, 0, 0));
+                continue;
+            }
+            double s = cMin((double)iterations / (double)REFERENCE_HEATMAP_MAX, 1.0);
+            double r = cMin(2.0 * s, 1.0);
+            double g = cMax(2.0 * s - 1.0, 0.0);
+            double b = cMax(1.0 - 2.0 * s, 0.0);
+            heatmap->setPixelColor(x, y, cColorb((unsigned char)(255.0 * r + 0.5),
+                                                 (unsigned char)(255.0 * g + 0.5),
+                                                 (unsigned char)(255.0 * b + 0.5)));
+        }
     }
-    //----------------MOVE-----------------
-    else if (a_key == GLFW_KEY_W)
+
+    return (color->saveToFile(a_prefix + ".png") && heatmap->saveToFile(a_prefix + "_iterations.png"));
+}
+
+//------------------------------------------------------------------------------
+
+bool renderReferenceImages(const string& a_prefix, double a_heightScale)
+{
+    ReferenceTextures textures;
+    if (!loadReferenceTextures(textures))
     {
-        cameraView1->setLocalPos(cameraView1->getLocalPos()+cVector3d(-0.01,0.0,0.0));
+        return (false);
     }
-    else if (a_key == GLFW_KEY_S)
+
+    ReferenceView view;
+    getDefaultReferenceView(view);
+    view.m_heightScale = a_heightScale;
+
+    cout << "Reference images (" << view.m_width << "x" << view.m_height << ", height scale " << a_heightScale
+         << ", " << thread::hardware_concurrency() << " threads)" << endl;
+    cout << "mode, file, mean iterations, max iterations, ms" << endl;
+    bool saved = true;
+    for (int mode = 0; mode < MAPPING_MODE_COUNT; mode++)
     {
-        cameraView1->setLocalPos(cameraView1->getLocalPos() + cVector3d(0.01, 0.0, 0.0));
+        view.m_mode = mode;
+        ReferenceImage image;
+        cPrecisionClock clock;
+        clock.start(true);
+        renderReference(textures, view, image);
+        double elapsed = clock.stop();
+
+        long long sumIterations = 0;
+        int numPixels = 0, maxIterations = 0;
+        for (unsigned int i = 0; i < image.m_iterations.size(); i++)
+        {
+            if (image.m_iterations[i] >= 0)
+            {
+                sumIterations += image.m_iterations[i];
+                maxIterations = cMax(maxIterations, image.m_iterations[i]);
+                numPixels++;
+            }
+        }
+
+        string name = MAPPING_MODE_NAMES[mode];
+        replace(name.begin(), name.end(), ' ', '_');
+        string filename = a_prefix + "_" + name;
+        saved = saveReferenceImage(image, filename) && saved;
+
+        cout << MAPPING_MODE_NAMES[mode] << ", " << filename << ".png, "
+             << cStr((double)sumIterations / cMax(numPixels, 1), 2) << ", " << maxIterations << ", "
+             << cStr(1000.0 * elapsed, 1) << endl;
     }
-    else if (a_key == GLFW_KEY_A)
+
+    if (!saved)
     {
-        cameraView1->setLocalPos(cameraView1->getLocalPos() + cVector3d(0.0, -0.01, 0.0));
+        cout << "Error - Reference images could not be written." << endl;
     }
-    else if (a_key == GLFW_KEY_D)
+    return (saved);
+}
+
+//------------------------------------------------------------------------------
+
+void AdaptiveQuality::update(double a_frameMs)
+{
+    if (!m_enabled || (a_frameMs <= 0.0))
     {
-        cameraView1->setLocalPos(cameraView1->getLocalPos() + cVector3d(0.0, 0.01, 0.0));
+        return;
     }
-    else if (a_key == GLFW_KEY_Z)
+
+    // small steps around the target so that the budget does not oscillate
+    double ratio = m_targetMs / a_frameMs;
+    if ((ratio < 0.95) || (ratio > 1.05))
     {
-        cameraView1->setLocalPos(cameraView1->getLocalPos() + cVector3d(0.0, 0.00, -0.01));
+        m_budget = cClamp(m_budget * cClamp(ratio, 0.9, 1.1), ADAPTIVE_MIN_BUDGET, 1.0);
     }
-    else if (a_key == GLFW_KEY_X)
+}
+
+//------------------------------------------------------------------------------
+
+void AdaptiveQuality::apply(CachedShaderProgramPtr a_program, int a_mode)
+{
+    if (a_mode == 2)
     {
-        cameraView1->setLocalPos(cameraView1->getLocalPos() + cVector3d(0.0, 0.0, 0.01));
+        // coarser depth samples as the budget drops, log2(1 / budget)
+        float depthSize = (heightPyramid.m_numLevels > 0) ? (float)heightPyramid.m_width[0] : 1.0f;
+        a_program->setUniformf(a_program->getCachedUniformLocation("uAdaptive"), m_enabled ? 1.0f : 0.0f);
+        a_program->setUniformf(a_program->getCachedUniformLocation("uMinSteps"), (float)ADAPTIVE_MIN_STEPS);
+        a_program->setUniformf(a_program->getCachedUniformLocation("uMaxSteps"), (float)ADAPTIVE_MAX_STEPS);
+        a_program->setUniformf(a_program->getCachedUniformLocation("uStepBudget"), m_enabled ? (float)m_budget : 1.0f);
+        a_program->setUniformf(a_program->getCachedUniformLocation("uLodBias"), (float)(-log(m_budget) / log(2.0)));
+        a_program->setUniformf(a_program->getCachedUniformLocation("uDepthSize"), depthSize);
     }
-    else if (a_key == GLFW_KEY_U)
+    else if (a_mode == 3)
     {
-        cout << cameraView1->getLocalPos().str(3) << endl;
-        cout << cameraView1->getLookVector().str(3) << endl;
-        cout << cameraView1->getUpVector().str(3) << endl;
+        int iterations = m_enabled ? (int)(PYRAMID_MAX_ITERATIONS * m_budget) : PYRAMID_MAX_ITERATIONS;
+        a_program->setUniformi(a_program->getCachedUniformLocation("uMaxIterations"), iterations);
     }
 }
 
 //------------------------------------------------------------------------------
 
-void mouseButtonCallback(GLFWwindow* a_window, int a_button, int a_action, int a_mods)
+// closest point of the triangle abc to p (Ericson, Real-Time Collision Detection, 5.1.5)
+static cVector3d closestPointOnTriangle(const cVector3d& a_p,
+                                        const cVector3d& a_a,
+                                        const cVector3d& a_b,
+                                        const cVector3d& a_c)
 {
-    if (a_action == GLFW_PRESS)
+    cVector3d ab = a_b - a_a;
+    cVector3d ac = a_c - a_a;
+    cVector3d ap = a_p - a_a;
+    double d1 = cDot(ab, ap);
+    double d2 = cDot(ac, ap);
+    if ((d1 <= 0.0) && (d2 <= 0.0))
     {
-        // store mouse position
-        glfwGetCursorPos(window, &mouseX, &mouseY);
+        return (a_a);
+    }
 
-        // variable for storing collision information
-        cCollisionRecorder recorder;
-        cCollisionSettings settings;
-        mouseState = MOUSE_SELECTION;
-        //cout << "hola" << endl;
-            
+    cVector3d bp = a_p - a_b;
+    double d3 = cDot(ab, bp);
+    double d4 = cDot(ac, bp);
+    if ((d3 >= 0.0) && (d4 <= d3))
+    {
+        return (a_b);
     }
-    else
+
+    double vc = d1 * d4 - d3 * d2;
+    if ((vc <= 0.0) && (d1 >= 0.0) && (d3 <= 0.0))
     {
-        mouseState = MOUSE_IDLE;
+        return (a_a + (d1 / (d1 - d3)) * ab);
     }
-}
 
-void mouseMotionCallback(GLFWwindow* a_window, double a_posX, double a_posY)
-{
-    if (mouseState == MOUSE_SELECTION)
+    cVector3d cp = a_p - a_c;
+    double d5 = cDot(ab, cp);
+    double d6 = cDot(ac, cp);
+    if ((d6 >= 0.0) && (d5 <= d6))
     {
-        
-        double posRelX = (a_posX - (0.5 * width));
-        double posRelY = ((height - a_posY) - (0.5 * height));
-        double Xnew = mouseX - a_posX;
-        double Ynew = mouseY - a_posY;
-        //cout << Xnew << endl;
-        cameraView1->rotateAboutLocalAxisDeg(cVector3d(0.0,0.0,1.0),Xnew/100.0);
-        cameraView1->rotateAboutLocalAxisDeg(cVector3d(0.0, 1.0, 0.0), Ynew / 100.0);
-        
-        //cout << "hola" << endl;
+        return (a_c);
+    }
 
-        // get the vector that goes from the camera to the selected point (mouse click)
-        /*cVector3d vCameraObject = selectedPoint - camera->getLocalPos();
-        
-        // get the vector that point in the direction of the camera. ("where the camera is looking at")
-        cVector3d vCameraLookAt = camera->getLookVector();
+    double vb = d5 * d2 - d1 * d6;
+    if ((vb <= 0.0) && (d2 >= 0.0) && (d6 <= 0.0))
+    {
+        return (a_a + (d2 / (d2 - d6)) * ac);
+    }
 
-        // compute the angle between both vectors
-        double angle = cAngle(vCameraObject, vCameraLookAt);
+    double va = d3 * d6 - d5 * d4;
+    if ((va <= 0.0) && ((d4 - d3) >= 0.0) && ((d5 - d6) >= 0.0))
+    {
+        return (a_b + ((d4 - d3) / ((d4 - d3) + (d5 - d6))) * (a_c - a_b));
+    }
 
-        // compute the distance between the camera and the plane that intersects the object and 
-        // which is parallel to the camera plane
-        double distanceToObjectPlane = vCameraObject.length() * cos(angle);
+    double denom = 1.0 / (va + vb + vc);
+    return (a_a + (vb * denom) * ab + (vc * denom) * ac);
+}
 
-        // convert the pixel in mouse space into a relative position in the world
-        double factor = (distanceToObjectPlane * tan(0.5 * camera->getFieldViewAngleRad())) / (0.5 * height);
-        double posRelX = factor * (a_posX - (0.5 * width));
-        double posRelY = factor * ((height - a_posY) - (0.5 * height));
+//------------------------------------------------------------------------------
 
-        // compute the new position in world coordinates
-        cVector3d pos = camera->getLocalPos() +
-            distanceToObjectPlane * camera->getLookVector() +
-            posRelX * camera->getRightVector() +
-            posRelY * camera->getUpVector();
+void SignedDistanceField::bake(const vector<cVector3d>& a_vertices,
+                               const vector<unsigned int>& a_indices,
+                               double a_cellSize,
+                               double a_band,
+                               int a_numThreads)
+{
+    m_cellSize = a_cellSize;
+    m_band = a_band;
+    m_brickIndex.clear();
+    m_samples.clear();
+    m_triangles.clear();
+    m_numBricks[0] = m_numBricks[1] = m_numBricks[2] = 0;
+    if (a_vertices.empty() || (a_indices.size() < 3))
+    {
+        return;
+    }
+
+    // grid of bricks covering the vertices grown by the band
+    cVector3d lower = a_vertices[0];
+    cVector3d upper = a_vertices[0];
+    for (unsigned int i = 1; i < a_vertices.size(); i++)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            lower(k) = cMin(lower(k), a_vertices[i](k));
+            upper(k) = cMax(upper(k), a_vertices[i](k));
+        }
+    }
+    double brickSize = SDF_BRICK_SIZE * m_cellSize;
+    m_origin = lower - cVector3d(m_band, m_band, m_band);
+    for (int k = 0; k < 3; k++)
+    {
+        m_numBricks[k] = cMax(1, (int)ceil((upper(k) - lower(k) + 2.0 * m_band) / brickSize));
+    }
+    int numSlots = m_numBricks[0] * m_numBricks[1] * m_numBricks[2];
 
-        // compute position of object by taking in account offset
-        cVector3d posObject = pos - selectedObjectOffset;
+    // triangles whose box grown by the band overlaps each brick
+    int numTriangles = (int)(a_indices.size() / 3);
+    vector<cVector3d> normals(numTriangles);
+    vector<vector<int> > candidates(numSlots);
+    for (int i = 0; i < numTriangles; i++)
+    {
+        const cVector3d& a = a_vertices[a_indices[3 * i]];
+        const cVector3d& b = a_vertices[a_indices[3 * i + 1]];
+        const cVector3d& c = a_vertices[a_indices[3 * i + 2]];
+        cVector3d normal = cCross(b - a, c - a);
+        double area = normal.length();
+        if (area <= 0.0)
+        {
+            continue;
+        }
+        normals[i] = (1.0 / area) * normal;
 
-        // apply new position to object
-        selectedObject->setLocalPos(posObject);
+        int first[3], last[3];
+        for (int k = 0; k < 3; k++)
+        {
+            double low = cMin(a(k), cMin(b(k), c(k))) - m_band - m_origin(k);
+            double high = cMax(a(k), cMax(b(k), c(k))) + m_band - m_origin(k);
+            first[k] = cClamp((int)floor(low / brickSize), 0, m_numBricks[k] - 1);
+            last[k] = cClamp((int)floor(high / brickSize), 0, m_numBricks[k] - 1);
+        }
+        for (int z = first[2]; z <= last[2]; z++)
+        {
+            for (int y = first[1]; y <= last[1]; y++)
+            {
+                for (int x = first[0]; x <= last[0]; x++)
+                {
+                    candidates[getSlot(x, y, z)].push_back(i);
+                }
+            }
+        }
+    }
 
-        // place cursor at the position of the mouse click
-        sphereSelect->setLocalPos(pos);*/
+    // only the bricks near a triangle are stored
+    vector<int> slots;
+    m_brickIndex.assign(numSlots, -1);
+    for (int i = 0; i < numSlots; i++)
+    {
+        if (!candidates[i].empty())
+        {
+            m_brickIndex[i] = (int)slots.size();
+            slots.push_back(i);
+        }
+    }
+    m_samples.resize(4 * SDF_BRICK_SAMPLES * slots.size());
+    m_triangles.resize(SDF_BRICK_SAMPLES * slots.size());
+
+    int numThreads = (a_numThreads > 0) ? a_numThreads : (int)thread::hardware_concurrency();
+    numThreads = cClamp(numThreads, 1, cMax((int)slots.size(), 1));
+    atomic<int> nextBrick(0);
+    vector<thread> workers;
+    for (int i = 0; i < numThreads; i++)
+    {
+        workers.push_back(thread(&SignedDistanceField::bakeBricks, this, &a_vertices, &a_indices, &normals,
+                                 &candidates, &slots, &nextBrick));
+    }
+    for (int i = 0; i < numThreads; i++)
+    {
+        workers[i].join();
     }
 }
 
 //------------------------------------------------------------------------------
 
-void close(void)
+void SignedDistanceField::bakeBricks(const vector<cVector3d>* a_vertices,
+                                     const vector<unsigned int>* a_indices,
+                                     const vector<cVector3d>* a_normals,
+                                     const vector<vector<int> >* a_candidates,
+                                     const vector<int>* a_slots,
+                                     atomic<int>* a_nextBrick)
 {
-    // stop the simulation
-    simulationRunning = false;
+    const int n = SDF_BRICK_SIZE + 1;
+    const double tolerance = 1e-10 * m_cellSize * m_cellSize;
+    vector<double> best(SDF_BRICK_SAMPLES);
+    vector<cVector3d> nearest(SDF_BRICK_SAMPLES);
+    vector<cVector3d> normalSum(SDF_BRICK_SAMPLES);
+    vector<int> triangle(SDF_BRICK_SAMPLES);
+
+    int brick;
+    while ((brick = (*a_nextBrick)++) < (int)a_slots->size())
+    {
+        int slot = (*a_slots)[brick];
+        int bx = slot % m_numBricks[0];
+        int by = (slot / m_numBricks[0]) % m_numBricks[1];
+        int bz = slot / (m_numBricks[0] * m_numBricks[1]);
+        cVector3d corner = m_origin + (SDF_BRICK_SIZE * m_cellSize) * cVector3d(bx, by, bz);
+        std::fill(best.begin(), best.end(), m_band * m_band);
+        std::fill(triangle.begin(), triangle.end(), -1);
+
+        // each triangle updates the samples of the brick within the band of it
+        const vector<int>& candidates = (*a_candidates)[slot];
+        for (unsigned int j = 0; j < candidates.size(); j++)
+        {
+            int t = candidates[j];
+            const cVector3d& a = (*a_vertices)[(*a_indices)[3 * t]];
+            const cVector3d& b = (*a_vertices)[(*a_indices)[3 * t + 1]];
+            const cVector3d& c = (*a_vertices)[(*a_indices)[3 * t + 2]];
+            const cVector3d& normal = (*a_normals)[t];
+
+            int first[3], last[3];
+            for (int k = 0; k < 3; k++)
+            {
+                double low = cMin(a(k), cMin(b(k), c(k))) - m_band - corner(k);
+                double high = cMax(a(k), cMax(b(k), c(k))) + m_band - corner(k);
+                first[k] = cClamp((int)ceil(low / m_cellSize), 0, n - 1);
+                last[k] = cClamp((int)floor(high / m_cellSize), 0, n - 1);
+            }
+            for (int z = first[2]; z <= last[2]; z++)
+            {
+                for (int y = first[1]; y <= last[1]; y++)
+                {
+                    for (int x = first[0]; x <= last[0]; x++)
+                    {
+                        int i = (z * n + y) * n + x;
+                        cVector3d p = corner + m_cellSize * cVector3d(x, y, z);
+                        cVector3d q = closestPointOnTriangle(p, a, b, c);
+                        double d = (p - q).lengthsq();
+
+                        // triangles sharing the nearest point (edges, vertices)
+                        // vote for the side together
+                        if (d < best[i] - tolerance)
+                        {
+                            best[i] = d;
+                            nearest[i] = q;
+                            normalSum[i] = normal;
+                            triangle[i] = t;
+                        }
+                        else if ((triangle[i] >= 0) && (d <= best[i] + tolerance))
+                        {
+                            normalSum[i] = normalSum[i] + normal;
+                        }
+                    }
+                }
+            }
+        }
 
-    // wait for graphics and haptics loops to terminate
-    while (!simulationFinished) { cSleepMs(100); }
+        for (int z = 0; z < n; z++)
+        {
+            for (int y = 0; y < n; y++)
+            {
+                for (int x = 0; x < n; x++)
+                {
+                    int i = (z * n + y) * n + x;
+                    float* sample = &m_samples[4 * (brick * SDF_BRICK_SAMPLES + i)];
+                    m_triangles[brick * SDF_BRICK_SAMPLES + i] = triangle[i];
+                    if (triangle[i] < 0)
+                    {
+                        sample[0] = (float)m_band;
+                        sample[1] = sample[2] = sample[3] = 0.0f;
+                        continue;
+                    }
+
+                    cVector3d p = corner + m_cellSize * cVector3d(x, y, z);
+                    cVector3d offset = p - nearest[i];
+                    double distance = sqrt(best[i]);
+                    double sign = (cDot(offset, normalSum[i]) >= 0.0) ? 1.0 : -1.0;
+                    cVector3d gradient = (distance > 1e-9 * m_cellSize) ? (sign / distance) * offset :
+                                         (*a_normals)[triangle[i]];
+                    sample[0] = (float)(sign * distance);
+                    sample[1] = (float)gradient(0);
+                    sample[2] = (float)gradient(1);
+                    sample[3] = (float)gradient(2);
+                }
+            }
+        }
+    }
+}
 
-    // close haptic device
-    tool->stop();
+//------------------------------------------------------------------------------
 
-    // delete resources
-    delete hapticsThread;
-    delete world;
-    delete handler;
+int SignedDistanceField::getSlot(int a_x, int a_y, int a_z) const
+{
+    if ((a_x < 0) || (a_y < 0) || (a_z < 0) ||
+        (a_x >= m_numBricks[0]) || (a_y >= m_numBricks[1]) || (a_z >= m_numBricks[2]))
+    {
+        return (-1);
+    }
+    return ((a_z * m_numBricks[1] + a_y) * m_numBricks[0] + a_x);
 }
 
 //------------------------------------------------------------------------------
 
-void updateGraphics(void)
+// cell containing a point and the position inside it
+static inline void locateSignedDistanceCell(const cVector3d& a_point,
+                                           const cVector3d& a_origin,
+                                           double a_cellSize,
+                                           int* a_cell,
+                                           double* a_fraction)
 {
-    /////////////////////////////////////////////////////////////////////
-    // UPDATE WIDGETS
-    /////////////////////////////////////////////////////////////////////
+    for (int k = 0; k < 3; k++)
+    {
+        double c = (a_point(k) - a_origin(k)) / a_cellSize;
+        double f = floor(c);
+        a_cell[k] = (int)f;
+        a_fraction[k] = c - f;
+    }
+}
 
-    // update haptic and graphic rate data
-    labelRates->setText(cStr(freqCounterGraphics.getFrequency(), 0) + " Hz / " +
-                        cStr(freqCounterHaptics.getFrequency(), 0) + " Hz");
+//------------------------------------------------------------------------------
 
-    // update position of label
-    labelRates->setLocalPos((int)(0.5 * (width - labelRates->getWidth())), 15);
+double SignedDistanceField::sample(const cVector3d& a_point, cVector3d& a_gradient) const
+{
+    a_gradient.zero();
 
-    // update haptic and graphic rate data
-    labelRates2->setText(cStr(freqCounterGraphics.getFrequency(), 0) + " Hz / " +
-        cStr(freqCounterHaptics.getFrequency(), 0) + " Hz");
+    int cell[3];
+    double f[3];
+    locateSignedDistanceCell(a_point, m_origin, m_cellSize, cell, f);
+    if ((cell[0] < 0) || (cell[1] < 0) || (cell[2] < 0))
+    {
+        return (m_band);
+    }
+    int slot = getSlot(cell[0] / SDF_BRICK_SIZE, cell[1] / SDF_BRICK_SIZE, cell[2] / SDF_BRICK_SIZE);
+    int brick = (slot < 0) ? -1 : m_brickIndex[slot];
+    if (brick < 0)
+    {
+        return (m_band);
+    }
 
-    // update position of label
-    labelRates2->setLocalPos((int)(0.5 * (width - labelRates2->getWidth())), 15);
+    // trilinear interpolation of the distance and gradient
+    const int n = SDF_BRICK_SIZE + 1;
+    const float* base = &m_samples[4 * brick * SDF_BRICK_SAMPLES];
+    int x = cell[0] % SDF_BRICK_SIZE;
+    int y = cell[1] % SDF_BRICK_SIZE;
+    int z = cell[2] % SDF_BRICK_SIZE;
+    double value[4] = { 0.0, 0.0, 0.0, 0.0 };
+    for (int corner = 0; corner < 8; corner++)
+    {
+        int dx = corner & 1, dy = (corner >> 1) & 1, dz = (corner >> 2) & 1;
+        double w = (dx ? f[0] : 1.0 - f[0]) * (dy ? f[1] : 1.0 - f[1]) * (dz ? f[2] : 1.0 - f[2]);
+        const float* s = base + 4 * (((z + dz) * n + (y + dy)) * n + (x + dx));
+        for (int k = 0; k < 4; k++)
+        {
+            value[k] += w * s[k];
+        }
+    }
+    a_gradient.set(value[1], value[2], value[3]);
+    return (value[0]);
+}
 
-    cVector3d posA = tool->getDeviceGlobalPos();
-    // update haptic and graphic rate data
-    /*labelRatesPos->setText("Position Tool : " + posA.str(3));
+//------------------------------------------------------------------------------
 
-    // update position of label
-    labelRatesPos->setLocalPos((int)(0.5 * (width - labelRatesPos->getWidth())), 30);*/
+int SignedDistanceField::getNearestTriangle(const cVector3d& a_point) const
+{
+    int cell[3];
+    double f[3];
+    locateSignedDistanceCell(a_point, m_origin, m_cellSize, cell, f);
+    if ((cell[0] < 0) || (cell[1] < 0) || (cell[2] < 0))
+    {
+        return (-1);
+    }
+    int slot = getSlot(cell[0] / SDF_BRICK_SIZE, cell[1] / SDF_BRICK_SIZE, cell[2] / SDF_BRICK_SIZE);
+    int brick = (slot < 0) ? -1 : m_brickIndex[slot];
+    if (brick < 0)
+    {
+        return (-1);
+    }
 
+    const int n = SDF_BRICK_SIZE + 1;
+    int x = cell[0] % SDF_BRICK_SIZE + ((f[0] >= 0.5) ? 1 : 0);
+    int y = cell[1] % SDF_BRICK_SIZE + ((f[1] >= 0.5) ? 1 : 0);
+    int z = cell[2] % SDF_BRICK_SIZE + ((f[2] >= 0.5) ? 1 : 0);
+    return (m_triangles[brick * SDF_BRICK_SAMPLES + (z * n + y) * n + x]);
+}
 
-    /////////////////////////////////////////////////////////////////////
-    // RENDER SCENE
-    /////////////////////////////////////////////////////////////////////
+//------------------------------------------------------------------------------
 
-    // update shadow maps (if any)
-    //world->updateShadowMaps(false, mirroredDisplay);
+size_t SignedDistanceField::getMemorySize() const
+{
+    return (m_samples.size() * sizeof(float) + m_triangles.size() * sizeof(int) + m_brickIndex.size() * sizeof(int));
+}
 
-    // render all framebuffers
-    frameBuffer1->renderView();
-    frameBuffer2->renderView();
+//------------------------------------------------------------------------------
 
-    // render world
-    camera->renderView(width, height);
+SignedDistanceCollision::SignedDistanceCollision(cMesh* a_mesh,
+                                                 double a_radius,
+                                                 const HeightPyramid* a_pyramid,
+                                                 double a_depthScale) :
+    m_surface(a_mesh),
+    m_ownsSurface(false)
+{
+    vector<cVector3d> vertices;
+    vector<unsigned int> indices;
+    if ((a_pyramid != NULL) && (a_pyramid->m_numLevels > 0))
+    {
+        // the plane displaced by the height map, kept to report contact triangles
+        int gridSize = cMin(a_pyramid->m_width[0], SDF_DISPLACED_GRID_SIZE);
+        createDisplacedGrid(*a_pyramid, gridSize, a_depthScale, vertices, indices);
+        m_surface = new cMesh();
+        m_ownsSurface = true;
+        for (unsigned int i = 0; i < vertices.size(); i++)
+        {
+            m_surface->newVertex(vertices[i]);
+        }
+        for (unsigned int i = 0; i < indices.size(); i += 3)
+        {
+            m_surface->newTriangle(indices[i], indices[i + 1], indices[i + 2]);
+        }
+    }
+    else
+    {
+        // removed triangles stay in the list as degenerate ones, so that
+        // triangle indices match the mesh
+        vertices.assign(a_mesh->m_vertices->m_localPos.begin(),
+                        a_mesh->m_vertices->m_localPos.begin() + a_mesh->getNumVertices());
+        unsigned int numTriangles = a_mesh->getNumTriangles();
+        indices.assign(3 * numTriangles, 0);
+        for (unsigned int i = 0; i < numTriangles; i++)
+        {
+            if (a_mesh->m_triangles->getAllocated(i))
+            {
+                indices[3 * i] = a_mesh->m_triangles->getVertexIndex0(i);
+                indices[3 * i + 1] = a_mesh->m_triangles->getVertexIndex1(i);
+                indices[3 * i + 2] = a_mesh->m_triangles->getVertexIndex2(i);
+            }
+        }
+    }
 
-    // wait until all GL commands are completed
-    glFinish();
+    // the band covers the tool radius and a few cells of approach
+    m_field.bake(vertices, indices, SDF_CELL_SIZE, a_radius + 4.0 * SDF_CELL_SIZE);
+}
 
-    // check for any OpenGL errors
-    GLenum err = glGetError();
-    if (err != GL_NO_ERROR) cout << "Error: " << gluErrorString(err) << endl;
+//------------------------------------------------------------------------------
+
+SignedDistanceCollision::~SignedDistanceCollision()
+{
+    if (m_ownsSurface)
+    {
+        delete m_surface;
+    }
 }
 
 //------------------------------------------------------------------------------
 
-void updateHaptics(void)
+bool SignedDistanceCollision::computeCollision(cGenericObject* a_object,
+                                               cVector3d& a_segmentPointA,
+                                               cVector3d& a_segmentPointB,
+                                               cCollisionRecorder& a_recorder,
+                                               cCollisionSettings& a_settings)
 {
-    // angular velocity of object
-    cVector3d angVel(0.0, 0.2, 0.3);
+    double radius = a_settings.m_collisionRadius;
+    cVector3d motion = a_segmentPointB - a_segmentPointA;
+    double length = motion.length();
+    cVector3d gradient;
+
+    // sphere tracing: a step as long as the distance to the surface offset by
+    // the radius never crosses it
+    double t = 0.0;
+    double distance = m_field.sample(a_segmentPointA, gradient) - radius;
+    if (distance <= 0.0)
+    {
+        // already touching, only a motion into the surface collides
+        if (cDot(motion, gradient) >= 0.0)
+        {
+            return (false);
+        }
+    }
+    else
+    {
+        double minStep = 0.1 * m_field.getCellSize();
+        double previous = 0.0;
+        while (distance > 0.0)
+        {
+            if (t >= length)
+            {
+                return (false);
+            }
+            previous = t;
+            t = cMin(t + cMax(distance, minStep), length);
+            distance = m_field.sample(a_segmentPointA + (t / length) * motion, gradient) - radius;
+        }
 
-    // reset clock
-    cPrecisionClock clock;
-    clock.reset();
+        // bisection between the last point outside and the first inside
+        for (int i = 0; i < 8; i++)
+        {
+            double tm = 0.5 * (previous + t);
+            cVector3d g;
+            double d = m_field.sample(a_segmentPointA + (tm / length) * motion, g) - radius;
+            if (d > 0.0)
+            {
+                previous = tm;
+            }
+            else
+            {
+                t = tm;
+                distance = d;
+                gradient = g;
+            }
+        }
+    }
 
-    // simulation in now running
-    simulationRunning  = true;
-    simulationFinished = false;
+    cVector3d center = (length > 0.0) ? a_segmentPointA + (t / length) * motion : a_segmentPointA;
+    double squareDistance = (center - a_segmentPointA).lengthsq();
+    if (a_settings.m_checkForNearestCollisionOnly && (squareDistance > a_recorder.m_nearestCollision.m_squareDistance))
+    {
+        return (false);
+    }
 
-    // main haptic simulation loop
-    while(simulationRunning)
+    // contact on the surface below the sphere center
+    cVector3d normal = (gradient.length() > 0.0) ? cNormalize(gradient) : cVector3d(0.0, 0.0, 1.0);
+    cVector3d localPos = center - (distance + radius) * normal;
+    cCollisionEvent collision;
+    collision.m_object = a_object;
+    collision.m_triangles = m_surface->m_triangles;
+    collision.m_index = cMax(m_field.getNearestTriangle(center), 0);
+    collision.m_localPos = localPos;
+    collision.m_localNormal = normal;
+    collision.m_globalPos = a_object->getGlobalPos() + a_object->getGlobalRot() * localPos;
+    collision.m_globalNormal = a_object->getGlobalRot() * normal;
+    collision.m_squareDistance = squareDistance;
+    collision.m_adjustedSegmentAPoint = a_segmentPointA;
+
+    if (!a_settings.m_checkForNearestCollisionOnly)
     {
-        /////////////////////////////////////////////////////////////////////
-        // SIMULATION TIME
-        /////////////////////////////////////////////////////////////////////
+        a_recorder.m_collisions.push_back(collision);
+    }
+    if (squareDistance <= a_recorder.m_nearestCollision.m_squareDistance)
+    {
+        a_recorder.m_nearestCollision = collision;
+    }
+    return (true);
+}
 
-        // stop the simulation clock
-        clock.stop();
+//------------------------------------------------------------------------------
 
-        // read the time increment in seconds
-        double timeInterval = clock.getCurrentTimeSeconds();
+void benchmarkSignedDistance(const HeightPyramid& a_pyramid)
+{
+    const int NUM_SEGMENTS = 20000;
+    const int NUM_SURFACES = 6;
+    const int gridSizes[NUM_SURFACES] = { 32, 64, 128, 256, 512, 0 };
+    const double depthScale = 0.05 * PLANE_SIZE;
+
+    // proxy motions: short segments ending near the surface
+    srand(1);
+    vector<cVector3d> segmentA(NUM_SEGMENTS), segmentB(NUM_SEGMENTS);
+    for (int i = 0; i < NUM_SEGMENTS; i++)
+    {
+        double x = PLANE_SIZE * (0.9 * (double)rand() / (double)RAND_MAX - 0.45);
+        double y = PLANE_SIZE * (0.9 * (double)rand() / (double)RAND_MAX - 0.45);
+        double z = -depthScale * (double)rand() / (double)RAND_MAX;
+        cVector3d step(0.002 * ((double)rand() / (double)RAND_MAX - 0.5),
+                       0.002 * ((double)rand() / (double)RAND_MAX - 0.5),
+                       0.01 * (double)rand() / (double)RAND_MAX);
+        segmentA[i] = cVector3d(x, y, z) + step;
+        segmentB[i] = cVector3d(x, y, z);
+    }
 
-        // restart the simulation clock
-        clock.reset();
-        clock.start();
+    cout << "Signed distance field benchmark (" << NUM_SEGMENTS << " proxy segments of radius " << SPHERE_RADIUS
+         << ", cell " << SDF_CELL_SIZE << ")" << endl;
+    cout << "surface, triangles, aabb build ms, sdf bake ms, bricks, sdf MB, aabb ns/segment, sdf ns/segment, "
+         << "aabb hits, sdf hits, mean force error %, max force error %" << endl;
+    for (int s = 0; s < NUM_SURFACES; s++)
+    {
+        // the last surface is the plane with the height map baked in, checked
+        // against the grid the field is built from
+        bool displaced = (gridSizes[s] == 0);
+        int gridSize = displaced ? cMin(a_pyramid.m_width[0], SDF_DISPLACED_GRID_SIZE) : gridSizes[s];
+        cMesh* mesh = new cMesh();
+        vector<cVector3d> vertices;
+        vector<unsigned int> indices;
+        createDisplacedGrid(a_pyramid, gridSize, depthScale, vertices, indices);
+        for (unsigned int i = 0; i < vertices.size(); i++)
+        {
+            mesh->newVertex(vertices[i]);
+        }
+        for (unsigned int i = 0; i < indices.size(); i += 3)
+        {
+            mesh->newTriangle(indices[i], indices[i + 1], indices[i + 2]);
+        }
+        cMesh* plane = NULL;
+        if (displaced)
+        {
+            plane = new cMesh();
+            cCreatePlane(plane, PLANE_SIZE, PLANE_SIZE);
+        }
 
-        // signal frequency counter
-        freqCounterHaptics.signal(1);
+        cPrecisionClock clock;
+        clock.start(true);
+        setCollisionTree(mesh, COLLISION_TREE_AABB, SPHERE_RADIUS);
+        double buildTime = clock.stop();
+        clock.start(true);
+        SignedDistanceCollision* sdf = displaced ?
+            new SignedDistanceCollision(plane, SPHERE_RADIUS, &a_pyramid, depthScale) :
+            new SignedDistanceCollision(mesh, SPHERE_RADIUS);
+        double bakeTime = clock.stop();
 
+        cCollisionRecorder recorder;
+        cCollisionSettings settings;
+        settings.m_checkForNearestCollisionOnly = true;
+        settings.m_returnMinimalCollisionData = false;
+        settings.m_collisionRadius = SPHERE_RADIUS;
+
+        // proxy position along each segment, -1 without contact
+        vector<double> proxy[2];
+        double segmentTime[2];
+        int numHits[2] = { 0, 0 };
+        for (int detector = 0; detector < 2; detector++)
+        {
+            clock.start(true);
+            for (int i = 0; i < NUM_SEGMENTS; i++)
+            {
+                recorder.clear();
+                bool hit = (detector == 0) ?
+                    mesh->computeCollisionDetection(segmentA[i], segmentB[i], recorder, settings) :
+                    sdf->computeCollision(mesh, segmentA[i], segmentB[i], recorder, settings);
+                numHits[detector] += hit ? 1 : 0;
+                proxy[detector].push_back(hit ? sqrt(recorder.m_nearestCollision.m_squareDistance) : -1.0);
+            }
+            segmentTime[detector] = clock.stop();
+        }
 
-        /////////////////////////////////////////////////////////////////////
-        // HAPTIC FORCE COMPUTATION
-        /////////////////////////////////////////////////////////////////////
+        // penalty force from the proxy to the device position, compared where
+        // both detectors stop the proxy
+        double sumError = 0.0, maxError = 0.0;
+        int numCompared = 0;
+        for (int i = 0; i < NUM_SEGMENTS; i++)
+        {
+            if ((proxy[0][i] < 0.0) || (proxy[1][i] < 0.0))
+            {
+                continue;
+            }
+            double length = cDistance(segmentA[i], segmentB[i]);
+            double force = length - proxy[0][i];
+            if (force < 0.01 * SDF_CELL_SIZE)
+            {
+                continue;
+            }
+            double error = fabs(proxy[1][i] - proxy[0][i]) / force;
+            sumError += error;
+            maxError = cMax(maxError, error);
+            numCompared++;
+        }
 
-        // compute global reference frames for each object
-        world->computeGlobalPositions(true);
+        const SignedDistanceField& field = sdf->getField();
+        cout << (displaced ? "plane + height map" : "displaced grid " + cStr(gridSize)) << ", " << indices.size() / 3 << ", "
+             << cStr(1e3 * buildTime, 1) << ", " << cStr(1e3 * bakeTime, 1) << ", " << field.getNumBricks() << ", "
+             << cStr((double)field.getMemorySize() / (1024.0 * 1024.0), 2) << ", "
+             << cStr(1e9 * segmentTime[0] / NUM_SEGMENTS, 0) << ", " << cStr(1e9 * segmentTime[1] / NUM_SEGMENTS, 0) << ", "
+             << numHits[0] << ", " << numHits[1] << ", "
+             << cStr(100.0 * ((numCompared > 0) ? sumError / numCompared : 0.0), 2) << ", " << cStr(100.0 * maxError, 2) << endl;
+
+        delete sdf;
+        delete mesh;
+        delete plane;
+    }
+}
 
-        // update position and orientation of tool
-        tool->updateFromDevice();
+//------------------------------------------------------------------------------
 
-        // compute interaction forces
-        tool->computeInteractionForces();
+// trace buffer of the calling thread
+static THREAD_LOCAL TraceBuffer* threadTraceBuffer = NULL;
 
-        // send forces to haptic device
-        tool->applyToDevice();
+//------------------------------------------------------------------------------
 
-        spheres->setLocalPos(tool->getDeviceGlobalPos());
-        /////////////////////////////////////////////////////////////////////
-        // DYNAMIC SIMULATION
-        /////////////////////////////////////////////////////////////////////
-        /*
-        // some constants
-        const double INERTIA = 0.4;
-        const double MAX_ANG_VEL = 10.0;
-        const double DAMPING = 0.1;
+Tracer::Tracer() : m_enabled(false), m_origin(now())
+{
+}
 
-        // get position of cursor in global coordinates
-        cVector3d toolPos = tool->getDeviceGlobalPos();
+//------------------------------------------------------------------------------
 
-        // get position of object in global coordinates
-        cVector3d objectPos = object->getGlobalPos();
+Tracer::~Tracer()
+{
+    for (unsigned int i = 0; i < m_buffers.size(); i++)
+    {
+        delete m_buffers[i];
+    }
+}
 
-        // compute a vector from the center of mass of the object (point of rotation) to the tool
-        cVector3d v = cSub(toolPos, objectPos);
+//------------------------------------------------------------------------------
 
-        // compute angular acceleration based on the interaction forces
-        // between the tool and the object
-        cVector3d angAcc(0,0,0);
-        if (v.length() > 0.0)
+long long Tracer::now()
+{
+    return (chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+//------------------------------------------------------------------------------
+
+TraceBuffer* Tracer::getBuffer()
+{
+    if (threadTraceBuffer == NULL)
+    {
+        TraceBuffer* buffer = new TraceBuffer();
+        buffer->m_numEvents = 0;
+        buffer->m_numDropped = 0;
+        if (getEnabled())
         {
-            // get the last force applied to the cursor in global coordinates
-            // we negate the result to obtain the opposite force that is applied on the
-            // object
-            cVector3d toolForce = -tool->getDeviceGlobalForce();
+            buffer->m_events.resize(TRACE_BUFFER_EVENTS);
+        }
+        lock_guard<mutex> lock(m_mutex);
+        buffer->m_threadId = (int)m_buffers.size();
+        m_buffers.push_back(buffer);
+        threadTraceBuffer = buffer;
+    }
+    return (threadTraceBuffer);
+}
 
-            // compute the effective force that contributes to rotating the object.
-            cVector3d force = toolForce - cProject(toolForce, v);
+//------------------------------------------------------------------------------
 
-            // compute the resulting torque
-            cVector3d torque = cMul(v.length(), cCross( cNormalize(v), force));
+void Tracer::setThreadName(const string& a_name)
+{
+    TraceBuffer* buffer = getBuffer();
+    lock_guard<mutex> lock(m_mutex);
+    buffer->m_threadName = a_name;
+}
 
-            // update rotational acceleration
-            angAcc = (1.0 / INERTIA) * torque;
-        }
+//------------------------------------------------------------------------------
 
-        // update rotational velocity
-        angVel.add(timeInterval * angAcc);
+void Tracer::record(const char* a_name, long long a_start, long long a_end)
+{
+    // never allocates events, a buffer created while tracing was disabled
+    // drops them like a full one
+    TraceBuffer* buffer = getBuffer();
+    int count = buffer->m_numEvents.load(memory_order_relaxed);
+    if (count >= (int)buffer->m_events.size())
+    {
+        buffer->m_numDropped.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+    TraceEvent& event = buffer->m_events[count];
+    event.m_name = a_name;
+    event.m_start = a_start - m_origin;
+    event.m_duration = a_end - a_start;
+    buffer->m_numEvents.store(count + 1, memory_order_release);
+}
 
-        // set a threshold on the rotational velocity term
-        double vel = angVel.length();
-        if (vel > MAX_ANG_VEL)
-        {
-            angVel.mul(MAX_ANG_VEL / vel);
-        }
+//------------------------------------------------------------------------------
 
-        // add some damping too
-        angVel.mul(1.0 - DAMPING * timeInterval);
+bool Tracer::write(const string& a_filename) const
+{
+    ofstream json(a_filename.c_str());
+    if (!json)
+    {
+        cout << "Error - Cannot write trace " << a_filename << endl;
+        return (false);
+    }
 
-        // if user switch is pressed, set velocity to zero
-        if (tool->getUserSwitch(0) == 1)
+    // one track per thread, complete events in microseconds
+    lock_guard<mutex> lock(m_mutex);
+    long long numEvents = 0, numDropped = 0;
+    json << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    for (unsigned int i = 0; i < m_buffers.size(); i++)
+    {
+        const TraceBuffer* buffer = m_buffers[i];
+        string name = buffer->m_threadName.empty() ? "thread " + cStr(buffer->m_threadId) : buffer->m_threadName;
+        json << ((i > 0) ? ",\n" : "\n")
+             << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << buffer->m_threadId
+             << ", \"args\": {\"name\": \"" << name << "\", \"droppedZones\": "
+             << buffer->m_numDropped.load(memory_order_relaxed) << "}}";
+
+        int count = buffer->m_numEvents.load(memory_order_acquire);
+        for (int j = 0; j < count; j++)
         {
-            angVel.zero();
+            const TraceEvent& event = buffer->m_events[j];
+            json << ",\n{\"name\": \"" << event.m_name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer->m_threadId
+                 << ", \"ts\": " << cStr(1e-3 * (double)event.m_start, 3)
+                 << ", \"dur\": " << cStr(1e-3 * (double)event.m_duration, 3) << "}";
         }
+        numEvents += count;
+        numDropped += buffer->m_numDropped.load(memory_order_relaxed);
+    }
+    json << "\n], \"otherData\": {\"droppedZones\": " << numDropped << "}}\n";
 
-        // compute the next rotation configuration of the object
-        if (angVel.length() > C_SMALL)
-        {
-            object->rotateAboutGlobalAxisRad(cNormalize(angVel), timeInterval * angVel.length());
-        }*/
+    cout << "> Trace: " << numEvents << " zones of " << m_buffers.size() << " threads written to " << a_filename;
+    if (numDropped > 0)
+    {
+        cout << " (" << numDropped << " dropped, buffers full)";
     }
-    
-    // exit haptics thread
-    simulationFinished = true;
+    cout << endl;
+    return (true);
 }
 
 //------------------------------------------------------------------------------